@@ -0,0 +1,268 @@
+/**
+ * af_packet.cpp
+ *
+ * TPACKET_V3 live capture; see af_packet.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "af_packet.h"
+
+#ifdef HAVE_AF_PACKET
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/filter.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#define SLL_HDR_LEN 16
+
+af_packet::af_packet(const std::string &device_,const std::string &expression,const config &cfg_):
+    packets(0),kernel_drops(0),freezes(0),
+    device(device_),cfg(cfg_),dlt(DLT_EN10MB),cooked(false),lo_ifindex(if_nametoindex("lo")),
+    rings(),stop(0)
+#ifdef HAVE_LIBPCAP
+    ,fcode(),user_filter(false)
+#endif
+{
+    long page = sysconf(_SC_PAGESIZE);
+    if(cfg.block_size==0 || cfg.block_size % page){
+        die("af-packet-block-size must be a multiple of the page size (%ld)",page);
+    }
+    if(cfg.block_count==0) die("af-packet-blocks must be at least 1");
+    if(cfg.fanout==0) cfg.fanout = 1;
+
+    /* "any" and devices without an Ethernet header are read cooked */
+    int ifindex = 0;
+    if(device!="any"){
+        ifindex = if_nametoindex(device.c_str());
+        if(ifindex==0) die("%s: %s",device.c_str(),strerror(errno));
+        int s = socket(AF_PACKET,SOCK_RAW,0);
+        if(s<0) die("af_packet: socket: %s",strerror(errno));
+        struct ifreq ifr;
+        memset(&ifr,0,sizeof(ifr));
+        strncpy(ifr.ifr_name,device.c_str(),sizeof(ifr.ifr_name)-1);
+        if(ioctl(s,SIOCGIFHWADDR,&ifr)<0) die("%s: SIOCGIFHWADDR: %s",device.c_str(),strerror(errno));
+        close(s);
+        cooked = !(ifr.ifr_hwaddr.sa_family==ARPHRD_ETHER || ifr.ifr_hwaddr.sa_family==ARPHRD_LOOPBACK);
+    } else {
+        cooked = true;
+    }
+    if(cooked){
+#ifdef DLT_LINUX_SLL
+        dlt = DLT_LINUX_SLL;
+#else
+        die("%s: only Ethernet devices can be captured with af-packet in this build",device.c_str());
+#endif
+    }
+
+    rings.resize(cfg.fanout);
+    for(size_t i=0;i<rings.size();i++){
+        rings[i].fd   = -1;
+        rings[i].map  = 0;
+        rings[i].next = 0;
+    }
+
+    /* The sockets receive nothing until they are bound, which happens after the filter is on */
+    for(size_t i=0;i<rings.size();i++){
+        rings[i].fd = socket(AF_PACKET,cooked ? SOCK_DGRAM : SOCK_RAW,0);
+        if(rings[i].fd<0) die("af_packet: socket: %s",strerror(errno));
+    }
+    set_filter(expression);
+    for(size_t i=0;i<rings.size();i++){
+        open_ring(rings[i],ifindex);
+    }
+    if(rings.size()>1){
+        int arg = (getpid() & 0xffff) | (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG)<<16;
+        for(size_t i=0;i<rings.size();i++){
+            if(setsockopt(rings[i].fd,SOL_PACKET,PACKET_FANOUT,&arg,sizeof(arg))<0){
+                die("%s: PACKET_FANOUT: %s",device.c_str(),strerror(errno));
+            }
+        }
+    }
+    DEBUG(2)("af_packet: %s: %u socket(s) of %u x %zu byte blocks%s",device.c_str(),
+             (unsigned)rings.size(),(unsigned)cfg.block_count,cfg.block_size,cooked ? ", cooked" : "");
+}
+
+af_packet::~af_packet()
+{
+    for(size_t i=0;i<rings.size();i++){
+        if(rings[i].map) munmap(rings[i].map,cfg.block_size*cfg.block_count);
+        if(rings[i].fd>=0) close(rings[i].fd);
+    }
+#ifdef HAVE_LIBPCAP
+    if(user_filter) pcap_freecode(&fcode);
+#endif
+}
+
+void af_packet::set_filter(const std::string &expression)
+{
+    if(expression.empty()) return;
+#ifdef HAVE_LIBPCAP
+    pcap_t *dead = pcap_open_dead(dlt,SNAPLEN);
+    if(dead==0) die("pcap_open_dead failed");
+    if(pcap_compile(dead,&fcode,expression.c_str(),1,0)<0) die("%s",pcap_geterr(dead));
+    pcap_close(dead);
+    if(cooked){
+        /* The kernel never sees the SLL header the filter was compiled against */
+        user_filter = true;
+        return;
+    }
+    struct sock_fprog prog;
+    prog.len    = fcode.bf_len;
+    prog.filter = (struct sock_filter *)fcode.bf_insns;
+    for(size_t i=0;i<rings.size();i++){
+        if(setsockopt(rings[i].fd,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog))<0){
+            die("%s: SO_ATTACH_FILTER: %s",device.c_str(),strerror(errno));
+        }
+    }
+    pcap_freecode(&fcode);
+#else
+    die("filter expressions require libpcap");
+#endif
+}
+
+void af_packet::open_ring(ring &r,int ifindex)
+{
+    int version = TPACKET_V3;
+    if(setsockopt(r.fd,SOL_PACKET,PACKET_VERSION,&version,sizeof(version))<0){
+        die("%s: TPACKET_V3 is not supported: %s",device.c_str(),strerror(errno));
+    }
+
+    /* v3 ignores the frame size, but the kernel still checks it */
+    struct tpacket_req3 req;
+    memset(&req,0,sizeof(req));
+    req.tp_block_size     = cfg.block_size;
+    req.tp_block_nr       = cfg.block_count;
+    req.tp_frame_size     = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr       = (cfg.block_size / req.tp_frame_size) * cfg.block_count;
+    req.tp_retire_blk_tov = cfg.timeout_ms;
+    if(setsockopt(r.fd,SOL_PACKET,PACKET_RX_RING,&req,sizeof(req))<0){
+        die("%s: PACKET_RX_RING: %s",device.c_str(),strerror(errno));
+    }
+    void *map = mmap(0,cfg.block_size*cfg.block_count,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_LOCKED,r.fd,0);
+    if(map==MAP_FAILED){
+        /* MAP_LOCKED fails without CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK */
+        map = mmap(0,cfg.block_size*cfg.block_count,PROT_READ|PROT_WRITE,MAP_SHARED,r.fd,0);
+    }
+    if(map==MAP_FAILED) die("%s: mmap: %s",device.c_str(),strerror(errno));
+    r.map = (uint8_t *)map;
+
+    struct sockaddr_ll sll;
+    memset(&sll,0,sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+    if(bind(r.fd,(struct sockaddr *)&sll,sizeof(sll))<0){
+        die("%s: bind: %s",device.c_str(),strerror(errno));
+    }
+    if(cfg.promisc && ifindex){
+        struct packet_mreq mr;
+        memset(&mr,0,sizeof(mr));
+        mr.mr_ifindex = ifindex;
+        mr.mr_type    = PACKET_MR_PROMISC;
+        if(setsockopt(r.fd,SOL_PACKET,PACKET_ADD_MEMBERSHIP,&mr,sizeof(mr))<0){
+            die("%s: PACKET_MR_PROMISC: %s",device.c_str(),strerror(errno));
+        }
+    }
+}
+
+/* Hand every frame in a block to the handler, in place */
+void af_packet::process_block(struct tpacket_block_desc *bd,pcap_handler handler,u_char *user)
+{
+    uint32_t n = bd->hdr.bh1.num_pkts;
+    uint8_t *p = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    for(uint32_t i=0;i<n;i++){
+        struct tpacket3_hdr *tp  = (struct tpacket3_hdr *)p;
+        struct sockaddr_ll  *sll = (struct sockaddr_ll *)(p + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        p += tp->tp_next_offset;
+
+        if(sll->sll_pkttype==PACKET_OUTGOING && sll->sll_ifindex==lo_ifindex) continue;
+
+        struct pcap_pkthdr h;
+        h.ts.tv_sec  = tp->tp_sec;
+        h.ts.tv_usec = tp->tp_nsec / 1000;
+        h.caplen     = tp->tp_snaplen;
+        h.len        = tp->tp_len;
+        u_char *frame = (u_char *)tp + tp->tp_mac;
+        if(cooked){
+            /* the kernel leaves room for exactly this in front of the frame */
+            frame -= SLL_HDR_LEN;
+            uint16_t pkttype = htons(sll->sll_pkttype);
+            uint16_t hatype  = htons(sll->sll_hatype);
+            uint16_t halen   = htons(sll->sll_halen);
+            memcpy(frame,   &pkttype,2);
+            memcpy(frame+2, &hatype,2);
+            memcpy(frame+4, &halen,2);
+            memset(frame+6, 0,8);
+            memcpy(frame+6, sll->sll_addr,sll->sll_halen < 8 ? sll->sll_halen : 8);
+            memcpy(frame+14,&sll->sll_protocol,2);
+            h.caplen += SLL_HDR_LEN;
+            h.len    += SLL_HDR_LEN;
+#ifdef HAVE_LIBPCAP
+            if(user_filter && pcap_offline_filter(&fcode,&h,frame)==0) continue;
+#endif
+        }
+        (*handler)(user,&h,frame);
+    }
+}
+
+void af_packet::loop(pcap_handler handler,u_char *user,void (*idle)(u_char *))
+{
+    std::vector<struct pollfd> pfds(rings.size());
+    while(!stop){
+        bool nothing = true;
+        for(size_t i=0;i<rings.size();i++){
+            ring &r = rings[i];
+            struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(r.map + r.next*cfg.block_size);
+            if((__atomic_load_n(&bd->hdr.bh1.block_status,__ATOMIC_ACQUIRE) & TP_STATUS_USER)==0) continue;
+            process_block(bd,handler,user);
+            __atomic_store_n(&bd->hdr.bh1.block_status,TP_STATUS_KERNEL,__ATOMIC_RELEASE);
+            r.next = (r.next+1) % cfg.block_count;
+            nothing = false;
+        }
+        if(nothing){
+            if(idle) (*idle)(user);
+            for(size_t i=0;i<rings.size();i++){
+                pfds[i].fd      = rings[i].fd;
+                pfds[i].events  = POLLIN | POLLERR;
+                pfds[i].revents = 0;
+            }
+            if(poll(&pfds[0],pfds.size(),cfg.timeout_ms)<0 && errno!=EINTR){
+                die("%s: poll: %s",device.c_str(),strerror(errno));
+            }
+        }
+    }
+    update_stats();
+}
+
+/* PACKET_STATISTICS resets the kernel's counters each time it is read */
+void af_packet::update_stats()
+{
+    for(size_t i=0;i<rings.size();i++){
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        memset(&st,0,sizeof(st));
+        if(getsockopt(rings[i].fd,SOL_PACKET,PACKET_STATISTICS,&st,&len)<0) continue;
+        packets      += st.tp_packets;
+        kernel_drops += st.tp_drops;
+        freezes      += st.tp_freeze_q_cnt;
+    }
+}
+
+void af_packet::dump_xml(dfxml_writer &xreport)
+{
+    xreport.push("af_packet",ssprintf("device='%s' sockets='%u' block_size='%zu' blocks='%u'",
+                                      device.c_str(),(unsigned)rings.size(),cfg.block_size,(unsigned)cfg.block_count));
+    xreport.xmlout("packets",packets);
+    xreport.xmlout("kernel_drops",kernel_drops);
+    xreport.xmlout("ring_full",freezes);
+    xreport.pop();                      // af_packet
+}
+
+#endif // HAVE_AF_PACKET
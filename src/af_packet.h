@@ -0,0 +1,91 @@
+#ifndef AF_PACKET_H
+#define AF_PACKET_H
+
+/**
+ * af_packet.h
+ *
+ * Live capture on Linux straight from a TPACKET_V3 ring, without libpcap.
+ *
+ * The kernel fills fixed-size blocks of frames in a ring that is mapped
+ * into our address space, and hands a block over when it is full or when
+ * it has been open for timeout_ms. loop() walks each block it is given and
+ * passes every frame to the datalink handler in place, then gives the block
+ * back. The ring itself is the buffer between the kernel and tcpflow, so
+ * the capture_ring is not used.
+ *
+ * With fanout > 1 several sockets join one PACKET_FANOUT group, and the
+ * kernel spreads packets across their rings by flow hash, so both
+ * directions of a connection always land in the same ring. loop() services
+ * all of the rings from one thread.
+ *
+ * Ethernet and loopback devices are read as raw frames (DLT_EN10MB). Other
+ * devices are read cooked, and a DLT_LINUX_SLL header is written into the
+ * 16 bytes of headroom the kernel leaves in front of each frame. The
+ * kernel strips VLAN tags, and unlike libpcap we do not put them back.
+ */
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#endif
+
+#if defined(TPACKET3_HDRLEN) && defined(PACKET_FANOUT)
+#define HAVE_AF_PACKET 1
+
+#include <signal.h>
+#include <string>
+#include <vector>
+
+class af_packet {
+public:
+    struct config {
+        config():block_size(1024*1024),block_count(32),fanout(1),timeout_ms(10),promisc(true){}
+        size_t   block_size;            // bytes per block; a multiple of the page size
+        uint32_t block_count;           // blocks per socket
+        uint32_t fanout;                // sockets in the fanout group
+        int      timeout_ms;            // how long the kernel may keep a block that is not full
+        bool     promisc;
+    };
+
+    /* Open the device and install the filter; dies on error */
+    af_packet(const std::string &device,const std::string &expression,const config &cfg);
+    ~af_packet();
+
+    int  datalink() const { return dlt; }
+    void loop(pcap_handler handler,u_char *user,void (*idle)(u_char *)=0); // until breakloop()
+    void breakloop() { stop = 1; }                // safe to call from a signal handler
+    void dump_xml(class dfxml_writer &xreport);
+
+    uint64_t packets;                   // seen by the kernel
+    uint64_t kernel_drops;              // dropped because the ring was full
+    uint64_t freezes;                   // times the ring filled up
+
+private:
+    struct ring {
+        int      fd;
+        uint8_t *map;
+        unsigned next;                  // the next block we expect the kernel to hand over
+    };
+
+    std::string       device;
+    config            cfg;
+    int               dlt;
+    bool              cooked;           // frames need an SLL header
+    int               lo_ifindex;       // frames sent on loopback show up twice; skip the outgoing copy
+    std::vector<ring> rings;
+    volatile sig_atomic_t stop;
+#ifdef HAVE_LIBPCAP
+    struct bpf_program fcode;           // for cooked frames, applied here rather than in the kernel
+    bool               user_filter;
+#endif
+
+    void open_ring(ring &r,int ifindex);
+    void set_filter(const std::string &expression);
+    void process_block(struct tpacket_block_desc *bd,pcap_handler handler,u_char *user);
+    void update_stats();
+
+    af_packet(const af_packet &);
+    af_packet &operator=(const af_packet &);
+};
+
+#endif // TPACKET3_HDRLEN
+#endif // AF_PACKET_H
@@ -0,0 +1,75 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+/**
+ * bloom_filter.h
+ *
+ * A counting Bloom filter of 64-bit hashes: whether a hash might have
+ * been added more times than it has been removed. It is never wrong when
+ * it says no. tcpdemux keeps one of the flows in saved_flow_map, so that
+ * a packet with data for a flow it does not know is only looked up in the
+ * map if the flow might have been saved.
+ *
+ * Each hash counts in K one-byte counters, picked by double hashing. A
+ * counter that reaches 255 stays there, so removing is always safe. The
+ * owner is to rebuild the filter with twice the counters (grow()) when
+ * full() says it has more than one hash per SPARSENESS counters; at 16
+ * counters a hash, about 1 lookup in 200 of a hash that was not added
+ * says yes.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <vector>
+
+class bloom_filter {
+public:
+    enum { K = 3, SPARSENESS = 16, MIN_COUNTERS = 1024 };
+
+    bloom_filter():counters(MIN_COUNTERS),mask(MIN_COUNTERS-1),entries(0){}
+
+    void add(uint64_t h) {
+        for(unsigned int i=0;i<K;i++){
+            uint8_t &c = counters[index(h,i)];
+            if(c<255) c++;
+        }
+        entries++;
+    }
+    void remove(uint64_t h) {
+        for(unsigned int i=0;i<K;i++){
+            uint8_t &c = counters[index(h,i)];
+            if(c>0 && c<255) c--;
+        }
+        if(entries>0) entries--;
+    }
+    bool maybe(uint64_t h) const {
+        for(unsigned int i=0;i<K;i++){
+            if(counters[index(h,i)]==0) return false;
+        }
+        return true;
+    }
+
+    bool full() const { return entries*SPARSENESS > counters.size(); }
+    /* empty the filter, with room for n hashes; add them again after */
+    void grow(size_t n) {
+        size_t size = MIN_COUNTERS;
+        while(size < n*SPARSENESS) size *= 2;
+        counters.assign(size,0);
+        mask    = size-1;
+        entries = 0;
+    }
+    size_t bytes() const { return counters.size(); }
+
+private:
+    std::vector<uint8_t> counters;      // a power of two of them
+    size_t   mask;
+    size_t   entries;                   // hashes added and not removed
+
+    size_t index(uint64_t h,unsigned int i) const {
+        uint32_t h1 = (uint32_t)h;
+        uint32_t h2 = (uint32_t)(h>>32) | 1;
+        return (h1 + i*h2) & mask;
+    }
+};
+
+#endif // BLOOM_FILTER_H
@@ -0,0 +1,193 @@
+/**
+ * capture_ring.cpp
+ *
+ * A thread between pcap and the datalink handlers; see capture_ring.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "capture_ring.h"
+
+#include <algorithm>
+#include <signal.h>
+
+capture_ring::capture_ring(size_t bytes,full_policy policy_):
+    policy(policy_),packets(0),ring_drops(0),kernel_drops(0),
+    ring(bytes),pd(0),live(false),handler(0),idle(0),user(0),thread(),running(false),
+    last_kernel_drops(0),seconds(),interval(1)
+{
+}
+
+capture_ring::~capture_ring()
+{
+    if(running) stop();
+}
+
+void capture_ring::start(pcap_t *pd_,bool live_,pcap_handler handler_,u_char *user_,void (*idle_)(u_char *))
+{
+    pd      = pd_;
+    live    = live_;
+    handler = handler_;
+    idle    = idle_;
+    user    = user_;
+    last_kernel_drops = 0;
+
+    /* leave the signals to the capture thread, which can stop pcap_loop() */
+    sigset_t all,old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    int r = pthread_create(&thread,NULL,capture_ring::run,this);
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    if(r) die("cannot start packet processing thread: %s",strerror(r));
+    running = true;
+}
+
+void capture_ring::stop()
+{
+    record rec;
+    memset(&rec,0,sizeof(rec));
+    rec.type = STOP;
+    push(rec,0,0);
+    pthread_join(thread,NULL);
+    running = false;
+    sample_kernel_drops();
+    pd = 0;
+}
+
+void capture_ring::push(const record &rec,const u_char *data,size_t len)
+{
+    unsigned int spins = 0;
+    uint8_t *p = 0;
+    while((p = (uint8_t *)ring.reserve(sizeof(rec)+len))==0) packet_ring::backoff(spins);
+    memcpy(p,&rec,sizeof(rec));
+    if(len) memcpy(p+sizeof(rec),data,len);
+    ring.commit();
+}
+
+void capture_ring::sample_kernel_drops()
+{
+#ifdef HAVE_PCAP_STATS
+    if(!live || pd==0 || seconds.empty()) return;
+    struct pcap_stat ps;
+    if(pcap_stats(pd,&ps)!=0) return;
+    uint64_t drops = ps.ps_drop;
+    if(drops > last_kernel_drops){
+        seconds.back().kernel_drops += drops - last_kernel_drops;
+        kernel_drops                += drops - last_kernel_drops;
+    }
+    last_kernel_drops = drops;
+#endif
+}
+
+void capture_ring::tick(time_t now)
+{
+    now -= now % interval;
+    if(seconds.size() && seconds.back().second==now) return;
+    sample_kernel_drops();              // the drops belong to the interval that just ended
+    if(seconds.size()==MAX_INTERVALS){
+        merge_intervals();
+        now -= now % interval;
+        if(seconds.back().second==now) return;
+    }
+    seconds.push_back(second_stats(now));
+}
+
+void capture_ring::merge_intervals()
+{
+    interval *= 2;
+    size_t n = 0;
+    for(size_t i=0;i<seconds.size();i++){
+        time_t start = seconds[i].second - seconds[i].second % interval;
+        if(n>0 && seconds[n-1].second==start){
+            second_stats &to = seconds[n-1];
+            to.packets      += seconds[i].packets;
+            to.peak_used     = std::max(to.peak_used,seconds[i].peak_used);
+            to.ring_drops   += seconds[i].ring_drops;
+            to.kernel_drops += seconds[i].kernel_drops;
+        } else {
+            seconds[n] = seconds[i];
+            seconds[n].second = start;
+            n++;
+        }
+    }
+    seconds.resize(n,second_stats(0));
+}
+
+/* static */ void capture_ring::capture(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    capture_ring *self = (capture_ring *)user;
+    self->tick(h->ts.tv_sec);
+    second_stats &cur = self->seconds.back();
+    self->packets++;
+    cur.packets++;
+
+    size_t len = sizeof(record) + h->caplen;
+    if(len > self->ring.max_record()) die("packet of %u bytes is too large for the capture ring",h->caplen);
+    uint8_t *dst = (uint8_t *)self->ring.reserve(len);
+    if(dst==0){
+        /* full */
+        cur.peak_used = self->ring.capacity();
+        if(self->policy==DROP && self->live){
+            self->ring_drops++;
+            cur.ring_drops++;
+            return;
+        }
+        unsigned int spins = 0;
+        while((dst = (uint8_t *)self->ring.reserve(len))==0) packet_ring::backoff(spins);
+    }
+    record rec;
+    memset(&rec,0,sizeof(rec));
+    rec.type = PKT;
+    rec.hdr  = *h;
+    memcpy(dst,&rec,sizeof(rec));
+    memcpy(dst+sizeof(rec),p,h->caplen);
+    self->ring.commit();
+
+    if(cur.packets % SAMPLE_EVERY == 1){
+        size_t used = self->ring.used();
+        if(used > cur.peak_used) cur.peak_used = used;
+    }
+}
+
+/* the processing thread */
+void *capture_ring::run(void *arg)
+{
+    capture_ring *self = (capture_ring *)arg;
+    unsigned int spins = 0;
+    while(true){
+        size_t len = 0;
+        const record *rec = (const record *)self->ring.peek(&len);
+        if(rec==0){
+            if(spins==128 && self->idle) (*self->idle)(self->user); // done spinning; about to sleep
+            packet_ring::backoff(spins);
+            continue;
+        }
+        spins = 0;
+        if(rec->type==STOP){
+            self->ring.release();
+            return 0;
+        }
+        (*self->handler)(self->user,&rec->hdr,(const u_char *)(rec+1));
+        self->ring.release();
+    }
+}
+
+void capture_ring::dump_xml(dfxml_writer &xreport)
+{
+    xreport.push("capture_ring",ssprintf("bytes='%zu' full='%s' interval='%u'",
+                                         ring.capacity(),policy==DROP ? "drop" : "block",interval));
+    xreport.xmlout("packets",packets);
+    xreport.xmlout("ring_drops",ring_drops);
+    xreport.xmlout("kernel_drops",kernel_drops);
+    for(std::vector<second_stats>::const_iterator it=seconds.begin();it!=seconds.end();it++){
+        xreport.xmlout("second","",
+                       ssprintf("t='%" PRId64 "' packets='%" PRIu64 "' occupancy='%.1f' ring_drops='%" PRIu64 "' kernel_drops='%" PRIu64 "'",
+                                (int64_t)it->second,it->packets,it->peak_used*100.0/ring.capacity(),
+                                it->ring_drops,it->kernel_drops),
+                       false);
+    }
+    xreport.pop();                      // capture_ring
+}
@@ -0,0 +1,98 @@
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+/**
+ * capture_ring.h
+ *
+ * Decouples packet capture from packet processing.
+ *
+ * Without it, the pcap callback runs the datalink handler, the demux and
+ * all of its file I/O inline, so a slow disk backs up into the kernel's
+ * capture buffer and packets are silently dropped. With it, the callback
+ * only copies each packet into a preallocated packet_ring, and a second
+ * thread takes packets out of the ring and runs the datalink handler.
+ *
+ * When the ring is full the capture thread either waits for room (BLOCK)
+ * or throws the packet away and counts it (DROP). Reading a file always
+ * blocks, since there is nobody to drop packets on us.
+ *
+ * The ring keeps one set of counters per second of packet time: packets
+ * seen, the most bytes that were waiting in the ring, packets dropped
+ * because the ring was full and packets dropped by the kernel (from
+ * pcap_stats(), live capture only). dump_xml() writes them to the report.
+ * So that a long capture does not make a long report, there are at most
+ * MAX_INTERVALS sets: when there would be more, neighbouring ones are
+ * merged and each covers twice as many seconds from then on.
+ */
+
+#include "packet_ring.h"
+#include <vector>
+
+class capture_ring {
+public:
+    enum full_policy { BLOCK, DROP };
+
+    enum { MAX_INTERVALS = 1024 };
+
+    struct second_stats {
+        second_stats(time_t second_):second(second_),packets(0),peak_used(0),ring_drops(0),kernel_drops(0){}
+        time_t   second;                // the first of the interval's seconds
+        uint64_t packets;               // packets captured during the interval
+        size_t   peak_used;             // most bytes waiting in the ring
+        uint64_t ring_drops;            // packets dropped because the ring was full
+        uint64_t kernel_drops;          // packets dropped by the kernel
+    };
+
+    capture_ring(size_t bytes,full_policy policy);
+    ~capture_ring();
+
+    /* Start a thread to run handler(user,...) on each packet in the ring,
+     * and idle(user), if given, when the ring has been empty for a while.
+     * If pd is a live capture, its kernel drops are counted.
+     */
+    void start(pcap_t *pd,bool live,pcap_handler handler,u_char *user,void (*idle)(u_char *)=0);
+    void stop();                        // wait for the ring to drain, then stop the thread
+
+    /* the pcap callback; user is the capture_ring */
+    static void capture(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+
+    void dump_xml(class dfxml_writer &xreport);
+
+    full_policy policy;
+    uint64_t packets;                   // totals for the whole run
+    uint64_t ring_drops;
+    uint64_t kernel_drops;
+
+private:
+    enum { PKT, STOP };
+    struct record {
+        uint32_t type;
+        uint32_t pad;
+        struct pcap_pkthdr hdr;
+        /* followed by hdr.caplen bytes of packet data */
+    };
+    enum { SAMPLE_EVERY = 64 };         // how often the producer looks at how full the ring is
+
+    packet_ring  ring;
+    pcap_t      *pd;
+    bool         live;
+    pcap_handler handler;
+    void       (*idle)(u_char *);
+    u_char      *user;
+    pthread_t    thread;
+    bool         running;
+    uint64_t     last_kernel_drops;     // pcap_stats() counts from when the capture started
+    std::vector<second_stats> seconds;
+    uint32_t     interval;              // seconds that each of them covers
+
+    void tick(time_t now);              // start a new interval if now is not in the current one
+    void merge_intervals();             // double interval, halving the number of seconds
+    void sample_kernel_drops();
+    void push(const record &rec,const u_char *data,size_t len);
+    static void *run(void *arg);
+
+    capture_ring(const capture_ring &);
+    capture_ring &operator=(const capture_ring &);
+};
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * console_writer.cpp
+ *
+ * Console output; see console_writer.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "console_writer.h"
+
+#include <algorithm>
+#include <stdarg.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CONSOLE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/****************************************************************
+ *** the kernels
+ ****************************************************************/
+
+#ifdef CONSOLE_SIMD_X86
+static bool have_avx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+/* ' ' through '~' are the bytes greater than 0x1f and less than 0x7f as signed chars */
+__attribute__((target("avx2")))
+static size_t printable_avx2(char *out,const uint8_t *in,size_t n,bool keep_crlf)
+{
+    const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    const __m256i dot = _mm256_set1_epi8('.');
+    size_t i = 0;
+    for(;i+32<=n;i+=32){
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(in+i));
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v,lo),_mm256_cmpgt_epi8(hi,v));
+        if(keep_crlf) ok = _mm256_or_si256(ok,_mm256_or_si256(_mm256_cmpeq_epi8(v,cr),_mm256_cmpeq_epi8(v,lf)));
+        _mm256_storeu_si256((__m256i *)(out+i),_mm256_blendv_epi8(dot,v,ok));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t hex_avx2(char *out,const uint8_t *in,size_t n)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f), nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0'), af = _mm256_set1_epi8('a'-'0'-10);
+    size_t i = 0;
+    for(;i+32<=n;i+=32){
+        __m256i v  = _mm256_loadu_si256((const __m256i *)(in+i));
+        __m256i h  = _mm256_and_si256(_mm256_srli_epi16(v,4),mask);
+        __m256i l  = _mm256_and_si256(v,mask);
+        h = _mm256_add_epi8(_mm256_add_epi8(h,zero),_mm256_and_si256(_mm256_cmpgt_epi8(h,nine),af));
+        l = _mm256_add_epi8(_mm256_add_epi8(l,zero),_mm256_and_si256(_mm256_cmpgt_epi8(l,nine),af));
+        /* the unpacks work within 128-bit lanes; put the lanes back in order */
+        __m256i a = _mm256_unpacklo_epi8(h,l), b = _mm256_unpackhi_epi8(h,l);
+        _mm256_storeu_si256((__m256i *)(out+2*i),   _mm256_permute2x128_si256(a,b,0x20));
+        _mm256_storeu_si256((__m256i *)(out+2*i+32),_mm256_permute2x128_si256(a,b,0x31));
+    }
+    return i;
+}
+
+static size_t printable_sse2(char *out,const uint8_t *in,size_t n,bool keep_crlf)
+{
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    const __m128i dot = _mm_set1_epi8('.');
+    size_t i = 0;
+    for(;i+16<=n;i+=16){
+        __m128i v  = _mm_loadu_si128((const __m128i *)(in+i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v,lo),_mm_cmplt_epi8(v,hi));
+        if(keep_crlf) ok = _mm_or_si128(ok,_mm_or_si128(_mm_cmpeq_epi8(v,cr),_mm_cmpeq_epi8(v,lf)));
+        _mm_storeu_si128((__m128i *)(out+i),_mm_or_si128(_mm_and_si128(ok,v),_mm_andnot_si128(ok,dot)));
+    }
+    return i;
+}
+
+static size_t hex_sse2(char *out,const uint8_t *in,size_t n)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0'), af = _mm_set1_epi8('a'-'0'-10);
+    size_t i = 0;
+    for(;i+16<=n;i+=16){
+        __m128i v  = _mm_loadu_si128((const __m128i *)(in+i));
+        __m128i h  = _mm_and_si128(_mm_srli_epi16(v,4),mask);
+        __m128i l  = _mm_and_si128(v,mask);
+        h = _mm_add_epi8(_mm_add_epi8(h,zero),_mm_and_si128(_mm_cmpgt_epi8(h,nine),af));
+        l = _mm_add_epi8(_mm_add_epi8(l,zero),_mm_and_si128(_mm_cmpgt_epi8(l,nine),af));
+        _mm_storeu_si128((__m128i *)(out+2*i),   _mm_unpacklo_epi8(h,l));
+        _mm_storeu_si128((__m128i *)(out+2*i+16),_mm_unpackhi_epi8(h,l));
+    }
+    return i;
+}
+#endif
+
+void console_writer::printable(char *out,const uint8_t *in,size_t n,bool keep_crlf)
+{
+    size_t i = 0;
+#ifdef CONSOLE_SIMD_X86
+    if(have_avx2()) i = printable_avx2(out,in,n,keep_crlf);
+    i += printable_sse2(out+i,in+i,n-i,keep_crlf);
+#endif
+    for(;i<n;i++){
+        uint8_t ch = in[i];
+        out[i] = ((ch>=' ' && ch<='~') || (keep_crlf && (ch=='\n' || ch=='\r'))) ? ch : '.';
+    }
+}
+
+void console_writer::hex(char *out,const uint8_t *in,size_t n)
+{
+    size_t i = 0;
+#ifdef CONSOLE_SIMD_X86
+    if(have_avx2()) i = hex_avx2(out,in,n);
+    i += hex_sse2(out+2*i,in+i,n-i);
+#endif
+    for(;i<n;i++){
+        out[2*i]   = hexdigits[in[i]>>4];
+        out[2*i+1] = hexdigits[in[i]&0x0f];
+    }
+}
+
+/****************************************************************
+ *** the buffer
+ ****************************************************************/
+
+console_writer::console_writer():writes(0),buf(FLUSH_BYTES),len(0),
+                                 flush_bytes(FLUSH_BYTES),flush_ms(FLUSH_MS),first()
+{
+}
+
+console_writer::~console_writer()
+{
+    flush();
+}
+
+char *console_writer::room(size_t n)
+{
+    if(len+n > buf.size()) buf.resize(std::max(2*buf.size(),len+n));
+    if(len==0) gettimeofday(&first,0);
+    char *p = &buf[len];
+    len += n;
+    return p;
+}
+
+void console_writer::put(const char *s,size_t n)
+{
+    if(n) memcpy(room(n),s,n);
+}
+
+void console_writer::printf(const char *fmt,...)
+{
+    char b[256];
+    va_list ap;
+    va_start(ap,fmt);
+    int n = vsnprintf(b,sizeof(b),fmt,ap);
+    va_end(ap);
+    if(n<0) return;
+    if((size_t)n < sizeof(b)){
+        put(b,n);
+        return;
+    }
+    va_start(ap,fmt);
+    vsnprintf(room(n+1),n+1,fmt,ap);    // the NUL is dropped
+    va_end(ap);
+    len--;
+}
+
+void console_writer::put_printable(const uint8_t *data,size_t n)
+{
+    printable(room(n),data,n,true);
+}
+
+void console_writer::put_hex_dump(const uint8_t *data,size_t n)
+{
+    const size_t bytes_per_line = 32;
+    size_t max_spaces = 0;
+    char digits[bytes_per_line*2];
+    for(size_t i=0;i<n;i+=bytes_per_line){
+        size_t k = std::min(bytes_per_line,n-i);
+
+        /* the offset: at least four hex digits, then ": " */
+        size_t width = 4;
+        while(width<16 && (i>>(4*width))) width++;
+        char *p = room(width+2);
+        for(size_t w=0;w<width;w++) p[w] = hexdigits[(i>>(4*(width-1-w))) & 0x0f];
+        p[width] = ':';
+        p[width+1] = ' ';
+        size_t spaces = width+2;
+
+        /* the bytes, a space after each pair, spaced out to where the ASCII goes */
+        hex(digits,data+i,k);
+        p = room(2*k + k/2);
+        for(size_t j=0;j+2<=k;j+=2){
+            memcpy(p,digits+2*j,4);
+            p[4] = ' ';
+            p += 5;
+        }
+        if(k%2) memcpy(p,digits+2*(k-1),2);
+        spaces += 2*k + k/2;
+        if(spaces>max_spaces) max_spaces = spaces;
+        p = room(max_spaces-spaces+1);
+        memset(p,' ',max_spaces-spaces+1);
+
+        printable(room(k),data+i,k,false);
+        put('\n');
+    }
+}
+
+void console_writer::put_base64(const uint8_t *data,size_t n)
+{
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *p = room((n+2)/3*4);
+    size_t i = 0;
+    for(;i+3<=n;i+=3){
+        uint32_t v = (data[i]<<16) | (data[i+1]<<8) | data[i+2];
+        p[0] = b64[v>>18];
+        p[1] = b64[(v>>12) & 0x3f];
+        p[2] = b64[(v>>6) & 0x3f];
+        p[3] = b64[v & 0x3f];
+        p += 4;
+    }
+    if(i<n){
+        uint32_t v = (data[i]<<16) | (i+1<n ? data[i+1]<<8 : 0);
+        p[0] = b64[v>>18];
+        p[1] = b64[(v>>12) & 0x3f];
+        p[2] = i+1<n ? b64[(v>>6) & 0x3f] : '=';
+        p[3] = '=';
+    }
+}
+
+void console_writer::end_record()
+{
+    if(len==0) return;
+    if(len >= flush_bytes){
+        flush();
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now,0);
+    int64_t ms = (int64_t)(now.tv_sec-first.tv_sec)*1000 + (now.tv_usec-first.tv_usec)/1000;
+    if(ms >= (int64_t)flush_ms) flush();
+}
+
+void console_writer::flush()
+{
+    if(len==0) return;
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_wait(semlock)){
+	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+    size_t written = fwrite(&buf[0],1,len,stdout);
+    if(written!=len || fflush(stdout)){
+        std::cerr << "\nwrite error to stdout (" << len << "!=" << written << ") \n";
+        exit(1);
+    }
+    writes++;
+    len = 0;
+#ifdef HAVE_PTHREAD
+    if(semlock){
+	if(sem_post(semlock)){
+	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+	    exit(1);
+	}
+    }
+#endif
+}
@@ -0,0 +1,72 @@
+/*
+ * console_writer.h:
+ *
+ * The output of -c and -C, formatted into one reusable buffer
+ *
+ * print_packet() puts each packet's output into the buffer, as it is, with
+ * unprintable bytes made dots (-s), as a hex and ASCII dump (-D) or as a
+ * line of JSON with the payload in base64 or hex (-J), and end_record()
+ * writes the buffer to stdout once it holds flush_bytes, or its oldest
+ * output is flush_ms old.
+ * Records are never split between writes, and the -L semaphore is taken
+ * once for each write rather than for each packet.
+ *
+ * The byte kernels use SSE2, and AVX2 when the CPU has it, on x86; other
+ * machines get the scalar loops, which produce the same bytes.
+ */
+
+#ifndef CONSOLE_WRITER_H
+#define CONSOLE_WRITER_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+class console_writer {
+public:
+    enum { FLUSH_BYTES = 64*1024, FLUSH_MS = 100 };
+
+    console_writer();
+    ~console_writer();
+
+    /* flush when this much is gathered (0 after every record), or when output is ms old */
+    void set_flush(size_t bytes,uint32_t ms) { flush_bytes = bytes; flush_ms = ms; }
+
+    void put(char ch)                           { *room(1) = ch; }
+    void put(const char *s,size_t n);
+    void put(const char *s)                     { put(s,strlen(s)); }
+    void put(const std::string &s)              { put(s.data(),s.size()); }
+    void printf(const char *fmt,...) __attribute__((format(printf,2,3)));
+
+    void put_printable(const uint8_t *data,size_t n);   // unprintables but CR and LF as '.'
+    void put_hex_dump(const uint8_t *data,size_t n);    // 32 bytes a line, with offsets and ASCII
+    void put_hex(const uint8_t *data,size_t n)  { hex(room(2*n),data,n); }
+    void put_base64(const uint8_t *data,size_t n);     // with padding
+
+    void end_record();                  // a packet's output is complete; write if it is time
+    void flush();                       // write out what is gathered
+
+    uint64_t writes;                    // write()s of the buffer
+
+    /* the kernels: n dots or bytes, and 2n hex digits */
+    static void printable(char *out,const uint8_t *in,size_t n,bool keep_crlf);
+    static void hex(char *out,const uint8_t *in,size_t n);
+
+private:
+    /* These are not implemented */
+    console_writer(const console_writer &);
+    console_writer &operator=(const console_writer &);
+
+    char *room(size_t n);               // n bytes at the end of the buffer, which are now in it
+
+    std::vector<char> buf;
+    size_t   len;                       // bytes of buf in use
+    size_t   flush_bytes;
+    uint32_t flush_ms;
+    struct timeval first;               // when the oldest gathered output was put
+};
+
+#endif
@@ -97,8 +97,6 @@ void dl_loop(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
 
 #endif
 
-static uint64_t counter=0;
-
 #ifdef DLT_PPP_ETHER
 
 #define	PPP_ETHER_HDRLEN 8
@@ -135,7 +133,6 @@ void dl_raw(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     }
     struct timeval tv;
     be13::packet_info pi(DLT_RAW,h,p,tvshift(tv,h->ts),p, h->caplen);
-    counter++;
     be13::plugin::process_packet(pi);
 }
 
@@ -195,7 +192,8 @@ void dl_ethernet(u_char *user, const struct pcap_pkthdr *h, const u_char *p)
     /* Create a packet_info structure with ip data and data length  */
     try {
         struct timeval tv;
-        be13::packet_info pi(DLT_IEEE802,h,p,tvshift(tv,h->ts),
+        /* DLT_IEEE802 frames are parsed as Ethernet too, so -K and -w write them as Ethernet */
+        be13::packet_info pi(DLT_EN10MB,h,p,tvshift(tv,h->ts),
                              ether_data, caplen - sizeof(struct be13::ether_header));
         switch (ntohs(*ether_type)){
         case ETHERTYPE_IP:
@@ -0,0 +1,60 @@
+/**
+ * dir_cache.cpp
+ *
+ * Output directories held open; see dir_cache.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "dir_cache.h"
+
+#include <algorithm>
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+int dir_cache::get(const std::string &path,size_t dir_len)
+{
+    for(size_t i=0;i<dirs.size();i++){
+        if(dirs[i].name.size()==dir_len && path.compare(0,dir_len,dirs[i].name)==0){
+            hits++;
+            std::rotate(dirs.begin(),dirs.begin()+i,dirs.begin()+i+1);
+            return dirs[0].fd;
+        }
+    }
+    misses++;
+    mkdirs_for_path(path);
+#ifdef HAVE_OPENAT
+    if(capacity==0) return -1;
+    std::string name = path.substr(0,dir_len);
+    int fd = ::open(name.size() ? name.c_str() : "/",O_RDONLY|O_DIRECTORY);
+    if(fd<0) return -1;                 // out of descriptors, most likely; the caller copes
+    if(dirs.size()>=capacity){
+        ::close(dirs.back().fd);
+        dirs.pop_back();
+    }
+    dirs.insert(dirs.begin(),dir(name,fd));
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+void dir_cache::set_capacity(size_t n)
+{
+    capacity = n;
+    while(dirs.size()>capacity){
+        ::close(dirs.back().fd);
+        dirs.pop_back();
+    }
+}
+
+void dir_cache::clear()
+{
+    for(size_t i=0;i<dirs.size();i++) ::close(dirs[i].fd);
+    dirs.clear();
+}
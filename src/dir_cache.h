@@ -0,0 +1,59 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+/**
+ * dir_cache.h
+ *
+ * The directories that flows were last put in, held open, so that a
+ * flow file is made with openat() relative to its directory instead of
+ * with its whole path (-Fk, -Fm, -Fg and -T templates with a '/').
+ *
+ * A directory is made, with mkdirs_for_path(), the first time it is
+ * asked for; after that it is found here without a system call, and
+ * each open (and each try of a name that was taken) only looks up the
+ * last part of the path. The directories are kept in least recently used
+ * order and the oldest is closed when there are capacity of them; with
+ * binning, flows go in the same few directories one after another, so a
+ * handful is plenty.
+ *
+ * Each tcpdemux (and so each -j shard) has its own, and counts the
+ * descriptors it holds among its max_fds. A capacity of 0 holds none.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class dir_cache {
+public:
+    enum { SIZE = 8 };                  // the most that are held open
+
+    dir_cache():hits(0),misses(0),dirs(),capacity(SIZE){}
+    ~dir_cache(){ clear(); }
+
+    /* an fd for the first dir_len bytes of path, a directory, made if
+     * need be; -1 if it cannot be held open, in which case open path itself
+     */
+    int  get(const std::string &path,size_t dir_len);
+    void set_capacity(size_t n);
+    void clear();                       // close them all
+    size_t size() const { return dirs.size(); }
+
+    uint64_t hits;                      // directories that were already open
+    uint64_t misses;                    // and those that were not
+
+private:
+    struct dir {
+        dir(const std::string &name_,int fd_):name(name_),fd(fd_){}
+        std::string name;
+        int         fd;
+    };
+    std::vector<dir> dirs;              // most recently used first
+    size_t      capacity;
+
+    dir_cache(const dir_cache &);
+    dir_cache &operator=(const dir_cache &);
+};
+
+#endif // DIR_CACHE_H
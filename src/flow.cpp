@@ -23,7 +23,7 @@
 
 #include <assert.h>
 #include <iostream>
-#include <sstream>
+#include <vector>
 
 std::string flow::filename_template("%A.%a-%B.%b%V%v%C%c");
 std::string flow::outdir(".");
@@ -51,112 +51,200 @@ void flow::usage()
     std::cout << "      Filename template format handles '/' to create sub-directories.\n";
 }
 
-std::string flow::filename(uint32_t connection_count, bool is_pcap)
+/* The template, compiled the first time a flow is named: runs of text
+ * (with the output directory in front, and %% made into %) between the
+ * codes. The options that change the template have all been read by then.
+ */
+struct name_op {
+    name_op(char code_,const std::string &text_):code(code_),text(text_){}
+    char        code;                   // the letter after the %, or 0 for text
+    std::string text;
+};
+
+struct name_template {
+    name_template():ops(),max_len(0){}
+    std::vector<name_op> ops;
+    size_t      max_len;                // the longest name it can make
+};
+
+/* the most that code can put in a name, or 0 if it is not a code */
+static size_t code_max_len(char code)
 {
-    std::stringstream ss;
+    switch(code){
+    case 'A': case 'B': return INET6_ADDRSTRLEN;
+    case 'a': case 'b': return 5;       // a port
+    case 'E': case 'e': return 17;      // a MAC address
+    case 'N': case 'K': case 'M': case 'G': return 4;
+    case 'T': return 64;                // what strftime() is given
+    case 't': return 21;                // a time_t
+    case 'V': return 2;
+    case 'v': return 11;                // an int32_t
+    case 'C': return 1;
+    case 'c': case '#': return 10;      // a uint32_t
+    case 'S': return 20;                // a uint64_t
+    }
+    return 0;
+}
+
+static name_template compile_template()
+{
+    const std::string &t = flow::filename_template;
+    name_template nt;
+    std::string text;
 
     /* Add the outdir */
-    if(flow::outdir!="." && flow::outdir!=""){
-        ss << flow::outdir;
-        ss << '/';
+    if(flow::outdir!="." && flow::outdir!="") text = flow::outdir + '/';
+
+    for(unsigned int i=0;i<t.size();i++){
+        if(t[i]!='%'){
+            text += t[i];
+            continue;
+        }
+        if(i==t.size()-1){
+            std::cerr << "Invalid filename_template: " << t << " cannot end with a %\n";
+            exit(1);
+        }
+        char code = t[++i];
+        if(code=='%'){                  // Output a '%'
+            text += '%';
+            continue;
+        }
+        size_t len = code_max_len(code);
+        if(len==0){
+            std::cerr << "Invalid filename_template: " << t << "\n";
+            std::cerr << "unknown character: " << code << "\n";
+            exit(1);
+        }
+        if(text.size()){
+            nt.ops.push_back(name_op(0,text));
+            nt.max_len += text.size();
+            text.clear();
+        }
+        nt.ops.push_back(name_op(code,""));
+        nt.max_len += len;
+    }
+    if(text.size()){
+        nt.ops.push_back(name_op(0,text));
+        nt.max_len += text.size();
+    }
+    return nt;
+}
+
+/* v in decimal, with zeros in front to make it width digits */
+static char *put_uint(char *p,uint64_t v,int width)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v%10;
+        v /= 10;
+    } while(v);
+    while(width-- > n) *p++ = '0';
+    while(n) *p++ = digits[--n];
+    return p;
+}
+
+/* as printf's %0*d would */
+static char *put_int(char *p,int64_t v,int width)
+{
+    if(v<0){
+        *p++ = '-';
+        return put_uint(p,-(uint64_t)v,width-1);
+    }
+    return put_uint(p,(uint64_t)v,width);
+}
+
+static char *put_addr(char *p,int family,const uint8_t *addr)
+{
+    switch(family){
+    case AF_INET:
+        for(int i=0;i<4;i++){
+            if(i) *p++ = '.';
+            p = put_uint(p,addr[i],3);
+        }
+        break;
+    case AF_INET6:
+        *p = 0;
+        inet_ntop(family,addr,p,INET6_ADDRSTRLEN);
+        p += strlen(p);
+        break;
+    }
+    return p;
+}
+
+static char *put_mac(char *p,const uint8_t *mac)
+{
+    static const char hex[] = "0123456789abcdef";
+    for(int i=0;i<6;i++){
+        if(i) *p++ = ':';
+        *p++ = hex[mac[i]>>4];
+        *p++ = hex[mac[i]&15];
+    }
+    return p;
+}
+
+std::string flow::filename(uint32_t connection_count, bool is_pcap)
+{
+    static const name_template nt = compile_template();
+    char stack_buf[512];
+    std::vector<char> heap_buf;
+    char *buf = stack_buf;
+    if(nt.max_len+sizeof(".pcap") > sizeof(stack_buf)){
+        heap_buf.resize(nt.max_len+sizeof(".pcap"));
+        buf = &heap_buf[0];
     }
 
-    for(unsigned int i=0;i<filename_template.size();i++){
-	switch(filename_template.at(i)){
-	default:
-	    ss << filename_template.at(i);
-	    break;
-	case '%':
-	    if(i==filename_template.size()-1){
-		std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
-		exit(1);
-	    }
-	    /* put the substitute in ss or buf */
-	    char buf[1024];
-	    buf[0] = 0;
-	    switch(filename_template.at(++i)){
-	    case 'A': // source IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             src.addr[0], src.addr[1], src.addr[2], src.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, src.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'a': // source IP port
-		snprintf(buf,sizeof(buf),"%05d",sport);
-		break;
-	    case 'B': // dest IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             dst.addr[0], dst.addr[1], dst.addr[2], dst.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, dst.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'b': // dest IP port
-		snprintf(buf,sizeof(buf),"%05d",dport);
-		break;
-                /* binning by connection number */
-            case 'E':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_saddr[0],mac_saddr[1],mac_saddr[2],mac_saddr[3],mac_saddr[4],mac_saddr[5]);
-                break;
-            case 'e':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_daddr[0],mac_daddr[1],mac_daddr[2],mac_daddr[3],mac_daddr[4],mac_daddr[5]);
-                break;
-            case 'N': snprintf(buf,sizeof(buf),"%03d",(int)(id)             % 1000);break;
-            case 'K': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000 )      % 1000);break;
-            case 'M': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000)    % 1000);break;
-            case 'G': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000000) % 1000);break;
-
-	    case 'T': // Timestamp in ISO8601 format
-	      {
-		time_t t = tstart.tv_sec;
-		strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t));
-		break;
-	      }
-	    case 't': // Unix time_t
-		ss << tstart.tv_sec;
-		break;
-	    case 'V': // '--' if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << "--";
-		break;
-	    case 'v': // VLAN number if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << vlan;
-		break;
-	    case 'C': // 'c' if connection_count >0
-		if(connection_count>0) ss << "c";
-		break;
-	    case 'c': // connection_count if connection_count >0
-		if(connection_count>0) ss << connection_count;
-		break;
-	    case 'S': // session ID
-		ss << std::setfill('0') << std::setw(20) << session_id;
-		break;
-	    case '#': // always output connection count
-		ss << connection_count;
-		break;
-	    case '%': // Output a '%'
-		ss << "%";
-		break;
-	    default:
-		std::cerr << "Invalid filename_template: " << filename_template << "\n";
-		std::cerr << "unknown character: " << filename_template.at(i+1) << "\n";
-		exit(1);
-	    }
-	    if(buf[0]) ss << buf;
-	}
+    char *p = buf;
+    for(std::vector<name_op>::const_iterator op=nt.ops.begin();op!=nt.ops.end();op++){
+        switch(op->code){
+        case 0:
+            memcpy(p,op->text.data(),op->text.size());
+            p += op->text.size();
+            break;
+        case 'A': p = put_addr(p,family,src.addr); break; // source IP address
+        case 'a': p = put_uint(p,sport,5); break;          // source IP port
+        case 'B': p = put_addr(p,family,dst.addr); break; // dest IP address
+        case 'b': p = put_uint(p,dport,5); break;          // dest IP port
+        case 'E': p = put_mac(p,mac_saddr); break;
+        case 'e': p = put_mac(p,mac_daddr); break;
+            /* binning by connection number */
+        case 'N': p = put_int(p,(int)(id)             % 1000,3); break;
+        case 'K': p = put_int(p,(int)(id /1000 )      % 1000,3); break;
+        case 'M': p = put_int(p,(int)(id /1000000)    % 1000,3); break;
+        case 'G': p = put_int(p,(int)(id /1000000000) % 1000,3); break;
+        case 'T': // Timestamp in ISO8601 format
+          {
+            time_t t = tstart.tv_sec;
+            struct tm tm;
+            gmtime_r(&t,&tm);           // gmtime() is not safe with -j
+            p += strftime(p,code_max_len('T'),"%Y-%m-%dT%H:%M:%SZ",&tm);
+            break;
+          }
+        case 't': p = put_int(p,tstart.tv_sec,0); break; // Unix time_t
+        case 'V': // '--' if VLAN is present
+            if(vlan!=be13::packet_info::NO_VLAN){
+                *p++ = '-';
+                *p++ = '-';
+            }
+            break;
+        case 'v': // VLAN number if VLAN is present
+            if(vlan!=be13::packet_info::NO_VLAN) p = put_int(p,vlan,0);
+            break;
+        case 'C': // 'c' if connection_count >0
+            if(connection_count>0) *p++ = 'c';
+            break;
+        case 'c': // connection_count if connection_count >0
+            if(connection_count>0) p = put_uint(p,connection_count,0);
+            break;
+        case 'S': p = put_uint(p,session_id,20); break; // session ID
+        case '#': p = put_uint(p,connection_count,0); break; // always output connection count
+        }
     }
     if(is_pcap){
-        ss << ".pcap"; // file extension
+        memcpy(p,".pcap",5);            // file extension
+        p += 5;
     }
-    return ss.str();
+    return std::string(buf,p-buf);
 }
 
 /**
@@ -164,13 +252,12 @@ std::string flow::filename(uint32_t connection_count, bool is_pcap)
  * This is called from tcpip::open_file().
  */
 
-std::string flow::new_filename(int *fd,int flags,int mode)
+std::string flow::new_filename(tcpdemux &demux,int *fd,int flags,int mode)
 {
     /* Loop connection count until we find a file that doesn't exist */
     for(uint32_t connection_count=0;;connection_count++){
         std::string nfn = filename(connection_count, false);
-        if(nfn.find('/')!=std::string::npos) mkdirs_for_path(nfn.c_str());
-        int nfd = tcpdemux::getInstance()->retrying_open(nfn,flags,mode);
+        int nfd = demux.open_in_dir(nfn,flags,mode);
         if(nfd>=0){
             *fd = nfd;
             return nfn;
@@ -179,14 +266,3 @@ std::string flow::new_filename(int *fd,int flags,int mode)
     }
     return std::string("<<CANNOT CREATE FILE>>");               // error; no file
 }
-
-std::string flow::new_pcap_filename()
-{
-    /* Loop connection count until we find a file that doesn't exist */
-    for(uint32_t connection_count=0;;connection_count++){
-        std::string nfn = filename(connection_count, true);
-        if(nfn.find('/')!=std::string::npos) mkdirs_for_path(nfn.c_str());
-        return nfn;
-    }
-    return std::string("<<CANNOT CREATE FILE>>");               // error; no file
-}
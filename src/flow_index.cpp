@@ -0,0 +1,133 @@
+/**
+ * flow_index.cpp
+ *
+ * The -I packet index; see flow_index.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "config.h"
+#include "flow_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const char MAGIC[8] = {'T','C','P','F','L','O','W','I'};
+
+static inline void put32(uint8_t *p,uint32_t v)
+{
+    for(int i=0;i<4;i++) p[i] = (uint8_t)(v>>(8*i));
+}
+
+static inline void put64(uint8_t *p,uint64_t v)
+{
+    for(int i=0;i<8;i++) p[i] = (uint8_t)(v>>(8*i));
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    for(int i=3;i>=0;i--) v = (v<<8) | p[i];
+    return v;
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for(int i=7;i>=0;i--) v = (v<<8) | p[i];
+    return v;
+}
+
+void flow_index::put_header(uint8_t *buf)
+{
+    memcpy(buf,MAGIC,sizeof(MAGIC));
+    put32(buf+8,FORMAT_VERSION);
+    put32(buf+12,RECORD_SIZE);
+}
+
+bool flow_index::check_header(const uint8_t *buf)
+{
+    return memcmp(buf,MAGIC,sizeof(MAGIC))==0 && get32(buf+8)==FORMAT_VERSION && get32(buf+12)==RECORD_SIZE;
+}
+
+void flow_index::put_record(uint8_t *buf,const record &r)
+{
+    put64(buf,r.offset);
+    put64(buf+8,(uint64_t)r.sec);
+    put32(buf+16,r.usec);
+    put32(buf+20,r.length);
+}
+
+flow_index::record flow_index::get_record(const uint8_t *buf)
+{
+    return record(get64(buf),(int64_t)get64(buf+8),get32(buf+16),get32(buf+20));
+}
+
+std::string flow_index::text(const record &r)
+{
+    char buf[80];
+    snprintf(buf,sizeof(buf),"%" PRIu64 "|%" PRId64 ".%06u|%u",r.offset,r.sec,r.usec,r.length);
+    return std::string(buf);
+}
+
+bool flow_index_reader::open(const std::string &path)
+{
+    records.clear();
+    max_length = 0;
+    int fd = ::open(path.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) return false;
+    std::vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    ssize_t r;
+    while((r = ::read(fd,chunk,sizeof(chunk)))!=0){
+        if(r<0){
+            if(errno==EINTR) continue;
+            int e = errno;
+            ::close(fd);
+            errno = e;
+            return false;
+        }
+        buf.insert(buf.end(),chunk,chunk+r);
+    }
+    ::close(fd);
+    if(buf.size()<flow_index::HEADER_SIZE || !flow_index::check_header(&buf[0]) ||
+       (buf.size()-flow_index::HEADER_SIZE) % flow_index::RECORD_SIZE != 0){
+        errno = EINVAL;
+        return false;
+    }
+    size_t n = (buf.size()-flow_index::HEADER_SIZE) / flow_index::RECORD_SIZE;
+    records.reserve(n);
+    bool sorted = true;
+    for(size_t i=0;i<n;i++){
+        records.push_back(flow_index::get_record(&buf[flow_index::HEADER_SIZE + i*flow_index::RECORD_SIZE]));
+        if(i>0 && records[i] < records[i-1]) sorted = false;
+        max_length = std::max(max_length,records[i].length);
+    }
+    if(!sorted) std::stable_sort(records.begin(),records.end());
+    return true;
+}
+
+size_t flow_index_reader::find(uint64_t offset) const
+{
+    /* the ones that could have the byte start at or before it, and no more than max_length before */
+    size_t after = std::upper_bound(records.begin(),records.end(),
+                                    flow_index::record(offset,0,0,0)) - records.begin();
+    size_t found = after;
+    for(size_t i=after;i>0;i--){
+        const flow_index::record &r = records[i-1];
+        if(r.offset + max_length <= offset) break;
+        if(r.offset + r.length > offset) found = i-1;
+    }
+    return found;
+}
@@ -0,0 +1,72 @@
+#ifndef FLOW_INDEX_H
+#define FLOW_INDEX_H
+
+/**
+ * flow_index.h
+ *
+ * The packet index that -I writes next to each flow file, as
+ * flowname.findx: for each packet stored in the flow, where its bytes
+ * went in the file and when it arrived.
+ *
+ * The file is a header of HEADER_SIZE bytes, "TCPFLOWI" and then the
+ * version and the record size as 32-bit numbers, followed by records of
+ * RECORD_SIZE bytes: the offset (64 bits), the seconds (64 bits) and
+ * microseconds (32 bits) of the packet's time, and its length (32 bits).
+ * All are little-endian.
+ *
+ * A flow gathers its records in memory and appends them when its data is
+ * flushed, each batch in order of offset, so the index of a flow that
+ * was written front to back is in order. flow_index_reader sorts one
+ * that is not as it reads it, and finds the record for a stream offset.
+ * tcpflow-findx prints an index in the old text form, one
+ * "offset|sec.usec|length" line per packet.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class flow_index {
+public:
+    enum { HEADER_SIZE = 16, RECORD_SIZE = 24, FORMAT_VERSION = 1 };
+
+    struct record {
+        record():offset(0),sec(0),usec(0),length(0){}
+        record(uint64_t offset_,int64_t sec_,uint32_t usec_,uint32_t length_):
+            offset(offset_),sec(sec_),usec(usec_),length(length_){}
+        uint64_t offset;                // in the flow file
+        int64_t  sec;                   // when the packet arrived
+        uint32_t usec;
+        uint32_t length;                // bytes of the packet that were stored
+        bool operator<(const record &b) const { return offset < b.offset; }
+    };
+
+    static void put_header(uint8_t *buf);
+    static bool check_header(const uint8_t *buf); // false if buf is not the start of an index
+    static void put_record(uint8_t *buf,const record &r);
+    static record get_record(const uint8_t *buf);
+    static std::string text(const record &r); // "offset|sec.usec|length"
+};
+
+class flow_index_reader {
+public:
+    flow_index_reader():records(),max_length(0){}
+
+    /* read the index in path; false, with errno set, if it cannot be read or is not an index */
+    bool open(const std::string &path);
+
+    size_t size() const { return records.size(); }
+    const flow_index::record &operator[](size_t i) const { return records[i]; }
+
+    /* the first record, in offset order, with the byte at offset, or the
+     * first after it if none has it; size() if there is neither
+     */
+    size_t find(uint64_t offset) const;
+
+private:
+    std::vector<flow_index::record> records; // in order of offset
+    uint32_t max_length;                // of any record; how far back find() has to look
+};
+
+#endif
@@ -0,0 +1,619 @@
+/**
+ * flow_io.cpp
+ *
+ * Writing flow files synchronously or through io_uring; see flow_io.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_io.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+/* openat, write and close came with 5.6, as did IORING_FEAT_CUR_PERSONALITY */
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_CUR_PERSONALITY)
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+/****************************************************************
+ ** common
+ ****************************************************************/
+
+/* static */ void flow_io::set_times(int fd,const struct timeval &mtime)
+{
+    struct timeval times[2];
+    times[0] = mtime;
+    times[1] = mtime;
+#if defined(HAVE_FUTIMES)
+    /* fix microseconds if they are invalid */
+    for ( int i=0; i<2; i++){
+        if ( times[i].tv_usec < 0 || times[i].tv_usec >= 1000000 ){
+            times[i].tv_usec = 0;
+        }
+    }
+    if (futimes(fd,times)){
+        fprintf(stderr,"%s: futimes(fd=%d,[%ld:%ld,%ld:%ld])\n",
+                strerror(errno),fd,
+                times[0].tv_sec,times[1].tv_usec,
+                times[1].tv_sec,times[1].tv_usec);
+    }
+#elif defined(HAVE_FUTIMENS)
+    struct timespec tstimes[2];
+    for(int i=0;i<2;i++){
+        tstimes[i].tv_sec = times[i].tv_sec;
+        tstimes[i].tv_nsec = times[i].tv_usec * 1000;
+    }
+    if(futimens(fd,tstimes)){
+        fprintf(stderr,"%s: futimens(fd=%d)\n",strerror(errno),fd);
+    }
+#endif
+}
+
+void flow_io::remember(int fd,const std::string &p)
+{
+    if(fd<0) return;
+    if((size_t)fd >= paths.size()) paths.resize(fd+1);
+    paths[fd] = p;
+}
+
+const std::string &flow_io::path(int fd) const
+{
+    static const std::string unknown("<unknown>");
+    if(fd<0 || (size_t)fd >= paths.size()) return unknown;
+    return paths[fd];
+}
+
+/* The files are there to read */
+
+/*
+ * Insert inslen bytes at the front of the file.
+ *
+ * Based on:
+ * http://stackoverflow.com/questions/10467711/c-write-in-the-middle-of-a-binary-file-without-overwriting-any-existing-content
+ */
+int flow_io::shift(int fd,uint64_t inslen)
+{
+    enum { BUFFERSIZE = 64 * 1024 };
+    char buffer[BUFFERSIZE];
+    struct stat sb;
+
+    DEBUG(100)("shift(%d,%d)",fd,(int)inslen);
+
+    wait(fd);
+    if (fstat(fd, &sb) != 0) return -1;
+
+    /* Move data after offset up by inslen bytes */
+    size_t bytes_to_move = sb.st_size;
+    off_t read_end_offset = sb.st_size; 
+    while (bytes_to_move != 0) {
+	ssize_t bytes_this_time = bytes_to_move < BUFFERSIZE ? bytes_to_move : BUFFERSIZE ;
+	ssize_t rd_off = read_end_offset - bytes_this_time;
+	ssize_t wr_off = rd_off + inslen;
+	lseek(fd, rd_off, SEEK_SET);
+	if (::read(fd, buffer, bytes_this_time) != bytes_this_time)
+	    return -1;
+	lseek(fd, wr_off, SEEK_SET);
+	if (::write(fd, buffer, bytes_this_time) != bytes_this_time)
+	    return -1;
+	bytes_to_move -= bytes_this_time;
+    }   
+
+    /* What was at the front is now further up; the front is a hole until it is written */
+    size_t bytes_to_clear = std::min((size_t)sb.st_size,(size_t)inslen);
+    memset(buffer, 0, std::min(bytes_to_clear,(size_t)BUFFERSIZE));
+    for(off_t o=0; bytes_to_clear != 0; ){
+	ssize_t bytes_this_time = bytes_to_clear < BUFFERSIZE ? bytes_to_clear : BUFFERSIZE ;
+	lseek(fd, o, SEEK_SET);
+	if (::write(fd, buffer, bytes_this_time) != bytes_this_time)
+	    return -1;
+	o += bytes_this_time;
+	bytes_to_clear -= bytes_this_time;
+    }
+    return 0;
+}
+
+sbuf_t *flow_io::map_file(const std::string &p,int fd)
+{
+    return sbuf_t::map_file(p,fd);
+}
+
+ssize_t flow_io::read(const std::string &p,uint64_t offset,void *buf,size_t length)
+{
+    int fd = ::open(p.c_str(),O_RDONLY | O_BINARY);
+    if(fd<0) return -1;
+    lseek(fd,offset,SEEK_SET);
+    ssize_t r = ::read(fd,buf,length);
+    ::close(fd);
+    return r;
+}
+
+void flow_io::add(const flow_io &child)
+{
+    ops     += child.ops;
+    submits += child.submits;
+    stalls  += child.stalls;
+    errors  += child.errors;
+}
+
+void flow_io::dump_xml(dfxml_writer &xreport)
+{
+    xreport.push("flow_io",std::string("backend='") + name() + "'");
+    xreport.xmlout("ops",ops);
+    xreport.xmlout("submits",submits);
+    xreport.xmlout("stalls",stalls);
+    xreport.xmlout("errors",errors);
+    xreport.pop();                      // flow_io
+}
+
+/****************************************************************
+ ** sync: the system calls, as they are asked for
+ ****************************************************************/
+
+class flow_io_sync : public flow_io {
+public:
+    flow_io_sync(){}
+    virtual const char *name() const { return "sync"; }
+
+    virtual int openat(int dirfd,const char *name,const std::string &p,int flags,int mode) {
+        submits++;
+#ifdef HAVE_OPENAT
+        int fd = ::openat(dirfd,name,flags,mode);
+#else
+        int fd = ::open(p.c_str(),flags,mode);
+#endif
+        remember(fd,p);
+        return fd;
+    }
+
+    virtual void write(int fd,uint64_t offset,const void *data,size_t length) {
+        const uint8_t *b = (const uint8_t *)data;
+        ops++;
+        while(length>0){
+            submits++;
+#ifdef HAVE_PWRITE
+            ssize_t r = pwrite(fd,b,length,(off_t)offset);
+#else
+            lseek(fd,(off_t)offset,SEEK_SET);
+            ssize_t r = ::write(fd,b,length);
+#endif
+            if(r<=0){
+                if(r<0 && errno==EINTR) continue;
+                errors++;
+                DEBUG(1) ("write to %s failed: %s", path(fd).c_str(), r<0 ? strerror(errno) : "no progress");
+                return;
+            }
+            b      += r;
+            length -= r;
+            offset += r;
+        }
+    }
+
+    virtual void write_owned(int fd,uint64_t offset,void *buf,size_t length) {
+        write(fd,offset,buf,length);
+        free(buf);
+    }
+
+    virtual void close(int fd,const struct timeval *mtime) {
+        ops++;
+        if(mtime) set_times(fd,*mtime);
+        submits++;
+        if(::close(fd)){
+            errors++;
+            DEBUG(1) ("close of %s failed: %s", path(fd).c_str(), strerror(errno));
+        }
+    }
+};
+
+/****************************************************************
+ ** uring: writes and closes go on an io_uring
+ ****************************************************************/
+
+#ifdef HAVE_IO_URING
+class flow_io_uring : public flow_io {
+public:
+    explicit flow_io_uring(unsigned int depth);
+    virtual ~flow_io_uring();
+    const std::string &error() const { return err; } // why the ring could not be set up
+
+    virtual const char *name() const { return "uring"; }
+    virtual int  openat(int dirfd,const char *name,const std::string &p,int flags,int mode);
+    virtual void write(int fd,uint64_t offset,const void *data,size_t length);
+    virtual void write_owned(int fd,uint64_t offset,void *buf,size_t length);
+    virtual void close(int fd,const struct timeval *mtime);
+    virtual void wait(int fd);
+    virtual void drain();
+    virtual size_t pending() const { return outstanding; }
+
+private:
+    enum op_type { OPEN, WRITE, CLOSE };
+    struct op {
+        op(op_type type_,int fd_):type(type_),fd(fd_),offset(0),buf(0),length(0),done(false),res(0){}
+        op_type  type;
+        int      fd;
+        uint64_t offset;
+        uint8_t  *buf;                  // from malloc(); ours
+        size_t   length;
+        bool     done;                  // for OPEN, which is waited for
+        int      res;
+    private:
+        op(const op &);
+        op &operator=(const op &);
+    };
+    /* the operations asked of one fd that are not done */
+    struct file {
+        file():waiting(),running(0),set(false),mtime(){}
+        std::deque<op *> waiting;       // until the chain in the kernel is done
+        unsigned int running;           // operations of that chain not yet completed
+        bool     set;                   // set the times to mtime before closing
+        struct timeval mtime;
+    };
+    typedef std::map<int,file> files_t;
+
+    std::string  err;
+    int          ring;
+    unsigned int depth;
+    unsigned int batch;                 // submit when this many are queued
+    unsigned int queued;                // in the submission queue, not yet submitted
+    unsigned int inflight;              // in the submission queue or the kernel
+    unsigned int outstanding;           // inflight, or waiting behind a chain
+    files_t      files;                 // fds with outstanding operations
+
+    /* the mapped rings */
+    void         *sq_map,*cq_map;
+    size_t       sq_len,cq_len,sqes_len;
+    unsigned int *sq_head,*sq_tail,*sq_mask,*sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head,*cq_tail,*cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void setup();
+    void push(const struct io_uring_sqe &sqe); // onto the submission queue
+    void enter(unsigned int min_complete);     // submit what is queued and wait for min_complete
+    void reap();                               // handle the completions that are there
+    void complete(op *o,int res);
+    void enqueue(op *o);
+    void start(int fd,file &f);                // submit the waiting operations of fd
+    void make_room();
+
+    flow_io_uring(const flow_io_uring &);
+    flow_io_uring &operator=(const flow_io_uring &);
+};
+
+flow_io_uring::flow_io_uring(unsigned int depth_):
+    err(),ring(-1),depth(depth_),batch(depth_/8),queued(0),inflight(0),outstanding(0),files(),
+    sq_map(MAP_FAILED),cq_map(MAP_FAILED),sq_len(0),cq_len(0),sqes_len(0),
+    sq_head(0),sq_tail(0),sq_mask(0),sq_array(0),sq_entries(0),sqes((struct io_uring_sqe *)MAP_FAILED),
+    cq_head(0),cq_tail(0),cq_mask(0),cqes(0)
+{
+    if(depth<1) depth = 1;
+    if(batch<1) batch = 1;
+    setup();
+}
+
+void flow_io_uring::setup()
+{
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+#ifdef IORING_SETUP_CLAMP
+    p.flags = IORING_SETUP_CLAMP;       // a depth beyond the kernel's limit gets the limit
+#endif
+    ring = syscall(__NR_io_uring_setup,depth,&p);
+    if(ring<0){
+        err = std::string("io_uring_setup: ") + strerror(errno);
+        return;
+    }
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) sq_len = cq_len = std::max(sq_len,cq_len);
+    sq_map = mmap(0,sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_SQ_RING);
+    if(sq_map==MAP_FAILED){
+        err = std::string("mmap of the submission queue: ") + strerror(errno);
+        return;
+    }
+    if(!single){
+        cq_map = mmap(0,cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_CQ_RING);
+        if(cq_map==MAP_FAILED){
+            err = std::string("mmap of the completion queue: ") + strerror(errno);
+            return;
+        }
+    }
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(0,sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_SQES);
+    if(sqes==MAP_FAILED){
+        err = std::string("mmap of the submission entries: ") + strerror(errno);
+        return;
+    }
+    uint8_t *sq = (uint8_t *)sq_map;
+    uint8_t *cq = single ? sq : (uint8_t *)cq_map;
+    sq_head    = (unsigned int *)(sq + p.sq_off.head);
+    sq_tail    = (unsigned int *)(sq + p.sq_off.tail);
+    sq_mask    = (unsigned int *)(sq + p.sq_off.ring_mask);
+    sq_array   = (unsigned int *)(sq + p.sq_off.array);
+    sq_entries = p.sq_entries;
+    cq_head    = (unsigned int *)(cq + p.cq_off.head);
+    cq_tail    = (unsigned int *)(cq + p.cq_off.tail);
+    cq_mask    = (unsigned int *)(cq + p.cq_off.ring_mask);
+    cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* every operation we use must be there */
+    const size_t nops = 256;
+    struct io_uring_probe *probe =
+        (struct io_uring_probe *)calloc(1,sizeof(struct io_uring_probe) + nops*sizeof(struct io_uring_probe_op));
+    if(probe==0){
+        err = "out of memory";
+        return;
+    }
+    if(syscall(__NR_io_uring_register,ring,IORING_REGISTER_PROBE,probe,nops)<0){
+        err = std::string("IORING_REGISTER_PROBE: ") + strerror(errno);
+    } else {
+        const int needed[] = {IORING_OP_OPENAT,IORING_OP_WRITE,IORING_OP_CLOSE};
+        for(size_t i=0;i<sizeof(needed)/sizeof(needed[0]);i++){
+            if(needed[i] > probe->last_op || (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)==0){
+                err = "the kernel's io_uring cannot openat, write and close";
+            }
+        }
+    }
+    free(probe);
+}
+
+flow_io_uring::~flow_io_uring()
+{
+    if(err.empty()) drain();
+    if(sqes!=MAP_FAILED)   munmap(sqes,sqes_len);
+    if(cq_map!=MAP_FAILED) munmap(cq_map,cq_len);
+    if(sq_map!=MAP_FAILED) munmap(sq_map,sq_len);
+    if(ring>=0) ::close(ring);
+}
+
+void flow_io_uring::push(const struct io_uring_sqe &sqe)
+{
+    unsigned int tail = *sq_tail;
+    if(tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE) >= sq_entries) enter(0);
+    unsigned int index = tail & *sq_mask;
+    sqes[index] = sqe;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+    queued++;
+    inflight++;
+}
+
+void flow_io_uring::enter(unsigned int min_complete)
+{
+    unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    if(queued==0 && min_complete==0) return;
+    if(queued) submits++;
+    while(syscall(__NR_io_uring_enter,ring,queued,min_complete,flags,NULL,0)<0){
+        if(errno==EINTR || errno==EAGAIN || errno==EBUSY) continue;
+        die("io_uring_enter: %s",strerror(errno));
+    }
+    queued = *sq_tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE);
+}
+
+void flow_io_uring::reap()
+{
+    unsigned int head = *cq_head;
+    while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)){
+        const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+        op *o   = (op *)(uintptr_t)cqe.user_data;
+        int res = cqe.res;
+        __atomic_store_n(cq_head,++head,__ATOMIC_RELEASE);
+        complete(o,res);                // may submit more
+        head = *cq_head;
+    }
+}
+
+void flow_io_uring::complete(op *o,int res)
+{
+    inflight--;
+    outstanding--;
+    const int fd = o->fd;
+    switch(o->type){
+    case OPEN:
+        o->done = true;
+        o->res  = res;
+        return;                         // it is on the stack of open()
+    case WRITE:
+        if(res<0 || (size_t)res!=o->length){
+            errors++;
+            DEBUG(1) ("write to %s failed: %s", path(fd).c_str(), res<0 ? strerror(-res) : "short write");
+        }
+        free(o->buf);
+        break;
+    case CLOSE:
+        if(res<0){
+            errors++;
+            DEBUG(1) ("close of %s failed: %s", path(fd).c_str(), strerror(-res));
+        }
+        break;
+    }
+    delete o;
+
+    files_t::iterator it = files.find(fd);
+    if(it==files.end() || --it->second.running > 0) return;
+    if(it->second.waiting.empty()){
+        files.erase(it);                // nothing more for fd; after a close the number may be reused
+        return;
+    }
+    start(fd,it->second);
+}
+
+/* Submit fd's waiting writes as one chain, or its close on its own.
+ * The chain has to go to the kernel in one submission to stay linked,
+ * so it is at most as long as the submission queue, and the queue is
+ * emptied first if it does not have room for it.
+ */
+void flow_io_uring::start(int fd,file &f)
+{
+    op *first = f.waiting.front();
+    if(first->type==CLOSE){
+        f.waiting.pop_front();
+        if(f.set) set_times(fd,f.mtime); // the writes are done, so they will not change the times again
+        struct io_uring_sqe sqe;
+        memset(&sqe,0,sizeof(sqe));
+        sqe.opcode    = IORING_OP_CLOSE;
+        sqe.fd        = fd;
+        sqe.user_data = (uintptr_t)first;
+        push(sqe);
+        f.running = 1;
+        return;
+    }
+    unsigned int n = 0;
+    while(n < f.waiting.size() && n < sq_entries && f.waiting[n]->type==WRITE) n++;
+    if(*sq_tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE) + n > sq_entries) enter(0);
+    for(unsigned int i=0;i<n;i++){
+        op *o = f.waiting.front();
+        f.waiting.pop_front();
+        struct io_uring_sqe sqe;
+        memset(&sqe,0,sizeof(sqe));
+        sqe.opcode    = IORING_OP_WRITE;
+        sqe.fd        = fd;
+        sqe.off       = o->offset;
+        sqe.addr      = (uintptr_t)o->buf;
+        sqe.len       = o->length;
+        sqe.flags     = i+1<n ? IOSQE_IO_HARDLINK : 0; // in order, even if one fails
+        sqe.user_data = (uintptr_t)o;
+        push(sqe);
+    }
+    f.running = n;
+}
+
+/* block until fewer than depth operations are outstanding */
+void flow_io_uring::make_room()
+{
+    reap();
+    if(outstanding < depth) return;
+    stalls++;
+    while(outstanding >= depth){
+        enter(1);
+        reap();
+    }
+}
+
+void flow_io_uring::enqueue(op *o)
+{
+    ops++;
+    outstanding++;
+    file &f = files[o->fd];
+    f.waiting.push_back(o);
+    if(f.running==0) start(o->fd,f);
+    if(queued >= batch) enter(0);
+}
+
+int flow_io_uring::openat(int dirfd,const char *name,const std::string &p,int flags,int mode)
+{
+    op o(OPEN,-1);
+    struct io_uring_sqe sqe;
+    memset(&sqe,0,sizeof(sqe));
+    sqe.opcode     = IORING_OP_OPENAT;
+    sqe.fd         = dirfd;
+    sqe.addr       = (uintptr_t)name;
+    sqe.len        = mode;
+    sqe.open_flags = flags;
+    sqe.user_data  = (uintptr_t)&o;
+    outstanding++;
+    push(sqe);
+    while(!o.done){
+        enter(1);
+        reap();
+    }
+    if(o.res<0){
+        errno = -o.res;
+        return -1;
+    }
+    remember(o.res,p);
+    return o.res;
+}
+
+void flow_io_uring::write_owned(int fd,uint64_t offset,void *buf,size_t length)
+{
+    make_room();
+    op *o = new op(WRITE,fd);
+    o->offset = offset;
+    o->buf    = (uint8_t *)buf;
+    o->length = length;
+    enqueue(o);
+}
+
+void flow_io_uring::write(int fd,uint64_t offset,const void *data,size_t length)
+{
+    void *buf = malloc(length);
+    if(buf==0) die("out of memory for a write of %u bytes",(unsigned int)length);
+    memcpy(buf,data,length);
+    write_owned(fd,offset,buf,length);
+}
+
+void flow_io_uring::close(int fd,const struct timeval *mtime)
+{
+    make_room();
+    file &f = files[fd];
+    if(mtime){
+        f.set   = true;
+        f.mtime = *mtime;
+    }
+    enqueue(new op(CLOSE,fd));
+}
+
+void flow_io_uring::wait(int fd)
+{
+    reap();
+    while(files.count(fd)){
+        enter(1);
+        reap();
+    }
+}
+
+void flow_io_uring::drain()
+{
+    reap();
+    while(outstanding){
+        enter(1);
+        reap();
+    }
+}
+#endif // HAVE_IO_URING
+
+/****************************************************************
+ ** choosing one
+ ****************************************************************/
+
+/* static */ std::string flow_io::unavailable(const std::string &backend)
+{
+    if(backend=="sync") return "";
+    if(backend=="uring"){
+#ifdef HAVE_IO_URING
+        flow_io_uring probe(4);
+        return probe.error();
+#else
+        return "this tcpflow was built without io_uring";
+#endif
+    }
+    return "there is no such backend";
+}
+
+/* static */ flow_io *flow_io::make(const std::string &backend,unsigned int depth)
+{
+#ifndef HAVE_IO_URING
+    (void)backend;
+    (void)depth;
+#else
+    if(backend=="uring"){
+        flow_io_uring *u = new flow_io_uring(depth);
+        if(u->error().empty()) return u;
+        DEBUG(1) ("io_uring: %s; writing synchronously", u->error().c_str());
+        delete u;
+    }
+#endif
+    return new flow_io_sync();
+}
@@ -0,0 +1,113 @@
+#ifndef FLOW_IO_H
+#define FLOW_IO_H
+
+/**
+ * flow_io.h
+ *
+ * How tcpdemux opens, writes and closes the files it makes: flow files
+ * and HTTP bodies (-S io-backend=sync|uring).
+ *
+ * The sync backend makes the system calls as they are asked for, as
+ * tcpflow always has.
+ *
+ * The uring backend (Linux 5.6 and later) puts each write and close on an
+ * io_uring and goes on with the next packet. Operations are copied to the
+ * ring as they come, and handed to the kernel in batches of depth/8, and
+ * whenever a file is opened; completions are reaped as they turn up.
+ * Writes to one file must land in the order they were made (a segment
+ * may fill in a hole that was written as zeros), so each file's
+ * operations go in as one linked chain, and the next chain waits until
+ * that one is done. Files proceed independently of each other.
+ *
+ * A flow is opened relative to its directory, held open by tcpdemux
+ * (see dir_cache.h), so the kernel does not look up the whole path each
+ * time.
+ *
+ * Opens still wait for their result: a flow's name is chosen by trying
+ * O_EXCL opens until one works, and running out of descriptors is handled
+ * by closing other flows first. The openat goes in with whatever else is
+ * queued, and waits only for itself. io_uring has no futimens, so a
+ * file's times are set from here when the last write of its chain has
+ * completed, just before its close is submitted.
+ *
+ * Packet processing waits for the uring otherwise only when depth
+ * operations are outstanding, when a file is to be read back (wait()),
+ * and at the end (drain()).
+ *
+ * With -S segment-size, either backend is wrapped in a flow_io_segments,
+ * which puts all of the files in a few big ones (see flow_segments.h).
+ * That is why reading a file back goes through here as well.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#ifndef AT_FDCWD
+#define AT_FDCWD -100                   // no openat(); see flow_io_sync
+#endif
+
+class dfxml_writer;
+class sbuf_t;
+
+class flow_io {
+public:
+    enum { DEPTH = 256 };               // operations outstanding at once
+
+    /* why backend cannot be used here; empty if it can */
+    static std::string unavailable(const std::string &backend);
+    static flow_io *make(const std::string &backend,unsigned int depth);
+
+    virtual ~flow_io(){}
+    virtual const char *name() const = 0;
+
+    /* an fd, or -1 with errno set; name is path, relative to the directory dirfd */
+    virtual int  openat(int dirfd,const char *name,const std::string &path,int flags,int mode) = 0;
+    int open(const std::string &path,int flags,int mode) {
+        return openat(AT_FDCWD,path.c_str(),path,flags,mode);
+    }
+
+    /* write length bytes at offset; data is copied */
+    virtual void write(int fd,uint64_t offset,const void *data,size_t length) = 0;
+
+    /* the same, for a buffer from malloc(), which is freed when the write is done */
+    virtual void write_owned(int fd,uint64_t offset,void *buf,size_t length) = 0;
+
+    /* close after the writes before it, setting the file's times to *mtime first if it is given */
+    virtual void close(int fd,const struct timeval *mtime) = 0;
+
+    virtual void wait(int) {}           // until everything asked of fd is done, so that it can be read
+    virtual void drain() {}             // until everything is done
+    virtual size_t pending() const { return 0; } // operations not done yet
+
+    /* reading back what was written; wait(fd) first */
+    virtual int     shift(int fd,uint64_t bytes); // move the whole file up by bytes, leaving zeros; 0 if it worked
+    virtual sbuf_t  *map_file(const std::string &path,int fd); // the file, for the scanners, or 0
+    virtual ssize_t read(const std::string &path,uint64_t offset,void *buf,size_t length); // a closed file, like pread()
+    virtual void    forget(const std::string &) {} // path is closed and will not be read again
+
+    virtual void add(const flow_io &child); // a finished shard's counts
+    virtual void dump_xml(dfxml_writer &xreport);
+
+    uint64_t ops;                       // writes and closes
+    uint64_t submits;                   // system calls that submitted them, and opens
+    uint64_t stalls;                    // times that depth operations were outstanding
+    uint64_t errors;                    // writes and closes that failed
+
+protected:
+    flow_io():ops(0),submits(0),stalls(0),errors(0),paths(){}
+    static void set_times(int fd,const struct timeval &mtime);
+    void remember(int fd,const std::string &path);
+    const std::string &path(int fd) const;
+
+private:
+    std::vector<std::string> paths;     // by fd, for error messages
+
+    flow_io(const flow_io &);
+    flow_io &operator=(const flow_io &);
+};
+
+#endif // FLOW_IO_H
@@ -0,0 +1,465 @@
+/**
+ * flow_segments.cpp
+ *
+ * Writing flows into segment files; see flow_segments.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_segments.h"
+#include "flow_table.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+/*
+ * The names that have been taken, by any instance.
+ *
+ * A name that an instance still has in its files is kept whole, with the
+ * number of instances that have it. Once they have all forgotten it, only
+ * its hash is kept, with where a line of an index names it, so memory
+ * does not grow with the length of the names; a hash that matches is
+ * checked against that line, so two names cannot collide. Hashes that
+ * collide take the next keys up: h, h+1, ...
+ */
+typedef uint64_t name_line;             // the index, in index_paths, <<48 | where the line starts
+struct name_key {
+    uint64_t h;
+    bool operator==(const name_key &b) const { return h==b.h; }
+};
+inline uint64_t flow_hash(const name_key &k) { return flow_hash_mix(k.h); }
+
+static const uint64_t LINE_OFFSET = ((uint64_t)1<<48)-1;
+static std::map<std::string,uint32_t> live_names;
+static flow_table<name_key,name_line> gone_names;
+static std::vector<std::string> index_paths;
+static cppmutex taken_M;
+
+static uint64_t name_hash(const std::string &name)
+{
+    return std::hash<std::string>()(name);
+}
+
+/* whether the line of the index at l names name; if it cannot be read, say it does */
+static bool names(name_line l,const std::string &name)
+{
+    int fd = ::open(index_paths[l>>48].c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) return true;
+    std::string line(name.size()+128,'\0');
+#ifdef HAVE_PWRITE
+    ssize_t n = pread(fd,&line[0],line.size(),(off_t)(l & LINE_OFFSET));
+#else
+    lseek(fd,(off_t)(l & LINE_OFFSET),SEEK_SET);
+    ssize_t n = ::read(fd,&line[0],line.size());
+#endif
+    ::close(fd);
+    if(n<=0) return true;
+    line.resize(n);
+    size_t nl = line.find('\n');
+    if(nl==std::string::npos) return true;
+    line.resize(nl);
+
+    /* the name is the last field: after 5 tabs in E lines, 2 in S and C lines and 1 in T lines */
+    int tabs = line[0]=='E' ? 5 : line[0]=='T' ? 1 : 2;
+    size_t start = 0;
+    for(int i=0;i<tabs;i++){
+        start = line.find('\t',start);
+        if(start==std::string::npos) return true;
+        start++;
+    }
+    return line.compare(start,std::string::npos,name)==0;
+}
+
+/* called with taken_M held */
+static bool name_taken(const std::string &name)
+{
+    if(live_names.count(name)) return true;
+    name_key k = {name_hash(name)};
+    for(name_line *l;(l = gone_names.find(k,flow_hash(k)))!=0;k.h++){
+        if(names(*l,name)) return true;
+    }
+    return false;
+}
+
+/* take name for open() with flags: 0, ENOENT or EEXIST. *known if it was taken before */
+static int take_name(const std::string &name,int flags,bool *known)
+{
+    cppmutex::lock lock(taken_M);
+    *known = name_taken(name);
+    if(!*known && (flags & O_CREAT)==0) return ENOENT;
+    if(*known && (flags & O_EXCL)) return EEXIST;
+    live_names[name]++;
+    return 0;
+}
+
+flow_io_segments::flow_io_segments(flow_io *inner_,const std::string &outdir_,uint64_t segment_size_):
+    segments(0),extents(0),bytes(0),
+    inner(inner_),outdir(outdir_),segment_size(segment_size_),prefix(),index(0),
+    index_number(0),index_len(0),forgotten(),
+    seg_fd(-1),seg_number(0),seg_len(0),files(),by_fd(),free_fds(),read_fd(-1),read_number(0)
+{
+}
+
+flow_io_segments::~flow_io_segments()
+{
+    for(files_t::iterator it=files.begin();it!=files.end();it++){
+        seal(it->second);
+        drop(it->second);
+    }
+    hand_over_names();
+    if(seg_fd>=0) inner->close(seg_fd,0);
+    if(read_fd>=0) ::close(read_fd);
+    inner->drain();
+    if(index) fclose(index);
+    delete inner;
+}
+
+/* make the index, the first time there is something for it */
+bool flow_io_segments::start()
+{
+    if(index) return true;
+    std::string dir = (outdir=="." || outdir=="") ? std::string("") : outdir + "/";
+    for(unsigned int n=0;;n++){
+        std::stringstream ss;
+        ss << dir << "flows-" << n;
+        std::string p = ss.str() + ".idx";
+        int fd = ::open(p.c_str(),O_WRONLY|O_CREAT|O_EXCL|O_BINARY,0666);
+        if(fd<0){
+            if(errno==EEXIST) continue;
+            errors++;
+            DEBUG(1) ("cannot create segment index %s: %s", p.c_str(), strerror(errno));
+            return false;
+        }
+        index = fdopen(fd,"w");
+        if(index==0){
+            ::close(fd);
+            errors++;
+            return false;
+        }
+        prefix = ss.str();
+        cppmutex::lock lock(taken_M);
+        index_number = index_paths.size();
+        index_paths.push_back(p);
+        break;
+    }
+    put_line("# tcpflow segments 1\n");
+    return true;
+}
+
+/* a line of the index; returns where it starts */
+uint64_t flow_io_segments::put_line(const char *fmt,...)
+{
+    uint64_t start = index_len;
+    va_list ap;
+    va_start(ap,fmt);
+    int n = vfprintf(index,fmt,ap);
+    va_end(ap);
+    if(n>0) index_len += n;
+    return start;
+}
+
+std::string flow_io_segments::relative(const std::string &path) const
+{
+    if(outdir!="." && outdir!="" && path.size()>outdir.size() &&
+       path.compare(0,outdir.size(),outdir)==0 && path[outdir.size()]=='/'){
+        return path.substr(outdir.size()+1);
+    }
+    return path;
+}
+
+std::string flow_io_segments::segment_path(uint32_t n) const
+{
+    char buf[32];
+    snprintf(buf,sizeof(buf),".%06u.seg",n);
+    return prefix + buf;
+}
+
+flow_io_segments::file *flow_io_segments::lookup(int fd) const
+{
+    if(fd<FIRST_FD || (size_t)(fd-FIRST_FD) >= by_fd.size()) return 0;
+    return by_fd[fd-FIRST_FD];
+}
+
+int flow_io_segments::openat(int,const char *,const std::string &path,int flags,int)
+{
+    if(!start()){
+        errno = EIO;
+        return -1;
+    }
+    std::string name = relative(path);
+    files_t::iterator it = files.find(name);
+    file *f = it==files.end() ? 0 : it->second;
+    bool known = f!=0;
+    if(f==0){
+        int err = take_name(name,flags,&known);
+        if(err){
+            errno = err;
+            return -1;
+        }
+        f = new file(name);
+        files[name] = f;
+    } else if(flags & O_EXCL){
+        errno = EEXIST;
+        return -1;
+    }
+    if((flags & O_TRUNC) && known){
+        seal(f);
+        f->extents.clear();
+        f->line = put_line("T\t%s\n",name.c_str());
+    }
+    if(f->fd<0){
+        int slot;
+        if(free_fds.size()){
+            slot = free_fds.back();
+            free_fds.pop_back();
+        } else {
+            slot = by_fd.size();
+            by_fd.push_back(0);
+        }
+        by_fd[slot] = f;
+        f->fd = FIRST_FD + slot;
+    }
+    return f->fd;
+}
+
+/* put length bytes at the end of the current segment, as offset in f */
+void flow_io_segments::append(file *f,uint64_t offset,const void *data,size_t length,void *owned)
+{
+    if(seg_len>0 && seg_len+length > segment_size){
+        inner->close(seg_fd,0);
+        seg_fd = -1;
+        seg_number++;
+        seg_len = 0;
+    }
+    if(seg_fd<0){
+        seg_fd = inner->open(segment_path(seg_number),O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0666);
+        if(seg_fd<0){
+            errors++;
+            DEBUG(1) ("cannot create segment %s: %s", segment_path(seg_number).c_str(), strerror(errno));
+            free(owned);
+            return;
+        }
+        segments++;
+    }
+    if(owned) inner->write_owned(seg_fd,seg_len,owned,length);
+    else inner->write(seg_fd,seg_len,data,length);
+
+    if(f->unsealed){
+        segment_extent &last = f->extents.back();
+        if(last.offset+last.length==offset && last.segment==seg_number &&
+           last.segment_offset+last.length==seg_len){
+            last.length += length;
+            seg_len += length;
+            bytes   += length;
+            return;
+        }
+        seal(f);
+    }
+    f->extents.push_back(segment_extent(offset,length,seg_number,seg_len));
+    f->unsealed = true;
+    seg_len += length;
+    bytes   += length;
+}
+
+/* the last extent of f will not grow any more: put it in the index */
+void flow_io_segments::seal(file *f)
+{
+    if(!f->unsealed) return;
+    const segment_extent &e = f->extents.back();
+    f->line = put_line("E\t%" PRIu64 "\t%" PRIu64 "\t%u\t%" PRIu64 "\t%s\n",
+            e.offset,e.length,e.segment,e.segment_offset,f->name.c_str());
+    extents++;
+    f->unsealed = false;
+}
+
+void flow_io_segments::write(int fd,uint64_t offset,const void *data,size_t length)
+{
+    file *f = lookup(fd);
+    ops++;
+    if(f==0 || length==0) return;
+    append(f,offset,data,length,0);
+}
+
+void flow_io_segments::write_owned(int fd,uint64_t offset,void *buf,size_t length)
+{
+    file *f = lookup(fd);
+    ops++;
+    if(f==0 || length==0){
+        free(buf);
+        return;
+    }
+    append(f,offset,buf,length,buf);
+}
+
+void flow_io_segments::close(int fd,const struct timeval *mtime)
+{
+    file *f = lookup(fd);
+    ops++;
+    if(f==0) return;
+    seal(f);
+    if(mtime){
+        f->line = put_line("C\t%ld.%06ld\t%s\n",(long)mtime->tv_sec,(long)mtime->tv_usec,f->name.c_str());
+    }
+    by_fd[fd-FIRST_FD] = 0;
+    free_fds.push_back(fd-FIRST_FD);
+    f->fd = -1;
+}
+
+void flow_io_segments::drain()
+{
+    inner->drain();
+    if(index) fflush(index);
+}
+
+int flow_io_segments::shift(int fd,uint64_t n)
+{
+    file *f = lookup(fd);
+    if(f==0) return -1;
+    seal(f);
+    for(std::vector<segment_extent>::iterator it=f->extents.begin();it!=f->extents.end();it++){
+        it->offset += n;
+    }
+    f->line = put_line("S\t%" PRIu64 "\t%s\n",n,f->name.c_str());
+    return 0;
+}
+
+/* length bytes of e, from skip bytes in */
+bool flow_io_segments::read_extent(const segment_extent &e,uint64_t skip,uint8_t *out,size_t length)
+{
+    int fd = -1;
+    if(e.segment==seg_number && seg_fd>=0){
+        inner->wait(seg_fd);
+        fd = seg_fd;
+    } else {
+        if(read_fd<0 || read_number!=e.segment){
+            inner->drain();             // the segment's last writes, and its close
+            if(read_fd>=0) ::close(read_fd);
+            read_fd     = ::open(segment_path(e.segment).c_str(),O_RDONLY|O_BINARY);
+            read_number = e.segment;
+        }
+        fd = read_fd;
+    }
+    if(fd<0) return false;
+#ifdef HAVE_PWRITE
+    return pread(fd,out,length,(off_t)(e.segment_offset+skip))==(ssize_t)length;
+#else
+    lseek(fd,(off_t)(e.segment_offset+skip),SEEK_SET);
+    return ::read(fd,out,length)==(ssize_t)length;
+#endif
+}
+
+sbuf_t *flow_io_segments::map_file(const std::string &path,int fd)
+{
+    file *f = lookup(fd);
+    if(f==0){
+        files_t::const_iterator it = files.find(relative(path));
+        if(it==files.end()) return 0;
+        f = it->second;
+    }
+    uint64_t size = 0;
+    for(std::vector<segment_extent>::const_iterator it=f->extents.begin();it!=f->extents.end();it++){
+        size = std::max(size,it->offset+it->length);
+    }
+    if(size==0) return 0;
+    uint8_t *buf = (uint8_t *)calloc(size,1);
+    if(buf==0) return 0;
+    for(std::vector<segment_extent>::const_iterator it=f->extents.begin();it!=f->extents.end();it++){
+        if(!read_extent(*it,0,buf+it->offset,it->length)){
+            free(buf);
+            return 0;
+        }
+    }
+    return new sbuf_t(pos0_t(path+sbuf_t::map_file_delimiter),buf,size,size,true);
+}
+
+ssize_t flow_io_segments::read(const std::string &path,uint64_t offset,void *buf,size_t length)
+{
+    files_t::const_iterator it = files.find(relative(path));
+    if(it==files.end()){
+        errno = ENOENT;
+        return -1;
+    }
+    const file *f = it->second;
+    uint64_t size = 0;
+    memset(buf,0,length);
+    for(std::vector<segment_extent>::const_iterator e=f->extents.begin();e!=f->extents.end();e++){
+        size = std::max(size,e->offset+e->length);
+        uint64_t from = std::max(offset,e->offset);
+        uint64_t to   = std::min(offset+length,e->offset+e->length);
+        if(from>=to) continue;
+        if(!read_extent(*e,from-e->offset,(uint8_t *)buf+(from-offset),to-from)) return -1;
+    }
+    if(size<=offset) return 0;
+    return std::min((uint64_t)length,size-offset);
+}
+
+void flow_io_segments::forget(const std::string &path)
+{
+    files_t::iterator it = files.find(relative(path));
+    if(it==files.end() || it->second->fd>=0) return;
+    drop(it->second);
+    files.erase(it);
+}
+
+/* f is gone from files; its name is handed over with the next batch */
+void flow_io_segments::drop(file *f)
+{
+    if(f->line==NO_LINE) f->line = put_line("T\t%s\n",f->name.c_str()); // made and never written
+    forgotten.push_back(std::make_pair(f->name,f->line));
+    delete f;
+    if(forgotten.size() >= FORGET_BATCH) hand_over_names();
+}
+
+/* once the index is flushed, the lines can be read back, and the names need not be kept */
+void flow_io_segments::hand_over_names()
+{
+    if(forgotten.empty()) return;
+    fflush(index);
+    cppmutex::lock lock(taken_M);
+    for(size_t i=0;i<forgotten.size();i++){
+        const std::string &name = forgotten[i].first;
+        std::map<std::string,uint32_t>::iterator live = live_names.find(name);
+        if(live!=live_names.end() && --live->second==0) live_names.erase(live);
+
+        name_line l = (name_line)index_number<<48 | forgotten[i].second;
+        name_key k = {name_hash(name)};
+        for(;;k.h++){
+            name_line *other = gone_names.find(k,flow_hash(k));
+            if(other==0){
+                gone_names.insert(k,flow_hash(k),l);
+                break;
+            }
+            if(names(*other,name)) break; // it was forgotten before
+        }
+    }
+    forgotten.clear();
+}
+
+void flow_io_segments::add(const flow_io &child_)
+{
+    flow_io::add(child_);
+    const flow_io_segments *child = dynamic_cast<const flow_io_segments *>(&child_);
+    if(child==0) return;
+    inner->add(*child->inner);
+    segments += child->segments;
+    extents  += child->extents;
+    bytes    += child->bytes;
+}
+
+void flow_io_segments::dump_xml(dfxml_writer &xreport)
+{
+    inner->dump_xml(xreport);
+    std::stringstream attrs;
+    attrs << "segment_bytes='" << segment_size << "'";
+    xreport.push("segments",attrs.str());
+    xreport.xmlout("ops",ops);
+    xreport.xmlout("segments",segments);
+    xreport.xmlout("extents",extents);
+    xreport.xmlout("bytes",bytes);
+    xreport.xmlout("errors",errors);
+    xreport.pop();                      // segments
+}
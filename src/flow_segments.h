@@ -0,0 +1,130 @@
+#ifndef FLOW_SEGMENTS_H
+#define FLOW_SEGMENTS_H
+
+/**
+ * flow_segments.h
+ *
+ * Writing all of the flows into a few large segment files instead of a
+ * file each (-S segment-size=megabytes).
+ *
+ * flow_io_segments is a flow_io, so tcpip and scan_http write flows and
+ * HTTP bodies to it just as they write files. open() only makes up a
+ * descriptor for the name; every write is appended to the current
+ * segment, through the sync or uring backend, and noted in an index as an
+ * extent: where in the flow the bytes go, and where in the segments they
+ * are. A segment is closed and the next one started when it would grow
+ * past the segment size. Out-of-order and rewritten bytes are just more
+ * extents; the later of two extents that cover the same bytes wins, as
+ * the later write would in a file. Moving a flow up when bytes turn up
+ * from before its start is a record in the index, not a copy.
+ *
+ * Each flow_io_segments (one per tcpdemux, so one per -j shard) writes
+ *     flows-N.idx                  the index
+ *     flows-N.000000.seg, ...      its segments
+ * in the output directory, with the first N whose index does not exist.
+ * The index is text, one record a line, fields separated by tabs:
+ *     E offset length segment segment_offset name    an extent
+ *     S bytes name                  move everything already in name up by bytes
+ *     T name                        name was truncated: forget its extents
+ *     C seconds.microseconds name   name was closed, with this modification time
+ * The name is where the file would have been, relative to the output
+ * directory. tcpflow-extract makes the files from the index.
+ *
+ * Names are taken as O_EXCL would take files, across all of the
+ * instances, so flows are named as they would be in an empty directory.
+ * The names of files that have been forgotten are not kept in memory: a
+ * hash of each is, with where in an index a line names it.
+ * The extents of a file are kept in memory until it is closed and
+ * forget() is called for it, so that it can be read back for the
+ * scanners and for checking late retransmissions.
+ */
+
+#include "flow_io.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct segment_extent {
+    segment_extent(uint64_t offset_,uint64_t length_,uint32_t segment_,uint64_t segment_offset_):
+        offset(offset_),length(length_),segment(segment_),segment_offset(segment_offset_){}
+    uint64_t offset;                    // in the file
+    uint64_t length;
+    uint32_t segment;
+    uint64_t segment_offset;
+};
+
+class flow_io_segments : public flow_io {
+public:
+    enum { FIRST_FD = 1<<30 };          // made-up descriptors start here, well clear of real ones
+    enum { FORGET_BATCH = 1024 };       // forgotten names handed over at once, after flushing the index
+
+    /* writes through inner, which it then owns */
+    flow_io_segments(flow_io *inner,const std::string &outdir,uint64_t segment_size);
+    virtual ~flow_io_segments();
+    virtual const char *name() const { return "segments"; }
+
+    virtual int  openat(int dirfd,const char *name,const std::string &path,int flags,int mode); // by path alone
+    virtual void write(int fd,uint64_t offset,const void *data,size_t length);
+    virtual void write_owned(int fd,uint64_t offset,void *buf,size_t length);
+    virtual void close(int fd,const struct timeval *mtime);
+    virtual void drain();
+    virtual size_t pending() const { return inner->pending(); }
+
+    virtual int     shift(int fd,uint64_t bytes);
+    virtual sbuf_t  *map_file(const std::string &path,int fd);
+    virtual ssize_t read(const std::string &path,uint64_t offset,void *buf,size_t length);
+    virtual void    forget(const std::string &path);
+
+    virtual void add(const flow_io &child);
+    virtual void dump_xml(dfxml_writer &xreport);
+
+    uint64_t segments;                  // segment files started
+    uint64_t extents;                   // extents in the index
+    uint64_t bytes;                     // appended to the segments
+
+private:
+    struct file {
+        file(const std::string &name_):name(name_),fd(-1),extents(),unsealed(false),line(NO_LINE){}
+        std::string name;               // relative to the output directory
+        int         fd;                 // made up, or -1 once closed
+        std::vector<segment_extent> extents; // in the order they were written
+        bool        unsealed;           // the last extent may still grow, and is not in the index yet
+        uint64_t    line;               // where the last line of the index that names it starts
+    };
+    static const uint64_t NO_LINE = ~(uint64_t)0;
+    typedef std::map<std::string,file *> files_t;
+
+    flow_io     *inner;
+    std::string outdir;
+    uint64_t    segment_size;
+    std::string prefix;                 // outdir/flows-N, once the index has been made
+    FILE        *index;
+    uint32_t    index_number;           // of the index, among those of all of the instances
+    uint64_t    index_len;              // bytes put in the index
+    std::vector<std::pair<std::string,uint64_t> > forgotten; // names, and their lines, not yet handed over
+    int         seg_fd;                 // the segment being appended to
+    uint32_t    seg_number;
+    uint64_t    seg_len;
+    files_t     files;                  // open, or closed and not forgotten
+    std::vector<file *> by_fd;          // fd-FIRST_FD
+    std::vector<int> free_fds;
+    int         read_fd;                // an earlier segment, open for reading extents back
+    uint32_t    read_number;
+
+    bool start();
+    std::string relative(const std::string &path) const;
+    std::string segment_path(uint32_t n) const;
+    file *lookup(int fd) const;
+    void append(file *f,uint64_t offset,const void *data,size_t length,void *owned);
+    void seal(file *f);
+    uint64_t put_line(const char *fmt,...);
+    void drop(file *f);
+    void hand_over_names();
+    bool read_extent(const segment_extent &e,uint64_t skip,uint8_t *out,size_t length);
+
+    flow_io_segments(const flow_io_segments &);
+    flow_io_segments &operator=(const flow_io_segments &);
+};
+
+#endif // FLOW_SEGMENTS_H
@@ -0,0 +1,344 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+/**
+ * flow_table.h
+ *
+ * An open-addressing hash table for the active flow database.
+ *
+ * std::unordered_map allocates a node for every flow and chases a pointer
+ * for every lookup. This table keeps the keys and values in one flat,
+ * cache-line-aligned array and uses Robin Hood probing with backward-shift
+ * deletion, so lookups touch one or two cache lines and probe sequences
+ * stay short even at a high load factor.
+ *
+ * A separate metadata array holds one 32-bit word per slot:
+ *   0                        - the slot is empty
+ *   (distance+1)<<24 | frag  - the slot is in use; frag is 24 bits of hash
+ * so most mismatches are rejected without looking at the key.
+ *
+ * Keys are packed PODs, not flow_addr: IPv4 flows use a 12-byte key and get
+ * their own table, IPv6 flows use a 40-byte key. flow_key builds the right
+ * key and computes the hash once, so a packet that is looked up, inserted
+ * and removed only hashes its addresses a single time.
+ */
+
+#include <inttypes.h>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/socket.h>
+
+/* packed flow keys */
+struct flow_key4 {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    bool operator==(const flow_key4 &b) const {
+        return src==b.src && dst==b.dst && sport==b.sport && dport==b.dport;
+    }
+};
+
+struct flow_key6 {
+    uint8_t  src[16];
+    uint8_t  dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t family;
+    uint16_t pad;                       // always 0, so the key can be compared with memcmp
+    bool operator==(const flow_key6 &b) const {
+        return memcmp(this,&b,sizeof(*this))==0;
+    }
+};
+
+/* 64-bit finalizer from MurmurHash3; every input bit affects every output bit */
+inline uint64_t flow_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t flow_hash(const flow_key4 &k)
+{
+    /* the two halves are mixed separately, so mirrored tuples do not collide */
+    uint64_t a = (uint64_t)k.src<<32 | k.dst;
+    uint64_t b = (uint64_t)k.sport<<16 | k.dport;
+    return flow_hash_mix(a ^ flow_hash_mix(b + 0x9e3779b97f4a7c15ULL));
+}
+
+inline uint64_t flow_hash(const flow_key6 &k)
+{
+    uint64_t w[4];
+    memcpy(w,k.src,16);
+    memcpy(w+2,k.dst,16);
+    uint64_t h = (uint64_t)k.sport<<32 | (uint64_t)k.dport<<16 | k.family;
+    for(int i=0;i<4;i++){
+        h = flow_hash_mix(h ^ w[i]) + 0x9e3779b97f4a7c15ULL;
+    }
+    return flow_hash_mix(h);
+}
+
+/**
+ * A flow key in either form, with its hash.
+ *
+ * A canonical key names a connection rather than one direction of it:
+ * the endpoint that sorts first is always stored as src, and reversed
+ * records whether the addresses had to be swapped to get there. Both
+ * directions of a connection have the same canonical key and opposite
+ * values of reversed.
+ */
+class flow_key {
+    void set(const uint8_t src[16],const uint8_t dst[16],uint16_t sport,uint16_t dport,sa_family_t family){
+        if(v4){
+            memcpy(&k4.src,src,4);
+            memcpy(&k4.dst,dst,4);
+            k4.sport = sport;
+            k4.dport = dport;
+            hash = flow_hash(k4);
+        } else {
+            memcpy(k6.src,src,16);
+            memcpy(k6.dst,dst,16);
+            k6.sport  = sport;
+            k6.dport  = dport;
+            k6.family = family;
+            hash = flow_hash(k6);
+        }
+    }
+public:
+    flow_key(const uint8_t src[16],const uint8_t dst[16],uint16_t sport,uint16_t dport,sa_family_t family,
+             bool canonical=false):
+        v4(family==AF_INET),reversed(false),hash(0),k4(),k6(){
+        if(canonical){
+            int c = memcmp(src,dst,v4 ? 4 : 16);
+            reversed = c>0 || (c==0 && sport>dport);
+        }
+        if(reversed) set(dst,src,dport,sport,family);
+        else         set(src,dst,sport,dport,family);
+    }
+    bool      v4;
+    bool      reversed;                 // canonical key, built from the dst->src direction
+    uint64_t  hash;
+    flow_key4 k4;                       // valid if v4
+    flow_key6 k6;                       // valid if !v4
+};
+
+/**
+ * Robin Hood hash table from K to V.
+ * K must be a POD with operator== and a flow_hash() overload; V must be
+ * cheap to copy (in practice, a pointer).
+ */
+template <class K,class V>
+class flow_table {
+    struct entry {
+        K key;
+        V value;
+    };
+    enum {
+        MIN_SLOTS = 16,
+        FRAG_BITS = 24,
+        MAX_DIST  = 254                 // probe distance that forces a grow
+    };
+    static const uint32_t FRAG_MASK = (1U<<FRAG_BITS)-1;
+    static const size_t   CACHE_LINE = 64;
+
+    uint32_t *meta;
+    entry    *entries;
+    size_t   mask;                      // number of slots - 1; 0 if nothing allocated
+    size_t   count;
+
+    flow_table(const flow_table &);
+    flow_table &operator=(const flow_table &);
+
+    static uint32_t make_meta(uint32_t dist,uint32_t frag) {
+        return (dist+1)<<FRAG_BITS | (frag & FRAG_MASK);
+    }
+    static uint32_t dist_of(uint32_t m) { return (m>>FRAG_BITS)-1; }
+
+    /* The fragment kept in meta, from bits 32-55 of the hash: the home slot
+     * comes from the low bits, so entries that share it would otherwise
+     * share their fragments too once there are 2^24 slots, and the -j shard
+     * is picked by the top bits, which are the same for all of a shard's flows.
+     */
+    static uint32_t frag_of(uint64_t h) { return (uint32_t)(h>>32) & FRAG_MASK; }
+
+    static void *alloc(size_t bytes) {
+        void *p = 0;
+        if(posix_memalign(&p,CACHE_LINE,bytes)!=0) throw std::bad_alloc();
+        return p;
+    }
+
+    /* grow at 7/8 full */
+    bool over_load(size_t n) const { return mask==0 || n*8 > (mask+1)*7; }
+
+    void rehash(size_t slots) {
+        uint32_t *old_meta    = meta;
+        entry    *old_entries = entries;
+        size_t    old_slots   = mask ? mask+1 : 0;
+
+        meta    = (uint32_t *)alloc(slots*sizeof(uint32_t));
+        entries = (entry *)alloc(slots*sizeof(entry));
+        memset(meta,0,slots*sizeof(uint32_t));
+        mask    = slots-1;
+        count   = 0;
+        for(size_t i=0;i<old_slots;i++){
+            if(old_meta[i]) place(old_entries[i].key,flow_hash(old_entries[i].key),old_entries[i].value);
+        }
+        free(old_meta);
+        free(old_entries);
+    }
+
+    /* insert a key known not to be present */
+    void place(const K &key,uint64_t h,const V &value) {
+        entry    cur  = {key,value};
+        uint32_t frag = frag_of(h);
+        size_t   pos  = h & mask;
+        for(uint32_t dist=0;;dist++){
+            if(dist>=MAX_DIST){
+                /* pathological clustering; make room and try again with whatever we are carrying */
+                rehash((mask+1)*2);
+                place(cur.key,flow_hash(cur.key),cur.value);
+                return;
+            }
+            uint32_t m = meta[pos];
+            if(m==0){
+                meta[pos]    = make_meta(dist,frag);
+                entries[pos] = cur;
+                count++;
+                return;
+            }
+            if(dist_of(m) < dist){
+                /* the resident is closer to home than we are; take its slot and carry it on */
+                entry tmp    = entries[pos];
+                meta[pos]    = make_meta(dist,frag);
+                entries[pos] = cur;
+                cur  = tmp;
+                frag = m & FRAG_MASK;
+                dist = dist_of(m);
+            }
+            pos = (pos+1) & mask;
+        }
+    }
+
+    size_t slot_of(const K &key,uint64_t h) const {
+        if(mask==0) return (size_t)-1;
+        size_t   pos  = h & mask;
+        uint32_t frag = frag_of(h);
+        for(uint32_t dist=0;;dist++){
+            uint32_t m = meta[pos];
+            if(m==0 || dist_of(m) < dist) return (size_t)-1;
+            if((m & FRAG_MASK)==frag && entries[pos].key==key) return pos;
+            pos = (pos+1) & mask;
+        }
+    }
+
+public:
+    flow_table():meta(0),entries(0),mask(0),count(0){}
+    ~flow_table(){
+        free(meta);
+        free(entries);
+    }
+
+    size_t size()  const { return count; }
+    bool   empty() const { return count==0; }
+    size_t slots() const { return mask ? mask+1 : 0; }
+    size_t memory_used() const { return slots()*(sizeof(uint32_t)+sizeof(entry)); }
+
+    /* returns a pointer to the value, or 0 if the key is not present */
+    V *find(const K &key,uint64_t h) {
+        size_t pos = slot_of(key,h);
+        return pos==(size_t)-1 ? 0 : &entries[pos].value;
+    }
+
+    /* insert or overwrite */
+    void insert(const K &key,uint64_t h,const V &value) {
+        size_t pos = slot_of(key,h);
+        if(pos!=(size_t)-1){
+            entries[pos].value = value;
+            return;
+        }
+        if(over_load(count+1)) rehash(mask ? (mask+1)*2 : (size_t)MIN_SLOTS);
+        place(key,h,value);
+    }
+
+    /* returns true if the key was present */
+    bool erase(const K &key,uint64_t h) {
+        size_t pos = slot_of(key,h);
+        if(pos==(size_t)-1) return false;
+        /* backward-shift: pull each following displaced entry one slot closer to home */
+        size_t next = (pos+1) & mask;
+        while(meta[next]!=0 && dist_of(meta[next])>0){
+            meta[pos]    = meta[next] - (1U<<FRAG_BITS);
+            entries[pos] = entries[next];
+            pos  = next;
+            next = (next+1) & mask;
+        }
+        meta[pos] = 0;
+        count--;
+        return true;
+    }
+
+    void clear() {
+        if(mask) memset(meta,0,(mask+1)*sizeof(uint32_t));
+        count = 0;
+    }
+
+    /* visit slots in table order; only valid until the table is modified */
+    class iterator {
+        const flow_table *t;
+        size_t pos;
+        void skip() { while(pos<t->slots() && t->meta[pos]==0) pos++; }
+    public:
+        iterator(const flow_table *t_,size_t pos_):t(t_),pos(pos_){ skip(); }
+        const K &key()   const { return t->entries[pos].key; }
+        V       &value() const { return t->entries[pos].value; }
+        iterator &operator++() { pos++; skip(); return *this; }
+        bool operator==(const iterator &b) const { return pos==b.pos; }
+        bool operator!=(const iterator &b) const { return pos!=b.pos; }
+    };
+    iterator begin() const { return iterator(this,0); }
+    iterator end()   const { return iterator(this,slots()); }
+};
+
+/**
+ * The two tables together, indexed by flow_key.
+ */
+template <class V>
+class flow_key_map {
+    flow_table<flow_key4,V> t4;
+    flow_table<flow_key6,V> t6;
+public:
+    flow_key_map():t4(),t6(){}
+
+    size_t size() const { return t4.size() + t6.size(); }
+    bool   empty() const { return size()==0; }
+    size_t memory_used() const { return t4.memory_used() + t6.memory_used(); }
+
+    V *find(const flow_key &k) {
+        return k.v4 ? t4.find(k.k4,k.hash) : t6.find(k.k6,k.hash);
+    }
+    void insert(const flow_key &k,const V &v) {
+        if(k.v4) t4.insert(k.k4,k.hash,v);
+        else     t6.insert(k.k6,k.hash,v);
+    }
+    bool erase(const flow_key &k) {
+        return k.v4 ? t4.erase(k.k4,k.hash) : t6.erase(k.k6,k.hash);
+    }
+    void clear() {
+        t4.clear();
+        t6.clear();
+    }
+
+    /* copy out every value; use this when the caller is going to modify the map */
+    template <class C> void values(C &out) const {
+        for(typename flow_table<flow_key4,V>::iterator it=t4.begin();it!=t4.end();++it) out.push_back(it.value());
+        for(typename flow_table<flow_key6,V>::iterator it=t6.begin();it!=t6.end();++it) out.push_back(it.value());
+    }
+};
+
+#endif // FLOW_TABLE_H
@@ -0,0 +1,192 @@
+/*
+ * This file is part of tcpflow by Simson Garfinkel <simsong@acm.org>.
+ *
+ * This source code is under the GNU Public License (GPL) version 3.
+ * See COPYING for details.
+ *
+ * flow_table_bench:
+ * Compare the open-addressing flow table (flow_table.h) with the
+ * std::unordered_map<flow_addr,tcpip *> and flow_addr hash that tcpdemux
+ * used before it.
+ *
+ * usage: flow_table_bench [-6] [nflows ...]
+ * The default is 10000, 1000000 and 10000000 flows.
+ *
+ * Flows look like client traffic: sequential client ports on a growing
+ * range of client addresses, talking to 64 servers on port 80 or 443.
+ * For each size we time N inserts, N lookups that hit (in a scattered
+ * order), N lookups that miss, and N erases.
+ *
+ * Build with "make flow_table_bench".
+ */
+
+#include "config.h"
+#include "tcpflow.h"
+#include "tcpip.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <time.h>
+
+/* the hash that flow_addr::hash() used to compute */
+struct legacy_flow_addr_hash {
+    static uint32_t quad(const ipaddr &a,int i) {
+        return (a.addr[i*4+0]<<24) | (a.addr[i*4+2]<<16) | (a.addr[i*4+1]<<8) | (a.addr[i*4+3]<<0);
+    }
+    static uint64_t dquad(const ipaddr &a,int i) {
+        return (uint64_t)(quad(a,i*2+1))<<32 | (uint64_t)(quad(a,i*2));
+    }
+    long operator() (const flow_addr &k) const {
+        if(k.family==AF_INET){
+            return ((uint64_t)(quad(k.src,0))<<32 | quad(k.dst,0))
+                ^ ((uint64_t)(quad(k.dst,0))<<32 | quad(k.src,0))
+                ^ (k.sport<<16 | k.dport);
+        } else {
+            return (dquad(k.src,0)<<32 ^ dquad(k.dst,0))
+                ^ (dquad(k.dst,0)<<32  ^ dquad(k.src,0))
+                ^ (dquad(k.src,1)      ^ dquad(k.dst,1))
+                ^ (k.sport<<16 | k.dport);
+        }
+    }
+};
+
+struct flow_addr_key_eq {
+    bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y;}
+};
+
+typedef std::unordered_map<flow_addr,tcpip *,legacy_flow_addr_hash,flow_addr_key_eq> legacy_map_t;
+
+static bool ipv6 = false;
+
+/* the i'th test flow; distinct for every i */
+static flow_addr make_flow(uint64_t i)
+{
+    uint64_t client = i / 60000;
+    uint16_t sport  = 1024 + (i % 60000);
+    uint64_t r      = flow_hash_mix(i);
+    uint8_t  src[16], dst[16];
+    memset(src,0,sizeof(src));
+    memset(dst,0,sizeof(dst));
+    if(ipv6){
+        src[0]=0x20; src[1]=0x01; src[2]=0x0d; src[3]=0xb8;
+        dst[0]=0x20; dst[1]=0x01; dst[2]=0x0d; dst[3]=0xb8; dst[4]=0xff;
+        for(int b=0;b<4;b++) src[15-b] = (client >> (b*8)) & 0xff;
+        dst[15] = r & 63;
+    } else {
+        src[0]=10;
+        src[1]=(client >> 16) & 0xff;
+        src[2]=(client >>  8) & 0xff;
+        src[3]=(client >>  0) & 0xff;
+        dst[0]=192; dst[1]=0; dst[2]=2;
+        dst[3]=r & 63;
+    }
+    return flow_addr(ipaddr(src),ipaddr(dst),sport,(r & 64) ? 443 : 80,ipv6 ? AF_INET6 : AF_INET);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* visit 0..n-1 in a scattered order */
+static uint64_t scatter(uint64_t i,uint64_t n)
+{
+    return (i * 1000003ULL) % n;         // 1000003 is prime, so this is a permutation unless it divides n
+}
+
+static void report(const char *map,const char *op,uint64_t n,double t0,double t1,uint64_t found)
+{
+    printf("%-14s %-8s %10" PRIu64 " flows %8.1f ns/op  (found %" PRIu64 ")\n",
+           map,op,n,(t1-t0)*1e9/n,found);
+}
+
+static void bench_legacy(uint64_t n)
+{
+    legacy_map_t m;
+    tcpip *v = reinterpret_cast<tcpip *>(1);
+    uint64_t found = 0;
+    double t0 = now();
+    for(uint64_t i=0;i<n;i++) m[make_flow(i)] = v;
+    double t1 = now();
+    report("unordered_map","insert",n,t0,t1,m.size());
+
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.find(make_flow(scatter(i,n)))!=m.end();
+    t1 = now();
+    report("unordered_map","hit",n,t0,t1,found);
+
+    found = 0;
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.find(make_flow(n+i))!=m.end();
+    t1 = now();
+    report("unordered_map","miss",n,t0,t1,found);
+
+    /* how badly the old hash clusters */
+    size_t worst = 0;
+    for(size_t b=0;b<m.bucket_count();b++) worst = std::max(worst,m.bucket_size(b));
+    printf("%-14s %-8s %10" PRIu64 " flows %8zu buckets, longest chain %zu\n","unordered_map","buckets",n,
+           m.bucket_count(),worst);
+
+    found = 0;
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.erase(make_flow(scatter(i,n)));
+    t1 = now();
+    report("unordered_map","erase",n,t0,t1,found);
+}
+
+static void bench_table(uint64_t n)
+{
+    flow_key_map<tcpip *> m;
+    tcpip *v = reinterpret_cast<tcpip *>(1);
+    uint64_t found = 0;
+    double t0 = now();
+    for(uint64_t i=0;i<n;i++) m.insert(make_flow(i).key(),v);
+    double t1 = now();
+    report("flow_table","insert",n,t0,t1,m.size());
+
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.find(make_flow(scatter(i,n)).key())!=0;
+    t1 = now();
+    report("flow_table","hit",n,t0,t1,found);
+
+    found = 0;
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.find(make_flow(n+i).key())!=0;
+    t1 = now();
+    report("flow_table","miss",n,t0,t1,found);
+
+    printf("%-14s %-8s %10" PRIu64 " flows %8.1f MB\n","flow_table","memory",n,m.memory_used()/1e6);
+
+    found = 0;
+    t0 = now();
+    for(uint64_t i=0;i<n;i++) found += m.erase(make_flow(scatter(i,n)).key());
+    t1 = now();
+    report("flow_table","erase",n,t0,t1,found);
+}
+
+int main(int argc,char **argv)
+{
+    std::vector<uint64_t> sizes;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"-6")==0){
+            ipv6 = true;
+            continue;
+        }
+        sizes.push_back(strtoull(argv[i],0,10));
+    }
+    if(sizes.empty()){
+        sizes.push_back(10000);
+        sizes.push_back(1000000);
+        sizes.push_back(10000000);
+    }
+    for(std::vector<uint64_t>::const_iterator it=sizes.begin();it!=sizes.end();it++){
+        if(*it==0) continue;
+        bench_legacy(*it);
+        bench_table(*it);
+        printf("\n");
+    }
+    return 0;
+}
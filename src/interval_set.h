@@ -0,0 +1,144 @@
+#ifndef INTERVAL_SET_H
+#define INTERVAL_SET_H
+
+/**
+ * interval_set.h
+ *
+ * The set of byte offsets of a flow that have been stored (tcpip::seen).
+ *
+ * This replaces a boost::icl::interval_set<uint64_t>, which is a red-black
+ * tree of intervals that every tcpip had to allocate, and whose size()
+ * walks the whole tree; tcpdemux asks for the size on every packet of a
+ * flow once it has seen a FIN. Nearly every flow is one interval that
+ * grows at the end, so:
+ *
+ *  - up to INLINE disjoint intervals are kept in order in the object
+ *    itself, with no allocation;
+ *  - a segment that starts inside or just after the last interval only
+ *    moves its end, which is the whole cost of an in-order segment;
+ *  - the number of bytes covered is kept up to date, so size() is O(1);
+ *  - a flow with more holes than INLINE spills into a std::map of
+ *    intervals, and stays there.
+ *
+ * Intervals are half-open: [begin,end). Adjacent intervals are merged.
+ * interval_set_bench compares this with boost::icl::interval_set.
+ */
+
+#include <inttypes.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+class interval_set {
+public:
+    enum { INLINE = 4 };                // intervals kept without allocating
+    typedef std::pair<uint64_t,uint64_t> interval; // [first,second)
+
+    interval_set():n(0),tree(0),bytes(0){}
+    ~interval_set(){ delete tree; }
+
+    /* add [begin,end) */
+    void add(uint64_t begin,uint64_t end) {
+        if(begin>=end) return;
+        if(tree==0 && n>0){
+            interval &last = r[n-1];
+            if(begin>=last.first && begin<=last.second){
+                if(end>last.second){
+                    bytes += end-last.second;
+                    last.second = end;
+                }
+                return;
+            }
+        }
+        add_slow(begin,end);
+    }
+    uint64_t size() const { return bytes; }     // bytes covered
+    size_t   intervals() const { return tree ? tree->size() : n; }
+    bool     spilled() const { return tree!=0; }
+
+    /* every offset moves up by by */
+    void shift(uint64_t by) {
+        if(tree==0){
+            for(unsigned int i=0;i<n;i++){
+                r[i].first  += by;
+                r[i].second += by;
+            }
+            return;
+        }
+        tree_t moved;
+        for(tree_t::const_iterator it=tree->begin();it!=tree->end();it++){
+            moved.insert(moved.end(),std::make_pair(it->first+by,it->second+by));
+        }
+        tree->swap(moved);
+    }
+
+    /* the intervals, in order */
+    void get(std::vector<interval> &out) const {
+        out.clear();
+        if(tree) out.assign(tree->begin(),tree->end());
+        else     out.assign(r,r+n);
+    }
+
+private:
+    typedef std::map<uint64_t,uint64_t> tree_t; // begin -> end
+
+    interval     r[INLINE];             // in order, disjoint and not adjacent; r[0..n) are used
+    unsigned int n;
+    tree_t       *tree;                 // if there were ever more than INLINE; then r is unused
+    uint64_t     bytes;
+
+    void add_slow(uint64_t begin,uint64_t end) {
+        if(tree){
+            add_tree(begin,end);
+            return;
+        }
+        /* r[i..j) touch [begin,end) and are merged with it */
+        unsigned int i = 0;
+        while(i<n && r[i].second<begin) i++;
+        unsigned int j = i;
+        while(j<n && r[j].first<=end){
+            begin  = std::min(begin,r[j].first);
+            end    = std::max(end,r[j].second);
+            bytes -= r[j].second-r[j].first;
+            j++;
+        }
+        bytes += end-begin;
+        if(i==j && n==INLINE){          // one interval too many: move them all to a tree
+            tree = new tree_t(r,r+n);
+            tree->insert(std::make_pair(begin,end));
+            n = 0;
+            return;
+        }
+        if(i==j){                       // a new interval; make room for it at i
+            for(unsigned int k=n;k>i;k--) r[k] = r[k-1];
+            n++;
+        } else if(j>i+1){               // several merged into one; close up after i
+            for(unsigned int k=j;k<n;k++) r[i+1+k-j] = r[k];
+            n -= j-i-1;
+        }
+        r[i] = interval(begin,end);
+    }
+
+    void add_tree(uint64_t begin,uint64_t end) {
+        tree_t::iterator it = tree->upper_bound(begin);
+        if(it!=tree->begin()){
+            tree_t::iterator prev = it;
+            --prev;
+            if(prev->second>=begin) it = prev;
+        }
+        while(it!=tree->end() && it->first<=end){
+            begin  = std::min(begin,it->first);
+            end    = std::max(end,it->second);
+            bytes -= it->second-it->first;
+            tree->erase(it++);
+        }
+        bytes += end-begin;
+        tree->insert(it,std::make_pair(begin,end));
+    }
+
+    interval_set(const interval_set &);
+    interval_set &operator=(const interval_set &);
+};
+
+#endif // INTERVAL_SET_H
@@ -0,0 +1,157 @@
+/*
+ * This file is part of tcpflow by Simson Garfinkel <simsong@acm.org>.
+ *
+ * This source code is under the GNU Public License (GPL) version 3.
+ * See COPYING for details.
+ *
+ * interval_set_bench:
+ * Compare interval_set (interval_set.h) with the boost::icl::interval_set
+ * that tcpip used before it to remember which bytes of a flow it had seen.
+ *
+ * usage: interval_set_bench [nflows [segments]]
+ * The default is 100000 flows of 64 segments.
+ *
+ * Each flow is created, fed its 1448-byte segments the way store_packet
+ * does, asked for its size() after every segment the way tcpdemux does
+ * once a FIN has arrived, and destroyed. The segments arrive
+ *
+ *   in-order  one after the other;
+ *   late      in order, except that 1 in 100 arrives 8 segments late;
+ *   lossy     in order, but 1 in 10 never arrives, leaving a hole.
+ *
+ * Build with "make interval_set_bench".
+ */
+
+#include "config.h"
+#include "interval_set.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#ifdef HAVE_BOOST_ICL_INTERVAL_SET_HPP
+#pragma GCC diagnostic ignored "-Weffc++"
+#pragma GCC diagnostic ignored "-Wshadow"
+#include <boost/icl/interval_set.hpp>
+typedef boost::icl::interval_set<uint64_t> recon_set;
+#endif
+
+static const uint64_t MSS = 1448;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* the segment numbers of one flow, in arrival order */
+static std::vector<uint64_t> arrivals(const char *workload,uint64_t segments)
+{
+    std::vector<uint64_t> v;
+    for(uint64_t i=0;i<segments;i++){
+        if(strcmp(workload,"lossy")==0 && i%10==9) continue;
+        v.push_back(i);
+    }
+    if(strcmp(workload,"late")==0){
+        for(uint64_t i=50;i+8<v.size();i+=100){
+            uint64_t s = v[i];
+            v.erase(v.begin()+i);
+            v.insert(v.begin()+i+8,s);
+        }
+    }
+    return v;
+}
+
+static void report(const char *set,const char *workload,uint64_t segs,double t0,double t1,double t2,uint64_t bytes)
+{
+    printf("%-14s %-9s %10" PRIu64 " segments %8.1f ns/segment %8.1f ns/size()  (%" PRIu64 " bytes)\n",
+           set,workload,segs,(t1-t0)*1e9/segs,(t2-t1)*1e9/segs,bytes);
+}
+
+/* the add time is measured without size(), then add+size() again, so t2-t1 is the cost of size() */
+#ifdef HAVE_BOOST_ICL_INTERVAL_SET_HPP
+static uint64_t bench_boost(const char *workload,uint64_t nflows,const std::vector<uint64_t> &order)
+{
+    uint64_t segs = nflows * order.size();
+    uint64_t bytes = 0;
+    double t0 = now();
+    for(uint64_t f=0;f<nflows;f++){
+        recon_set *seen = new recon_set();
+        for(std::vector<uint64_t>::const_iterator it=order.begin();it!=order.end();it++){
+            *seen += boost::icl::discrete_interval<uint64_t>::closed(*it*MSS,*it*MSS+MSS-1);
+        }
+        bytes += seen->size();
+        delete seen;
+    }
+    double t1 = now();
+    uint64_t check = 0;
+    for(uint64_t f=0;f<nflows;f++){
+        recon_set *seen = new recon_set();
+        for(std::vector<uint64_t>::const_iterator it=order.begin();it!=order.end();it++){
+            *seen += boost::icl::discrete_interval<uint64_t>::closed(*it*MSS,*it*MSS+MSS-1);
+            check += seen->size();
+        }
+        delete seen;
+    }
+    double t2 = now();
+    report("boost::icl",workload,segs,t0,t1,t2-(t1-t0),bytes);
+    return check;
+}
+#endif
+
+static uint64_t bench_interval_set(const char *workload,uint64_t nflows,const std::vector<uint64_t> &order,uint64_t *spilled)
+{
+    uint64_t segs = nflows * order.size();
+    uint64_t bytes = 0;
+    *spilled = 0;
+    double t0 = now();
+    for(uint64_t f=0;f<nflows;f++){
+        interval_set seen;
+        for(std::vector<uint64_t>::const_iterator it=order.begin();it!=order.end();it++){
+            seen.add(*it*MSS,*it*MSS+MSS);
+        }
+        bytes += seen.size();
+        *spilled += seen.spilled();
+    }
+    double t1 = now();
+    uint64_t check = 0;
+    for(uint64_t f=0;f<nflows;f++){
+        interval_set seen;
+        for(std::vector<uint64_t>::const_iterator it=order.begin();it!=order.end();it++){
+            seen.add(*it*MSS,*it*MSS+MSS);
+            check += seen.size();
+        }
+    }
+    double t2 = now();
+    report("interval_set",workload,segs,t0,t1,t2-(t1-t0),bytes);
+    return check;
+}
+
+int main(int argc,char **argv)
+{
+    uint64_t nflows   = argc>1 ? strtoull(argv[1],0,10) : 100000;
+    uint64_t segments = argc>2 ? strtoull(argv[2],0,10) : 64;
+    const char *workloads[] = {"in-order","late","lossy",0};
+    int ret = 0;
+    for(int w=0;workloads[w];w++){
+        std::vector<uint64_t> order = arrivals(workloads[w],segments);
+        uint64_t spilled = 0;
+        uint64_t mine = bench_interval_set(workloads[w],nflows,order,&spilled);
+        printf("%-14s %-9s %10" PRIu64 " of %" PRIu64 " flows spilled to a tree\n","interval_set",workloads[w],spilled,nflows);
+#ifdef HAVE_BOOST_ICL_INTERVAL_SET_HPP
+        uint64_t theirs = bench_boost(workloads[w],nflows,order);
+        if(mine!=theirs){
+            printf("%s: interval_set and boost::icl disagree about the sizes\n",workloads[w]);
+            ret = 1;
+        }
+#else
+        (void)mine;
+#endif
+        printf("\n");
+    }
+    return ret;
+}
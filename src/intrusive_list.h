@@ -1,67 +1,84 @@
 #ifndef INTRUSIVE_LIST_H
 #define INTRUSIVE_LIST_H
 
-#include <iostream>
-#include <list>
+#include <stddef.h>
 
-// implement boost::intrusive::list using std::list
+// a doubly linked list of T, like boost::intrusive::list: the links are in T itself,
+// so putting a T on the list or taking it off allocates nothing.
+// hook is the member of T that holds its links, so that T can be on more than one list
 
 template <class T>
+struct list_hook {
+    list_hook():prev(0),next(0) {}
+    T *prev;
+    T *next;
+};
+
+template <class T, list_hook<T> T::*hook>
 class intrusive_list {
   public:
-  intrusive_list():li(), len(0) {}
-  
-  typedef typename std::list<T*>::iterator iterator;
-  
+  intrusive_list():head(0), tail(0), len(0) {}
+
   inline void push_back(T* node) {
-    li.push_back(node);
+    list_hook<T> &h = node->*hook;
+    h.prev = tail;
+    h.next = 0;
+    if (tail) (tail->*hook).next = node;
+    else head = node;
+    tail = node;
     len++;
-    node->it = --li.end();
   }
 
   inline void erase(T* node) {
     if (!is_linked(node))
       return;
-    li.erase(node->it);
+    list_hook<T> &h = node->*hook;
+    if (h.prev) (h.prev->*hook).next = h.next;
+    else head = h.next;
+    if (h.next) (h.next->*hook).prev = h.prev;
+    else tail = h.prev;
+    h.prev = h.next = 0;
     len--;
-    reset(node);
   }
-  
+
   inline void move_to_end(T* node) {
-    if (!is_linked(node))
+    if (node == tail || !is_linked(node))
       return;
-    li.splice(li.end(), li, node->it);
+    erase(node);
+    push_back(node);
   }
-  
-  inline void reset(T* node) {
-    node->it = li.end();
-  }
-  
-  inline bool empty() {
-    return li.empty();
+
+  inline bool empty() const {
+    return len == 0;
   }
-  
-  inline size_t size() {
-    // std::list.size() is O(n) in some platform. Is there any define flag for that?
-    //return li.size();
+
+  inline size_t size() const {
     return len;
   }
-  
-  inline iterator begin() {
-    return li.begin();
+
+  inline T* front() const {             // the first, or 0 if there are none
+    return head;
   }
-  
-  inline iterator end() {
-    return li.end();
+
+  inline T* back() const {
+    return tail;
   }
-  
-  private:
-  inline bool is_linked(T* node) {
-    return node->it != li.end();
+
+  inline static T* next(const T* node) {  // the one after node, or 0
+    return (node->*hook).next;
+  }
+
+  inline bool is_linked(const T* node) const {
+    return (node->*hook).prev != 0 || head == node;
   }
-  
-  std::list<T*> li;
+
+  private:
+  T* head;
+  T* tail;
   size_t len;
+
+  intrusive_list(const intrusive_list &);
+  intrusive_list &operator=(const intrusive_list &);
 };
 
 #endif // INTRUSIVE_LIST_H
@@ -0,0 +1,142 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+/**
+ * packet_ring.h
+ *
+ * A single-producer, single-consumer ring of variable-length records.
+ * The capture thread copies each packet into the ring of the shard that
+ * owns its connection and the shard's worker thread reads it out. Neither
+ * side takes a lock; the only shared state is the head and tail counters.
+ *
+ * Records are stored contiguously, each preceded by an 8-byte header
+ * holding its length, and padded to a multiple of 8 bytes. A record that
+ * would run off the end of the buffer is written at the start instead,
+ * after a WRAP marker. The buffer is followed by SLACK bytes that are never
+ * written, so a reader that strays a little past the end of a truncated
+ * packet reads zeros instead of faulting.
+ *
+ * reserve() and peek() return 0 when the ring is full or empty; callers
+ * decide whether to wait (see packet_ring::backoff) or give up.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <inttypes.h>
+#include <sched.h>
+#include <unistd.h>
+
+class packet_ring {
+    enum {
+        HDR   = 8,
+        SLACK = 65536 + 64
+    };
+    static const uint32_t WRAP = 0xffffffffU;
+
+    uint8_t *buf;
+    size_t   size;                      // power of two
+    size_t   mask;
+
+    /* producer and consumer state live on separate cache lines */
+    alignas(64) std::atomic<uint64_t> head; // next byte the producer will write
+    uint64_t tail_cache;                // producer's last look at tail
+    uint64_t reserved;                  // where the reserved record starts
+    size_t   reserved_len;
+    alignas(64) std::atomic<uint64_t> tail; // next byte the consumer will read
+    uint64_t head_cache;                // consumer's last look at head
+    uint64_t next_tail;                 // where the record being read ends
+    alignas(64) char pad[1];
+
+    packet_ring(const packet_ring &);
+    packet_ring &operator=(const packet_ring &);
+
+    static size_t align8(size_t n) { return (n+7) & ~(size_t)7; }
+
+public:
+    /* bytes is rounded up to a power of two */
+    packet_ring(size_t bytes):buf(0),size(4096),mask(0),head(0),tail_cache(0),reserved(0),reserved_len(0),
+                              tail(0),head_cache(0),next_tail(0),pad(){
+        while(size < bytes) size <<= 1;
+        mask = size-1;
+        buf = (uint8_t *)calloc(size+SLACK,1);
+        if(buf==0) throw std::bad_alloc();
+    }
+    ~packet_ring(){ free(buf); }
+
+    /* the largest record that can ever fit */
+    size_t max_record() const { return size/2 - HDR; }
+
+    /* producer: space for a record of len bytes, or 0 if the ring is full */
+    void *reserve(size_t len) {
+        size_t   need = align8(len+HDR);
+        uint64_t h    = head.load(std::memory_order_relaxed);
+        size_t   off  = h & mask;
+        size_t   total = need <= size-off ? need : (size-off) + need;
+        if(h + total - tail_cache > size){
+            tail_cache = tail.load(std::memory_order_acquire);
+            if(h + total - tail_cache > size) return 0;
+        }
+        if(need > size-off){
+            memcpy(buf+off,&WRAP,sizeof(WRAP));
+            h  += size-off;
+            off = 0;
+        }
+        uint32_t len32 = (uint32_t)len;
+        memcpy(buf+off,&len32,sizeof(len32));
+        reserved     = h;
+        reserved_len = need;
+        return buf+off+HDR;
+    }
+
+    /* producer: publish the record returned by the last reserve() */
+    void commit() {
+        head.store(reserved+reserved_len,std::memory_order_release);
+    }
+
+    /* consumer: the next record, or 0 if the ring is empty */
+    const void *peek(size_t *len) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if(t==head_cache){
+            head_cache = head.load(std::memory_order_acquire);
+            if(t==head_cache) return 0;
+        }
+        size_t   off = t & mask;
+        uint32_t len32;
+        memcpy(&len32,buf+off,sizeof(len32));
+        if(len32==WRAP){
+            t  += size-off;
+            off = 0;
+            memcpy(&len32,buf,sizeof(len32));
+        }
+        *len      = len32;
+        next_tail = t + align8(len32+HDR);
+        return buf+off+HDR;
+    }
+
+    /* consumer: done with the record returned by the last peek() */
+    void release() {
+        tail.store(next_tail,std::memory_order_release);
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire)==tail.load(std::memory_order_acquire);
+    }
+
+    /* bytes in use, including headers and padding; exact only when called by the producer */
+    size_t used() const {
+        return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return size; }
+
+    /* wait a little longer each time around a polling loop */
+    static void backoff(unsigned int &spins) {
+        if(spins < 64)        { spins++; }
+        else if(spins < 128)  { spins++; sched_yield(); }
+        else                  { usleep(spins < 1024 ? (spins++ - 127) : 1000); }
+    }
+};
+
+#endif // PACKET_RING_H
@@ -0,0 +1,74 @@
+/**
+ * pcap_merge.cpp
+ *
+ * Reading several capture files as one, in timestamp order; see pcap_merge.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_reader.h"
+#include "pcap_merge.h"
+
+pcap_merge::pcap_merge():packets(0),out_of_order(0),inputs(),heap(),err(),stop(0)
+{
+}
+
+pcap_merge::~pcap_merge()
+{
+    for(std::vector<input *>::iterator it=inputs.begin();it!=inputs.end();it++){
+        delete (*it)->reader;
+        delete *it;
+    }
+}
+
+void pcap_merge::add(const std::string &path,pcap_reader *reader)
+{
+    inputs.push_back(new input(path,reader,inputs.size()));
+}
+
+void pcap_merge::advance(input &in)
+{
+    int r = in.reader->next(&in.h,&in.data,&in.handler);
+    if(r>0){
+        heap.push(&in);
+        return;
+    }
+    if(r<0){
+        DEBUG(1) ("%s: %s", in.path.c_str(), in.reader->error().c_str());
+        if(err.empty()) err = in.path + ": " + in.reader->error();
+    }
+    DEBUG(2) ("merge-inputs: %s ended after %" PRIu64 " packets", in.path.c_str(), in.reader->packets);
+}
+
+int pcap_merge::loop(u_char *user)
+{
+    for(std::vector<input *>::iterator it=inputs.begin();it!=inputs.end();it++){
+        advance(**it);
+    }
+    struct timeval last = {0,0};
+    while(!stop && !heap.empty()){
+        input &in = *heap.top();
+        heap.pop();
+        const struct timeval &ts = in.h->ts;
+        if(ts.tv_sec < last.tv_sec || (ts.tv_sec==last.tv_sec && ts.tv_usec < last.tv_usec)){
+            out_of_order++;
+        } else {
+            last = ts;
+        }
+        packets++;
+        (*in.handler)(user,in.h,in.data);
+        advance(in);
+    }
+    return err.size() ? -1 : 0;
+}
+
+void pcap_merge::dump_xml(dfxml_writer &xreport)
+{
+    xreport.push("pcap_merge",ssprintf("inputs='%u'",(unsigned int)inputs.size()));
+    xreport.xmlout("packets",packets);
+    xreport.xmlout("out_of_order",out_of_order);
+    xreport.pop();                      // pcap_merge
+}
@@ -0,0 +1,79 @@
+#ifndef PCAP_MERGE_H
+#define PCAP_MERGE_H
+
+/**
+ * pcap_merge.h
+ *
+ * Reads several capture files at once as one, in timestamp order
+ * (-S merge-inputs=1), for captures of the same traffic taken in pieces,
+ * such as one per NIC. A connection whose packets are spread over the
+ * files is then reassembled in a single pass, as if it had been captured
+ * in one file, rather than a file at a time with -R to pick up the rest.
+ *
+ * Each input holds the next packet it has read, and a min-heap of the
+ * inputs, keyed by that packet's timestamp, picks which goes next. Ties go
+ * to the input named first. Each file is assumed to be in timestamp order
+ * already; packets that are not are counted, and passed on as they come.
+ *
+ * Every input reads ahead on its own (see pcap_reader.h), so while the
+ * packets of one are being processed the kernel is reading all of them.
+ */
+
+#include <queue>
+#include <signal.h>
+#include <string>
+#include <vector>
+
+class pcap_reader;
+class dfxml_writer;
+
+class pcap_merge {
+public:
+    pcap_merge();
+    ~pcap_merge();
+
+    void add(const std::string &path,pcap_reader *reader); // takes the reader
+    int  loop(u_char *user);            // 0 when every input has ended, -1 if one had an error (see error())
+    void breakloop() { stop = 1; }      // safe to call from a signal handler
+    const std::string &error() const { return err; }
+
+    void dump_xml(dfxml_writer &xreport);
+
+    uint64_t packets;                   // packets merged
+    uint64_t out_of_order;              // packets older than the one merged before them
+
+private:
+    struct input {
+        input(const std::string &path_,pcap_reader *reader_,unsigned int index_):
+            path(path_),reader(reader_),index(index_),h(0),data(0),handler(0){}
+        std::string               path;
+        pcap_reader              *reader;
+        unsigned int              index;
+        const struct pcap_pkthdr *h;    // the input's next packet
+        const u_char             *data;
+        pcap_handler              handler;
+    private:
+        input(const input &);
+        input &operator=(const input &);
+    };
+    /* orders the heap with the earliest packet on top */
+    struct later {
+        bool operator()(const input *a,const input *b) const {
+            if(a->h->ts.tv_sec  != b->h->ts.tv_sec)  return a->h->ts.tv_sec  > b->h->ts.tv_sec;
+            if(a->h->ts.tv_usec != b->h->ts.tv_usec) return a->h->ts.tv_usec > b->h->ts.tv_usec;
+            return a->index > b->index;
+        }
+    };
+
+    std::vector<input *> inputs;
+    std::priority_queue<input *,std::vector<input *>,later> heap;
+    std::string          err;
+    volatile sig_atomic_t stop;
+
+    void advance(input &in);            // read its next packet, and put it back on the heap if there is one
+
+    pcap_merge(const pcap_merge &);
+    pcap_merge &operator=(const pcap_merge &);
+};
+
+#endif // PCAP_MERGE_H
@@ -0,0 +1,873 @@
+/**
+ * pcap_reader.cpp
+ *
+ * Native pcap and pcapng reader; see pcap_reader.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_reader.h"
+#include "be13_api/utils.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#if defined(HAVE_BZLIB_H) && defined(HAVE_LIBBZ2)
+#include <bzlib.h>
+#define PCAP_READER_BZIP2
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#include <lzma.h>
+#define PCAP_READER_XZ
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define PCAP_READER_ZSTD
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+namespace {
+    const uint32_t PCAP_MAGIC      = 0xa1b2c3d4;
+    const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+    const uint32_t NG_SHB          = 0x0a0d0d0a; // section header block
+    const uint32_t NG_IDB          = 1;          // interface description block
+    const uint32_t NG_OPB          = 2;          // obsolete packet block
+    const uint32_t NG_SPB          = 3;          // simple packet block
+    const uint32_t NG_EPB          = 6;          // enhanced packet block
+    const uint32_t NG_BYTE_ORDER   = 0x1a2b3c4d;
+    const uint32_t MAX_BLOCK       = 16*1024*1024; // larger records are taken to be corruption
+    const uint32_t MAX_PACKET      = 262144;       // libpcap's largest snapshot length
+    const int      RESYNC_RECORDS  = 8;            // plausible records in a row that make a boundary
+    const uint32_t RESYNC_SECONDS  = 86400;        // and how far apart their timestamps may be
+    const size_t   SLACK           = 65536;        // zeros after each record for readers that stray
+}
+
+/****************************************************************
+ *** input: the bytes of the file, before any decompression
+ ****************************************************************/
+
+class pcap_input {
+public:
+    enum { SIZE = 1024*1024, AHEAD = 16*1024*1024 };
+    pcap_input(int fd_):fd(fd_),buf(SIZE),pos(0),len(0),err(),offset(0),advised(0){}
+    ~pcap_input(){ ::close(fd); }
+    int                  fd;
+    std::vector<uint8_t> buf;
+    size_t               pos;           // next unread byte in buf
+    size_t               len;           // bytes in buf
+    std::string          err;
+
+    /* refill an exhausted buffer; false at the end of the file or on error */
+    bool fill() {
+        pos = len = 0;
+
+        /* Ask for the next AHEAD bytes before we need them, so that while we
+         * decode this buffer (or read another file) the disk is busy with ours.
+         * Pipes refuse, which costs nothing.
+         */
+        if(offset + AHEAD/2 >= advised){
+            posix_fadvise(fd,advised,AHEAD,POSIX_FADV_WILLNEED);
+            advised += AHEAD;
+        }
+        ssize_t r;
+        do {
+            r = ::read(fd,&buf[0],buf.size());
+        } while(r<0 && errno==EINTR);
+        if(r<0){
+            err = strerror(errno);
+            return false;
+        }
+        len = r;
+        offset += r;
+        return r>0;
+    }
+
+    /* read until at least n bytes are buffered, for sniffing the file type */
+    void prefetch(size_t n) {
+        while(len < n){
+            ssize_t r = ::read(fd,&buf[len],buf.size()-len);
+            if(r<0 && errno==EINTR) continue;
+            if(r<=0) break;
+            len += r;
+            offset += r;
+        }
+    }
+private:
+    off_t                offset;        // of the end of buf in the file
+    off_t                advised;       // POSIX_FADV_WILLNEED has been given up to here
+    pcap_input(const pcap_input &);
+    pcap_input &operator=(const pcap_input &);
+};
+
+/****************************************************************
+ *** decoders: decompress the input a buffer at a time
+ ****************************************************************/
+
+class pcap_decoder {
+protected:
+    bool ended;                         // the input so far is a whole number of compressed streams
+public:
+    pcap_decoder():ended(true),err(){}
+    virtual ~pcap_decoder(){}
+    std::string err;
+
+    /* Run the decompressor over in[0..in_len) into out[0..out_len). finish is
+     * set when there is no more input. Sets ended, and returns false on error.
+     */
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish)=0;
+
+    /* up to len bytes of output; 0 at the end of the input, -1 on error */
+    ssize_t decode(pcap_input &in,uint8_t *out,size_t len) {
+        while(true){
+            bool finish = false;
+            if(in.pos==in.len && !in.fill()){
+                if(in.err.size()){
+                    err = in.err;
+                    return -1;
+                }
+                finish = true;
+            }
+            size_t used = 0,made = 0;
+            if(!step(&in.buf[in.pos],in.len-in.pos,&used,out,len,&made,finish)) return -1;
+            in.pos += used;
+            if(made) return made;
+            if(finish){
+                if(!ended){
+                    err = "compressed file is truncated";
+                    return -1;
+                }
+                return 0;
+            }
+            if(used==0){
+                err = "decompressor made no progress";
+                return -1;
+            }
+        }
+    }
+};
+
+class raw_decoder : public pcap_decoder {
+public:
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish) {
+        size_t n = std::min(in_len,out_len);
+        memcpy(out,in,n);
+        *used = *made = n;
+        return true;
+    }
+};
+
+#ifdef HAVE_ZLIB_H
+class gzip_decoder : public pcap_decoder {
+    z_stream zs;
+public:
+    gzip_decoder():zs() {
+        if(inflateInit2(&zs,15+32)!=Z_OK) die("inflateInit2 failed");
+    }
+    virtual ~gzip_decoder(){ inflateEnd(&zs); }
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish) {
+        zs.next_in   = (Bytef *)in;
+        zs.avail_in  = in_len;
+        zs.next_out  = out;
+        zs.avail_out = out_len;
+        int r = inflate(&zs,Z_NO_FLUSH);
+        *used = in_len - zs.avail_in;
+        *made = out_len - zs.avail_out;
+        if(r==Z_STREAM_END){
+            inflateReset(&zs);          // another member may follow
+            ended = true;
+            return true;
+        }
+        if(r==Z_OK || r==Z_BUF_ERROR){
+            if(*used || *made) ended = false;
+            return true;
+        }
+        err = zs.msg ? zs.msg : "gzip data error";
+        return false;
+    }
+};
+#endif
+
+#ifdef PCAP_READER_BZIP2
+class bzip2_decoder : public pcap_decoder {
+    bz_stream bs;
+public:
+    bzip2_decoder():bs() {
+        if(BZ2_bzDecompressInit(&bs,0,0)!=BZ_OK) die("BZ2_bzDecompressInit failed");
+    }
+    virtual ~bzip2_decoder(){ BZ2_bzDecompressEnd(&bs); }
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish) {
+        if(finish && ended) return true;  // BZ2_bzDecompress complains about running off the end
+        bs.next_in   = (char *)in;
+        bs.avail_in  = in_len;
+        bs.next_out  = (char *)out;
+        bs.avail_out = out_len;
+        int r = BZ2_bzDecompress(&bs);
+        *used = in_len - bs.avail_in;
+        *made = out_len - bs.avail_out;
+        if(r==BZ_STREAM_END){
+            BZ2_bzDecompressEnd(&bs);   // another stream may follow
+            memset(&bs,0,sizeof(bs));
+            BZ2_bzDecompressInit(&bs,0,0);
+            ended = true;
+            return true;
+        }
+        if(r==BZ_OK){
+            if(*used || *made) ended = false;
+            return true;
+        }
+        err = "bzip2 data error";
+        return false;
+    }
+};
+#endif
+
+#ifdef PCAP_READER_XZ
+class xz_decoder : public pcap_decoder {
+    lzma_stream ls;
+public:
+    xz_decoder():ls() {
+        lzma_stream init = LZMA_STREAM_INIT;
+        ls = init;
+        /* handles .lzma as well as .xz */
+        if(lzma_auto_decoder(&ls,UINT64_MAX,LZMA_CONCATENATED)!=LZMA_OK) die("lzma_auto_decoder failed");
+        ended = false;                  // LZMA_CONCATENATED reports the end itself
+    }
+    virtual ~xz_decoder(){ lzma_end(&ls); }
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish) {
+        if(ended) { *used = *made = 0; return true; }
+        ls.next_in   = in;
+        ls.avail_in  = in_len;
+        ls.next_out  = out;
+        ls.avail_out = out_len;
+        lzma_ret r = lzma_code(&ls,finish ? LZMA_FINISH : LZMA_RUN);
+        *used = in_len - ls.avail_in;
+        *made = out_len - ls.avail_out;
+        if(r==LZMA_STREAM_END){
+            ended = true;
+            return true;
+        }
+        if(r==LZMA_OK || r==LZMA_BUF_ERROR) return true;
+        err = ssprintf("xz data error %d",(int)r);
+        return false;
+    }
+};
+#endif
+
+#ifdef PCAP_READER_ZSTD
+class zstd_decoder : public pcap_decoder {
+    ZSTD_DStream *ds;
+public:
+    zstd_decoder():ds(ZSTD_createDStream()) {
+        if(ds==0) die("ZSTD_createDStream failed");
+        ZSTD_initDStream(ds);
+    }
+    virtual ~zstd_decoder(){ ZSTD_freeDStream(ds); }
+    virtual bool step(const uint8_t *in,size_t in_len,size_t *used,
+                      uint8_t *out,size_t out_len,size_t *made,bool finish) {
+        ZSTD_inBuffer  ib = {in,in_len,0};
+        ZSTD_outBuffer ob = {out,out_len,0};
+        size_t r = ZSTD_decompressStream(ds,&ob,&ib);
+        *used = ib.pos;
+        *made = ob.pos;
+        if(ZSTD_isError(r)){
+            err = ZSTD_getErrorName(r);
+            return false;
+        }
+        ended = (r==0);                 // a frame is complete and flushed
+        return true;
+    }
+};
+#endif
+
+/****************************************************************
+ *** sources: contiguous records, from a mapping or a decoder
+ ****************************************************************/
+
+class pcap_source {
+public:
+    pcap_source():err(){}
+    virtual ~pcap_source(){}
+    /* The next n bytes, or 0 if the file ends first. Good until the next call. */
+    virtual const uint8_t *read(size_t n)=0;
+    virtual bool at_end()=0;
+    std::string err;                    // set on I/O or decompression errors
+};
+
+/* An uncompressed file, mapped and walked in place.
+ * A view reads records that start in [pos,limit) of a mapping it does not own;
+ * the last of them may run past limit.
+ */
+class mmap_source : public pcap_source {
+    enum { WINDOW = 16*1024*1024 };     // readahead and release granularity
+    const uint8_t       *base;
+    size_t               size;
+    size_t               pos;
+    size_t               limit;
+    size_t               advised;       // MADV_WILLNEED has been given up to here
+    size_t               released;      // MADV_DONTNEED has been given up to here
+    bool                 owner;
+    std::vector<uint8_t> tail;          // copies of the last records, followed by zeros
+public:
+    mmap_source(const uint8_t *base_,size_t size_):
+        base(base_),size(size_),pos(0),limit(size_),advised(0),released(0),owner(true),tail(){
+        madvise((void *)base,size,MADV_SEQUENTIAL);
+    }
+    mmap_source(const mmap_source &whole,size_t begin,size_t limit_):
+        base(whole.base),size(whole.size),pos(begin),limit(std::min(limit_,whole.size)),
+        advised(begin & ~(size_t)(WINDOW-1)),released((begin+WINDOW-1) & ~(size_t)(WINDOW-1)),owner(false),tail(){
+    }
+    virtual ~mmap_source(){ if(owner) munmap((void *)base,size); }
+    virtual bool at_end(){ return pos>=limit; }
+    size_t tell() const { return pos; }
+    size_t length() const { return size; }
+    void   seek(size_t pos_) {
+        if(pos_ < pos){                 // reading a range again: start the windows again too
+            advised  = pos_ & ~(size_t)(WINDOW-1);
+            released = (pos_+WINDOW-1) & ~(size_t)(WINDOW-1);
+        }
+        pos = pos_;
+    }
+    const uint8_t *at(size_t offset) const { return base+offset; }
+    virtual const uint8_t *read(size_t n) {
+        if(n > size-pos) return 0;
+        const uint8_t *p = base+pos;
+        pos += n;
+
+        /* keep a window ahead of us in memory, and let go of what is well behind us */
+        if(pos + WINDOW > advised && advised < limit){
+            size_t len = std::min((size_t)WINDOW,limit-advised);
+            madvise((void *)(base+advised),len,MADV_WILLNEED);
+            advised += len;
+        }
+        while(pos > released + 2*WINDOW){
+            madvise((void *)(base+released),WINDOW,MADV_DONTNEED);
+            released += WINDOW;
+        }
+
+        /* Near the end of the mapping, the bytes after a record may not be mapped */
+        if(pos + SLACK > size){
+            tail.assign(n+SLACK,0);
+            memcpy(&tail[0],p,n);
+            return &tail[0];
+        }
+        return p;
+    }
+private:
+    mmap_source(const mmap_source &);
+    mmap_source &operator=(const mmap_source &);
+};
+
+/* Anything else: decode into a buffer and hand out records from it */
+class stream_source : public pcap_source {
+    pcap_input          *in;
+    pcap_decoder        *dec;
+    std::vector<uint8_t> buf;           // SLACK bytes longer than cap
+    size_t               cap;
+    size_t               start;         // next unread byte
+    size_t               len;           // bytes decoded into buf
+    bool                 eof;
+
+    /* make n bytes available at start */
+    bool want(size_t n) {
+        if(len-start >= n) return true;
+        if(eof || err.size()) return false;
+        if(start){
+            memmove(&buf[0],&buf[start],len-start);
+            len  -= start;
+            start = 0;
+        }
+        if(n > cap){
+            cap = std::max(n,cap*2);
+            buf.resize(cap+SLACK);
+        }
+        while(len < n){
+            ssize_t r = dec->decode(*in,&buf[len],cap-len);
+            if(r<0){
+                err = dec->err;
+                return false;
+            }
+            if(r==0){
+                eof = true;
+                return false;
+            }
+            len += r;
+        }
+        return true;
+    }
+public:
+    stream_source(pcap_input *in_,pcap_decoder *dec_):
+        in(in_),dec(dec_),buf(pcap_input::SIZE+SLACK),cap(pcap_input::SIZE),start(0),len(0),eof(false){}
+    virtual ~stream_source(){
+        delete dec;
+        delete in;
+    }
+    virtual bool at_end(){ return !want(1) && err.empty(); }
+    virtual const uint8_t *read(size_t n) {
+        if(!want(n)) return 0;
+        const uint8_t *p = &buf[start];
+        start += n;
+        return p;
+    }
+private:
+    stream_source(const stream_source &);
+    stream_source &operator=(const stream_source &);
+};
+
+/****************************************************************
+ *** pcap_reader
+ ****************************************************************/
+
+pcap_reader::pcap_reader(const std::string &path_,pcap_source *src_):
+    packets(0),path(path_),src(src_),mapped(dynamic_cast<mmap_source *>(src_)),current(0),
+    format(PCAP),swapped(false),nsec(false),
+    ifaces(),expression(),err(),stop(0),pkt(),pkt_data(0),pkt_iface(0)
+{
+}
+
+pcap_reader::~pcap_reader()
+{
+    clear_ifaces();
+    delete src;
+}
+
+pcap_reader *pcap_reader::open(const std::string &path)
+{
+    int fd = path=="-" ? dup(0) : ::open(path.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) die("%s: %s",path.c_str(),strerror(errno));
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+
+    pcap_input *in = new pcap_input(fd);
+    in->prefetch(6);
+    const uint8_t *m = &in->buf[0];
+    bool gz   = in->len>=2 && m[0]==0x1f && m[1]==0x8b;
+    bool bz2  = in->len>=3 && m[0]=='B'  && m[1]=='Z' && m[2]=='h';
+    bool xz   = in->len>=6 && memcmp(m,"\xfd" "7zXZ\0",6)==0;
+    bool zstd = in->len>=4 && m[0]==0x28 && m[1]==0xb5 && m[2]==0x2f && m[3]==0xfd;
+    bool lzma = ends_with(path,".lzma");
+
+    pcap_decoder *dec = 0;
+    if(gz){
+#ifdef HAVE_ZLIB_H
+        dec = new gzip_decoder();
+#endif
+    } else if(bz2){
+#ifdef PCAP_READER_BZIP2
+        dec = new bzip2_decoder();
+#endif
+    } else if(xz || lzma){
+#ifdef PCAP_READER_XZ
+        dec = new xz_decoder();
+#endif
+    } else if(zstd){
+#ifdef PCAP_READER_ZSTD
+        dec = new zstd_decoder();
+#endif
+    } else {
+        /* uncompressed: map it if we can */
+        struct stat st;
+        if(fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0 && (uint64_t)st.st_size==(size_t)st.st_size){
+            void *base = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if(base!=MAP_FAILED){
+                delete in;              // closes fd; the mapping stays
+                pcap_reader *r = new pcap_reader(path,new mmap_source((const uint8_t *)base,st.st_size));
+                if(r->open_header()) return r;
+                delete r;
+                return 0;
+            }
+        }
+        dec = new raw_decoder();
+    }
+    if(dec==0){
+        DEBUG(2)("%s: compressed with a method this build cannot decode; using an external decompressor",path.c_str());
+        delete in;
+        return 0;
+    }
+    pcap_reader *r = new pcap_reader(path,new stream_source(in,dec));
+    if(r->open_header()) return r;
+    /* we cannot hand a half-read pipe to libpcap */
+    if(path=="-") die("%s: %s",path.c_str(),r->err.c_str());
+    delete r;
+    return 0;
+}
+
+/* read the file header; false if this is not a capture file we know */
+bool pcap_reader::open_header()
+{
+    const uint8_t *h = src->read(4);
+    if(h==0){
+        err = "unknown file format";
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic,h,4);
+    if(magic==NG_SHB){
+        format = PCAPNG;
+        h = src->read(4);
+        if(h==0){
+            err = "truncated section header block";
+            return false;
+        }
+        uint32_t raw_len;
+        memcpy(&raw_len,h,4);
+        return section_header(raw_len);
+    }
+    if(magic==PCAP_MAGIC || magic==PCAP_MAGIC_NSEC){
+        swapped = false;
+    } else if(__builtin_bswap32(magic)==PCAP_MAGIC || __builtin_bswap32(magic)==PCAP_MAGIC_NSEC){
+        swapped = true;
+        magic   = __builtin_bswap32(magic);
+    } else {
+        err = "unknown file format";
+        return false;
+    }
+    format = PCAP;
+    nsec   = (magic==PCAP_MAGIC_NSEC);
+    h = src->read(20);                  // version, thiszone, sigfigs, snaplen, linktype
+    if(h==0){
+        err = "truncated dump file header";
+        return false;
+    }
+    add_iface(get32(h+16),nsec ? 1000000000 : 1000000,0);
+    return true;
+}
+
+uint16_t pcap_reader::get16(const uint8_t *p) const
+{
+    uint16_t v;
+    memcpy(&v,p,2);
+    return swapped ? __builtin_bswap16(v) : v;
+}
+
+uint32_t pcap_reader::get32(const uint8_t *p) const
+{
+    uint32_t v;
+    memcpy(&v,p,4);
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+uint64_t pcap_reader::get64(const uint8_t *p) const
+{
+    uint64_t v;
+    memcpy(&v,p,8);
+    return swapped ? __builtin_bswap64(v) : v;
+}
+
+void pcap_reader::add_iface(int linktype,uint64_t units,int64_t offset)
+{
+    iface i;
+    i.dlt    = linktype & 0x03ffffff;   // the upper bits describe the FCS
+    i.units  = units;
+    i.offset = offset;
+    ifaces.push_back(i);
+    if(expression.size()) compile(ifaces.back());
+}
+
+void pcap_reader::clear_ifaces()
+{
+#ifdef HAVE_LIBPCAP
+    for(std::vector<iface>::iterator it=ifaces.begin();it!=ifaces.end();it++){
+        if(it->filtered) pcap_freecode(&it->fcode);
+    }
+#endif
+    ifaces.clear();
+}
+
+void pcap_reader::compile(iface &i)
+{
+#ifdef HAVE_LIBPCAP
+    pcap_t *dead = pcap_open_dead(i.dlt,SNAPLEN);
+    if(dead==0) die("pcap_open_dead failed");
+    if(pcap_compile(dead,&i.fcode,expression.c_str(),1,0)<0) die("%s",pcap_geterr(dead));
+    pcap_close(dead);
+    i.filtered = true;
+#else
+    die("%s: filter expressions require libpcap",path.c_str());
+#endif
+}
+
+void pcap_reader::set_filter(const std::string &expression_)
+{
+    expression = expression_;
+    if(expression.empty()) return;
+    for(std::vector<iface>::iterator it=ifaces.begin();it!=ifaces.end();it++){
+        compile(*it);
+    }
+}
+
+int pcap_reader::fail(const std::string &why)
+{
+    err = src->err.size() ? src->err : why;
+    return -1;
+}
+
+/* The block type and the byte-order magic that follows it are already read */
+bool pcap_reader::section_header(uint32_t raw_len)
+{
+    const uint8_t *h = src->read(4);
+    if(h==0){
+        err = "truncated section header block";
+        return false;
+    }
+    uint32_t bom;
+    memcpy(&bom,h,4);
+    if(bom==NG_BYTE_ORDER)                         swapped = false;
+    else if(__builtin_bswap32(bom)==NG_BYTE_ORDER) swapped = true;
+    else {
+        err = "bad pcapng byte-order magic";
+        return false;
+    }
+    uint32_t len = swapped ? __builtin_bswap32(raw_len) : raw_len;
+    if(len < 28 || len % 4 || len > MAX_BLOCK){
+        err = "bad section header block length";
+        return false;
+    }
+    const uint8_t *body = src->read(len-12);
+    if(body==0){
+        err = "truncated section header block";
+        return false;
+    }
+    if(get16(body)!=1){
+        err = ssprintf("unsupported pcapng version %d",get16(body));
+        return false;
+    }
+    clear_ifaces();                     // interface numbers start again in each section
+    return true;
+}
+
+bool pcap_reader::interface_description(const uint8_t *b,size_t len)
+{
+    if(len < 8){
+        err = "bad interface description block";
+        return false;
+    }
+    int      linktype = get16(b);
+    uint64_t units    = 1000000;
+    int64_t  offset   = 0;
+    for(size_t o=8;o+4<=len;){
+        uint16_t code = get16(b+o);
+        uint16_t olen = get16(b+o+2);
+        if(code==0 || o+4+olen > len) break;
+        const uint8_t *v = b+o+4;
+        if(code==9 && olen>=1){         // if_tsresol
+            units = 1;
+            if(v[0] & 0x80) units <<= std::min(v[0] & 0x7f,63);
+            else for(int i=0;i<(v[0] & 0x7f) && i<19;i++) units *= 10;
+        }
+        if(code==14 && olen>=8){        // if_tsoffset
+            offset = (int64_t)get64(v);
+        }
+        o += 4 + ((olen+3) & ~3);
+    }
+    add_iface(linktype,units,offset);
+    return true;
+}
+
+/* a record has been read: make it the pending packet unless the filter drops it */
+void pcap_reader::accept(iface &i,int64_t sec,uint32_t usec,uint32_t caplen,uint32_t len,const uint8_t *data)
+{
+    pkt.ts.tv_sec  = sec;
+    pkt.ts.tv_usec = usec;
+    pkt.caplen     = caplen;
+    pkt.len        = len;
+#ifdef HAVE_LIBPCAP
+    if(i.filtered && pcap_offline_filter(&i.fcode,&pkt,data)==0) return;
+#endif
+    pkt_data  = data;
+    pkt_iface = &i;
+}
+
+int pcap_reader::accept_ng(uint32_t id,uint64_t ts,uint32_t caplen,uint32_t len,const uint8_t *data)
+{
+    if(id >= ifaces.size()) return fail(ssprintf("packet for undefined interface %u",id));
+    iface   &i    = ifaces[id];
+    uint64_t frac = ts % i.units;
+    uint32_t usec;
+    if(i.units==1000000)         usec = frac;
+    else if(i.units==1000000000) usec = frac / 1000;
+    else                         usec = (uint32_t)((double)frac * 1000000.0 / i.units);
+    accept(i,(int64_t)(ts / i.units) + i.offset,usec,caplen,len,data);
+    return 1;
+}
+
+int pcap_reader::read_pcap()
+{
+    if(src->at_end()) return 0;
+    if(mapped) current = mapped->tell();
+    const uint8_t *rh = src->read(16);
+    if(rh==0) return fail("truncated dump file");
+    uint32_t sec    = get32(rh);
+    uint32_t frac   = get32(rh+4);
+    uint32_t caplen = get32(rh+8);
+    uint32_t len    = get32(rh+12);
+    if(caplen > MAX_BLOCK) return fail(ssprintf("invalid packet capture length %u",caplen));
+    const uint8_t *data = src->read(caplen);
+    if(data==0) return fail(ssprintf("truncated dump file; tried to read %u captured bytes",caplen));
+    accept(ifaces[0],sec,nsec ? frac/1000 : frac,caplen,len,data);
+    return 1;
+}
+
+int pcap_reader::read_pcapng()
+{
+    if(src->at_end()) return 0;
+    const uint8_t *bh = src->read(8);
+    if(bh==0) return fail("truncated block header");
+    uint32_t type,raw_len;
+    memcpy(&type,bh,4);
+    memcpy(&raw_len,bh+4,4);
+    if(type==NG_SHB) return section_header(raw_len) ? 1 : -1;
+    type = swapped ? __builtin_bswap32(type) : type;
+    uint32_t blen = swapped ? __builtin_bswap32(raw_len) : raw_len;
+    if(blen < 12 || blen % 4 || blen > MAX_BLOCK) return fail(ssprintf("bad block length %u",blen));
+    const uint8_t *b = src->read(blen-8);
+    if(b==0) return fail("truncated block");
+    size_t len = blen-12;               // without the header and the trailing length
+
+    switch(type){
+    case NG_IDB:
+        return interface_description(b,len) ? 1 : -1;
+    case NG_EPB:
+    case NG_OPB: {
+        if(len < 20) return fail("bad packet block");
+        uint32_t id     = type==NG_EPB ? get32(b) : get16(b);
+        uint64_t ts     = (uint64_t)get32(b+4)<<32 | get32(b+8);
+        uint32_t caplen = get32(b+12);
+        if(caplen > len-20) return fail("packet block is shorter than its packet");
+        return accept_ng(id,ts,caplen,get32(b+16),b+20);
+    }
+    case NG_SPB: {
+        if(len < 4) return fail("bad simple packet block");
+        uint32_t plen = get32(b);
+        return accept_ng(0,0,std::min((size_t)plen,len-4),plen,b+4);
+    }
+    default:
+        return 1;                       // statistics, name resolution, custom blocks...
+    }
+}
+
+/* hand out the pending packet */
+int pcap_reader::take(const struct pcap_pkthdr **h,const u_char **data,pcap_handler *handler)
+{
+    if(pkt_iface->handler==0) pkt_iface->handler = find_handler(pkt_iface->dlt,path.c_str());
+    packets++;
+    *h       = &pkt;
+    *data    = pkt_data;
+    *handler = pkt_iface->handler;
+    pkt_iface = 0;
+    return 1;
+}
+
+int pcap_reader::next(const struct pcap_pkthdr **h,const u_char **data,pcap_handler *handler)
+{
+    while(pkt_iface==0){
+        int r = format==PCAPNG ? read_pcapng() : read_pcap();
+        if(r<=0) return r;
+    }
+    return take(h,data,handler);
+}
+
+int pcap_reader::loop(u_char *user)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *data;
+    pcap_handler handler;
+    while(!stop){
+        int r = next(&h,&data,&handler);
+        if(r<=0) return r;
+        (*handler)(user,h,data);
+    }
+    return 0;
+}
+
+/****************************************************************
+ *** byte ranges
+ ****************************************************************/
+
+uint64_t pcap_reader::size() const
+{
+    return mapped ? mapped->length() : 0;
+}
+
+uint64_t pcap_reader::tell() const
+{
+    return mapped ? mapped->tell() : 0;
+}
+
+/* Could rh be a record header? Only checks what no real record gets wrong. */
+bool pcap_reader::plausible(const uint8_t *rh,uint32_t first_sec) const
+{
+    uint32_t sec    = get32(rh);
+    uint32_t frac   = get32(rh+4);
+    uint32_t caplen = get32(rh+8);
+    uint32_t len    = get32(rh+12);
+    if(frac >= (nsec ? 1000000000U : 1000000U)) return false;
+    if(caplen > len || len > MAX_PACKET) return false;
+    uint32_t apart = sec > first_sec ? sec-first_sec : first_sec-sec;
+    return apart <= RESYNC_SECONDS;
+}
+
+/* A record boundary is where RESYNC_RECORDS plausible records follow one another,
+ * or where plausible records run exactly to the end of the file.
+ */
+uint64_t pcap_reader::resync(uint64_t from) const
+{
+    const uint64_t end = size();
+    for(uint64_t o=std::max(from,data_offset()); o+16 <= end; o++){
+        uint32_t first_sec = get32(mapped->at(o));
+        uint64_t p = o;
+        int n = 0;
+        while(n < RESYNC_RECORDS && p+16 <= end && plausible(mapped->at(p),first_sec)){
+            p += 16 + get32(mapped->at(p)+8);
+            n++;
+        }
+        if(n==RESYNC_RECORDS || (n>0 && p==end)) return o;
+    }
+    return end;
+}
+
+pcap_reader *pcap_reader::range(uint64_t begin,uint64_t end) const
+{
+    pcap_reader *r = new pcap_reader(path,new mmap_source(*mapped,begin,end));
+    r->format     = format;
+    r->swapped    = swapped;
+    r->nsec       = nsec;
+    r->expression = expression;
+    for(std::vector<iface>::const_iterator it=ifaces.begin();it!=ifaces.end();it++){
+        r->add_iface(it->dlt,it->units,it->offset);
+    }
+    return r;
+}
+
+void pcap_reader::seek(uint64_t offset)
+{
+    mapped->seek(offset);
+}
+
+int pcap_reader::deliver_at(uint64_t offset,u_char *user)
+{
+    mapped->seek(offset);
+    pkt_iface = 0;
+    int r = read_pcap();
+    if(r<=0 || pkt_iface==0) return r;
+    const struct pcap_pkthdr *h;
+    const u_char *data;
+    pcap_handler handler;
+    take(&h,&data,&handler);
+    (*handler)(user,h,data);
+    return 1;
+}
@@ -0,0 +1,121 @@
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+/**
+ * pcap_reader.h
+ *
+ * Reads pcap and pcapng capture files for -r and -R without libpcap.
+ *
+ * An uncompressed regular file is mapped into memory and each record is
+ * handed to the datalink handler where it lies, with no copy and no per-
+ * record read(). The mapping is read sequentially: the kernel is told so,
+ * the next window is prefetched with MADV_WILLNEED, and windows we have
+ * finished with are dropped so a multi-GB file does not fill our RSS.
+ *
+ * gzip, bzip2, xz/lzma and zstd files (recognised by their magic numbers,
+ * or by a .lzma suffix) and pipes are decompressed in-process, a buffer
+ * at a time, by whichever of zlib, libbz2, liblzma and libzstd this build
+ * has. open() returns 0 for anything else, and process_infile() falls back
+ * to libpcap and the external decompressors.
+ *
+ * pcapng files may have several interfaces with different link types;
+ * each gets its own datalink handler and filter. Link types are used as
+ * DLT values directly, which is right for every link type tcpflow decodes.
+ *
+ * A mapped classic pcap file can also be read as independent byte ranges
+ * (see pcap_split.h): range() makes a reader for the records that start
+ * in a range, and resync() finds where records start without reading the
+ * file from the beginning.
+ */
+
+#include <signal.h>
+#include <string>
+#include <vector>
+
+class pcap_source;
+class mmap_source;
+
+class pcap_reader {
+public:
+    /* Returns 0 if path is not a capture file we can read natively; dies if it cannot be opened */
+    static pcap_reader *open(const std::string &path);
+    ~pcap_reader();
+
+    void set_filter(const std::string &expression); // dies if the expression does not compile
+    int  loop(u_char *user);            // 0 at the end of the file, -1 on error (see error())
+    /* Or pull packets one at a time: 1 with the next packet and its handler,
+     * 0 at the end of the file, -1 on error. The packet is good until the next call.
+     */
+    int  next(const struct pcap_pkthdr **h,const u_char **data,pcap_handler *handler);
+    void breakloop() { stop = 1; }      // safe to call from a signal handler
+    const std::string &error() const { return err; }
+
+    /* byte ranges, for files that are splittable() */
+    bool     splittable() const { return mapped!=0 && format==PCAP; }
+    uint64_t size() const;              // of the whole file
+    uint64_t data_offset() const { return 24; } // where the first record starts
+    uint64_t tell() const;              // offset of the next record
+    void     seek(uint64_t offset);     // offset must be a record boundary
+    uint64_t record_offset() const { return current; } // offset of the record being delivered
+    uint64_t resync(uint64_t from) const; // first plausible record boundary at or after from; size() if none
+    pcap_reader *range(uint64_t begin,uint64_t end) const; // reads the records that start in [begin,end)
+    int      deliver_at(uint64_t offset,u_char *user); // reads the one record at offset; as loop()
+
+    uint64_t packets;                   // records read
+
+private:
+    struct iface {
+        iface():dlt(0),handler(0),units(1000000),offset(0)
+#ifdef HAVE_LIBPCAP
+               ,fcode(),filtered(false)
+#endif
+        {}
+        int          dlt;
+        pcap_handler handler;
+        uint64_t     units;             // timestamp units per second
+        int64_t      offset;            // seconds to add to each timestamp
+#ifdef HAVE_LIBPCAP
+        struct bpf_program fcode;
+        bool               filtered;
+#endif
+    };
+    enum format_t { PCAP, PCAPNG };
+
+    std::string        path;
+    pcap_source       *src;
+    mmap_source       *mapped;          // src, if it is a mapping
+    uint64_t           current;         // offset of the record being delivered, if mapped
+    format_t           format;
+    bool               swapped;         // file is in the other byte order
+    bool               nsec;            // classic pcap with nanosecond timestamps
+    std::vector<iface> ifaces;
+    std::string        expression;
+    std::string        err;
+    volatile sig_atomic_t stop;
+    struct pcap_pkthdr pkt;             // the record read and accepted, but not yet handed out
+    const uint8_t     *pkt_data;
+    iface             *pkt_iface;       // 0 if there is none
+
+    pcap_reader(const std::string &path,pcap_source *src);
+    uint16_t get16(const uint8_t *p) const;
+    uint32_t get32(const uint8_t *p) const;
+    uint64_t get64(const uint8_t *p) const;
+    void add_iface(int linktype,uint64_t units,int64_t offset);
+    void clear_ifaces();
+    void compile(iface &i);
+    bool open_header();
+    bool section_header(uint32_t raw_len);
+    bool interface_description(const uint8_t *body,size_t len);
+    bool plausible(const uint8_t *rh,uint32_t first_sec) const;
+    int  read_pcap();                   // read a record: 1, 0 at the end, -1 on error
+    int  read_pcapng();                 // read a block: likewise
+    void accept(iface &i,int64_t sec,uint32_t usec,uint32_t caplen,uint32_t len,const uint8_t *data);
+    int  accept_ng(uint32_t id,uint64_t ts,uint32_t caplen,uint32_t len,const uint8_t *data);
+    int  take(const struct pcap_pkthdr **h,const u_char **data,pcap_handler *handler);
+    int  fail(const std::string &why);
+
+    pcap_reader(const pcap_reader &);
+    pcap_reader &operator=(const pcap_reader &);
+};
+
+#endif // PCAP_READER_H
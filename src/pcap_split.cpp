@@ -0,0 +1,265 @@
+/**
+ * pcap_split.cpp
+ *
+ * Reading one pcap file as parallel byte ranges; see pcap_split.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "pcap_reader.h"
+#include "pcap_split.h"
+
+#include <algorithm>
+#include <signal.h>
+
+/* static */ std::string pcap_split::unsplittable(const tcpdemux &demux)
+{
+#ifndef HAVE_PTHREAD
+    return "this tcpflow was built without pthreads";
+#endif
+    if(demux.opt.console_output) return "console output has to come out in packet order";
+    if(demux.pwriter)            return "unprocessed packets are written in packet order";
+    if(tcpdemux::timeouts_enabled()) return "idle timeouts depend on the packets of other connections";
+    if(demux.shards.size())      return "it cannot be combined with -j";
+
+    /* flows must be named by their addresses, which one demux owns, and not by ids, which it does not */
+    const std::string &t = flow::filename_template;
+    const char *owned[] = {"%A","%a","%B","%b",0};
+    for(int i=0;owned[i];i++){
+        if(t.find(owned[i])==std::string::npos) return "the filename template does not name flows by addresses and ports";
+    }
+    const char *ids[] = {"%N","%K","%M","%G","%S",0};
+    for(int i=0;ids[i];i++){
+        if(t.find(ids[i])!=std::string::npos) return "the filename template names flows by flow or session id";
+    }
+
+    /* netviz is the only other scanner that sees packets, and it would see them all three times */
+    std::vector<std::string> enabled;
+    be13::plugin::get_enabled_scanners(enabled);
+    if(std::find(enabled.begin(),enabled.end(),"netviz")!=enabled.end()) return "netviz needs packets in file order";
+    return "";
+}
+
+pcap_split::pcap_split(tcpdemux &demux_,pcap_reader &root_,unsigned int ranges_):
+    ranges(ranges_),resynced(0),spanning_conns(0),spanning_packets(0),
+    demux(demux_),root(root_),workers(),used(0),spanning(),phase(SCAN),err(),stop(0),current()
+{
+    uint64_t data = root.size() - root.data_offset();
+    if(ranges > data / MIN_RANGE) ranges = data / MIN_RANGE;
+    if(ranges < 1) ranges = 1;
+
+    used = ranges;
+    for(unsigned int i=0;i<ranges;i++){
+        workers.push_back(new worker());
+        worker &w = *workers.back();
+        w.split = this;
+        w.index = i;
+        w.begin = root.data_offset() + data * i / ranges;
+        w.limit = root.data_offset() + data * (i+1) / ranges;
+        w.start = w.begin;
+        w.end   = w.begin;
+        w.reader = root.range(w.begin,w.limit);
+        w.whole  = root.range(root.data_offset(),root.size());
+        w.deferred.resize(ranges);
+    }
+    pthread_key_create(&current,0);
+}
+
+pcap_split::~pcap_split()
+{
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        delete (*it)->reader;
+        delete (*it)->whole;
+        delete (*it)->demux;
+        delete *it;
+    }
+    pthread_key_delete(current);
+}
+
+void pcap_split::breakloop()
+{
+    stop = 1;
+    for(std::vector<worker *>::iterator it=workers.begin();it!=workers.end();it++){
+        (*it)->reader->breakloop();
+    }
+}
+
+int pcap_split::process_pkt(const be13::packet_info &pi)
+{
+    worker *w = (worker *)pthread_getspecific(current);
+    uint64_t hash = 0;
+    switch(phase){
+    case SCAN:
+        if(tcpdemux::conn_hash(pi,&hash)) w->conns.insert(hash);
+        return 0;
+    case LOCAL:
+        if(tcpdemux::conn_hash(pi,&hash) && spanning.count(hash)){
+            w->deferred[shard(hash)].push_back(w->reader->record_offset());
+            return 0;
+        }
+        return w->demux->process_pkt(pi);
+    case SPANNING:
+        return w->demux->process_pkt(pi);
+    }
+    return 1;
+}
+
+/* Pass 1: find the first record and the connections in the range */
+void pcap_split::scan(worker &w)
+{
+    if(w.index>0) w.start = root.resync(w.begin);
+    w.reader->seek(w.start);
+    w.conns.clear();
+    w.ret = w.reader->loop((u_char *)&demux);
+    w.end = w.reader->tell();
+}
+
+/* Pass 2: the connections that are only in this range */
+void pcap_split::local(worker &w)
+{
+    w.reader->seek(w.start);
+    w.ret = w.reader->loop((u_char *)&demux);
+    w.demux->remove_all_flows();
+}
+
+/* Pass 3: the connections of this shard that span ranges, in file order */
+void pcap_split::stitch(worker &w)
+{
+    for(unsigned int i=0;i<used && !stop;i++){
+        const std::vector<uint64_t> &offsets = workers[i]->deferred[w.index];
+        for(std::vector<uint64_t>::const_iterator o=offsets.begin();o!=offsets.end() && !stop;o++){
+            w.whole->deliver_at(*o,(u_char *)&demux);
+        }
+    }
+    w.demux->remove_all_flows();
+}
+
+/* static */ void *pcap_split::run_worker(void *arg)
+{
+    worker &w = *(worker *)arg;
+    pcap_split &self = *w.split;
+    pthread_setspecific(self.current,&w);
+    switch(self.phase){
+    case SCAN:     self.scan(w);   break;
+    case LOCAL:    self.local(w);  break;
+    case SPANNING: self.stitch(w); break;
+    }
+    return 0;
+}
+
+/* run the first count workers through a pass, each on its own thread */
+void pcap_split::run_pass(phase_t phase_,unsigned int count)
+{
+    phase = phase_;
+    if(phase!=SCAN){
+        unsigned int fds = demux.max_fds / count;
+        if(fds < 2) fds = 2;
+        for(unsigned int i=0;i<count;i++){
+            workers[i]->demux = new tcpdemux(&demux,fds);
+            workers[i]->demux->opt.write_buffer_mem = demux.opt.write_buffer_mem / count;
+            workers[i]->demux->opt.saved_flow_mem   = demux.opt.saved_flow_mem / count;
+        }
+    }
+
+    /* signals are for the main thread, which passes them on with breakloop() */
+    sigset_t all,old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    for(unsigned int i=0;i<count;i++){
+        int r = pthread_create(&workers[i]->thread,NULL,run_worker,workers[i]);
+        if(r) die("cannot start pcap-split thread: %s",strerror(r));
+    }
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    for(unsigned int i=0;i<count;i++) pthread_join(workers[i]->thread,NULL);
+
+    if(phase!=SCAN){
+        for(unsigned int i=0;i<count;i++){
+            demux.finish_child(*workers[i]->demux);
+            delete workers[i]->demux;
+            workers[i]->demux = 0;
+        }
+    }
+}
+
+/* Each range must start where the records of the one before it ended.
+ * A range whose resync found a false boundary is scanned again, on this
+ * thread, from the right place. A range that ends in an error ends the
+ * file, as it would for a sequential read.
+ */
+void pcap_split::check_boundaries()
+{
+    pthread_setspecific(current,0);
+    for(unsigned int i=0;i<used;i++){
+        worker &w = *workers[i];
+        if(i>0 && w.start != workers[i-1]->end){
+            DEBUG(2)("pcap-split: range %u resynced at %" PRIu64 " but starts at %" PRIu64,
+                     i,w.start,workers[i-1]->end);
+            resynced++;
+            pthread_setspecific(current,&w);
+            w.start = workers[i-1]->end;
+            w.reader->seek(w.start);
+            w.conns.clear();
+            w.ret = w.reader->loop((u_char *)&demux);
+            w.end = w.reader->tell();
+            pthread_setspecific(current,0);
+        }
+        if(w.ret<0){
+            err  = w.reader->error();
+            used = i+1;
+            return;
+        }
+    }
+}
+
+void pcap_split::find_spanning()
+{
+    hash_map_t first_range;
+    for(unsigned int i=0;i<used;i++){
+        for(hash_set_t::const_iterator it=workers[i]->conns.begin();it!=workers[i]->conns.end();it++){
+            std::pair<hash_map_t::iterator,bool> r = first_range.insert(std::make_pair(*it,i));
+            if(!r.second && r.first->second!=i) spanning.insert(*it);
+        }
+        hash_set_t().swap(workers[i]->conns);
+    }
+    spanning_conns = spanning.size();
+}
+
+int pcap_split::run()
+{
+#ifdef HAVE_PTHREAD
+    if(ranges==1) return root.loop((u_char *)&demux);
+
+    demux.split = this;
+    run_pass(SCAN,used);
+    if(!stop){
+        check_boundaries();
+        find_spanning();
+        DEBUG(2)("pcap-split: %u ranges, %" PRIu64 " connections span ranges",used,spanning_conns);
+
+        /* the spanning pass needs every range's queues, so it waits for all of them */
+        run_pass(LOCAL,used);
+        for(unsigned int i=0;i<used;i++){
+            for(unsigned int s=0;s<used;s++) spanning_packets += workers[i]->deferred[s].size();
+        }
+        run_pass(SPANNING,used);
+    }
+    demux.split = 0;
+    return err.size() ? -1 : 0;
+#else
+    return root.loop((u_char *)&demux);
+#endif
+}
+
+void pcap_split::dump_xml(dfxml_writer &xreport)
+{
+    xreport.push("pcap_split",ssprintf("ranges='%u'",ranges));
+    xreport.xmlout("resynced",resynced);
+    xreport.xmlout("spanning_connections",spanning_conns);
+    xreport.xmlout("spanning_packets",spanning_packets);
+    xreport.pop();                      // pcap_split
+}
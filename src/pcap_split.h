@@ -0,0 +1,132 @@
+#ifndef PCAP_SPLIT_H
+#define PCAP_SPLIT_H
+
+/**
+ * pcap_split.h
+ *
+ * Reads one large pcap file as several byte ranges at once (-S pcap-split=N).
+ *
+ * Each range starts at the first record boundary at or after its nominal
+ * start, found by pcap_reader::resync(), and ends with the last record that
+ * starts inside it. The file is read in three passes, each with one thread
+ * per range:
+ *
+ *  1. scan: each range notes the connections (by the hash of their canonical
+ *     key) that its packets belong to. Afterwards every range boundary is
+ *     checked against where the records of the range before it actually
+ *     ended, and a range whose resync was fooled is scanned again from the
+ *     right place.
+ *
+ *  2. local: a connection seen in only one range is reassembled there, by
+ *     that range's own tcpdemux. Packets of connections that span ranges
+ *     are not processed; their offsets are queued instead, by shard.
+ *
+ *  3. spanning: each shard's tcpdemux reads the queued packets of its
+ *     connections in file order, so streams that cross a boundary are
+ *     stitched together by the same sequence number logic as always.
+ *
+ * Every connection is therefore reassembled from all of its packets, in
+ * order, by one tcpdemux, and the flow files are the same as a sequential
+ * run makes. Flow and session ids, and the order of the <fileobject>s in
+ * the report, depend on thread timing, as they do with -j.
+ *
+ * unsplittable() lists the options that need packets of different
+ * connections to be processed in file order; with them the file is read
+ * sequentially.
+ */
+
+#if defined(HAVE_UNORDERED_MAP)
+# include <unordered_map>
+# include <unordered_set>
+#else
+# include <tr1/unordered_map>
+# include <tr1/unordered_set>
+#endif
+#include <signal.h>
+#include <string>
+#include <vector>
+
+class pcap_reader;
+class tcpdemux;
+class dfxml_writer;
+namespace be13 { class packet_info; }
+
+class pcap_split {
+public:
+    enum { MIN_RANGE = 4096 };          // smaller ranges are not worth a thread
+
+    /* why a split run could not match a sequential one; empty if it can */
+    static std::string unsplittable(const tcpdemux &demux);
+
+    pcap_split(tcpdemux &demux,pcap_reader &reader,unsigned int ranges);
+    ~pcap_split();
+
+    int  run();                         // 0 at the end of the file, -1 on error (see error())
+    void breakloop();                   // safe to call from a signal handler
+    const std::string &error() const { return err; }
+
+    /* called by the demux for each packet while the file is being read */
+    int  process_pkt(const be13::packet_info &pi);
+
+    void dump_xml(dfxml_writer &xreport);
+
+    unsigned int ranges;
+    uint64_t     resynced;              // ranges whose first boundary had to be corrected
+    uint64_t     spanning_conns;
+    uint64_t     spanning_packets;
+
+private:
+#ifdef HAVE_UNORDERED_MAP
+    typedef std::unordered_set<uint64_t> hash_set_t;
+    typedef std::unordered_map<uint64_t,unsigned int> hash_map_t;
+#else
+    typedef std::tr1::unordered_set<uint64_t> hash_set_t;
+    typedef std::tr1::unordered_map<uint64_t,unsigned int> hash_map_t;
+#endif
+    enum phase_t { SCAN, LOCAL, SPANNING };
+
+    struct worker {
+        worker():split(0),index(0),begin(0),limit(0),start(0),end(0),reader(0),whole(0),demux(0),ret(0),
+                 conns(),deferred(),thread(){}
+        pcap_split  *split;
+        unsigned int index;
+        uint64_t     begin;             // the nominal range
+        uint64_t     limit;
+        uint64_t     start;             // the first record of the range
+        uint64_t     end;               // just after its last record
+        pcap_reader *reader;            // for the range
+        pcap_reader *whole;             // for the spanning pass, which reads from all over the file
+        tcpdemux    *demux;
+        int          ret;               // of the last pass
+        hash_set_t   conns;             // connections seen in the range
+        std::vector<std::vector<uint64_t> > deferred; // offsets of spanning packets, by shard
+        pthread_t    thread;
+    private:
+        worker(const worker &);
+        worker &operator=(const worker &);
+    };
+
+    tcpdemux            &demux;
+    pcap_reader         &root;
+    std::vector<worker *> workers;
+    unsigned int         used;          // workers whose ranges are read; the rest follow an error
+    hash_set_t           spanning;      // connections seen in more than one range
+    phase_t              phase;
+    std::string          err;
+    volatile sig_atomic_t stop;
+    pthread_key_t        current;       // the worker running on this thread
+
+    void scan(worker &w);
+    void local(worker &w);
+    void stitch(worker &w);
+    void run_pass(phase_t phase,unsigned int count);
+    void check_boundaries();            // and rescan ranges that started in the wrong place
+    void find_spanning();
+    unsigned int shard(uint64_t hash) const { return ((hash >> 32) * used) >> 32; }
+    static void *run_worker(void *arg);
+
+    pcap_split(const pcap_split &);
+    pcap_split &operator=(const pcap_split &);
+};
+
+#endif // PCAP_SPLIT_H
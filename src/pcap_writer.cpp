@@ -0,0 +1,203 @@
+/**
+ * pcap_writer.cpp
+ *
+ * Writing pcap and pcapng files; see pcap_writer.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_writer.h"
+
+static const uint32_t PCAP_MAGIC     = 0xa1b2c3d4;
+static const uint32_t PCAPNG_SHB     = 0x0a0d0d0a; // section header block
+static const uint32_t PCAPNG_IDB     = 0x00000001; // interface description block
+static const uint32_t PCAPNG_EPB     = 0x00000006; // enhanced packet block
+static const uint32_t PCAPNG_BOM     = 0x1a2b3c4d; // byte order magic
+static const size_t   PCAP_RECORD_SIZE = 16;
+static const size_t   SHB_SIZE       = 28;
+static const size_t   IDB_SIZE       = 32;      // with if_tsresol and the end of options
+static const size_t   EPB_OVERHEAD   = 32;      // an EPB with no packet data
+static const size_t   PAGE           = 4096;    // the batch's alignment
+
+/* all in host byte order, which readers tell from the magic numbers */
+static inline uint8_t *put16(uint8_t *p,uint16_t v) { memcpy(p,&v,2); return p+2; }
+static inline uint8_t *put32(uint8_t *p,uint32_t v) { memcpy(p,&v,4); return p+4; }
+
+bool pcap_writer::parse_format(const std::string &name,format_t *format)
+{
+    if(name=="pcap")   { *format = PCAP;   return true; }
+    if(name=="pcapng") { *format = PCAPNG; return true; }
+    return false;
+}
+
+size_t pcap_writer::interface_block(uint8_t *buf,int pcap_dlt)
+{
+    uint8_t *p = buf;
+    p = put32(p,PCAPNG_IDB);
+    p = put32(p,IDB_SIZE);
+    p = put16(p,pcap_dlt);
+    p = put16(p,0);                     // reserved
+    p = put32(p,0);                     // snapshot length: no limit
+    p = put16(p,9);                     // if_tsresol:
+    p = put16(p,1);
+    *p++ = 9;                           // 10^-9 seconds; a single byte, so not put32()
+    *p++ = 0;                           // 3 bytes of padding
+    *p++ = 0;
+    *p++ = 0;
+    p = put32(p,0);                     // opt_endofopt
+    p = put32(p,IDB_SIZE);
+    return p-buf;
+}
+
+size_t pcap_writer::file_header(uint8_t *buf,format_t format,int pcap_dlt)
+{
+    uint8_t *p = buf;
+    if(format==PCAP){
+        p = put32(p,PCAP_MAGIC);
+        p = put16(p,2);                 // major version number
+        p = put16(p,4);                 // minor version number
+        p = put32(p,0);                 // time zone offset; always 0
+        p = put32(p,0);                 // accuracy of time stamps in the file; always 0
+        p = put32(p,PCAP_MAX_PKT_LEN);  // snapshot length
+        p = put32(p,pcap_dlt);          // link layer encapsulation
+        return p-buf;
+    }
+    p = put32(p,PCAPNG_SHB);
+    p = put32(p,SHB_SIZE);
+    p = put32(p,PCAPNG_BOM);
+    p = put16(p,1);                     // major version number
+    p = put16(p,0);                     // minor version number
+    p = put32(p,0xffffffff);            // section length: not given
+    p = put32(p,0xffffffff);
+    p = put32(p,SHB_SIZE);
+    return (p-buf) + interface_block(p,pcap_dlt);
+}
+
+size_t pcap_writer::record_size(format_t format,uint32_t caplen)
+{
+    if(format==PCAP) return PCAP_RECORD_SIZE + caplen;
+    return EPB_OVERHEAD + ((caplen+3) & ~3);
+}
+
+void pcap_writer::put_record(uint8_t *buf,format_t format,uint32_t iface,
+                             const struct pcap_pkthdr *h,const u_char *data)
+{
+    uint8_t *p = buf;
+    if(format==PCAP){
+        p = put32(p,h->ts.tv_sec);      // time stamp, seconds avalue
+        p = put32(p,h->ts.tv_usec);     // time stamp, microseconds
+        p = put32(p,h->caplen);
+        p = put32(p,h->len);
+        memcpy(p,data,h->caplen);       // the packet
+        return;
+    }
+    uint32_t total = record_size(format,h->caplen);
+    uint64_t ns    = (uint64_t)h->ts.tv_sec*1000000000 + (uint64_t)h->ts.tv_usec*1000;
+    p = put32(p,PCAPNG_EPB);
+    p = put32(p,total);
+    p = put32(p,iface);
+    p = put32(p,(uint32_t)(ns>>32));
+    p = put32(p,(uint32_t)ns);
+    p = put32(p,h->caplen);
+    p = put32(p,h->len);
+    memcpy(p,data,h->caplen);
+    p += h->caplen;
+    memset(p,0,buf+total-4-p);          // padding
+    put32(buf+total-4,total);
+}
+
+pcap_writer *pcap_writer::open_new(const std::string &ofname,format_t format)
+{
+    int fd = ::open(ofname.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0666);
+    if(fd<0) throw write_error(ofname + ": " + strerror(errno));
+    return new pcap_writer(ofname,format,fd);
+}
+
+pcap_writer::pcap_writer(const std::string &fname_,format_t format_,int fd_):
+    packets(0),writes(0),fname(fname_),format(format_),fd(fd_),raw(0),batch(0),batch_len(0),ifaces()
+{
+#ifdef HAVE_POSIX_MEMALIGN
+    void *mem = 0;
+    if(posix_memalign(&mem,PAGE,BATCH)==0) raw = batch = (uint8_t *)mem;
+#else
+    raw = (uint8_t *)malloc(BATCH+PAGE);
+    if(raw) batch = (uint8_t *)(((uintptr_t)raw + PAGE-1) & ~(uintptr_t)(PAGE-1));
+#endif
+    if(batch==0){
+        ::close(fd);
+        throw std::bad_alloc();
+    }
+}
+
+pcap_writer::~pcap_writer()
+{
+    try {
+        if(ifaces.empty()){             // no packets: still a pcap file
+            batch_len = file_header(batch,format,DLT_EN10MB);
+        }
+        flush();
+    } catch(const write_error &e) {
+        std::cerr << e.what() << "\n";
+    }
+    ::close(fd);
+    free(raw);
+}
+
+void pcap_writer::write_out(const uint8_t *buf,size_t len)
+{
+    while(len>0){
+        ssize_t r = ::write(fd,buf,len);
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) throw write_error(fname + ": " + (r<0 ? strerror(errno) : "no progress"));
+        buf += r;
+        len -= r;
+    }
+    writes++;
+}
+
+void pcap_writer::flush()
+{
+    if(batch_len==0) return;
+    size_t len = batch_len;
+    batch_len = 0;
+    write_out(batch,len);
+}
+
+uint8_t *pcap_writer::room(size_t len)
+{
+    if(batch_len + len > BATCH) flush();
+    uint8_t *p = batch + batch_len;
+    batch_len += len;
+    return p;
+}
+
+void pcap_writer::writepkt(const struct pcap_pkthdr *h,const u_char *p,int pcap_dlt)
+{
+    /* Write a packet, and before it the file header or a new interface */
+    uint32_t iface = 0;
+    if(ifaces.empty()){
+        ifaces.push_back(pcap_dlt);
+        uint8_t hdr[MAX_HEADER_SIZE];
+        size_t n = file_header(hdr,format,pcap_dlt);
+        memcpy(room(n),hdr,n);
+    } else if(format==PCAPNG){
+        while(iface<ifaces.size() && ifaces[iface]!=pcap_dlt) iface++;
+        if(iface==ifaces.size()){
+            ifaces.push_back(pcap_dlt);
+            interface_block(room(IDB_SIZE),pcap_dlt);
+        }
+    }
+    size_t len = record_size(format,h->caplen);
+    if(len > BATCH){                    // bigger than any snaplen; not worth buffering
+        flush();
+        std::vector<uint8_t> rec(len);
+        put_record(&rec[0],format,iface,h,p);
+        write_out(&rec[0],len);
+    } else {
+        put_record(room(len),format,iface,h,p);
+    }
+    packets++;
+}
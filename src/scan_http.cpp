@@ -275,14 +275,10 @@ int scan_http_cbo::on_body(const char *at,size_t length)
     }
 
     /* If not decompressing, just write the data and return. */
+    flow_io &io = tcpdemux::getInstance()->io();
     if(unzip==false){
-        size_t offset = 0;
-        while (offset < length) {
-                int rv = write(fd, at + offset, length - offset);
-                if (rv < 0) return -1;  // write error; that's bad
-                offset += rv;
-        }
-        bytes_written += offset;
+        io.write(fd, bytes_written, at, length);
+        bytes_written += length;
         return 0;
     }
 
@@ -338,14 +334,8 @@ int scan_http_cbo::on_body(const char *at,size_t length)
         /* successful decompression, at least partly */
         /* write the result */
         int bytes_decompressed = sizeof(decompressed) - zs.avail_out;
-        ssize_t written = write(fd, decompressed, bytes_decompressed);
-
-        if (written < bytes_decompressed) {
-            DEBUG(3) ("writing decompressed data failed");
-            zfail= true;
-            return 0;
-        }
-        bytes_written += written;
+        io.write(fd, bytes_written, decompressed, bytes_decompressed);
+        bytes_written += bytes_decompressed;
                 
         /* reset the buffer for the next iteration */
         zs.next_out = (Bytef*)decompressed;
@@ -367,15 +357,16 @@ int scan_http_cbo::on_message_complete()
     header_field = "";
     header_value = "";
     last_on_header = NOTHING;
+    flow_io &io = tcpdemux::getInstance()->io();
     if(fd >= 0) {
-        if (::close(fd) != 0) {
-            perror("close() of http body");
-        }
+        io.close(fd, 0);
+        io.forget(output_path);
         fd = -1;
     }
 
     /* Erase zero-length files and update the DFXML */
     if(bytes_written>0){
+        if(http_alert_fd>=0 || http_cmd.size()>0) io.drain(); // the body has to be complete before anyone is told about it
         /* Update DFXML */
         if(xmlstream){
             xml_fo << "<filesize>" << bytes_written << "</filesize></fileobject></byte_run>\n";
@@ -0,0 +1,170 @@
+/**
+ * slab_pool.cpp
+ *
+ * Slabs of flow state objects; see slab_pool.h.
+ *
+ * This file is part of tcpflow.
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "slab_pool.h"
+
+#include <sstream>
+
+/* At the start of each slab; the objects come after it. */
+struct slab_pool_base::slab {
+    slab         *prev;                 // on partial or full
+    slab         *next;
+    void         *raw;                  // what was allocated, which the slab is in
+    void         *free_list;            // freed objects, linked through their first word
+    char         *fresh;                // objects from here on have never been handed out
+    unsigned int used;                  // objects handed out and not freed
+};
+
+static const size_t SLAB_HEADER = 64;   // keeps the objects off the header's cache line
+
+void slab_pool_base::link(slab *&head,slab *s)
+{
+    s->prev = 0;
+    s->next = head;
+    if(head) head->prev = s;
+    head = s;
+}
+
+void slab_pool_base::unlink(slab *&head,slab *s)
+{
+    if(s->prev) s->prev->next = s->next;
+    else head = s->next;
+    if(s->next) s->next->prev = s->prev;
+    s->prev = s->next = 0;
+}
+
+slab_pool_base::slab_pool_base(const char *name_,size_t size_):
+    allocs(0),hits(0),slabs(0),released(0),resident(0),peak(0),
+    name(name_),size((size_+ALIGN-1) & ~(size_t)(ALIGN-1)),per_slab(0),
+    partial(0),full(0),spare(0)
+{
+    if(size<sizeof(void *)) size = sizeof(void *);
+    per_slab = (SLAB-SLAB_HEADER)/size;
+}
+
+slab_pool_base::~slab_pool_base()
+{
+    while(partial){
+        slab *s = partial;
+        unlink(partial,s);
+        release(s);
+    }
+    while(full){
+        slab *s = full;
+        unlink(full,s);
+        release(s);
+    }
+    if(spare) release(spare);
+}
+
+slab_pool_base::slab *slab_pool_base::new_slab()
+{
+    void *raw = 0;
+    void *mem = 0;
+#ifdef HAVE_POSIX_MEMALIGN
+    if(posix_memalign(&raw,SLAB,SLAB)==0) mem = raw;
+#else
+    raw = malloc(2*SLAB);
+    if(raw) mem = (void *)(((uintptr_t)raw + SLAB-1) & ~(uintptr_t)(SLAB-1));
+#endif
+    if(mem==0) throw std::bad_alloc();
+    slab *s = (slab *)mem;
+    s->prev = s->next = 0;
+    s->raw       = raw;
+    s->free_list = 0;
+    s->fresh     = (char *)mem + SLAB_HEADER;
+    s->used      = 0;
+    slabs++;
+    resident += SLAB;
+    if(resident>peak) peak = resident;
+    return s;
+}
+
+void slab_pool_base::release(slab *s)
+{
+    free(s->raw);
+    released++;
+    resident -= SLAB;
+}
+
+void *slab_pool_base::get()
+{
+    slab *s = partial;
+    if(s==0){
+        if(spare){
+            s = spare;
+            spare = 0;
+            hits++;
+        } else {
+            s = new_slab();
+        }
+        link(partial,s);
+    } else {
+        hits++;
+    }
+    void *obj = s->free_list;
+    if(obj){
+        s->free_list = *(void **)obj;
+    } else {
+        obj = s->fresh;
+        s->fresh += size;
+    }
+    s->used++;
+    allocs++;
+    if(s->used==per_slab){
+        unlink(partial,s);
+        link(full,s);
+    }
+    return obj;
+}
+
+void slab_pool_base::put(void *obj)
+{
+    slab *s = (slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB-1));
+    if(s->used==per_slab){
+        unlink(full,s);
+        link(partial,s);
+    }
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+    if(--s->used==0){
+        /* start the slab over, so that it is handed out from the beginning */
+        unlink(partial,s);
+        s->free_list = 0;
+        s->fresh     = (char *)s + SLAB_HEADER;
+        if(spare) release(s);
+        else spare = s;
+    }
+}
+
+void slab_pool_base::add(const slab_pool_base &child)
+{
+    allocs   += child.allocs;
+    hits     += child.hits;
+    slabs    += child.slabs;
+    released += child.released;
+    resident += child.resident;
+    peak     += child.peak;             // the children's peaks need not coincide, so this is an upper bound
+}
+
+void slab_pool_base::dump_xml(dfxml_writer &xreport) const
+{
+    std::stringstream attrs;
+    attrs << "type='" << name << "' object_bytes='" << size << "' slab_bytes='" << (int)SLAB << "'";
+    xreport.push("slab_pool",attrs.str());
+    xreport.xmlout("allocs",allocs);
+    xreport.xmlout("hits",hits);
+    xreport.xmlout("slabs",slabs);
+    xreport.xmlout("released",released);
+    xreport.xmlout("resident_bytes",resident);
+    xreport.xmlout("peak_bytes",peak);
+    xreport.pop();                      // slab_pool
+}
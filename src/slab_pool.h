@@ -0,0 +1,94 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+/**
+ * slab_pool.h
+ *
+ * Memory for the objects that tcpdemux makes and deletes once per flow:
+ * tcpip, tcpconn, saved_flow and sparse_saved_flow.
+ *
+ * The objects of one type are cut from 64KiB slabs. A freed object goes
+ * on its slab's free list and is handed out again before anything else
+ * on the slab, so connections that come and go at a steady rate do not
+ * call malloc at all. Slabs are aligned to their size, so the slab an
+ * object is on is found by masking its address. When every object on a
+ * slab has been freed the slab is given back, except for one that is
+ * kept in case the number of flows goes up again.
+ *
+ * Each tcpdemux (and so each -j shard) has its own pools; they are not
+ * locked. Objects still in a pool when it is destroyed are not destructed.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+class dfxml_writer;
+
+class slab_pool_base {
+public:
+    enum { SLAB = 64*1024 };            // bytes; a power of two
+    enum { ALIGN = 16 };                // objects are aligned to this
+
+    void add(const slab_pool_base &child); // a finished shard's counts
+    void dump_xml(dfxml_writer &xreport) const;
+
+    uint64_t allocs;                    // objects handed out
+    uint64_t hits;                      // of them, from a slab that was already held
+    uint64_t slabs;                     // slabs got from the system
+    uint64_t released;                  // slabs given back to it
+    uint64_t resident;                  // bytes of slabs held now
+    uint64_t peak;                      // the most that were held at once
+
+protected:
+    slab_pool_base(const char *name,size_t size);
+    ~slab_pool_base();
+    void *get();
+    void put(void *obj);
+
+private:
+    struct slab;
+    const char   *name;
+    size_t       size;                  // of an object, rounded up to ALIGN
+    unsigned int per_slab;              // objects on a slab
+    slab         *partial;              // slabs with objects, and room for another
+    slab         *full;                 // slabs without room
+    slab         *spare;                // a slab with no objects, or 0
+
+    slab *new_slab();
+    void release(slab *s);
+    static void link(slab *&head,slab *s);
+    static void unlink(slab *&head,slab *s);
+
+    slab_pool_base(const slab_pool_base &);
+    slab_pool_base &operator=(const slab_pool_base &);
+};
+
+template <class T> class slab_pool : public slab_pool_base {
+public:
+    explicit slab_pool(const char *name_):slab_pool_base(name_,sizeof(T)){
+        static_assert(alignof(T)<=ALIGN,"slab_pool objects are aligned to ALIGN");
+        static_assert(sizeof(T)<=SLAB/4,"slab_pool objects must be much smaller than a slab");
+    }
+
+    /* new T(args...) */
+    template <typename... Args> T *make(Args&&... args) {
+        void *p = get();
+        try {
+            return new(p) T(std::forward<Args>(args)...);
+        } catch(...) {
+            put(p);
+            throw;
+        }
+    }
+
+    /* delete t */
+    void destroy(T *t) {
+        if(t==0) return;
+        t->~T();
+        put(t);
+    }
+};
+
+#endif // SLAB_POOL_H
@@ -14,6 +14,7 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "pcap_split.h"
 
 #include <iostream>
 #include <sstream>
@@ -23,32 +24,64 @@
 #include <sys/wait.h>
 #endif
 
-/* static */ uint32_t tcpdemux::max_saved_flows = 100;
 /* static */ uint32_t tcpdemux::tcp_timeout = 0;
+/* static */ uint32_t tcpdemux::tcp_timeout_halfopen = 0;
+/* static */ uint32_t tcpdemux::tcp_timeout_established = 0;
+/* static */ uint32_t tcpdemux::tcp_timeout_closing = 0;
 /* static */ int tcpdemux::tcp_subproc_max = 10;
 /* static */ int tcpdemux::tcp_subproc = 0;
 /* static */ int tcpdemux::tcp_alert_fd = -1;
 /* static */ std::string tcpdemux::tcp_cmd = "";
+/* static */ cppmutex tcpdemux::shared_M;
 
 tcpdemux::tcpdemux():
 #ifdef HAVE_SQLITE3
     db(),insert_flow(),
 #endif
-    flow_sorter(0),tcp_processor(0),
+    tcp_processor(0),
     outdir("."),flow_counter(0),packet_counter(0),
-    xreport(0),pwriter(0),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
+    xreport(0),pwriter(0),console(),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
     unique_id(0),
-    flow_map(),open_flows(),saved_flow_map(),flow_fd_cache_map(0),
-    saved_flows(),start_new_connections(false),opt(),fs()
+    flow_map(),open_flows(),buffered_flows(),write_buffer_used(0),queued_flows(),reorder_queue_used(0),
+    flow_writes(0),flow_segments(0),queued_segments(0),queue_trims(0),file_shifts(0),
+    straggler_filtered(0),saved_flow_hits(0),saved_flow_misses(0),straggler_reads(0),
+    saved_flow_evictions(0),fio(0),dirs(),
+    tcpip_pool("tcpip"),conn_pool("tcpconn"),saved_flow_pool("saved_flow"),sparse_flow_pool("sparse_saved_flow"),
+    flow_timeouts(),expired_flows(),
+    saved_flow_map(),saved_flow_filter(),flow_fd_cache_map(0),
+    open_pcaps(),buffered_pcaps(),pcap_reopens(0),
+    saved_lru(),saved_flow_bytes(0),start_new_connections(false),opt(),fs(),
+    parent(0),shards(),shard_clock(0),split(0)
 {
     tcp_processor = &tcpdemux::process_tcp;
 }
 
+/* A shard shares its parent's options and outputs but has its own flow state */
+tcpdemux::tcpdemux(tcpdemux *parent_,unsigned int max_fds_):
+#ifdef HAVE_SQLITE3
+    db(),insert_flow(),
+#endif
+    tcp_processor(parent_->tcp_processor),
+    outdir(parent_->outdir),flow_counter(0),packet_counter(0),
+    xreport(parent_->xreport),pwriter(parent_->pwriter),console(),max_open_flows(),max_fds(max_fds_),
+    unique_id(0),
+    flow_map(),open_flows(),buffered_flows(),write_buffer_used(0),queued_flows(),reorder_queue_used(0),
+    flow_writes(0),flow_segments(0),queued_segments(0),queue_trims(0),file_shifts(0),
+    straggler_filtered(0),saved_flow_hits(0),saved_flow_misses(0),straggler_reads(0),
+    saved_flow_evictions(0),fio(0),dirs(),
+    tcpip_pool("tcpip"),conn_pool("tcpconn"),saved_flow_pool("saved_flow"),sparse_flow_pool("sparse_saved_flow"),
+    flow_timeouts(),expired_flows(),
+    saved_flow_map(),saved_flow_filter(),flow_fd_cache_map(0),
+    open_pcaps(),buffered_pcaps(),pcap_reopens(0),
+    saved_lru(),saved_flow_bytes(0),start_new_connections(parent_->start_new_connections),opt(parent_->opt),fs(parent_->fs),
+    parent(parent_),shards(),shard_clock(0),split(0)
+{
+}
+
 void tcpdemux::alter_processing_core()
 {
     DEBUG(1) ("ensuring pcap core");
     tcp_processor = &tcpdemux::dissect_tcp;
-    flow_sorter = new pcap_writer();
 }
 
 void tcpdemux::openDB()
@@ -107,23 +140,75 @@ void  tcpdemux::write_flow_record(const std::string &starttime,const std::string
     return theInstance;
 }
 
+/* Nothing is coming in, so what is printed should not wait for the next packet */
+/* static */ void tcpdemux::idle(u_char *user)
+{
+    ((tcpdemux *)user)->console.flush();
+}
+
 /**
  * find the flow that has been written to in the furthest past and close it.
+ *
+ * With -S fd-clock=1 a packet does not move its flow to the end of open_flows,
+ * it only marks the flow used; here a used flow is moved to the end, unmarked,
+ * and passed over (the clock, or second chance, algorithm).
  */
 void tcpdemux::close_oldest_fd()
 {
-    tcpip *oldest_tcp = *open_flows.begin();
+    if(open_flows.empty()){             // -K keeps its pcap files open instead
+        if(!open_pcaps.empty()) close_pcap(open_pcaps.front());
+        return;
+    }
+    tcpip *oldest_tcp = open_flows.front();
+    while(oldest_tcp && oldest_tcp->used){
+        oldest_tcp->used = false;
+        open_flows.move_to_end(oldest_tcp);
+        oldest_tcp = open_flows.front();
+    }
     if(oldest_tcp) oldest_tcp->close_file();
 }
 
+/* Write out the oldest write buffers until they are all younger than
+ * write_buffer_age and there is room for need more bytes of them.
+ */
+void tcpdemux::trim_write_buffers(const struct timeval &now,size_t need)
+{
+    while(!buffered_flows.empty()){
+        tcpip *oldest = buffered_flows.front();
+        if(write_buffer_used + need <= opt.write_buffer_mem &&
+           now.tv_sec - oldest->wbuf_time < (time_t)opt.write_buffer_age) break;
+        oldest->flush_buffer();
+    }
+}
+
+/* Write out the oldest reorder queues until they are all younger than
+ * reorder_queue_age and hold no more than reorder_queue_mem between them.
+ */
+void tcpdemux::trim_reorder_queues(const struct timeval &now)
+{
+    while(!queued_flows.empty()){
+        tcpip *oldest = queued_flows.front();
+        bool over = reorder_queue_used > opt.reorder_queue_mem;
+        if(!over && now.tv_sec - oldest->queue->since < (time_t)opt.reorder_queue_age) break;
+        if(over) queue_trims++;
+        oldest->release_queue(true,now);
+    }
+}
+
 /* Open a file, closing one of the existing flows f necessary.
  */
 int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
+{
+    return retrying_open(AT_FDCWD,filename.c_str(),filename,oflag,mask);
+}
+
+int tcpdemux::retrying_open(int dirfd,const char *name,const std::string &filename,int oflag,int mask)
 {
     while(true){
-    //Packet index file reduces max_fds by 1/2 as the index files also take a fd
-	if(open_flows.size() >= (opt.output_packet_index ?  max_fds/2 : max_fds)) close_oldest_fd();
-	int fd = ::open(filename.c_str(),oflag,mask);
+    //The directories held open and -K's pcap files take one each;
+    //-I index files are opened only while a batch is written
+	if(opt.segment_size==0 && open_flows.size()+open_pcaps.size()+dirs.size() >= max_fds) close_oldest_fd();
+	int fd = io().openat(dirfd,name,filename,oflag,mask);
 	DEBUG(2)("retrying_open ::open(fn=%s,oflag=x%x,mask:x%x)=%d",filename.c_str(),oflag,mask,fd);
 	if(fd>=0){
             /* Open was successful */
@@ -134,24 +219,54 @@ int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 	    DEBUG(2)("retrying_open ::open failed with errno=%d (%s)",errno,strerror(errno));
 	    return -1;		// wonder what it was
 	}
+	if (io().pending()){
+	    io().drain();		// closes that are still queued hold fds
+	    continue;
+	}
 	DEBUG(5) ("too many open files -- contracting FD ring (size=%d)", (int)open_flows.size());
 	close_oldest_fd();
     }
 }
 
-/* Find previously a previously created flow state in the database.
+/* Open filename in its directory, making the directory if need be. The
+ * directory is kept open if there are descriptors to spare (at most a
+ * sixteenth of max_fds, so that with -f or a small ulimit they stay with
+ * the flows), and the next file in it is opened relative to it.
  */
-tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
+int tcpdemux::open_in_dir(const std::string &filename,int oflag,int mask)
 {
-    flow_map_t::const_iterator it = flow_map.find(flow);
-    if (it==flow_map.end()){
-	return NULL; // flow not found
+    size_t slash = filename.rfind('/');
+    if(slash==std::string::npos || opt.segment_size) return retrying_open(filename,oflag,mask);
+    dirs.set_capacity(std::min((size_t)dir_cache::SIZE,(size_t)max_fds/16));
+    int dirfd = dirs.get(filename,slash);
+    if(dirfd<0) return retrying_open(filename,oflag,mask);
+    return retrying_open(dirfd,filename.c_str()+slash+1,filename,oflag,mask);
+}
+
+flow_io &tcpdemux::io()
+{
+    if(fio==0){
+        fio = flow_io::make(opt.io_backend,opt.io_depth);
+        if(opt.segment_size) fio = new flow_io_segments(fio,outdir,opt.segment_size);
     }
-    return it->second;
+    return *fio;
+}
+
+/* Find a previously created connection in the database.
+ * key must be the canonical connection key.
+ */
+tcpconn *tcpdemux::find_conn(const flow_key &key)
+{
+    tcpconn **conn = flow_map.find(key);
+    if (conn==NULL){
+	return NULL; // connection not found
+    }
+    return *conn;
 }
 
 /* Create a new flow state structure for a given flow.
- * Puts the flow in the map.
+ * Puts the flow in its connection, as the half given by reversed.
+ * The connection must already be in the map.
  * Returns a pointer to the new state.
  *
  * This is called by tcpdemux::process_tcp(). (Only place it is called)
@@ -167,17 +282,17 @@ tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
  * This is resulting in an unnecessary copy.
  */
 
-tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be13::packet_info &pi)
+tcpip *tcpdemux::create_tcpip(tcpconn *conn, const flow_addr &flowa, bool reversed, be13::tcp_seq isn,const be13::packet_info &pi)
 {
     /* create space for the new state */
-    flow flow(flowa,flow_counter++,pi);
+    flow flow(flowa,next_flow_id(),pi);
+    flow.session_id = conn->session_id;
 
-    tcpip *new_tcpip = new tcpip(*this,flow,isn);
+    tcpip *new_tcpip = tcpip_pool.make(*this,flow,isn);
     new_tcpip->nsn   = isn+1;		// expected sequence number of the first byte
     DEBUG(5) ("new flow %s. path: %s next seq num (nsn):%d",
               flowa.str().c_str(),new_tcpip->flow_pathname.c_str(),new_tcpip->nsn);
-    flow_map[flow] = new_tcpip;
-    open_flows.reset(new_tcpip);
+    conn->half[reversed ? 1 : 0] = new_tcpip;
     return new_tcpip;
 }
 
@@ -192,9 +307,10 @@ tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be
  * If a FIN is received and bytes are outstanding, they are post-processed when the last byte is received.
  * When the program shut down, all open flows are post-processed.
  *
- * Amended to trigger the packet/data location index sort as part of the post-processing.  This sorts
- * the (potentially out of order) index to make it simple for external applications.  No processing is
- * done if the (-I) index generation feature is turned off.  --GDD
+ * Closing the file writes out the rest of the flow's packet index (-I), if there is one.
+ *
+ * The flow's own file is flushed and closed without locking; shared_M is
+ * held only for what the shards share, so -j shards close flows in parallel.
  */
 
 void tcpdemux::post_process(tcpip *tcp)
@@ -211,8 +327,11 @@ void tcpdemux::post_process(tcpip *tcp)
         /* Open the fd if it is not already open */
         tcp->open_file();
         if(tcp->fd>=0){
-            sbuf_t *sbuf = sbuf_t::map_file(tcp->flow_pathname,tcp->fd);
+            tcp->flush();
+            io().wait(tcp->fd);         // the scanners read what was written
+            sbuf_t *sbuf = io().map_file(tcp->flow_pathname,tcp->fd);
             if(sbuf){
+                cppmutex::lock lock(shared_M); // the scanners are shared
                 be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,*(fs),&xmladd));
                 delete sbuf;
                 sbuf = 0;
@@ -220,16 +339,25 @@ void tcpdemux::post_process(tcpip *tcp)
         }
     }
     tcp->close_file();
-    if(xreport) tcp->dump_xml(xreport,xmladd.str());
+    if(fio && tcp->rare && tcp->rare->flow_index_pathname.size()) fio->forget(tcp->rare->flow_index_pathname);
+    if(opt.console_output && opt.output_json) tcp->print_close();
+    if(xreport){
+        cppmutex::lock lock(shared_M);  // so is the report
+        tcp->dump_xml(xreport,xmladd.str());
+    }
     /**
      * Before we delete the tcp structure, save information about the saved flow
      */
     save_flow(tcp);
 
+    /* the file has to be complete before anyone is told about it */
+    if((opt.store_output && tcp_alert_fd>=0) || tcp_cmd.size()>0) io().drain();
+
     if(opt.store_output && tcp_alert_fd>=0){
 	std::stringstream ss;
 	ss << "close\t" << tcp->flow_pathname.c_str() << "\n";
 	const std::string &sso = ss.str();
+	cppmutex::lock lock(shared_M);  // and the alert fd
 	if(write(tcp_alert_fd,sso.c_str(),sso.size()) != (int)sso.size()){
 	    perror("write");
 	}
@@ -239,50 +367,455 @@ void tcpdemux::post_process(tcpip *tcp)
 	/* If we are at maximum number of subprocesses, wait for one to exit */
 	std::string cmd = tcp_cmd + " " + tcp->flow_pathname;
 #ifdef HAVE_FORK
-	int status=0;
-	pid_t pid = 0;
-	while(tcp_subproc >= tcp_subproc_max){
-	    pid = wait(&status);
-	    tcp_subproc--;
+	/* The count is shared too; it is locked, but not while waiting */
+	for(;;){
+	    {
+		cppmutex::lock lock(shared_M);
+		if(tcp_subproc < tcp_subproc_max){
+		    tcp_subproc++;
+		    break;
+		}
+	    }
+	    int status=0;
+	    pid_t pid = wait(&status);
+	    int wait_errno = errno;
+	    cppmutex::lock lock(shared_M);
+	    if(pid>0) tcp_subproc--;
+	    else if(wait_errno==ECHILD) tcp_subproc = 0; // another shard reaped them
 	}
 	/* Fork off a child */
-	pid = fork();
+	pid_t pid = fork();
 	if(pid<0) die("Cannot fork child");
 	if(pid==0){
 	    /* We are the child */
 	    exit(system(cmd.c_str()));
 	}
-	tcp_subproc++;
 #else
 	system(cmd.c_str());
 #endif
     }
 
-    delete tcp;
+    tcpip_pool.destroy(tcp);
 }
 
 void tcpdemux::remove_flow(const flow_addr &flow)
 {
-    flow_map_t::iterator it = flow_map.find(flow);
-    if(it!=flow_map.end()){
-        post_process(it->second);
-	flow_map.erase(it);
+    remove_flow(flow.conn_key());
+}
+
+/* Remove one half of a connection; the connection goes when both halves have gone */
+void tcpdemux::remove_flow(const flow_key &key)
+{
+    tcpconn *conn = find_conn(key);
+    if(conn==0) return;
+    tcpip *&tcp = conn->half[key.reversed ? 1 : 0];
+    if(tcp){
+        post_process(tcp);
+        tcp = 0;
+    }
+    if(conn->empty()){
+        flow_timeouts.cancel(conn);
+        flow_map.erase(key);
+        conn_pool.destroy(conn);
+    }
+}
+
+void tcpdemux::remove_conn(tcpconn *conn)
+{
+    const flow_key key = (conn->half[0] ? conn->half[0] : conn->half[1])->myflow.conn_key();
+    for(int i=0;i<2;i++){
+        if(conn->half[i]){
+            post_process(conn->half[i]);
+            conn->half[i] = 0;
+        }
     }
+    flow_timeouts.cancel(conn);
+    flow_map.erase(key);
+    conn_pool.destroy(conn);
 }
 
 void tcpdemux::remove_all_flows()
 {
+    if(shards.size()) stop_shards();      // each shard removes its own flows
 
     DEBUG(10) ("Cleaning up flows");
-    for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
-        post_process(it->second);
+    flow_timeouts.clear();
+    std::vector<tcpconn *> conns;
+    flow_map.values(conns);
+    for(std::vector<tcpconn *>::iterator it=conns.begin();it!=conns.end();it++){
+        for(int i=0;i<2;i++){
+            if((*it)->half[i]) post_process((*it)->half[i]);
+        }
+        conn_pool.destroy(*it);
     }
     flow_map.clear();
 
     for(sparse_saved_flow_map_t::iterator it=flow_fd_cache_map.begin();it!=flow_fd_cache_map.end();it++){
-        delete it->second;
+        close_pcap(it->second);
+        sparse_flow_pool.destroy(it->second);
     }
     flow_fd_cache_map.clear();
+    if(fio) fio->drain();
+}
+
+/****************************************************************
+ *** idle timeouts
+ ****************************************************************
+ *
+ * Connections are kept in a timer wheel ordered by when they will expire;
+ * traffic in either direction keeps both halves alive.
+ * The wheel is updated lazily: each packet only moves the flow's tlast,
+ * and the connection is rescheduled when its slot comes due and it turns
+ * out to have seen traffic since. A connection is only moved eagerly when
+ * its timeout gets shorter (for example, when a FIN arrives).
+ */
+
+/* static */ bool tcpdemux::timeouts_enabled()
+{
+    return tcp_timeout || tcp_timeout_halfopen || tcp_timeout_established || tcp_timeout_closing;
+}
+
+uint32_t tcpdemux::idle_timeout(const tcpconn *conn) const
+{
+    bool closing = false;
+    bool data    = false;
+    for(int i=0;i<2;i++){
+        const tcpip *tcp = conn->half[i];
+        if(tcp==0) continue;
+        if(tcp->fin_count>0) closing = true;
+        if(tcp->last_byte>0) data    = true;
+    }
+    uint32_t timeout = tcp_timeout_established;
+    if(closing)    timeout = tcp_timeout_closing;
+    else if(!data) timeout = tcp_timeout_halfopen; // no data yet
+    return timeout ? timeout : tcp_timeout;
+}
+
+void tcpdemux::update_timeout(tcpconn *conn)
+{
+    uint32_t timeout = idle_timeout(conn);
+    if(timeout==0){
+        flow_timeouts.cancel(conn);
+        return;
+    }
+    /* a connection expires when it is more than timeout seconds old */
+    uint64_t deadline = (uint64_t)conn->last_seen() + timeout + 1;
+    if(!flow_timeouts.is_scheduled(conn) || deadline < flow_timeouts.when(conn)){
+        flow_timeouts.schedule(conn,deadline);
+    }
+}
+
+void tcpdemux::expire_flows(const struct timeval &now)
+{
+    expired_flows.clear();
+    flow_timeouts.advance(now.tv_sec,expired_flows);
+    for(std::vector<tcpconn *>::iterator it = expired_flows.begin(); it!=expired_flows.end(); it++){
+        tcpconn *conn = *it;
+        uint32_t timeout = idle_timeout(conn);
+        if(timeout==0) continue;
+        uint64_t deadline = (uint64_t)conn->last_seen() + timeout + 1;
+        if(deadline > flow_timeouts.now()){
+            flow_timeouts.schedule(conn,deadline); // saw traffic since it was scheduled
+            continue;
+        }
+        DEBUG(50)("session %" PRIu64 ": idle for more than %d seconds; removing connection",
+                  conn->session_id,(int)timeout);
+        remove_conn(conn);
+    }
+}
+
+/****************************************************************
+ *** sharding (-j)
+ ****************************************************************
+ *
+ * The capture thread hashes the canonical connection key of each packet
+ * to pick a shard, and copies the packet into that shard's ring. Each
+ * shard is a complete tcpdemux with its own flow table, timer wheel, saved
+ * flows and share of the file descriptors, and runs process_pkt() in its
+ * own thread. Both directions of a connection, and every later connection
+ * on the same addresses and ports, go to the same shard, so each flow is
+ * reassembled exactly as a single demux would reassemble it.
+ *
+ * Packets that can't be hashed (not TCP, fragments, no room for the ports)
+ * all go to shard 0, which deals with them as process_pkt() always has.
+ * When timeouts are enabled, or segments may be held back for reordering,
+ * every shard is sent a TICK whenever packet time reaches a new second, so
+ * connections on a quiet shard still expire and its old queues are written.
+ */
+
+class tcpdemux_shard {
+public:
+    enum { RING_SIZE = 8*1024*1024 };
+    enum record_type { PKT, TICK, FLUSH, STOP };
+    struct record {
+        uint32_t type;
+        int32_t  pcap_dlt;
+        struct pcap_pkthdr hdr;
+        struct timeval ts;
+        uint32_t ip_offset;             // where the ip data starts, from the start of the packet data
+        uint32_t ip_datalen;
+        /* followed by hdr.caplen bytes of packet data, then the ip data if it was not inside the packet */
+    };
+
+    tcpdemux_shard(tcpdemux *parent,unsigned int max_fds):demux(parent,max_fds),ring(RING_SIZE),thread(){}
+    tcpdemux    demux;
+    packet_ring ring;
+    pthread_t   thread;
+
+    static void *run(void *arg);
+    void push(const record &rec,const u_char *d1=0,size_t l1=0,const u_char *d2=0,size_t l2=0);
+private:
+    tcpdemux_shard(const tcpdemux_shard &);
+    tcpdemux_shard &operator=(const tcpdemux_shard &);
+};
+
+/* Copy a record into the ring, waiting for the shard to make room if it is behind */
+void tcpdemux_shard::push(const record &rec,const u_char *d1,size_t l1,const u_char *d2,size_t l2)
+{
+    size_t len = sizeof(rec) + l1 + l2;
+    if(len > ring.max_record()) die("packet of %zu bytes is too large for a shard",l1+l2);
+    unsigned int spins = 0;
+    uint8_t *p = 0;
+    while((p = (uint8_t *)ring.reserve(len))==0) packet_ring::backoff(spins);
+    memcpy(p,&rec,sizeof(rec));
+    if(l1) memcpy(p+sizeof(rec),d1,l1);
+    if(l2) memcpy(p+sizeof(rec)+l1,d2,l2);
+    ring.commit();
+}
+
+/* the shard's thread */
+void *tcpdemux_shard::run(void *arg)
+{
+    tcpdemux_shard *self = (tcpdemux_shard *)arg;
+    unsigned int spins = 0;
+    while(true){
+        size_t len = 0;
+        const record *rec = (const record *)self->ring.peek(&len);
+        if(rec==0){
+            packet_ring::backoff(spins);
+            continue;
+        }
+        spins = 0;
+        switch(rec->type){
+        case PKT:
+        {
+            const u_char *data = (const u_char *)(rec+1);
+            be13::packet_info pi(rec->pcap_dlt,&rec->hdr,data,rec->ts,data+rec->ip_offset,rec->ip_datalen);
+            self->demux.process_pkt(pi);
+            break;
+        }
+        case TICK:
+            if(tcpdemux::timeouts_enabled()) self->demux.expire_flows(rec->ts);
+            self->demux.trim_reorder_queues(rec->ts);
+            break;
+        case FLUSH:
+            self->demux.remove_all_flows();
+            break;
+        case STOP:
+            self->ring.release();
+            return 0;
+        }
+        self->ring.release();
+    }
+}
+
+void tcpdemux::start_shards(unsigned int n)
+{
+#ifdef HAVE_PTHREAD
+    /* each shard gets an equal share of the file descriptors and write buffers */
+    unsigned int shard_fds = max_fds / n;
+    if(shard_fds < 2) shard_fds = 2;
+    DEBUG(2)("starting %u shards with %u fds each",n,shard_fds);
+
+    /* signals are for the capture thread, so that it can stop pcap_loop() */
+    sigset_t all,old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    for(unsigned int i=0;i<n;i++){
+        tcpdemux_shard *s = new tcpdemux_shard(this,shard_fds);
+        s->demux.opt.write_buffer_mem = opt.write_buffer_mem / n;
+        s->demux.opt.reorder_queue_mem = opt.reorder_queue_mem / n;
+        s->demux.opt.saved_flow_mem   = opt.saved_flow_mem / n;
+        int r = pthread_create(&s->thread,NULL,tcpdemux_shard::run,s);
+        if(r) die("cannot start shard thread: %s",strerror(r));
+        shards.push_back(s);
+    }
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+#else
+    die("-j requires pthreads");
+#endif
+}
+
+void tcpdemux::sync_shards()
+{
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+        unsigned int spins = 0;
+        while(!(*it)->ring.empty()) packet_ring::backoff(spins);
+    }
+}
+
+void tcpdemux::stop_shards()
+{
+#ifdef HAVE_PTHREAD
+    tcpdemux_shard::record rec;
+    memset(&rec,0,sizeof(rec));
+    rec.type = tcpdemux_shard::FLUSH;
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++) (*it)->push(rec);
+    rec.type = tcpdemux_shard::STOP;
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++) (*it)->push(rec);
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+        tcpdemux_shard *s = *it;
+        pthread_join(s->thread,NULL);
+        finish_child(s->demux);
+        delete s;
+    }
+    shards.clear();
+#endif
+}
+
+/* The hash of the canonical key of the connection a packet belongs to.
+ * false if it is not a TCP packet that process_tcp() would see.
+ */
+/* static */ bool tcpdemux::conn_hash(const be13::packet_info &pi,uint64_t *hash)
+{
+    /* find the connection, with the same checks as process_ip4() and process_ip6() */
+    const uint8_t *src = 0;
+    const uint8_t *dst = 0;
+    const u_char  *tcp_data = 0;
+    sa_family_t    family = AF_INET;
+    switch(pi.ip_version()){
+    case 4:
+    {
+        const struct be13::ip4 *ip_header = (struct be13::ip4 *) pi.ip_data;
+        size_t ip_header_len = ip_header->ip_hl * 4;
+        if(ip_header->ip_p==IPPROTO_TCP && (ntohs(ip_header->ip_off) & 0x1fff)==0
+           && ip_header_len <= ntohs(ip_header->ip_len)){
+            src      = (const uint8_t *)&ip_header->ip_src.addr;
+            dst      = (const uint8_t *)&ip_header->ip_dst.addr;
+            tcp_data = pi.ip_data + ip_header_len;
+        }
+        break;
+    }
+    case 6:
+    {
+        const struct be13::ip6_hdr *ip_header = (struct be13::ip6_hdr *) pi.ip_data;
+        if(pi.ip_datalen >= sizeof(struct be13::ip6_hdr)
+           && ip_header->ip6_ctlun.ip6_un1.ip6_un1_nxt==IPPROTO_TCP){
+            src      = ip_header->ip6_src.addr.addr8;
+            dst      = ip_header->ip6_dst.addr.addr8;
+            tcp_data = pi.ip_data + sizeof(struct be13::ip6_hdr);
+            family   = AF_INET6;
+        }
+        break;
+    }
+    }
+    if(tcp_data==0 || tcp_data + 4 > pi.ip_data + pi.ip_datalen) return false;
+    const struct be13::tcphdr *tcp_header = (struct be13::tcphdr *) tcp_data;
+    flow_key key(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family,true);
+    *hash = key.hash;
+    return true;
+}
+
+/* Called when a demux made with tcpdemux(this,...) has removed all of its flows */
+void tcpdemux::finish_child(tcpdemux &child)
+{
+    packet_counter += child.packet_counter;
+    flow_writes    += child.flow_writes;
+    flow_segments  += child.flow_segments;
+    queued_segments += child.queued_segments;
+    queue_trims    += child.queue_trims;
+    file_shifts    += child.file_shifts;
+    straggler_filtered += child.straggler_filtered;
+    straggler_reads    += child.straggler_reads;
+    saved_flow_hits    += child.saved_flow_hits;
+    saved_flow_misses  += child.saved_flow_misses;
+    saved_flow_evictions += child.saved_flow_evictions;
+    pcap_reopens       += child.pcap_reopens;
+    if(child.fio) io().add(*child.fio);
+    tcpip_pool.add(child.tcpip_pool);
+    conn_pool.add(child.conn_pool);
+    saved_flow_pool.add(child.saved_flow_pool);
+    sparse_flow_pool.add(child.sparse_flow_pool);
+    max_open_flows += child.max_open_flows; // the children's peaks need not coincide, so this is an upper bound
+    child.xreport = 0;                      // these belong to us
+    child.pwriter = 0;
+}
+
+int tcpdemux::dispatch_pkt(const be13::packet_info &pi)
+{
+    /* pick up changes to start_new_connections between -r and -R files */
+    if(start_new_connections != shards[0]->demux.start_new_connections){
+        sync_shards();
+        for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+            (*it)->demux.start_new_connections = start_new_connections;
+        }
+    }
+
+    size_t n = 0;
+    uint64_t hash = 0;
+    if(conn_hash(pi,&hash)){
+        /* use the top of the hash, so the choice of shard doesn't thin out the flow table's buckets */
+        n = ((hash >> 32) * shards.size()) >> 32;
+    }
+
+    tcpdemux_shard::record rec;
+    memset(&rec,0,sizeof(rec));
+    rec.type       = tcpdemux_shard::PKT;
+    rec.pcap_dlt   = pi.pcap_dlt;
+    rec.hdr        = *pi.pcap_hdr;
+    rec.ts         = pi.ts;
+    rec.ip_datalen = pi.ip_datalen;
+    size_t caplen  = pi.pcap_hdr->caplen;
+    if(pi.ip_data >= pi.pcap_data && pi.ip_data + pi.ip_datalen <= pi.pcap_data + caplen){
+        rec.ip_offset = pi.ip_data - pi.pcap_data;
+        shards[n]->push(rec,pi.pcap_data,caplen);
+    } else {
+        rec.ip_offset = caplen;
+        shards[n]->push(rec,pi.pcap_data,caplen,pi.ip_data,pi.ip_datalen);
+    }
+
+    if((timeouts_enabled() || opt.reorder_queue) && pi.ts.tv_sec != shard_clock){
+        shard_clock = pi.ts.tv_sec;
+        memset(&rec,0,sizeof(rec));
+        rec.type = tcpdemux_shard::TICK;
+        rec.ts   = pi.ts;
+        for(size_t i=0;i<shards.size();i++){
+            if(i!=n) shards[i]->push(rec);
+        }
+    }
+    return 0;
+}
+
+uint64_t tcpdemux::next_flow_id()
+{
+    if(parent) return parent->next_flow_id();
+    return __sync_fetch_and_add(&flow_counter,1);
+}
+
+uint64_t tcpdemux::next_session_id()
+{
+    if(parent) return parent->next_session_id();
+    return __sync_fetch_and_add(&unique_id,1);
+}
+
+size_t tcpdemux::open_flow_count()
+{
+    sync_shards();
+    size_t count = open_flows.size();
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+        count += (*it)->demux.open_flows.size();
+    }
+    return count;
+}
+
+size_t tcpdemux::active_flow_count()
+{
+    sync_shards();
+    size_t count = flow_map.size();
+    for(std::vector<tcpdemux_shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+        count += (*it)->demux.flow_map.size();
+    }
+    return count;
 }
 
 /****************************************************************
@@ -355,38 +888,85 @@ unsigned int tcpdemux::get_max_fds(void)
 /*
  * open the packet save flow
  */
-void tcpdemux::save_unk_packets(const std::string &ofname,const std::string &ifname)
+void tcpdemux::save_unk_packets(const std::string &ofname)
 {
-    pwriter = pcap_writer::open_copy(ofname,ifname);
+    try {
+        pwriter = pcap_writer::open_new(ofname,opt.pcap_format);
+    } catch(const pcap_writer::write_error &e) {
+        die("%s",e.what());
+    }
 }
 
 /**
  * save information on this flow needed to handle strangling packets
+ *
+ * The saved flows are kept in a list, least recently used first, and the
+ * least recently used are forgotten when they take more than
+ * opt.saved_flow_mem; a flow is used when a straggler for it arrives.
  */
-int c = 0;
 void tcpdemux::save_flow(tcpip *tcp)
 {
-    /* First remove the oldest flow if we are in overload */
-    if(saved_flows.size()>0 && saved_flows.size()>max_saved_flows){
-        saved_flow *flow0 = saved_flows.at(0);
-        saved_flow_map.erase(flow0->addr);    // remove from the map
-        saved_flows.erase(saved_flows.begin()); // remove from the vector
-        delete flow0;                           // and delete the saved flow
+    if(opt.saved_flow_mem==0){
+        if(fio) fio->forget(tcp->flow_pathname);
+        return;
     }
 
+    /* a connection that was saved before under the same addresses is replaced */
+    saved_flow_map_t::iterator old = saved_flow_map.find(tcp->myflow);
+    if(old!=saved_flow_map.end()) forget_saved_flow(old->second);
+
     /* Now save the flow */
-    saved_flow *sf = new saved_flow(tcp);
+    saved_flow *sf = saved_flow_pool.make(tcp,saved_flow_hash(tcp->myflow.conn_key()));
     saved_flow_map[sf->addr] = sf;
-    saved_flows.push_back(sf);
+    saved_lru.push_back(sf);
+    saved_flow_bytes += sf->bytes();
+    saved_flow_filter.add(sf->hash);
+
+    /* then remove the oldest flows if we are in overload */
+    while(saved_flow_bytes > opt.saved_flow_mem && saved_lru.front()!=sf){
+        forget_saved_flow(saved_lru.front());
+        saved_flow_evictions++;
+    }
+
+    if(saved_flow_filter.full()){
+        saved_flow_filter.grow(saved_flow_map.size()*2);
+        for(saved_flow *it=saved_lru.front();it;it=saved_lru.next(it)){
+            saved_flow_filter.add(it->hash);
+        }
+    }
+}
+
+void tcpdemux::forget_saved_flow(saved_flow *sf)
+{
+    saved_lru.erase(sf);
+    saved_flow_map.erase(sf->addr);
+    saved_flow_filter.remove(sf->hash);
+    saved_flow_bytes -= sf->bytes();
+    if(fio) fio->forget(sf->saved_filename);
+    saved_flow_pool.destroy(sf);
+}
+
+/* The key's hash is the same for both directions of a connection; a saved flow is one of them */
+uint64_t tcpdemux::saved_flow_hash(const flow_key &key)
+{
+    return key.reversed ? flow_hash_mix(key.hash) : key.hash;
 }
 
 /**
  * dissect_tcp():
  *
  * Called to process tcp pkts in a way that dissected or isolated pcap flows are
- * emerging afterwards. Similar notions go into the direction of "sorting" pcap pkts
+ * emerging afterwards (-K). Similar notions go into the direction of "sorting" pcap pkts
  * as per flow context.
  *
+ * Each flow's packets go to a pcap file of its own, named by the filename
+ * template, or each connection's with opt.pcap_both_directions (named for the
+ * direction of its first packet). The files are opened, closed to stay within
+ * max_fds, and opened again to append as the flow files of process_tcp() are,
+ * least recently used first, and the records are gathered in the same write
+ * buffers (write_buffer bytes for each flow, write_buffer_mem in all) and
+ * written through io().
+ *
  * Returns 0 if packet is processed, 1 if it is not processed, -1 if error
  */
 
@@ -398,25 +978,109 @@ int tcpdemux::dissect_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     struct be13::tcphdr *tcp_header = (struct be13::tcphdr *) ip_data;
     flow_addr this_flow(src,dst,ntohs(tcp_header->th_sport),
                         ntohs(tcp_header->th_dport),family);
+    flow_addr key(this_flow);
+    if(opt.pcap_both_directions){
+        flow_addr reverse(dst,src,this_flow.dport,this_flow.sport,family);
+        if(reverse < key) key = reverse;
+    }
 
-    sparse_saved_flow_map_t::const_iterator it = flow_fd_cache_map.find(this_flow);
+    trim_pcap_buffers(pi.ts,0);
+    sparse_saved_flow *ssf = 0;
+    sparse_saved_flow_map_t::const_iterator it = flow_fd_cache_map.find(key);
     if(it!=flow_fd_cache_map.end()){
-        flow_sorter->update_sink(it->second->fcap);
+        ssf = it->second;
     }
     else {
         flow fn_gen_vehicle(this_flow, 0, pi); // impromptu flow name generator
-        std::string fn = fn_gen_vehicle.new_pcap_filename();
-        flow_sorter->refresh_sink(fn, pi.pcap_dlt);
-        FILE *sink= flow_sorter->yield_sink();
-        sparse_saved_flow *ssf = new sparse_saved_flow(this_flow, sink);
+        ssf = sparse_flow_pool.make(key, fn_gen_vehicle.filename(0, true));
         flow_fd_cache_map[ssf->addr] = ssf;
     }
+    if(ssf->fd<0) open_pcap(ssf,pi.pcap_dlt,pi.ts);
+    else open_pcaps.move_to_end(ssf);
 
-    flow_sorter->writepkt(pi.pcap_hdr,pi.pcap_data);
-
+    write_pcap(ssf,pcap_writer::record_size(opt.pcap_format,pi.pcap_hdr->caplen),pi.pcap_hdr,pi.pcap_data,pi.ts);
     return 0;
 }
 
+/* Open ssf's file: make it, with its pcap header, the first time, and append to it after */
+void tcpdemux::open_pcap(sparse_saved_flow *ssf,int pcap_dlt,const struct timeval &ts)
+{
+    int flags = ssf->size ? O_WRONLY|O_APPEND|O_BINARY : O_WRONLY|O_CREAT|O_TRUNC|O_BINARY;
+    ssf->fd = open_in_dir(ssf->filename,flags,0666);
+    if(ssf->fd<0) die("Cannot open: %s",ssf->filename.c_str());
+    open_pcaps.push_back(ssf);
+    if(open_pcaps.size() > max_open_flows) max_open_flows = open_pcaps.size();
+    if(ssf->size){
+        pcap_reopens++;
+        return;
+    }
+    uint8_t hdr[pcap_writer::MAX_HEADER_SIZE];
+    size_t len = pcap_writer::file_header(hdr,opt.pcap_format,pcap_dlt);
+    write_pcap(ssf,len,0,hdr,ts);
+}
+
+/* Put len bytes at the end of ssf's file, buffering them if we can: the
+ * record of the packet with header h, or data itself if h is 0. ssf is open.
+ */
+void tcpdemux::write_pcap(sparse_saved_flow *ssf,size_t len,const struct pcap_pkthdr *h,
+                          const uint8_t *data,const struct timeval &ts)
+{
+    const uint32_t size = opt.write_buffer;
+    if(ssf->buf && ssf->buf_len + len > size) flush_pcap(ssf);
+    if(ssf->buf==0 && len < size){
+        trim_pcap_buffers(ts,size);
+        if(write_buffer_used + size <= opt.write_buffer_mem && (ssf->buf = (uint8_t *)malloc(size))!=0){
+            write_buffer_used += size;
+            buffered_pcaps.push_back(ssf);
+            ssf->buf_len  = 0;
+            ssf->buf_time = ts.tv_sec;
+        }
+    }
+    uint8_t *to = ssf->buf ? ssf->buf + ssf->buf_len : (uint8_t *)malloc(len);
+    if(to==0) return;
+    if(h) pcap_writer::put_record(to,opt.pcap_format,0,h,data);
+    else memcpy(to,data,len);
+    if(ssf->buf){
+        ssf->buf_len += len;
+        return;
+    }
+    flow_writes++;
+    io().write_owned(ssf->fd,ssf->size,to,len); // which frees it
+    ssf->size += len;
+}
+
+void tcpdemux::flush_pcap(sparse_saved_flow *ssf)
+{
+    if(ssf->buf==0) return;
+    flow_writes++;
+    io().write_owned(ssf->fd,ssf->size,ssf->buf,ssf->buf_len); // which frees it
+    ssf->size    += ssf->buf_len;
+    ssf->buf      = 0;
+    ssf->buf_len  = 0;
+    write_buffer_used -= opt.write_buffer;
+    buffered_pcaps.erase(ssf);
+}
+
+void tcpdemux::close_pcap(sparse_saved_flow *ssf)
+{
+    if(ssf->fd<0) return;
+    flush_pcap(ssf);
+    io().close(ssf->fd,0);
+    ssf->fd = -1;
+    open_pcaps.erase(ssf);
+}
+
+/* Like trim_write_buffers(), for -K's buffers */
+void tcpdemux::trim_pcap_buffers(const struct timeval &now,size_t need)
+{
+    while(!buffered_pcaps.empty()){
+        sparse_saved_flow *oldest = buffered_pcaps.front();
+        if(write_buffer_used + need <= opt.write_buffer_mem &&
+           now.tv_sec - oldest->buf_time < (time_t)opt.write_buffer_age) break;
+        flush_pcap(oldest);
+    }
+}
+
 /**
  * process_tcp():
  *
@@ -452,6 +1116,8 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 
     /* fill in the flow_addr structure with info that identifies this flow */
     flow_addr this_flow(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family);
+    const flow_key this_key = this_flow.conn_key(); // hashed once; finds both directions of the connection
+    const int      this_half = this_key.reversed ? 1 : 0;
 
     be13::tcp_seq seq  = ntohl(tcp_header->th_seq);
     bool syn_set = FLAG_SET(tcp_header->th_flags, TH_SYN);
@@ -472,7 +1138,9 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 
     /* see if we have state about this flow; if not, create it */
     int32_t  delta = 0;			// from current position in tcp connection; must be SIGNED 32 bit!
-    tcpip   *tcp = find_tcpip(this_flow);
+    tcpconn *conn = find_conn(this_key);
+    tcpip   *tcp = conn ? conn->half[this_half] : 0;
+    bool     new_flow = false;
 
     DEBUG(60)("%s %s%s%s%s tcp_header_len=%d tcp_datalen=%d seq=%u tcp=%p",
               this_flow.str().c_str(),
@@ -481,7 +1149,8 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     /* If this_flow is not in the database and the start_new_connections flag is false, just return */
     if(tcp==0 && start_new_connections==false) return 0;
 
-    if(syn_set && tcp && tcp->syn_count>0 && tcp->pos>0){
+    /* (Printed flows have nothing to protect; a new SYN on them starts a new flow, below.) */
+    if(syn_set && tcp && tcp->syn_count>0 && tcp->pos>0 && !opt.console_output){
         std::cerr << "SYN TO IGNORE! SYN tcp="<<tcp << " flow="<<this_flow<<"\n";
         return 1;
     }
@@ -495,23 +1164,31 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
             /* Data present on a flow that is not actively being demultiplexed.
              * See if it is a saved flow. If so, see if the data in the packet
              * matches what is on the disk. If so, return.
-             *
+             * Most such packets are retransmissions of the last few
+             * segments, which the saved flow still has in memory.
              */
-            saved_flow_map_t::const_iterator it = saved_flow_map.find(this_flow);
+            saved_flow_map_t::const_iterator it = saved_flow_map.end();
+            if(saved_flow_filter.maybe(saved_flow_hash(this_key))){
+                it = saved_flow_map.find(this_flow);
+            } else {
+                straggler_filtered++;
+            }
+            if(it==saved_flow_map.end()) saved_flow_misses++;
             if(it!=saved_flow_map.end()){
                 uint32_t offset = seq - it->second->isn - 1;
                 bool data_match = false;
-                int fd = open(it->second->saved_filename.c_str(),O_RDONLY | O_BINARY);
-                if(fd>0){
+                saved_flow_hits++;
+                saved_lru.move_to_end(it->second);
+                if(!it->second->in_tail(offset,tcp_data,tcp_datalen,&data_match)){
+                    straggler_reads++;
+                    io().drain();           // its last writes may not have landed yet
                     char *buf = (char *)malloc(tcp_datalen);
                     if(buf){
-                        DEBUG(100)("lseek(fd,%" PRId64 ",SEEK_SET)",(int64_t)(offset));
-                        lseek(fd,offset,SEEK_SET);
-                        ssize_t r = read(fd,buf,tcp_datalen);
+                        DEBUG(100)("read(%s,%" PRId64 ")",it->second->saved_filename.c_str(),(int64_t)(offset));
+                        ssize_t r = io().read(it->second->saved_filename,offset,buf,tcp_datalen);
                         data_match = (r==(ssize_t)tcp_datalen) && memcmp(buf,tcp_data,tcp_datalen)==0;
                         free(buf);
                     }
-                    close(fd);
                 }
                 DEBUG(60)("Packet matches saved flow. offset=%u len=%d filename=%s data match=%d\n",
                           (u_int)offset,(u_int)tcp_datalen,it->second->saved_filename.c_str(),(u_int)data_match);
@@ -534,7 +1211,8 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 	delta = seq - tcp->nsn;		// notice that signed offset is calculated
 
 	if(abs(delta) > opt.max_seek){
-	    remove_flow(this_flow);
+	    remove_flow(this_key);
+	    conn = find_conn(this_key); // gone if this was its only half
 	    delta = 0;
 	    tcp = 0;
 	}
@@ -557,27 +1235,20 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
         /* Don't process if this is not a SYN and there is no data. */
         if(syn_set==false && tcp_datalen==0) return 0;
 
-	/* Check if this is the server->client flow related to a client->server flow that is being demultiplexed */
-	flow_addr reverse_flow(dst,src,ntohs(tcp_header->th_dport),ntohs(tcp_header->th_sport),family);
-	tcpip   *reverse_tcp = find_tcpip(reverse_flow);
-	uint64_t uid;
-	if (reverse_tcp)
-	{
-	    /* We found a matching client->server flow. Copy its session ID */
-	    uid = reverse_tcp->myflow.session_id;
-	}
-	else
-	{
-	    /* Assign a new unique ID */
-	    uid = unique_id++;
+	/* If the other direction is being demultiplexed, the connection already
+	 * exists and this flow shares its session ID. Otherwise assign a new one.
+	 */
+	if (conn==NULL){
+	    conn = conn_pool.make(next_session_id());
+	    flow_map.insert(this_key,conn);
 	}
 
-	/* Create a new connection.
-	 * delta will be 0, because it's a new connection!
+	/* Create a new flow.
+	 * delta will be 0, because it's a new flow!
 	 */
         be13::tcp_seq isn = syn_set ? seq : seq-1;
-	tcp = create_tcpip(this_flow, isn, pi);
-	tcp->myflow.session_id = uid;
+	tcp = create_tcpip(conn, this_flow, this_key.reversed, isn, pi);
+	new_flow = true;
     }
 
     /* Now tcp is valid */
@@ -622,10 +1293,11 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 	    tcp->dir = tcpip::dir_sc;	// server->client
 	}
 	if(tcp_datalen>0){
-	    tcp->violations++;
+	    tcp->cold().violations++;
 	    DEBUG(1) ("TCP PROTOCOL VIOLATION: SYN with data! (length=%d)",(int)tcp_datalen);
 	}
     }
+    if(new_flow && opt.console_output && opt.output_json) tcp->print_open(pi.ts); // now that its direction is known
     if(tcp_datalen==0) DEBUG(50) ("got TCP segment with no data"); // seems pointless to notify
 
     /* process any data.
@@ -634,7 +1306,7 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
      */
     if (tcp_datalen>0){
 	if (opt.console_output) {
-	    tcp->print_packet(tcp_data, tcp_datalen);
+	    tcp->print_packet(tcp_data, tcp_datalen, delta, pi.ts);
 	} else {
 	    if (opt.store_output){
 		bool new_file = false;
@@ -655,7 +1327,7 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     }
 
     if (rst_set){
-        remove_flow(this_flow);	// take it out of the map
+        remove_flow(this_key);	// take it out of the map
         return 0;
     }
 
@@ -663,24 +1335,28 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
      * If this is a fin, determine the size of the stream
      */
     if (fin_set){
+        tcp->flush();                   // the sender is done; so, most likely, is its file
         tcp->fin_count++;
         if(tcp->fin_count==1){
             tcp->fin_size = (seq+tcp_datalen-tcp->isn)-1;
         }
+    } else if(opt.fd_clock){
+        tcp->used = true;
     } else {
         open_flows.move_to_end(tcp);
     }
 
+    if(timeouts_enabled()) update_timeout(conn);
+
     /* If a fin was sent and we've seen all of the bytes, close the stream */
     DEBUG(50)("%d>0 && %d == %d",tcp->fin_count,tcp->seen_bytes(),tcp->fin_size);
+    DEBUG(50)("fin_set=%d  seq=%u fin_count=%d  seq_count=%d len=%d isn=%u",
+              fin_set,seq,tcp->fin_count,tcp->syn_count,(int)tcp_datalen,tcp->isn);
 
     if (tcp->fin_count>0 && tcp->seen_bytes() == tcp->fin_size){
         DEBUG(50)("all bytes have been received; removing flow");
-        remove_flow(this_flow);	// take it out of the map
+        remove_flow(this_key);	// take it out of the map
     }
-
-    DEBUG(50)("fin_set=%d  seq=%u fin_count=%d  seq_count=%d len=%d isn=%u",
-              fin_set,seq,tcp->fin_count,tcp->syn_count,(int)tcp_datalen,tcp->isn);
     return 0;                           // successfully processed
 }
 #pragma GCC diagnostic warning "-Wcast-align"
@@ -796,6 +1472,8 @@ int tcpdemux::process_ip6(const be13::packet_info &pi)
 #pragma GCC diagnostic ignored "-Wcast-align"
 int tcpdemux::process_pkt(const be13::packet_info &pi)
 {
+    if(shards.size()) return dispatch_pkt(pi);
+    if(split) return split->process_pkt(pi);
     DEBUG(10)("process_pkt..............................................................................");
     int r = 1;                          // not processed yet
     switch(pi.ip_version()){
@@ -808,27 +1486,21 @@ int tcpdemux::process_pkt(const be13::packet_info &pi)
     }
     if(r!=0){                           // packet not processed?
         /* Write the packet if we didn't process it */
-        if(pwriter) pwriter->writepkt(pi.pcap_hdr,pi.pcap_data);
-    }
-
-    /* Process the timeout, if there is any */
-    if(tcp_timeout){
-        /* Get a list of the flows that need to be closed.  */
-        std::vector<flow_addr *> to_close;
-        for(flow_map_t::iterator it = flow_map.begin(); it!=flow_map.end(); it++){
-            tcpip &tcp = *(it->second);
-            uint32_t age = pi.ts.tv_sec - tcp.myflow.tlast.tv_sec;
-            if (age > tcp_timeout){
-                to_close.push_back(&tcp.myflow);
+        if(pwriter){
+            cppmutex::lock lock(shared_M);
+            try {
+                pwriter->writepkt(pi.pcap_hdr,pi.pcap_data,pi.pcap_dlt);
+            } catch(const pcap_writer::write_error &e) {
+                die("%s",e.what());
             }
         }
-        /* Close them. This removes the flows from the flow_map(), which is why we need
-         * to create the list first.
-         */
-        for(std::vector<flow_addr *>::iterator it = to_close.begin(); it!=to_close.end(); it++){
-            remove_flow(*(*it));
-        }
     }
+
+    /* Process the timeouts, if there are any, and write out the reorder
+     * queues of flows that have gone quiet
+     */
+    if(timeouts_enabled()) expire_flows(pi.ts);
+    trim_reorder_queues(pi.ts);
     return r;
 }
 #pragma GCC diagnostic warning "-Wcast-align"
@@ -13,6 +13,7 @@
  * - class flow      - All of the information for a flow that's being tracked
  * - class tcp_header_t - convenience class for working with TCP headers
  * - class tcpip     - A one-sided TCP implementation
+ * - class tcpconn   - Both tcpip halves of a TCP connection
  * - class tcpdemux  - Processes individual packets, identifies flows,
  *                     and creates tcpip objects as required
  */
@@ -40,10 +41,30 @@
 
 #include <queue>
 #include "intrusive_list.h"
+#include "timer_wheel.h"
+#include "packet_ring.h"
+#include "flow_io.h"
+#include "flow_segments.h"
+#include "dir_cache.h"
+#include "console_writer.h"
+#include "slab_pool.h"
+#include "bloom_filter.h"
+
+class tcpdemux_shard;
+class pcap_split;
 
 /**
  * the tcp demultiplixer
- * This is a singleton class; we only need a single demultiplexer.
+ * getInstance() returns the one that the packets are given to. With -j,
+ * and when pcap_split reads ranges of a file in parallel, it makes child
+ * demultiplexers, tcpdemux(parent,max_fds), each with its own flows,
+ * pools, buffers and io.
+ *
+ * A child shares its parent's options, outdir, report, pcap writer and
+ * feature recorders (shared_M locks the ones they write to), and takes its
+ * flow and session ids from the parent with next_flow_id() and
+ * next_session_id(), so they are unique across children. Its counters
+ * are its own and finish_child() adds them into the parent's.
  */
 class tcpdemux {
     /* see http://mikecvet.wordpress.com/tag/hashing/ */
@@ -55,25 +76,24 @@ class tcpdemux {
         bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y;}
     } flow_addr_key_eq;
 
+    typedef flow_key_map<tcpconn *> flow_map_t; // active connections, by canonical key
 #ifdef HAVE_TR1_UNORDERED_MAP
-    typedef std::tr1::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
     typedef std::tr1::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
     typedef std::tr1::unordered_map<flow_addr,sparse_saved_flow *,flow_addr_hash,flow_addr_key_eq> sparse_saved_flow_map_t; // flows ctxt caching for pcap dissection
 #else
-    typedef std::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
     typedef std::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
     typedef std::unordered_map<flow_addr,sparse_saved_flow *,flow_addr_hash,flow_addr_key_eq> sparse_saved_flow_map_t; // flows ctxt caching for pcap dissection
 #endif
-    typedef std::vector<class saved_flow *> saved_flows_t; // needs to be ordered
 
 
+    friend class tcpdemux_shard;
+    friend class pcap_split;
     tcpdemux();
+    tcpdemux(tcpdemux *parent,unsigned int max_fds); // a shard of parent
 #ifdef HAVE_SQLITE3
     sqlite3 *db;
     sqlite3_stmt *insert_flow;
 #endif
-    pcap_writer *flow_sorter;
-
     /* facility logic hinge */
     int (tcpdemux::*tcp_processor)(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                          const u_char *tcp_data, uint32_t tcp_length,
@@ -81,29 +101,44 @@ class tcpdemux {
 
 public:
     static uint32_t tcp_timeout;
+    static uint32_t tcp_timeout_halfopen;        // idle timeout before any data; 0 means tcp_timeout
+    static uint32_t tcp_timeout_established;     // idle timeout once data has been seen; 0 means tcp_timeout
+    static uint32_t tcp_timeout_closing;         // idle timeout after a FIN; 0 means tcp_timeout
     static std::string tcp_cmd;                   // command to run on each tcp flow
     static int tcp_subproc_max;              // how many subprocesses are we allowed?
     static int tcp_subproc;                   // how many do we currently have?
     static int tcp_alert_fd; 
+    static cppmutex shared_M;                // protects what the shards share: the scanners (fs), xreport, pwriter, tcp_alert_fd and tcp_subproc
     
     static unsigned int get_max_fds(void);             // returns the max
     virtual ~tcpdemux(){
+        while(!saved_lru.empty()) forget_saved_flow(saved_lru.front());
         delete xreport;
         delete pwriter;
+        delete fio;
     }
 
     /* The pure options class means we can add new options without having to modify the tcpdemux constructor. */
     class options {
     public:;
         enum { MAX_SEEK=1024*1024*16 };
+        enum { WRITE_BUFFER=64*1024, WRITE_BUFFER_MEM=64*1024*1024, WRITE_BUFFER_AGE=5 };
+        enum { REORDER_QUEUE=256*1024, REORDER_QUEUE_MEM=64*1024*1024, REORDER_QUEUE_AGE=10 };
+        enum { STRAGGLER_TAIL=8192 };
+        enum { SAVED_FLOW_MEM=64*1024*1024 };
         options():console_output(false),console_output_nonewline(false),
                   store_output(true),opt_md5(false),
                   post_processing(false),gzip_decompress(true),
                   max_bytes_per_flow(-1),
                   max_flows(0),suppress_header(0),
-                  output_strip_nonprint(true),output_json(false),
+                  output_strip_nonprint(true),output_json(false),json_payload_hex(false),
                   output_pcap(false),output_hex(false),use_color(0),
-                  output_packet_index(false),max_seek(MAX_SEEK) {
+                  output_packet_index(false),max_seek(MAX_SEEK),
+                  write_buffer(WRITE_BUFFER),write_buffer_mem(WRITE_BUFFER_MEM),write_buffer_age(WRITE_BUFFER_AGE),
+                  reorder_queue(REORDER_QUEUE),reorder_queue_mem(REORDER_QUEUE_MEM),reorder_queue_age(REORDER_QUEUE_AGE),
+                  straggler_tail(STRAGGLER_TAIL),saved_flow_mem(SAVED_FLOW_MEM),
+                  io_backend("sync"),io_depth(flow_io::DEPTH),fd_clock(false),segment_size(0),
+                  pcap_both_directions(false),pcap_format(pcap_writer::PCAP) {
         }
         bool    console_output;
         bool    console_output_nonewline;
@@ -115,13 +150,28 @@ public:
         uint32_t max_flows;
         bool    suppress_header;
         bool    output_strip_nonprint;
-        bool    output_json;
+        bool    output_json;            // -J: print flow events as lines of JSON
+        bool    json_payload_hex;       // their payloads in hex rather than base64
         bool    output_pcap;
         bool    output_hex;
         bool    use_color;
         bool    output_packet_index;    // Generate a packet index file giving the timestamp and location
                                         // bytes written to the flow file.
         int32_t max_seek;               // signed becuase we compare with abs()
+        uint32_t write_buffer;          // bytes of each flow's writes to coalesce; 0 writes each segment
+        size_t   write_buffer_mem;      // at most this much for all of the write buffers
+        uint32_t write_buffer_age;      // seconds of packet time that bytes may stay buffered
+        uint32_t reorder_queue;         // bytes of each flow's segments to hold back until they can be written in order
+        size_t   reorder_queue_mem;     // at most this much for the segments of all flows
+        uint32_t reorder_queue_age;     // seconds of packet time that segments may be held back
+        uint32_t straggler_tail;        // bytes at the end of each flow to check stragglers against without reading the file
+        size_t   saved_flow_mem;        // at most this much for the saved flows; 0 saves none
+        std::string io_backend;         // how files are written; see flow_io.h
+        uint32_t io_depth;              // operations that may be outstanding
+        bool    fd_clock;               // choose the file to close with the clock algorithm instead of in LRU order
+        uint64_t segment_size;          // bytes per segment file; 0 writes a file per flow (see flow_segments.h)
+        bool    pcap_both_directions;   // -K writes the two directions of a connection to one pcap file
+        pcap_writer::format_t pcap_format; // of the files -K and -w write
     };
 
     enum { WARN_TOO_MANY_FILES=10000};  // warn if more than this number of files in a directory
@@ -131,25 +181,57 @@ public:
     uint64_t     packet_counter;         // monotomically increasing 
     dfxml_writer *xreport;               // DFXML output file
     pcap_writer  *pwriter;               // where we should write packets
+    console_writer console;             // where -c and -C print packets (see console_writer.h)
     unsigned int max_open_flows;        // how large did it ever get?
     unsigned int max_fds;               // maximum number of file descriptors for this tcpdemux
     uint64_t     unique_id;                 // next unique id to assign
 
-    flow_map_t   flow_map;               // db of open tcpip objects, indexed by flow
-    intrusive_list<tcpip> open_flows; // the tcpip flows with open files in access order
+    flow_map_t   flow_map;               // db of open connections; each holds up to two tcpip objects
+    intrusive_list<tcpip,&tcpip::open_link> open_flows; // the tcpip flows with open files in access order
+    intrusive_list<tcpip,&tcpip::wbuf_link> buffered_flows; // flows with buffered writes, oldest first
+    size_t       write_buffer_used;     // bytes of write buffers allocated
+    intrusive_list<tcpip,&tcpip::queue_link> queued_flows; // flows with reorder queues, oldest first
+    size_t       reorder_queue_used;    // bytes of segments held in them
+    uint64_t     flow_writes;           // writes to flow files
+    uint64_t     flow_segments;         // segments stored in flow files
+    uint64_t     queued_segments;       // segments held back to be written in order
+    uint64_t     queue_trims;           // reorder queues written early to stay within opt.reorder_queue_mem
+    uint64_t     file_shifts;           // flow files moved up to make room for bytes before their start
+    uint64_t     straggler_filtered;    // data for unknown flows that saved_flow_filter said were not saved
+    uint64_t     saved_flow_hits;       // data for unknown flows that were saved flows, compared with what was saved
+    uint64_t     saved_flow_misses;     // data for unknown flows that were not
+    uint64_t     straggler_reads;       // hits that were not in the saved tail, so the file was read
+    uint64_t     saved_flow_evictions;  // saved flows forgotten to stay within opt.saved_flow_mem
+    flow_io      *fio;                  // made by io() when it is first needed
+    dir_cache    dirs;                  // output directories held open for openat() (see dir_cache.h)
+    slab_pool<tcpip>   tcpip_pool;      // the objects made for each flow (see slab_pool.h)
+    slab_pool<tcpconn> conn_pool;
+    slab_pool<saved_flow> saved_flow_pool;
+    slab_pool<sparse_saved_flow> sparse_flow_pool;
+    timer_wheel<tcpconn,&tcpconn::timeout_hook> flow_timeouts; // idle connections, by expiration time
+    std::vector<tcpconn *> expired_flows; // scratch space for expire_flows()
 
     saved_flow_map_t saved_flow_map;  // db of saved flows, indexed by flow
-    sparse_saved_flow_map_t flow_fd_cache_map;  // db caching saved flows descriptors, indexed by flow
-    saved_flows_t    saved_flows;     // the flows that were saved
+    bloom_filter     saved_flow_filter; // the flows in saved_flow_map, by saved_flow_hash()
+    sparse_saved_flow_map_t flow_fd_cache_map;  // -K's flows, indexed by flow
+    intrusive_list<sparse_saved_flow,&sparse_saved_flow::open_link> open_pcaps; // those with open files, least recently used first
+    intrusive_list<sparse_saved_flow,&sparse_saved_flow::buf_link> buffered_pcaps; // those with buffered records, oldest first
+    uint64_t     pcap_reopens;          // -K files opened again after they were closed to free a descriptor
+    intrusive_list<saved_flow,&saved_flow::lru_link> saved_lru; // the saved flows, least recently used first
+    size_t           saved_flow_bytes;  // their saved_flow::bytes()
     bool             start_new_connections;  // true if we should start new connections
 
     options      opt;
     class feature_recorder_set *fs; // where features extracted from each flow should be stored
-    
-    static uint32_t max_saved_flows;       // how many saved flows are kept in the saved_flow_map
 
+    tcpdemux     *parent;               // if this is a shard, the demux that feeds it; otherwise 0
+    std::vector<tcpdemux_shard *> shards; // worker shards; empty unless -j was given
+    time_t       shard_clock;           // last second sent to the shards
+    pcap_split   *split;                // set while a file is read in byte ranges (see pcap_split.h)
+    
     void alter_processing_core();
     static tcpdemux *getInstance();
+    static void idle(u_char *user);     // called by the live capture loops when there are no packets
 
     /* Databse */
 
@@ -161,28 +243,58 @@ public:
                             const std::string &hashdigest_md5);
 
 
-    void  save_unk_packets(const std::string &wfname,const std::string &ifname);
+    void  save_unk_packets(const std::string &wfname);
                                        // save unknown packets at this location
     void  post_process(tcpip *tcp);    // just before closing; writes XML and closes fd
 
     /* management of open fds and in-process tcpip flows*/
     void  close_tcpip_fd(tcpip *);         
     void  close_oldest_fd();
+    void  trim_write_buffers(const struct timeval &now,size_t need); // flush old buffers, and make room for need bytes
+    void  trim_reorder_queues(const struct timeval &now); // release old reorder queues, and stay within reorder_queue_mem
     void  remove_flow(const flow_addr &flow); // remove a flow from the database, closing open files if necessary
+    void  remove_flow(const flow_key &key);   // key is the canonical connection key
+    void  remove_conn(tcpconn *conn);         // remove both halves of a connection
     void  remove_all_flows();                 // stop processing all tcpip connections
 
+    /* idle timeouts */
+    static bool timeouts_enabled();
+    uint32_t idle_timeout(const tcpconn *conn) const; // the timeout that applies to the connection in its current state
+    void  update_timeout(tcpconn *conn);      // called after each packet on a connection
+    void  expire_flows(const struct timeval &now); // remove flows that have been idle too long
+
+    /* sharding (-j).
+     * With shards, this demux only parses enough of each packet to find its
+     * connection, and copies the packet to the shard that owns the connection.
+     */
+    void  start_shards(unsigned int n);
+    void  sync_shards();                  // wait for the shards to process everything sent to them
+    void  stop_shards();                  // flush and delete the shards
+    int   dispatch_pkt(const be13::packet_info &pi);
+    uint64_t next_flow_id();              // ids are shared between a demux and its shards
+    uint64_t next_session_id();
+    void  finish_child(tcpdemux &child);  // take back what a finished shard shared with us
+    static bool conn_hash(const be13::packet_info &pi,uint64_t *hash); // false if not a TCP packet
+    size_t open_flow_count();             // open files, including the shards'
+    size_t active_flow_count();           // active connections, including the shards'
+
     /* open a new file, closing an fd in the openflow database if necessary */
     int   retrying_open(const std::string &filename,int oflag,int mask);
+    int   retrying_open(int dirfd,const char *name,const std::string &filename,int oflag,int mask); // name is filename, in dirfd
+    int   open_in_dir(const std::string &filename,int oflag,int mask); // retrying_open() relative to its directory, made if need be
+    flow_io &io();                        // how files are written
 
     /* the flow database holds in-process tcpip connections */
-    tcpip *create_tcpip(const flow_addr &flow, be13::tcp_seq isn, const be13::packet_info &pi);
-    tcpip *find_tcpip(const flow_addr &flow);
+    tcpip *create_tcpip(tcpconn *conn, const flow_addr &flow, bool reversed, be13::tcp_seq isn, const be13::packet_info &pi);
+    tcpconn *find_conn(const flow_key &key);
 
     /* saved flows are completed flows that we remember in case straggling packets
      * show up. Remembering the flows lets us resolve the packets rather than creating
      * new flows.
      */
     void  save_flow(tcpip *);
+    void  forget_saved_flow(saved_flow *sf);
+    static uint64_t saved_flow_hash(const flow_key &key); // one direction of the connection
 
     /** packet processing.
      * Each returns 0 if processed, 1 if not processed, -1 if error.
@@ -193,6 +305,12 @@ public:
     int  dissect_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                      const u_char *tcp_data, uint32_t tcp_length,
                      const be13::packet_info &pi);
+    void open_pcap(sparse_saved_flow *ssf,int pcap_dlt,const struct timeval &ts); // for -K
+    void write_pcap(sparse_saved_flow *ssf,size_t len,const struct pcap_pkthdr *h,
+                    const uint8_t *data,const struct timeval &ts);
+    void flush_pcap(sparse_saved_flow *ssf);
+    void close_pcap(sparse_saved_flow *ssf);
+    void trim_pcap_buffers(const struct timeval &now,size_t need);
     int  process_ip4(const be13::packet_info &pi);
     int  process_ip6(const be13::packet_info &pi);
     int  process_pkt(const be13::packet_info &pi);
@@ -15,6 +15,11 @@
 
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "capture_ring.h"
+#include "af_packet.h"
+#include "pcap_reader.h"
+#include "pcap_split.h"
+#include "pcap_merge.h"
 #include "bulk_extractor_i.h"
 #include "iptree.h"
 
@@ -48,6 +53,17 @@ const char *tcpflow_droproot_username = 0;
 const char *tcpflow_chroot_dir = 0;
 
 int packet_buffer_timeout = 10;
+#ifdef HAVE_PTHREAD
+static capture_ring *capture = 0;      // if set, packets are processed on a separate thread
+static size_t capture_ring_bytes = 0;   // its size, made when pcap_loop() is first used; 0 for none
+static capture_ring::full_policy capture_ring_policy = capture_ring::BLOCK;
+#endif
+static unsigned int opt_pcap_split = 0;  // byte ranges to read a single -r file as
+static bool opt_merge_inputs = false;    // read all the -r files at once, in timestamp order
+#ifdef HAVE_AF_PACKET
+static bool opt_af_packet = false;      // live capture with af_packet rather than libpcap
+static af_packet::config af_packet_config;
+#endif
 
 scanner_info::scanner_config be_config; // system configuration
 
@@ -60,6 +76,31 @@ typedef struct {
 default_t defaults[] = {
     {"tdelta","0","Time delta in seconds"},
     {"packet-buffer-timeout", "10", "Time in milliseconds between each callback from libpcap"},
+    {"capture-ring", "32", "Megabytes of packets buffered between capture and processing (0 to disable)"},
+    {"capture-ring-full", "block", "When the capture ring is full: block or drop"},
+    {"af-packet", "0", "Capture live from a TPACKET_V3 ring instead of libpcap (Linux)"},
+    {"af-packet-block-size", "1048576", "Bytes per af-packet ring block"},
+    {"af-packet-blocks", "32", "Blocks per af-packet ring"},
+    {"af-packet-fanout", "1", "Number of af-packet sockets in a PACKET_FANOUT group"},
+    {"write-buffer", "65536", "Bytes of each flow's output to gather into one write (0 to write each segment)"},
+    {"write-buffer-mem", "64", "Megabytes of write buffers for all flows together"},
+    {"write-buffer-age", "5", "Seconds that output may stay in a write buffer"},
+    {"reorder-queue", "262144", "Bytes of each flow's out-of-order segments to hold in memory (0 to write them as they come)"},
+    {"reorder-queue-mem", "64", "Megabytes of out-of-order segments to hold in memory for all flows together"},
+    {"reorder-queue-age", "10", "Seconds that out-of-order segments may be held in memory"},
+    {"saved-flow-mem", "64", "Megabytes of closed flows to remember, so that late retransmissions for them are not taken for new flows"},
+    {"straggler-tail", "8192", "Bytes at the end of each flow to check late retransmissions against without reading the file (0 to read it)"},
+    {"fd-clock", "0", "Pick the flow file to close when out of descriptors by the clock algorithm, not strictly the least recently used"},
+    {"io-backend", "sync", "How files are written: sync, or uring to queue writes and closes on an io_uring (Linux)"},
+    {"io-depth", "256", "File operations that may be outstanding with io-backend=uring"},
+    {"segment-size", "0", "Megabytes per segment file to append all of the flows to, with an index, instead of a file per flow (0 for a file per flow)"},
+    {"pcap-both-directions", "0", "With -K, write both directions of each connection to one pcap file"},
+    {"pcap-format", "pcap", "Format of the pcap files that -K and -w write: pcap, or pcapng with nanosecond timestamps"},
+    {"console-buffer", "65536", "Bytes of -c and -C output to gather into one write (0 to write after every packet)"},
+    {"console-flush-ms", "100", "Milliseconds that -c and -C output may wait to be written"},
+    {"json-payload", "base64", "How -J prints packet data: base64 or hex"},
+    {"pcap-split", "0", "Read a single -r pcap file as this many byte ranges in parallel"},
+    {"merge-inputs", "0", "Read all the -r files at once, merging their packets in timestamp order"},
     {0,0,0}
 };
 
@@ -120,7 +161,7 @@ static void usage(int level)
 {
     std::cout << PACKAGE_NAME << " version " << PACKAGE_VERSION << "\n\n";
     std::cout << "usage: " << progname << " [-aBcCDhIpsvVZ] [-b max_bytes] [-d debug_level] \n";
-    std::cout << "     [-[eE] scanner] [-f max_fds] [-F[ctTXMkmg]] [-h|--help] [-i iface]\n";
+    std::cout << "     [-[eE] scanner] [-f max_fds] [-F[ctTXMkmg]] [-h|--help] [-i iface] [-j jobs]\n";
     std::cout << "     [-l files...] [-L semlock] [-m min_bytes] [-o outdir] [-r file] [-R file]\n";
     std::cout << "     [-S name=value] [-T template] [-U|--relinquish-privileges user] [-v|--verbose]\n";
     std::cout << "     [-w file] [-x scanner] [-X xmlfile] [-z|--chroot dir] [expression]\n\n";
@@ -132,6 +173,7 @@ static void usage(int level)
     std::cout << "   -H: print detailed information about each scanner\n";
     std::cout << "   -i: network interface on which to listen\n";
     std::cout << "   -I: write for each flow another file *.findx to provide byte-indexed timestamps\n";
+    std::cout << "   -j jobs: demultiplex with this many worker threads (default 1)\n";
     std::cout << "   -g: output each flow in alternating colors (note change!)\n";
     std::cout << "   -l: treat non-flag arguments as input files rather than a pcap expression\n";
     std::cout << "   -L  semlock - specifies that writes are locked using a named semaphore\n";
@@ -175,7 +217,7 @@ static void usage(int level)
     std::cout << "   -C: console print only, but without the display of source/dest header\n";
     std::cout << "   -0: don't print newlines after packets when printing to console\n";
     std::cout << "   -s: strip non-printable characters (change to '.')\n";
-    std::cout << "   -J: output json format.\n";
+    std::cout << "   -J: print flow events (open, data, close) as lines of JSON (implies -c)\n";
     std::cout << "   -D: output in hex (useful to combine with -c or -C)\n";
     std::cout << "\n";
 #ifndef HAVE_LIBCAIRO
@@ -241,11 +283,23 @@ void replace(std::string &str,const std::string &from,const std::string &to)
 feature_recorder_set *the_fs = 0;
 dfxml_writer *xreport = 0;
 pcap_t *pd = 0;
+pcap_reader *file_reader = 0;
+pcap_split *file_split = 0;
+pcap_merge *file_merge = 0;
+#ifdef HAVE_AF_PACKET
+af_packet *af_capture = 0;
+#endif
 void terminate(int sig)
 {
     if (sig == SIGHUP || sig == SIGINT || sig == SIGTERM) {
         DEBUG(1) ("terminating orderly");
-        pcap_breakloop(pd);
+        if (pd) pcap_breakloop(pd);
+        if (file_split) file_split->breakloop();
+        else if (file_merge) file_merge->breakloop();
+        else if (file_reader) file_reader->breakloop();
+#ifdef HAVE_AF_PACKET
+        if (af_capture) af_capture->breakloop();
+#endif
         return;
     } else {
         DEBUG(1) ("terminating");
@@ -419,6 +473,89 @@ void tcpflow_droproot(tcpdemux &demux)
  * If start is false, do not initiate new connections
  * Return 0 on success or -1 on error
  */
+#ifdef HAVE_AF_PACKET
+/* Live capture from a TPACKET_V3 ring; frames go straight to the datalink handler */
+static int process_af_packet(tcpdemux &demux,const std::string &expression,const std::string &device)
+{
+    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+    af_capture = new af_packet(device,expression,af_packet_config);
+    tcpflow_droproot(demux);                     // drop root if requested
+    pcap_handler handler = find_handler(af_capture->datalink(), device.c_str());
+
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    DEBUG(1) ("listening on %s with af_packet", device.c_str());
+    af_capture->loop(handler, (u_char *)tcpdemux::getInstance(), tcpdemux::idle);
+    return 0;
+}
+#endif
+
+/* Read a capture file with pcap_reader; packets go straight to the datalink handlers */
+static int process_pcap_file(tcpdemux &demux,const std::string &expression,const std::string &infile,
+                             pcap_reader *reader)
+{
+    file_reader = reader;
+    tcpflow_droproot(demux);                     // drop root if requested
+    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+    reader->set_filter(expression);
+
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    int ret = 0;
+    if (opt_pcap_split > 1 && reader->splittable()) {
+        file_split = new pcap_split(demux,*reader,opt_pcap_split);
+        ret = file_split->run();
+        if (ret < 0) {
+            DEBUG(1) ("%s: %s", infile.c_str(), file_split->error().c_str());
+        }
+    } else {
+        if (opt_pcap_split > 1) {
+            DEBUG(1) ("%s: pcap-split needs an uncompressed pcap file; reading it sequentially", infile.c_str());
+        }
+        ret = reader->loop((u_char *)tcpdemux::getInstance());
+        if (ret < 0) {
+            DEBUG(1) ("%s: %s", infile.c_str(), reader->error().c_str());
+        }
+    }
+    file_reader = 0;
+    delete reader;
+    return ret < 0 ? -1 : 0;
+}
+
+/* Read all the -r files at once, merging their packets by timestamp */
+static int process_merged_files(tcpdemux &demux,const std::string &expression,const std::vector<std::string> &infiles)
+{
+    file_merge = new pcap_merge();
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        pcap_reader *reader = pcap_reader::open(*it);
+        if (reader==0) die("%s: merge-inputs can only read pcap and pcapng files it can decompress itself", it->c_str());
+        reader->set_filter(expression);
+        file_merge->add(*it,reader);
+    }
+    tcpflow_droproot(demux);                     // drop root if requested
+    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+
+    portable_signal(SIGTERM, terminate);
+    portable_signal(SIGINT, terminate);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, terminate);
+#endif
+
+    int ret = file_merge->loop((u_char *)tcpdemux::getInstance());
+    if (file_merge->out_of_order) {
+        DEBUG(1) ("merge-inputs: %" PRIu64 " packets were older than the packet before them", file_merge->out_of_order);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
 #ifdef HAVE_INFLATER
 static inflaters_t *inflaters = 0;
 #endif
@@ -435,6 +572,10 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
 #endif
 
     if (infile!=""){
+        /* pcap and pcapng, compressed or not, are read without libpcap where possible */
+        pcap_reader *reader = pcap_reader::open(infile);
+        if (reader) return process_pcap_file(demux,expression,infile,reader);
+
         std::string file_path = infile;
         // decompress input if necessary
 #ifdef HAVE_INFLATER
@@ -484,6 +625,9 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
         device.assign(dev);
 #endif
     }
+#ifdef HAVE_AF_PACKET
+    if (opt_af_packet) return process_af_packet(demux,expression,device);
+#endif
 
 	/* make sure we can open the device */
 	if ((pd = pcap_open_live(device.c_str(), SNAPLEN, !opt_no_promisc, packet_buffer_timeout, error)) == NULL){
@@ -520,13 +664,23 @@ static int process_infile(tcpdemux &demux,const std::string &expression,std::str
 
     /* start listening or reading from the input file */
     if (infile == "") DEBUG(1) ("listening on %s", device.c_str());
-    int pcap_retval = pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance());
+    int pcap_retval = 0;
+#ifdef HAVE_PTHREAD
+    if (capture==0 && capture_ring_bytes) capture = new capture_ring(capture_ring_bytes,capture_ring_policy);
+    if (capture) {
+        capture->start(pd, infile=="", handler, (u_char *)tcpdemux::getInstance(), tcpdemux::idle);
+        pcap_retval = pcap_loop(pd, -1, capture_ring::capture, (u_char *)capture);
+        capture->stop();
+    } else
+#endif
+    pcap_retval = pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance());
 
     if (pcap_retval < 0 && pcap_retval != -2){
 	DEBUG(1) ("%s: %s", infile.c_str(),pcap_geterr(pd));
 	return -1;
     }
     pcap_close (pd);
+    pd = 0;
 #ifdef HAVE_FORK
     if (waitfor != -1) {
         wait (0);
@@ -589,6 +743,7 @@ int main(int argc, char *argv[])
     std::string command_line = dfxml_writer::make_command_line(argc,argv);
     std::string opt_unk_packets;
     bool opt_quiet = false;
+    int opt_jobs = 1;
 
     /* Set up debug system */
     progname = argv[0];
@@ -605,7 +760,7 @@ int main(int argc, char *argv[])
 
     bool trailing_input_list = false;
     int arg;
-    while ((arg = getopt_long(argc, argv, "aA:Bb:cCd:DE:e:E:F:f:gHhIi:lL:m:o:pqR:r:S:sT:U:Vvw:x:X:z:ZK0J", longopts, NULL)) != EOF) {
+    while ((arg = getopt_long(argc, argv, "aA:Bb:cCd:DE:e:E:F:f:gHhIi:j:lL:m:o:pqR:r:S:sT:U:Vvw:x:X:z:ZK0J", longopts, NULL)) != EOF) {
 	switch (arg) {
 	case 'a':
 	    demux.opt.post_processing = true;
@@ -680,6 +835,13 @@ int main(int argc, char *argv[])
 	    break;
         }
     case 'i': device = std::string(optarg); break;
+	case 'j':
+	    opt_jobs = atoi(optarg);
+	    if(opt_jobs < 1){
+		std::cerr << "-j requires a positive number of jobs\n";
+		exit(1);
+	    }
+	    break;
  	case 'I':
  		DEBUG(10) ("creating packet index files");
  		demux.opt.output_packet_index = true;
@@ -690,6 +852,8 @@ int main(int argc, char *argv[])
 	    break;
         case 'l': trailing_input_list = true; break;
     case 'J':
+        opt_enable_report = false;
+        demux.opt.console_output = true;
         demux.opt.output_json = true;
         break;
     case 'K':;
@@ -847,14 +1011,6 @@ int main(int argc, char *argv[])
 	dfxml_create(*xreport,argc_original,argv_original);
 	demux.xreport = xreport;
     }
-    if(opt_unk_packets.size()>0){
-        if(input_fname.size()==0){
-            std::cerr << "currently the -w option requires the -r option\n";
-            exit(1);
-        }
-        if(access(input_fname.c_str(),R_OK)) die("cannot read: %s: %s",input_fname.c_str(),strerror(errno));
-        demux.save_unk_packets(opt_unk_packets,input_fname);
-    }
 
 
     /* Debug prefix set? */
@@ -878,6 +1034,68 @@ int main(int argc, char *argv[])
     si.get_config("tdelta",&datalink_tdelta,"Time offset for packets");
     si.get_config("packet-buffer-timeout", &packet_buffer_timeout, "Time in milliseconds between each callback from libpcap");
 
+    /* Gather each flow's segments into one write */
+    uint32_t write_buffer_mb = demux.opt.write_buffer_mem / (1024*1024);
+    si.get_config("write-buffer",&demux.opt.write_buffer,"Bytes of each flow's output to gather into one write (0 to write each segment)");
+    si.get_config("write-buffer-mem",&write_buffer_mb,"Megabytes of write buffers for all flows together");
+    si.get_config("write-buffer-age",&demux.opt.write_buffer_age,"Seconds that output may stay in a write buffer");
+    demux.opt.write_buffer_mem = (size_t)write_buffer_mb*1024*1024;
+
+    /* Hold back segments that arrive early so that flow files are written in order */
+    uint32_t reorder_queue_mb = demux.opt.reorder_queue_mem / (1024*1024);
+    si.get_config("reorder-queue",&demux.opt.reorder_queue,"Bytes of each flow's out-of-order segments to hold in memory (0 to write them as they come)");
+    si.get_config("reorder-queue-mem",&reorder_queue_mb,"Megabytes of out-of-order segments to hold in memory for all flows together");
+    si.get_config("reorder-queue-age",&demux.opt.reorder_queue_age,"Seconds that out-of-order segments may be held in memory");
+    demux.opt.reorder_queue_mem = (size_t)reorder_queue_mb*1024*1024;
+
+    /* Remember closed flows, and check late retransmissions for them in memory */
+    uint32_t saved_flow_mb = demux.opt.saved_flow_mem / (1024*1024);
+    si.get_config("saved-flow-mem",&saved_flow_mb,"Megabytes of closed flows to remember, so that late retransmissions for them are not taken for new flows");
+    demux.opt.saved_flow_mem = (size_t)saved_flow_mb*1024*1024;
+    si.get_config("straggler-tail",&demux.opt.straggler_tail,"Bytes at the end of each flow to check late retransmissions against without reading the file (0 to read it)");
+
+    si.get_config("fd-clock",&demux.opt.fd_clock,"Pick the flow file to close when out of descriptors by the clock algorithm, not strictly the least recently used");
+
+    /* Queue file writes and closes instead of waiting for them */
+    si.get_config("io-backend",&demux.opt.io_backend,"How files are written: sync, or uring to queue writes and closes on an io_uring (Linux)");
+    si.get_config("io-depth",&demux.opt.io_depth,"File operations that may be outstanding with io-backend=uring");
+    std::string io_why = flow_io::unavailable(demux.opt.io_backend);
+    if(io_why.size()){
+        if(!opt_quiet) std::cerr << "io-backend=" << demux.opt.io_backend << " is ignored: " << io_why << "\n";
+        demux.opt.io_backend = "sync";
+    }
+
+    /* Put the flows in a few big files */
+    uint32_t segment_mb = 0;
+    si.get_config("segment-size",&segment_mb,"Megabytes per segment file to append all of the flows to, with an index, instead of a file per flow (0 for a file per flow)");
+    demux.opt.segment_size = (uint64_t)segment_mb*1024*1024;
+
+    /* How -K and -w write pcaps */
+    si.get_config("pcap-both-directions",&demux.opt.pcap_both_directions,"With -K, write both directions of each connection to one pcap file");
+    std::string pcap_format("pcap");
+    si.get_config("pcap-format",&pcap_format,"Format of the pcap files that -K and -w write: pcap, or pcapng with nanosecond timestamps");
+    if(!pcap_writer::parse_format(pcap_format,&demux.opt.pcap_format)){
+        std::cerr << "pcap-format must be pcap or pcapng, not " << pcap_format << "\n";
+        exit(1);
+    }
+    if(opt_unk_packets.size()>0){
+        demux.save_unk_packets(opt_unk_packets);
+    }
+
+    /* How -c and -C output is gathered */
+    uint32_t console_buffer = console_writer::FLUSH_BYTES;
+    uint32_t console_flush_ms = console_writer::FLUSH_MS;
+    si.get_config("console-buffer",&console_buffer,"Bytes of -c and -C output to gather into one write (0 to write after every packet)");
+    si.get_config("console-flush-ms",&console_flush_ms,"Milliseconds that -c and -C output may wait to be written");
+    demux.console.set_flush(console_buffer,console_flush_ms);
+    std::string json_payload("base64");
+    si.get_config("json-payload",&json_payload,"How -J prints packet data: base64 or hex");
+    if(json_payload!="base64" && json_payload!="hex"){
+        std::cerr << "json-payload must be base64 or hex, not " << json_payload << "\n";
+        exit(1);
+    }
+    demux.opt.json_payload_hex = (json_payload=="hex");
+
     /* Record the configuration */
     if(xreport){
         xreport->push("configuration");
@@ -885,6 +1103,77 @@ int main(int argc, char *argv[])
         xreport->xmlout("tdelta",datalink_tdelta);
     }
 
+    /* Start the worker threads.
+     * Console output has to come out in packet order, so it stays single-threaded.
+     */
+    if(opt_jobs > 1 && demux.opt.console_output){
+        if(!opt_quiet) std::cerr << "-j is ignored with console output\n";
+        opt_jobs = 1;
+    }
+#ifndef HAVE_PTHREAD
+    if(opt_jobs > 1){
+        if(!opt_quiet) std::cerr << "-j is not available; this tcpflow was built without pthreads\n";
+        opt_jobs = 1;
+    }
+#endif
+    if(opt_jobs > 1) demux.start_shards(opt_jobs);
+
+    /* Live capture straight from the kernel's packet ring (Linux) */
+    bool opt_af = false;
+    uint32_t af_blocks = 32, af_fanout = 1;
+    size_t af_block_size = 1024*1024;
+    si.get_config("af-packet",&opt_af,"Capture live from a TPACKET_V3 ring instead of libpcap (Linux)");
+    si.get_config("af-packet-block-size",&af_block_size,"Bytes per af-packet ring block");
+    si.get_config("af-packet-blocks",&af_blocks,"Blocks per af-packet ring");
+    si.get_config("af-packet-fanout",&af_fanout,"Number of af-packet sockets in a PACKET_FANOUT group");
+#ifdef HAVE_AF_PACKET
+    opt_af_packet = opt_af;
+    af_packet_config.block_size  = af_block_size;
+    af_packet_config.block_count = af_blocks;
+    af_packet_config.fanout      = af_fanout;
+    af_packet_config.timeout_ms  = packet_buffer_timeout;
+    af_packet_config.promisc     = !opt_no_promisc;
+#else
+    if(opt_af && !opt_quiet) std::cerr << "af-packet is not available on this system; using libpcap\n";
+#endif
+
+    /* Move capture onto its own thread, so that slow output does not hold up libpcap */
+    uint32_t capture_ring_mb = 32;
+    std::string capture_ring_full("block");
+    si.get_config("capture-ring",&capture_ring_mb,"Megabytes of packets buffered between capture and processing (0 to disable)");
+    si.get_config("capture-ring-full",&capture_ring_full,"When the capture ring is full: block or drop");
+    if(capture_ring_full!="block" && capture_ring_full!="drop"){
+        die("capture-ring-full must be block or drop, not '%s'",capture_ring_full.c_str());
+    }
+    /* Read one large capture file as byte ranges, each on its own thread */
+    uint32_t pcap_split_ranges = 0;
+    si.get_config("pcap-split",&pcap_split_ranges,"Read a single -r pcap file as this many byte ranges in parallel");
+    if(pcap_split_ranges > 1){
+        std::string why = pcap_split::unsplittable(demux);
+        if(why.empty() && (rfiles.size()!=1 || Rfiles.size()>0)) why = "it reads a single -r file";
+        if(why.size()){
+            if(!opt_quiet) std::cerr << "pcap-split is ignored: " << why << "\n";
+            pcap_split_ranges = 0;
+        }
+    }
+    opt_pcap_split = pcap_split_ranges;
+
+    /* Read several -r files as one capture */
+    si.get_config("merge-inputs",&opt_merge_inputs,"Read all the -r files at once, merging their packets in timestamp order");
+    if(opt_merge_inputs && rfiles.size() < 2){
+        if(!opt_quiet) std::cerr << "merge-inputs is ignored: it needs more than one -r file\n";
+        opt_merge_inputs = false;
+    }
+
+#ifdef HAVE_PTHREAD
+#ifdef HAVE_AF_PACKET
+    if(opt_af_packet && rfiles.empty() && Rfiles.empty()) capture_ring_mb = 0; // its ring does the same job
+#endif
+    /* made when it is needed: files that pcap_reader reads do not go through pcap_loop() */
+    capture_ring_bytes  = (size_t)capture_ring_mb*1024*1024;
+    capture_ring_policy = capture_ring_full=="drop" ? capture_ring::DROP : capture_ring::BLOCK;
+#endif
+
 
 
     /* Process r files and R files */
@@ -904,12 +1193,18 @@ int main(int argc, char *argv[])
     else {
 	/* first pick up the new connections with -r */
 	demux.start_new_connections = true;
-	for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
-	    int err = process_infile(demux,expression,device,*it);
-	    if (err < 0) {
-	        exit_val = 1;
+        if (opt_merge_inputs) {
+            if (process_merged_files(demux,expression,rfiles) < 0) {
+                exit_val = 1;
+            }
+        } else {
+	    for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
+	        int err = process_infile(demux,expression,device,*it);
+	        if (err < 0) {
+	            exit_val = 1;
+	        }
 	    }
-	}
+        }
 	/* now pick up the outstanding connection with -R, but don't start new connections */
 	demux.start_new_connections = false;
 	for(std::vector<std::string>::const_iterator it=Rfiles.begin();it!=Rfiles.end();it++){
@@ -922,15 +1217,18 @@ int main(int argc, char *argv[])
 
     /* -1 causes pcap_loop to loop forever, but it finished when the input file is exhausted. */
 
-    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.open_flows.size());
+    int open_fds = (int)demux.open_flow_count();
+    int flow_map_size = (int)demux.active_flow_count();
+
+    DEBUG(2)("Open FDs at end of processing:      %d",open_fds);
     DEBUG(2)("demux.max_open_flows:               %d",(int)demux.max_open_flows);
-    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map.size());
+    DEBUG(2)("Flow map size at end of processing: %d",flow_map_size);
     DEBUG(2)("Flows seen:                         %d",(int)demux.flow_counter);
 
-    int open_fds = (int)demux.open_flows.size();
-    int flow_map_size = (int)demux.flow_map.size();
-
     demux.remove_all_flows();	// empty the map to capture the state
+    demux.console.flush();
+    delete demux.pwriter;               // writes out the unprocessed packets that are gathered
+    demux.pwriter = 0;
     std::stringstream ss;
     be13::plugin::phase_shutdown(fs,xreport ? &ss : 0);
 
@@ -951,13 +1249,65 @@ int main(int argc, char *argv[])
         xreport->xmlout("total_flows",demux.flow_counter);
         xreport->xmlout("flow_map_size",flow_map_size);
         xreport->xmlout("total_packets",demux.packet_counter);
+        xreport->xmlout("flow_segments",demux.flow_segments);
+        xreport->xmlout("flow_writes",demux.flow_writes);
+        xreport->xmlout("queued_segments",demux.queued_segments);
+        xreport->xmlout("queue_trims",demux.queue_trims);
+        xreport->xmlout("file_shifts",demux.file_shifts);
+        xreport->xmlout("straggler_filtered",demux.straggler_filtered);
+        xreport->xmlout("saved_flow_hits",demux.saved_flow_hits);
+        xreport->xmlout("saved_flow_misses",demux.saved_flow_misses);
+        xreport->xmlout("saved_flow_evictions",demux.saved_flow_evictions);
+        xreport->xmlout("straggler_reads",demux.straggler_reads);
+        xreport->xmlout("pcap_reopens",demux.pcap_reopens);
+        if(demux.fio) demux.fio->dump_xml(*xreport);
+        demux.tcpip_pool.dump_xml(*xreport);
+        demux.conn_pool.dump_xml(*xreport);
+        demux.saved_flow_pool.dump_xml(*xreport);
+        demux.sparse_flow_pool.dump_xml(*xreport);
+#ifdef HAVE_PTHREAD
+        if(capture) capture->dump_xml(*xreport);
+#endif
+#ifdef HAVE_AF_PACKET
+        if(af_capture) af_capture->dump_xml(*xreport);
+#endif
+        if(file_split) file_split->dump_xml(*xreport);
+        if(file_merge) file_merge->dump_xml(*xreport);
 	xreport->add_rusage();
 	xreport->pop();                 // bulk_extractor
 	xreport->close();
 	delete xreport;
     }
 
-    if(demux.flow_counter > tcpdemux::WARN_TOO_MANY_FILES){
+#ifdef HAVE_PTHREAD
+    if(capture){
+        if((capture->ring_drops || capture->kernel_drops) && !opt_quiet){
+            std::cerr << "*** tcpflow WARNING: " << capture->ring_drops << " packets dropped by the capture ring, "
+                      << capture->kernel_drops << " dropped by the kernel\n";
+        }
+        delete capture;
+        capture = 0;
+    }
+#endif
+    if(file_split){
+        delete file_split;
+        file_split = 0;
+    }
+    if(file_merge){
+        delete file_merge;
+        file_merge = 0;
+    }
+#ifdef HAVE_AF_PACKET
+    if(af_capture){
+        if(af_capture->kernel_drops && !opt_quiet){
+            std::cerr << "*** tcpflow WARNING: " << af_capture->kernel_drops << " packets dropped by the kernel\n";
+        }
+        delete af_capture;
+        af_capture = 0;
+    }
+#endif
+
+    if(demux.flow_counter > tcpdemux::WARN_TOO_MANY_FILES && demux.opt.segment_size==0){
         if(!opt_quiet){
             /* Start counting how many files we have in the output directory.
              * If we find more than 10,000, print the warning, and keep counting...
@@ -983,6 +1333,7 @@ int main(int argc, char *argv[])
                 std::cerr << "***\n";
                 std::cerr << "*** Next time, specify command-line options: -Fk , -Fm , or -Fg \n";
                 std::cerr << "*** This will automatically bin output into subdirectories.\n";
+                std::cerr << "*** Or use -S segment-size=1024 to put the flows in a few large files.\n";
                 std::cerr << "*** type 'tcpflow -hhh' for more information.\n";
             }
         }
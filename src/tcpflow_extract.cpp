@@ -0,0 +1,276 @@
+/*
+ * This file is part of tcpflow by Simson Garfinkel <simsong@acm.org>.
+ *
+ * This source code is under the GNU Public License (GPL) version 3.
+ * See COPYING for details.
+ *
+ * tcpflow-extract:
+ * Make the flow files (and HTTP bodies) that tcpflow -S segment-size=N
+ * put in segment files, from the indexes it wrote with them. The format
+ * is described in flow_segments.h.
+ *
+ * usage: tcpflow-extract [-l] [-c] [-o outdir] [-f name]... flows-N.idx...
+ *   -l       list the files in the indexes, with their sizes, instead
+ *   -c       write the files one after the other to stdout
+ *   -o dir   make the files under dir (default .)
+ *   -f name  only this file (may be given more than once)
+ *
+ * Several indexes may be given, such as the flows-0.idx, flows-1.idx ...
+ * of a run with -j; a segment is found next to the index that names it.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct extent {
+    uint64_t offset;                    // in the file
+    uint64_t length;
+    size_t   index;                     // which index named the segment
+    uint32_t segment;
+    uint64_t segment_offset;
+};
+
+struct flow_file {
+    flow_file():extents(),closed(false),mtime(){}
+    std::vector<extent> extents;        // the later wins where they overlap
+    bool     closed;
+    struct timeval mtime;
+    uint64_t size() const {
+        uint64_t s = 0;
+        for(size_t i=0;i<extents.size();i++) s = std::max(s,extents[i].offset+extents[i].length);
+        return s;
+    }
+};
+
+typedef std::map<std::string,flow_file> flow_files_t;
+
+static const char *progname = "tcpflow-extract";
+static std::vector<std::string> prefixes; // each index's name, without .idx
+
+static void usage()
+{
+    fprintf(stderr,"usage: %s [-l] [-c] [-o outdir] [-f name]... flows-N.idx...\n",progname);
+    fprintf(stderr,"  -l       list the files in the indexes, with their sizes\n");
+    fprintf(stderr,"  -c       write the files to stdout\n");
+    fprintf(stderr,"  -o dir   make the files under dir (default .)\n");
+    fprintf(stderr,"  -f name  only this file (may be repeated)\n");
+    exit(1);
+}
+
+/* split a line of the index at its tabs; the name, last, may have anything else in it */
+static std::vector<std::string> fields(const std::string &line,size_t n)
+{
+    std::vector<std::string> f;
+    size_t start = 0;
+    while(f.size()+1 < n){
+        size_t tab = line.find('\t',start);
+        if(tab==std::string::npos) break;
+        f.push_back(line.substr(start,tab-start));
+        start = tab+1;
+    }
+    f.push_back(line.substr(start));
+    return f;
+}
+
+static bool read_index(const std::string &path,flow_files_t &files)
+{
+    FILE *f = fopen(path.c_str(),"r");
+    if(f==0){
+        fprintf(stderr,"%s: %s: %s\n",progname,path.c_str(),strerror(errno));
+        return false;
+    }
+    size_t idx = prefixes.size();
+    prefixes.push_back(path.size()>4 && path.compare(path.size()-4,4,".idx")==0 ? path.substr(0,path.size()-4) : path);
+
+    char *buf = 0;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t lineno = 0;
+    while((len = getline(&buf,&cap,f)) > 0){
+        lineno++;
+        std::string line(buf,len);
+        if(line[line.size()-1]=='\n') line.erase(line.size()-1);
+        if(line.empty() || line[0]=='#') continue;
+        std::vector<std::string> v;
+        switch(line[0]){
+        case 'E': {
+            v = fields(line,6);
+            if(v.size()!=6) break;
+            extent e;
+            e.offset         = strtoull(v[1].c_str(),0,10);
+            e.length         = strtoull(v[2].c_str(),0,10);
+            e.index          = idx;
+            e.segment        = strtoul(v[3].c_str(),0,10);
+            e.segment_offset = strtoull(v[4].c_str(),0,10);
+            files[v[5]].extents.push_back(e);
+            continue;
+        }
+        case 'S': {
+            v = fields(line,3);
+            if(v.size()!=3) break;
+            uint64_t by = strtoull(v[1].c_str(),0,10);
+            flow_file &ff = files[v[2]];
+            for(size_t i=0;i<ff.extents.size();i++) ff.extents[i].offset += by;
+            continue;
+        }
+        case 'T':
+            v = fields(line,2);
+            if(v.size()!=2) break;
+            files[v[1]].extents.clear();
+            continue;
+        case 'C': {
+            v = fields(line,3);
+            if(v.size()!=3) break;
+            flow_file &ff = files[v[2]];
+            char *usec = 0;
+            ff.closed = true;
+            ff.mtime.tv_sec  = (time_t)strtoll(v[1].c_str(),&usec,10);
+            ff.mtime.tv_usec = *usec=='.' ? (suseconds_t)strtol(usec+1,0,10) : 0;
+            continue;
+        }
+        default:
+            break;
+        }
+        fprintf(stderr,"%s: %s:%" PRIu64 ": cannot read this line\n",progname,path.c_str(),lineno);
+    }
+    free(buf);
+    fclose(f);
+    return true;
+}
+
+/* the segments, opened as they are needed */
+static std::map<std::pair<size_t,uint32_t>,int> segment_fds;
+
+static int segment(size_t idx,uint32_t n)
+{
+    std::pair<size_t,uint32_t> key(idx,n);
+    std::map<std::pair<size_t,uint32_t>,int>::const_iterator it = segment_fds.find(key);
+    if(it!=segment_fds.end()) return it->second;
+    char suffix[32];
+    snprintf(suffix,sizeof(suffix),".%06u.seg",n);
+    std::string path = prefixes[idx] + suffix;
+    int fd = open(path.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) fprintf(stderr,"%s: %s: %s\n",progname,path.c_str(),strerror(errno));
+    segment_fds[key] = fd;
+    return fd;
+}
+
+/* the bytes of the file, with zeros where nothing was written */
+static bool contents(const std::string &name,const flow_file &ff,std::vector<uint8_t> &out)
+{
+    out.assign(ff.size(),0);
+    for(size_t i=0;i<ff.extents.size();i++){
+        const extent &e = ff.extents[i];
+        int fd = segment(e.index,e.segment);
+        if(fd<0) return false;
+        if(pread(fd,&out[e.offset],e.length,(off_t)e.segment_offset)!=(ssize_t)e.length){
+            fprintf(stderr,"%s: %s: a segment is too short\n",progname,name.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void mkdirs(const std::string &path)
+{
+    for(size_t slash = path.find('/',1);slash!=std::string::npos;slash = path.find('/',slash+1)){
+        mkdir(path.substr(0,slash).c_str(),0777);
+    }
+}
+
+static bool extract(const std::string &outdir,const std::string &name,const flow_file &ff)
+{
+    std::vector<uint8_t> buf;
+    if(!contents(name,ff,buf)) return false;
+    std::string path = outdir=="." ? name : outdir + "/" + name;
+    mkdirs(path);
+    int fd = open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0666);
+    if(fd<0){
+        fprintf(stderr,"%s: %s: %s\n",progname,path.c_str(),strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for(size_t done=0;done<buf.size();){
+        ssize_t r = write(fd,&buf[done],buf.size()-done);
+        if(r<=0){
+            fprintf(stderr,"%s: %s: %s\n",progname,path.c_str(),strerror(errno));
+            ok = false;
+            break;
+        }
+        done += r;
+    }
+    if(ff.closed){
+        struct timeval times[2] = {ff.mtime,ff.mtime};
+        futimes(fd,times);
+    }
+    close(fd);
+    return ok;
+}
+
+int main(int argc,char **argv)
+{
+    bool list = false;
+    bool to_stdout = false;
+    std::string outdir(".");
+    std::set<std::string> only;
+    int ch;
+    while((ch = getopt(argc,argv,"lco:f:h")) != -1){
+        switch(ch){
+        case 'l': list = true; break;
+        case 'c': to_stdout = true; break;
+        case 'o': outdir = optarg; break;
+        case 'f': only.insert(optarg); break;
+        default:  usage();
+        }
+    }
+    if(optind>=argc) usage();
+
+    flow_files_t files;
+    for(int i=optind;i<argc;i++){
+        if(!read_index(argv[i],files)) return 1;
+    }
+
+    int errors = 0;
+    for(std::set<std::string>::const_iterator it=only.begin();it!=only.end();it++){
+        if(files.find(*it)==files.end()){
+            fprintf(stderr,"%s: %s is not in the index\n",progname,it->c_str());
+            errors++;
+        }
+    }
+    for(flow_files_t::const_iterator it=files.begin();it!=files.end();it++){
+        if(only.size() && only.count(it->first)==0) continue;
+        if(list){
+            printf("%" PRIu64 "\t%s\n",it->second.size(),it->first.c_str());
+        } else if(to_stdout){
+            std::vector<uint8_t> buf;
+            if(!contents(it->first,it->second,buf)){
+                errors++;
+                continue;
+            }
+            if(buf.size() && fwrite(&buf[0],1,buf.size(),stdout)!=buf.size()) return 1;
+        } else {
+            if(!extract(outdir,it->first,it->second)) errors++;
+        }
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of tcpflow by Simson Garfinkel <simsong@acm.org>.
+ *
+ * This source code is under the GNU Public License (GPL) version 3.
+ * See COPYING for details.
+ *
+ * tcpflow-findx:
+ * Print the packet indexes that tcpflow -I wrote next to its flow files
+ * in the old text form, one "offset|sec.usec|length" line per packet, in
+ * order of offset. The format is described in flow_index.h.
+ *
+ * usage: tcpflow-findx [-o offset] flow.findx...
+ *   -o offset  only the packet with the byte at offset in the flow file,
+ *              or the first after it
+ */
+
+#include "config.h"
+#include "flow_index.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+static const char *progname = "tcpflow-findx";
+
+static void usage()
+{
+    fprintf(stderr,"usage: %s [-o offset] flow.findx...\n",progname);
+    fprintf(stderr,"  -o offset  only the packet with the byte at offset, or the first after it\n");
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    bool one = false;
+    uint64_t offset = 0;
+    int ch;
+    while((ch = getopt(argc,argv,"o:h")) != -1){
+        switch(ch){
+        case 'o': {
+            char *end = 0;
+            offset = strtoull(optarg,&end,10);
+            if(end==optarg || *end) usage();
+            one = true;
+            break;
+        }
+        default:  usage();
+        }
+    }
+    if(optind>=argc) usage();
+
+    int errors = 0;
+    for(int i=optind;i<argc;i++){
+        flow_index_reader idx;
+        if(!idx.open(argv[i])){
+            fprintf(stderr,"%s: %s: %s\n",progname,argv[i],
+                    errno==EINVAL ? "not a tcpflow packet index" : strerror(errno));
+            errors++;
+            continue;
+        }
+        size_t start = one ? idx.find(offset) : 0;
+        size_t end   = one ? std::min(start+1,idx.size()) : idx.size();
+        for(size_t j=start;j<end;j++){
+            if(argc-optind>1) printf("%s:",argv[i]);
+            printf("%s\n",flow_index::text(idx[j]).c_str());
+        }
+    }
+    return errors ? 1 : 0;
+}
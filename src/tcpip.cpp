@@ -33,31 +33,35 @@
  * called from tcpdemux::create_tcpip()
  */
 tcpip::tcpip(tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_):
-    demux(demux_),myflow(flow_),dir(unknown),isn(isn_),nsn(0),
-    syn_count(0),fin_count(0),fin_size(0),pos(0),
-    flow_pathname(),fd(-1),file_created(false),
-    flow_index_pathname(),idx_file(),
-    seen(new recon_set()),
-    last_byte(),
-    last_packet_number(),out_of_order_count(0),violations(0)
+    demux(demux_),isn(isn_),nsn(0),pos(0),fd(-1),
+    syn_count(0),fin_count(0),fin_size(0),
+    last_byte(),last_packet_number(),
+    dir(unknown),file_created(false),hold(true),used(false),
+    wbuf(0),wbuf_len(0),wbuf_off(0),wbuf_time(0),file_end(0),
+    queue(0),released(0),
+    seen(),
+    tail(0),tail_len(0),tail_cap(0),tail_off(0),
+    myflow(flow_),
+    flow_pathname(),
+    open_link(),wbuf_link(),queue_link(),
+    rare(0)
 {
 }
 
 
 uint32_t tcpip::seen_bytes()
 {
-    if(seen) return seen->size();
-    return 0;
+    return seen.size();
 }
 
 void tcpip::dump_seen()
 {
-    if(seen){
-        for(recon_set::const_iterator it = seen->begin(); it!=seen->end(); it++){
-            std::cerr << *it << ", ";
-        }
-        std::cerr << std::endl;
+    std::vector<interval_set::interval> ranges;
+    seen.get(ranges);
+    for(std::vector<interval_set::interval>::const_iterator it = ranges.begin(); it!=ranges.end(); it++){
+        std::cerr << "[" << it->first << "," << it->second << "), ";
     }
+    std::cerr << std::endl;
 }
 
 void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
@@ -83,8 +87,8 @@ void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
     attrs << "srcport='"  << myflow.sport << "' ";
     attrs << "dstport='"  << myflow.dport << "' ";
     attrs << "packets='"  << myflow.packet_count << "' ";
-    if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
-    if(violations)         attrs << "violations='" << violations << "' ";
+    if(out_of_order_count()) attrs << "out_of_order_count='" << out_of_order_count() << "' ";
+    if(violations())         attrs << "violations='" << violations() << "' ";
     attrs << "len='"      << myflow.len << "' ";
     if(myflow.len != myflow.caplen) attrs << "caplen='"   << myflow.caplen << "' ";
     xreport->xmlout(tcpflow_str,"",attrs.str(),false);
@@ -103,7 +107,13 @@ void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
 tcpip::~tcpip()
 {
     assert(fd<0);                       // file must be closed
-    delete seen;                        // no need to check to see if seen is null or not.
+    if(queue){                          // emptied when the file was closed
+        demux.reorder_queue_used -= queue->bytes;
+        demux.queued_flows.erase(this);
+        delete queue;
+    }
+    delete rare;
+    free(tail);
 }
 
 #pragma GCC diagnostic warning "-Weffc++"
@@ -127,47 +137,246 @@ tcpip::~tcpip()
  */
 void tcpip::close_file()
 {
+    flush();
     if (fd>=0){
-	struct timeval times[2];
-	times[0] = myflow.tstart;
-	times[1] = myflow.tstart;
-
 	DEBUG(5) ("%s: closing file in tcpip::close_file", flow_pathname.c_str());
-	/* close the file and remember that it's closed */
-#if defined(HAVE_FUTIMES)
-        /* fix microseconds if they are invalid */
-        for ( int i=0; i<2; i++){
-            if ( times[i].tv_usec < 0 || times[i].tv_usec >= 1000000 ){
-                times[i].tv_usec = 0;
-            }
-        }
-	if (futimes(fd,times)){
-	    fprintf(stderr,"%s: futimes(fd=%d,[%ld:%ld,%ld:%ld])\n",
-                    strerror(errno),fd,
-                    times[0].tv_sec,times[1].tv_usec,
-                    times[1].tv_sec,times[1].tv_usec);
-	}
-#elif defined(HAVE_FUTIMENS) 
-	struct timespec tstimes[2];
-	for(int i=0;i<2;i++){
-	    tstimes[i].tv_sec = times[i].tv_sec;
-	    tstimes[i].tv_nsec = times[i].tv_usec * 1000;
-	}
-	if(futimens(fd,tstimes)){
-	    perror("futimens(fd=%d)",fd);
-	}
-#endif
-	close(fd);
+	/* close the file, with the time of the flow, and remember that it's closed */
+	demux.io().close(fd,&myflow.tstart);
 	fd = -1;
 	demux.open_flows.erase(this);           // we are no longer open
     }
-    // Also close the flow_index file, if flow indexing is in use --GDD
-    if(demux.opt.output_packet_index && idx_file.is_open()){
-    	idx_file.close();
-    }
+    // Also write out the flow index, if flow indexing is in use --GDD
+    if(demux.opt.output_packet_index) flush_index();
     //std::cerr << "close_file1 " << *this << "\n";
 }
 
+/****************************************************************
+ ** WRITE COALESCING
+ ****************************************************************
+ *
+ * Most segments are a packet's worth of bytes or less, and a write() for
+ * each is most of the cost of storing a flow. Instead each flow gathers
+ * its bytes in a buffer of demux.opt.write_buffer bytes and writes the
+ * buffer with one pwrite() when the next segment will not fit in it.
+ *
+ * The buffer holds one run of the file. A segment fits if it starts
+ * inside the run or where it ends, as in-order data and retransmissions
+ * do, or after a gap beyond anything written to the file yet, as the
+ * segments after a lost one do; the gap is zeros in the buffer, just as
+ * it would be a hole in the file, and is filled in if the lost segment
+ * arrives while it is still buffered.
+ *
+ * The buffer is written out when the file is closed or read, on a FIN,
+ * when its bytes are write_buffer_age seconds old, and, oldest first,
+ * when the buffers of all the flows would need more than write_buffer_mem.
+ */
+
+/* write bytes straight to the file */
+void tcpip::write_file(uint64_t offset,const uint8_t *data,uint32_t length)
+{
+    remember_tail(offset,data,length);
+    demux.flow_writes++;
+    demux.io().write(fd,offset,data,length);
+    if(offset + length > file_end) file_end = offset + length;
+}
+
+/* keep the last demux.opt.straggler_tail bytes of the file that are known, as they are written */
+void tcpip::remember_tail(uint64_t offset,const uint8_t *data,uint32_t length)
+{
+    const uint32_t size = demux.opt.straggler_tail;
+    if(size==0 || length==0) return;
+    const uint64_t end = offset + length;
+    uint64_t tail_end = tail_off + tail_len;
+    if(tail_len==0 || offset > tail_end){      // not joined to what we have: start again
+        tail_off = tail_end = offset;
+        tail_len = 0;
+    }
+    if(end <= tail_end){                        // rewriting bytes we have
+        if(end > tail_off){
+            uint64_t from = std::max(offset,tail_off);
+            memcpy(tail+(from-tail_off),data+(from-offset),end-from);
+        }
+        return;
+    }
+    /* the tail now ends at end; keep the old bytes from its new start up to offset */
+    uint64_t start = std::min(offset,tail_off);
+    if(end - start > size) start = end - size;
+    if(end - start > tail_cap){         // short flows need less than size
+        uint32_t cap = std::min(size,std::max((uint32_t)(end - start),tail_cap*2));
+        uint8_t *bigger = (uint8_t *)realloc(tail,cap);
+        if(bigger==0) return;
+        tail     = bigger;
+        tail_cap = cap;
+    }
+    if(offset > start) memmove(tail,tail+(start-tail_off),offset-start);
+    uint64_t from = std::max(offset,start);
+    memcpy(tail+(from-start),data+(from-offset),end-from);
+    tail_off = start;
+    tail_len = end - start;
+}
+
+void tcpip::flush_buffer()
+{
+    if(wbuf==0) return;
+    DEBUG(25) ("%s: flush %u buffered bytes @%" PRId64, flow_pathname.c_str(), wbuf_len, wbuf_off);
+    if(fd>=0){
+        remember_tail(wbuf_off,wbuf,wbuf_len);
+        demux.flow_writes++;
+        demux.io().write_owned(fd,wbuf_off,wbuf,wbuf_len); // which frees it
+        if(wbuf_off + wbuf_len > file_end) file_end = wbuf_off + wbuf_len;
+    } else {
+        free(wbuf);
+    }
+    wbuf     = 0;
+    wbuf_len = 0;
+    demux.write_buffer_used -= demux.opt.write_buffer;
+    demux.buffered_flows.erase(this);
+}
+
+/* store bytes at offset in the file, buffering them if we can */
+void tcpip::write_data(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts)
+{
+    if(length==0) return;
+    demux.flow_segments++;
+    const uint32_t size = demux.opt.write_buffer;
+    demux.trim_write_buffers(ts,0);
+    if(wbuf){
+        const uint64_t end = wbuf_off + wbuf_len;
+        if(offset >= wbuf_off && offset + length <= wbuf_off + size && (offset <= end || end >= file_end)){
+            if(offset > end) memset(wbuf+wbuf_len,0,offset-end);
+            memcpy(wbuf+(offset-wbuf_off),data,length);
+            if(offset + length > end) wbuf_len = offset + length - wbuf_off;
+            return;
+        }
+        flush_buffer();
+    }
+    if(length < size){
+        demux.trim_write_buffers(ts,size);
+        if(demux.write_buffer_used + size <= demux.opt.write_buffer_mem && (wbuf = (uint8_t *)malloc(size))!=0){
+            demux.write_buffer_used += size;
+            demux.buffered_flows.push_back(this);
+            memcpy(wbuf,data,length);
+            wbuf_off  = offset;
+            wbuf_len  = length;
+            wbuf_time = ts.tv_sec;
+            return;
+        }
+    }
+    write_file(offset,data,length);
+}
+
+/****************************************************************
+ ** REORDERING
+ ****************************************************************
+ *
+ * A flow whose SYN we did not see starts where its first segment
+ * says it does, and a segment from before that used to mean moving
+ * everything already written up the file with flow_io::shift(). So
+ * until the start is settled, a new flow holds all of its segments in a
+ * reorder_queue; a segment from before the start just moves the offsets
+ * of the queued ones up. Once the flow is released, segments after a gap
+ * are held back until the gap is filled, so that the file is written
+ * front to back.
+ *
+ * A flow's queue is released when it has more than demux.opt.reorder_queue
+ * bytes, when its oldest segment is reorder_queue_age seconds old (checked
+ * on every packet, whichever flow it is for), on a FIN, when the file is
+ * closed, and, oldest first, when the queues of all the flows hold more
+ * than reorder_queue_mem. What is written then goes into the
+ * file in order, with holes for the gaps that were never filled; after
+ * that, a segment from before the start falls back to flow_io::shift().
+ */
+
+void reorder_queue::insert(uint64_t offset,const u_char *data,uint32_t length)
+{
+    const uint64_t end = offset + length;
+    std::vector<std::pair<uint64_t,uint64_t> > gaps; // the parts no segment covers yet
+    uint64_t cur = offset;
+
+    segments_t::iterator it = segments.upper_bound(offset);
+    if(it!=segments.begin()) --it;
+    for(;it!=segments.end() && it->first < end;it++){
+        uint64_t s = it->first;
+        uint64_t e = s + it->second.size();
+        if(e <= cur) continue;
+        if(s > cur) gaps.push_back(std::make_pair(cur,s));
+        uint64_t os = std::max(s,cur);
+        uint64_t oe = std::min(e,end);
+        it->second.replace(os-s,oe-os,(const char *)data+(os-offset),oe-os);
+        cur = oe;
+    }
+    if(cur < end) gaps.push_back(std::make_pair(cur,end));
+    for(size_t i=0;i<gaps.size();i++){
+        segments[gaps[i].first].assign((const char *)data+(gaps[i].first-offset),gaps[i].second-gaps[i].first);
+        bytes += gaps[i].second-gaps[i].first;
+    }
+}
+
+void reorder_queue::rebase(uint64_t by)
+{
+    segments_t moved;
+    for(segments_t::iterator it=segments.begin();it!=segments.end();it++){
+        moved[it->first+by].swap(it->second);
+    }
+    segments.swap(moved);
+}
+
+/* store bytes at offset in the file, in order if we can */
+void tcpip::queue_data(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts)
+{
+    if(length==0) return;
+    if(hold && (syn_count>0 || demux.opt.reorder_queue==0)) hold = false; // we know where it starts, or do not care
+    if(!hold && queue==0 && (offset <= released || demux.opt.reorder_queue==0)){
+        write_data(offset,data,length,ts);
+        if(offset+length > released) released = offset+length;
+        return;
+    }
+    if(queue==0){
+        queue = new reorder_queue(ts.tv_sec);
+        demux.queued_flows.push_back(this);
+    }
+    size_t before = queue->bytes;
+    queue->insert(offset,data,length);
+    demux.reorder_queue_used += queue->bytes - before;
+    demux.queued_segments++;
+
+    bool full = queue->bytes > demux.opt.reorder_queue || ts.tv_sec - queue->since >= (time_t)demux.opt.reorder_queue_age;
+    if(full) hold = false;
+    if(!hold) release_queue(full,ts);
+    if(demux.reorder_queue_used > demux.opt.reorder_queue_mem) demux.trim_reorder_queues(ts);
+}
+
+/* write the queued segments up to the first gap, or all of them */
+void tcpip::release_queue(bool all,const struct timeval &ts)
+{
+    if(queue==0) return;
+    hold = false;
+    reorder_queue::segments_t &segs = queue->segments;
+    while(!segs.empty()){
+        reorder_queue::segments_t::iterator first = segs.begin();
+        if(!all && first->first > released) break;
+        uint64_t end = first->first + first->second.size();
+        write_data(first->first,(const u_char *)first->second.data(),first->second.size(),ts);
+        if(end > released) released = end;
+        queue->bytes -= first->second.size();
+        demux.reorder_queue_used -= first->second.size();
+        segs.erase(first);
+    }
+    if(segs.empty()){
+        demux.queued_flows.erase(this);
+        delete queue;
+        queue = 0;
+    }
+}
+
+void tcpip::flush()
+{
+    if(fd<0) return;                    // nothing is queued or buffered without a file
+    release_queue(true,myflow.tlast);
+    flush_buffer();
+    if(demux.opt.output_packet_index) flush_index();
+}
+
 /*
  * Opens the file transcript file (creating file if necessary).
  * Called by store_packet()
@@ -176,14 +385,12 @@ void tcpip::close_file()
 
 int tcpip::open_file()
 {
-	int create_idx_needed = false;
     if(fd<0){
         //std::cerr << "open_file0 " << ct << " " << *this << "\n";
         /* If we don't have a filename, create the flow */
         if(flow_pathname.size()==0) {
-            flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
+            flow_pathname = myflow.new_filename(demux,&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
             file_created = true;		// remember we made it
-            create_idx_needed = true;	// We created a new stream, so we need to create a new flow file. --GDD
             DEBUG(5) ("%s: created new file",flow_pathname.c_str());
         } else {
             /* open an existing flow */
@@ -205,30 +412,6 @@ int tcpip::open_file()
         if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
         //std::cerr << "open_file1 " << *this << "\n";
     }
-    if(demux.opt.output_packet_index){
-    	//Open the file for the flow index.  We don't do this if the flow file could not be
-    	//	opened.  The file must be opened for append, in case this is a reopen.  The filename
-    	//	standard is the flow name followed by ".findx", which google currently says does not
-    	//	conflict with anything major.
-    	flow_index_pathname = flow_pathname + ".findx";
-    	DEBUG(10)("opening index file: %s",flow_index_pathname.c_str());
-    	if(create_idx_needed){
-    		//New flow file, even if there was an old one laying around --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::trunc|std::ios::in|std::ios::out);
-    	}else{
-    		//Use existing flow file --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::ate|std::ios::in|std::ios::out);
-    	}
-    	if(idx_file.bad()){
-    		perror(flow_index_pathname.c_str());
-    		// Be nice and be sure the flow has been closed in the demultiplexer.
-    		// demux.close_tcpip_fd(this);  Need to fix this.  Also, when called, it will
-    		// have to differentiate the fact that the open fd cound only needs to be
-    		// decremented by one and not by 2.--GDD
-    		return -1;
-    	}
-
-    }
     return 0;
 }
 
@@ -240,11 +423,18 @@ int tcpip::open_file()
  * This is nice for immediate satisfaction, but it can't handle
  * out of order packets, etc.
  */
-void tcpip::print_packet(const u_char *data, uint32_t length)
+void tcpip::print_packet(const u_char *data, uint32_t length, int32_t delta, const struct timeval &ts)
 {
     /* green, blue, read */
     const char *color[3] = { "\033[0;32m", "\033[0;34m", "\033[0;31m" };
 
+    /* Follow the stream as store_packet() does, so that the next packet's delta is small */
+    int64_t offset = (int64_t)pos + delta;
+    if(offset >= 0){
+        pos  = offset + length;
+        nsn += delta + length;
+    }
+
     if(demux.opt.max_bytes_per_flow>=0){
         uint64_t max_bytes_per_flow = (uint64_t)demux.opt.max_bytes_per_flow;
 
@@ -255,209 +445,74 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 	}
     }
 
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_wait(semlock)){
-	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
+    console_writer &out = demux.console;
+    if(flow_pathname.size()==0) flow_pathname = myflow.filename(0, false);
+    last_byte += length;
+
+    if (demux.opt.output_json){
+        json_event("data",ts);
+        out.printf(",\"offset\":%" PRId64 ",\"len\":%u,\"payload\":\"",offset,length);
+        if(demux.opt.json_payload_hex) out.put_hex(data,length);
+        else out.put_base64(data,length);
+        out.put("\"}\n",3);
+        out.end_record();
+        return;
     }
-#endif
 
-    if(flow_pathname.size()==0) flow_pathname = myflow.filename(0, false);
-    if (demux.opt.use_color) fputs(dir==dir_cs ? color[1] : color[2], stdout);
-    if (demux.opt.suppress_header == 0 && demux.opt.output_json == 0){
-        printf("%s: ", flow_pathname.c_str());
-        if(demux.opt.output_hex) putchar('\n');
+    if (demux.opt.use_color) out.put(dir==dir_cs ? color[1] : color[2]);
+    if (demux.opt.suppress_header == 0){
+        out.put(flow_pathname);
+        out.put(": ",2);
+        if(demux.opt.output_hex) out.put('\n');
     }
 
-    size_t written = 0;
     if(demux.opt.output_hex){
-        const size_t bytes_per_line = 32;
-        size_t max_spaces = 0;
-        for(u_int i=0;i<length;i+=bytes_per_line){
-            size_t spaces=0;
-            
-            /* Print the offset */
-            char b[64];
-            size_t count = snprintf(b,sizeof(b),"%04x: ",(int)i);
-            if(fwrite(b,1,count,stdout)!=count){
-	      perror("fwrite");
-	    }
-            spaces += count;
-            
-            /* Print the hext bytes */
-            for(size_t j=0;j<bytes_per_line && i+j<length ;j++){
-                unsigned char ch = data[i+j];
-                fprintf(stdout,"%02x",ch);  spaces += 2;
-                if(j%2==1){
-                    fputc(' ',stdout);
-                    spaces += 1;
-                }
-            }
-            /* space out to where the ASCII region is */
-            if(spaces>max_spaces) max_spaces=spaces;
-            for(;spaces<max_spaces;spaces++){
-                fputc(' ',stdout);
-            }
-            putchar(' ');
-            /* Print the ascii */
-            for(size_t j=0;j<bytes_per_line && i+j<length;j++){
-                unsigned char ch = data[i+j];
-                if(ch>=' ' && ch<='~') fputc(ch,stdout);
-                else fputc('.',stdout);
-            }
-            fputc('\n',stdout);
-        }
-        written = length;               // just fake it.
-    } else if (demux.opt.output_json) {
-        // {
-        //     "src_host": "192.168.0.1",
-        //     "src_port": 1234,
-        //     "dst_host": "1.1.1.1",
-        //     "dst_port": 80,
-        //     "payload" : [...]
-        // }    
-
-        std::string hoststr = std::string();
-
-        putchar('{');   
-        printf("\"src_host\":\"");
-
-        size_t src_pos = 0;
-        size_t src_end_pos = 0;
-        size_t src_pos_counter = 0;
-
-        size_t pathname_len = flow_pathname.length();
-        for(size_t i = 0; i < pathname_len; ++i) {
-            if(flow_pathname[i] == '.') {
-                src_pos_counter++;
-                printf("%d%s", atoi(hoststr.c_str()), (src_pos_counter != 4 ? "." : ""));
-                hoststr.clear();
-            } else {
-                hoststr = hoststr + flow_pathname[i];
-            }
-            if(src_pos_counter == 4) {
-                src_pos = i;
-                break;
-            }
-        }
-        src_end_pos = src_pos;
-        for(;src_end_pos < pathname_len; ++src_end_pos) {
-            if(flow_pathname[src_end_pos] == '-') {
-                break;
-            }
-        }
-        printf("\",\"src_port\":%d,\"dst_host\":\"", atoi(flow_pathname.substr(src_pos + 1, src_end_pos - src_pos).c_str()));
-        
-        size_t dst_pos = src_end_pos + 1;
-        size_t dst_end_pos = dst_pos;
-        size_t dst_pos_counter = 0;
-        
-        for(size_t i = dst_pos; i < pathname_len; ++i) {
-              if(flow_pathname[i] == '.') {
-                dst_pos_counter++;
-                printf("%d%s", atoi(hoststr.c_str()), (dst_pos_counter != 4 ? "." : ""));
-                hoststr.clear();
-            } else {
-                hoststr = hoststr + flow_pathname[i];
-            }
-            if(dst_pos_counter == 4) {
-                dst_pos = i;
-                break;
-            }
-        }
-        dst_end_pos = dst_pos;
-        for(;dst_end_pos < pathname_len; ++dst_end_pos) {
-            if(flow_pathname[dst_end_pos] == '-') {
-                break;
-            }
-        }
-        printf("\",\"dst_port\":%d,\"payload\": [", atoi(flow_pathname.substr(dst_pos + 1, dst_end_pos - dst_pos).c_str()));
-
-        for(size_t i = 0; i < length; ++i) {
-            printf("%d%s", data[i], (i != length - 1 ? "," : "]}"));
-        }
+        out.put_hex_dump(data,length);
     } else if (demux.opt.output_strip_nonprint) {
-	    for(const u_char *cc = data;cc<data+length;cc++){
-	    if(isprint(*cc) || (*cc=='\n') || (*cc=='\r')){
-                int ret = fputc(*cc,stdout);
-                if(ret==EOF){
-                    std::cerr << "EOF on write to stdout\n";
-                    exit(1);
-                
-                }
-	    }
-	    else fputc('.',stdout);
-            written += 1; // treat even unprintable characters as "written". It
-                          // really means "processed"
-        }
-	} else {
-	    written = fwrite(data,1,length,stdout);
-        if(length != written) std::cerr << "\nwrite error to stdout (" << length << "!=" << written << ") \n";
+        out.put_printable(data,length);
+    } else {
+        out.put((const char *)data,length);
     }
 
-    last_byte += length;
-
-    if (demux.opt.use_color) printf("\033[0m");
+    if (demux.opt.use_color) out.put("\033[0m");
 
-    if (! demux.opt.console_output_nonewline) putchar('\n');
-    fflush(stdout);
-
-#ifdef HAVE_PTHREAD
-    if(semlock){
-	if(sem_post(semlock)){
-	    fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
-	    exit(1);
-	}
-    }
-#endif
+    if (! demux.opt.console_output_nonewline) out.put('\n');
+    out.end_record();
 }
 
-/*
- * extend_file_and_insert():
- * A handy function for inserting in the middle or beginning of a file.
- *
- * Based on:
- * http://stackoverflow.com/questions/10467711/c-write-in-the-middle-of-a-binary-file-without-overwriting-any-existing-content
+/* -J: one line of JSON for each event of the flow: open, data for each
+ * packet, and close. They start with the same fields, from the flow's
+ * addresses rather than its filename, so IPv6 and -T templates are no
+ * matter.
  */
+void tcpip::json_event(const char *event,const struct timeval &ts)
+{
+    char src[INET6_ADDRSTRLEN],dst[INET6_ADDRSTRLEN];
+    inet_ntop(myflow.family,myflow.src.addr,src,sizeof(src));
+    inet_ntop(myflow.family,myflow.dst.addr,dst,sizeof(dst));
+    demux.console.printf("{\"event\":\"%s\",\"ts\":%ld.%06ld,\"flow_id\":%" PRIu64 ",\"session_id\":%" PRIu64
+                         ",\"direction\":%s,\"src\":\"%s\",\"sport\":%u,\"dst\":\"%s\",\"dport\":%u",
+                         event,(long)ts.tv_sec,(long)ts.tv_usec,myflow.id,myflow.session_id,
+                         dir==dir_cs ? "\"cs\"" : dir==dir_sc ? "\"sc\"" : "null",
+                         src,myflow.sport,dst,myflow.dport);
+}
 
-static int shift_file(int fd, size_t inslen)
+void tcpip::print_open(const struct timeval &ts)
 {
-    enum { BUFFERSIZE = 64 * 1024 };
-    char buffer[BUFFERSIZE];
-    struct stat sb;
-
-    DEBUG(100)("shift_file(%d,%d)",fd,(int)inslen);
-
-    if (fstat(fd, &sb) != 0) return -1;
-
-    /* Move data after offset up by inslen bytes */
-    size_t bytes_to_move = sb.st_size;
-    off_t read_end_offset = sb.st_size; 
-    while (bytes_to_move != 0) {
-	ssize_t bytes_this_time = bytes_to_move < BUFFERSIZE ? bytes_to_move : BUFFERSIZE ;
-	ssize_t rd_off = read_end_offset - bytes_this_time;
-	ssize_t wr_off = rd_off + inslen;
-	lseek(fd, rd_off, SEEK_SET);
-	if (read(fd, buffer, bytes_this_time) != bytes_this_time)
-	    return -1;
-	lseek(fd, wr_off, SEEK_SET);
-	if (write(fd, buffer, bytes_this_time) != bytes_this_time)
-	    return -1;
-	bytes_to_move -= bytes_this_time;
-    }   
-    return 0;
+    json_event("open",ts);
+    demux.console.put("}\n",2);
+    demux.console.end_record();
 }
 
-#pragma GCC diagnostic ignored "-Weffc++"
-void update_seen(recon_set *seen,uint64_t pos,uint32_t length)
+void tcpip::print_close()
 {
-    if(seen){
-        (*seen) += boost::icl::discrete_interval<uint64_t>::closed(pos,pos+length-1);
-    }
+    json_event("close",myflow.tlast);
+    demux.console.printf(",\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"wire_bytes\":%" PRIu64 "}\n",
+                         myflow.packet_count,last_byte,myflow.len);
+    demux.console.end_record();
 }
 
+#pragma GCC diagnostic ignored "-Weffc++"
 /* store the contents of this packet to its place in its file
  * This has to handle out-of-order packets as well as writes
  * past the 4GiB boundary. 
@@ -486,7 +541,7 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 	 */
 	if(syn_count>0){
 	    DEBUG(2)("packet received with offset %" PRId64 "; ignoring",offset);
-	    violations++;
+	    cold().violations++;
 	    return;
 	}
 	insert_bytes = -offset;		// open up this much space
@@ -525,19 +580,30 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
     /* Shift the file now if we were going shift it */
 
     if(insert_bytes>0){
-	if(fd>=0) shift_file(fd,insert_bytes);
+	if(hold){
+	    if(queue) queue->rebase(insert_bytes); // nothing has been written yet
+	} else {
+	    flush_buffer();		// the file has to be complete before it can be shifted
+	    if(fd>=0) demux.io().shift(fd,insert_bytes);
+	    demux.file_shifts++;
+	    file_end += insert_bytes;
+	    tail_off += insert_bytes;
+	    released += insert_bytes;
+	    if(queue) queue->rebase(insert_bytes);
+	}
 	isn -= insert_bytes;		// it's really earlier
-	lseek(fd,(off_t)0,SEEK_SET);	// put at the beginning
-	pos = 0;
+	pos = 0;			// put at the beginning
 	nsn = isn+1;
-	out_of_order_count++;
-	DEBUG(25)("%s: insert(0,%d); lseek(%d,0,SEEK_SET) out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), insert_bytes,
-		  fd,out_of_order_count);
-
-        /* TK: If we have seen packets, everything in the recon set needs to be shifted as well.*/
-        delete seen;
-        seen = 0;
+	cold().out_of_order_count++;
+	DEBUG(25)("%s: insert(0,%d) %s out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), insert_bytes, hold ? "in memory" : "in the file",
+		  out_of_order_count());
+
+        /* everything we knew about the flow is further in now */
+        seen.shift(insert_bytes);
+        if(demux.opt.output_packet_index) shift_index(insert_bytes);
+        if(fin_count>0) fin_size += insert_bytes;
+        last_byte += insert_bytes;
     }
 
     /* if we're not at the correct point in the file, seek there */
@@ -548,10 +614,9 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
             return;
         }
 
-	if(fd>=0) lseek(fd,(off_t)delta,SEEK_CUR);
-	if(delta<0) out_of_order_count++; // only increment for backwards seeks
-	DEBUG(25)("%s: lseek(%d,%d,SEEK_CUR) offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), fd,(int)delta,offset,pos,out_of_order_count);
+	if(delta<0) cold().out_of_order_count++; // only increment for backwards seeks
+	DEBUG(25)("%s: seek %d offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), (int)delta,offset,pos,out_of_order_count());
 	pos += delta;			// where we are now
 	nsn += delta;			// what we expect the nsn to be now
     }
@@ -563,29 +628,12 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
                (long) wlength, offset);
     
     if(fd>=0){
-      if ((uint32_t)write(fd,data, wlength) != wlength) {
-	    DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
-	    if (debug >= 1) perror("");
-	}
-	// Write to the index file if needed.  Note, index file is sorted before close, so no need to jump around --GDD
-		if (demux.opt.output_packet_index && idx_file.is_open()) {
-			idx_file << offset << "|" << ts.tv_sec << "." << std::setw(6) << std::setfill('0') << ts.tv_usec << "|"
-					<< wlength << "\n";
-			if (idx_file.bad()){
-				DEBUG(1)("write to index file %s failed: ",flow_index_pathname.c_str());
-				if(debug >= 1){
-					perror("");
-				}
-			}
-		}
-	if(wlength != length){
-	    off_t p = lseek(fd,length-wlength,SEEK_CUR); // seek out the space we didn't write
-            DEBUG(100)("   lseek(%" PRId64 ",SEEK_CUR)=%" PRId64,(int64_t)(length-wlength),(int64_t)p);
-	}
+	queue_data(offset,data,wlength,ts);
+	if (demux.opt.output_packet_index) index_packet(offset,ts,wlength);
     }
 
     /* Update the database of bytes that we've seen */
-    if(seen) update_seen(seen,pos,length);
+    seen.add(pos,pos+length);
 
     /* Update the position in the file and the next expected sequence number */
     pos += length;
@@ -593,12 +641,6 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 
     if(pos>last_byte) last_byte = pos;
 
-    if(debug>=100){
-        uint64_t rpos = lseek(fd,(off_t)0,SEEK_CUR);
-        DEBUG(100)("    pos=%" PRId64 "  lseek(fd,0,SEEK_CUR)=%" PRId64,pos,rpos);
-        assert(pos==rpos);
-    }
-
 #ifdef DEBUG_REOPEN_LOGIC
     /* For debugging, force this connection closed */
     demux.close_tcpip_fd(this);			
@@ -606,62 +648,80 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 }
 
 /*
- * Compare two index strings and return the result.  Called by
- * the vector::sort in sort_index.
- * --GDD
+ * The packet index (-I). Records are gathered in memory and written as
+ * part of the flow's flushes, INDEX_BATCH at a time, each batch in order
+ * of offset. The index file is opened only to write a batch, so it never
+ * holds a file descriptor between writes. It is written through io(),
+ * like the flow, so that with -S segment-size it goes in the segments too.
  */
-bool tcpip::compare(std::string a, std::string b){
-	std::stringstream ss_a(a),ss_b(b);
-	long a_l,b_l;
-
-	ss_a >> a_l;
-	ss_b >> b_l;
-	return a_l < b_l;
+void tcpip::index_packet(uint64_t offset,const struct timeval &ts,uint32_t length)
+{
+    cold().idx.push_back(flow_index::record(offset,ts.tv_sec,ts.tv_usec,length));
+    if(rare->idx.size() >= cold_state::INDEX_BATCH) flush_index();
 }
 
-/*
- * Sort an index file (presumably from this object) if file indexing is
- * turned on and the file exists.  Index files may be out of order due
- * to the arrival of out of order packets.  It is cheaper to reorder them
- * one time at the end of processing than it is to continually keep them
- * in order.
- * --GDD
- */
-void tcpip::sort_index(std::fstream *ix_file) {
-
-	std::vector<std::string> idx;
-	std::string line;
-
-	if (demux.opt.output_packet_index) {
-		if (!(idx_file.good() && idx_file.is_open())) {
-			DEBUG(5)("Skipping index file sort.  Unusual behavior.\n");
-			return; //Nothing to do
-		}
-		//Make sure we are at the beginning.
-		ix_file->clear();
-		ix_file->seekg(0);
-		do {
-			*ix_file >> line;
-			if (!ix_file->eof()) {
-				idx.push_back(line);
-			}
-		} while (ix_file->good());
-		std::sort(idx.begin(), idx.end(), &tcpip::compare);
-		ix_file->clear();
-		ix_file->seekg(0);
-		for (std::vector<std::string>::iterator s = idx.begin(); s != idx.end();
-				s++) {
-			*ix_file << *s << "\n";
-		}
-	}
+void tcpip::flush_index()
+{
+    if(rare==0 || rare->idx.empty()) return;
+
+    /* take the batch, so that a flow closed to free a descriptor for it
+     * (this one, perhaps) doesn't write it too
+     */
+    std::vector<flow_index::record> batch;
+    batch.swap(rare->idx);
+    std::stable_sort(batch.begin(),batch.end());
+
+    size_t hdr = rare->idx_size ? 0 : flow_index::HEADER_SIZE;
+    std::vector<uint8_t> buf(hdr + batch.size()*flow_index::RECORD_SIZE);
+    if(hdr) flow_index::put_header(&buf[0]);
+    for(size_t i=0;i<batch.size();i++){
+        flow_index::put_record(&buf[hdr + i*flow_index::RECORD_SIZE],batch[i]);
+    }
+
+    if(rare->flow_index_pathname.empty()) rare->flow_index_pathname = flow_pathname + ".findx";
+    const std::string &path = rare->flow_index_pathname;
+    int ifd = demux.open_in_dir(path,O_WRONLY|O_BINARY|O_CREAT|(rare->idx_size ? 0 : O_TRUNC),0666);
+    if(ifd<0){
+        DEBUG(1)("unable to open index file %s for writing",path.c_str());
+        perror(path.c_str());
+        return;
+    }
+    demux.io().write(ifd,rare->idx_size,&buf[0],buf.size());
+    demux.io().close(ifd,0);
+    rare->idx_size += buf.size();
 }
 
 /*
- * Convenience function to cause the local index file to be sorted.
- * --GDD
+ * The flow file gained by bytes at its front, so every packet in it
+ * is that much further in: those in memory and those already written.
  */
-void tcpip::sort_index(){
-	tcpip::sort_index(&(this->idx_file));
+void tcpip::shift_index(uint64_t by)
+{
+    if(rare==0) return;
+    for(std::vector<flow_index::record>::iterator it=rare->idx.begin();it!=rare->idx.end();it++){
+        it->offset += by;
+    }
+    if(rare->idx_size <= flow_index::HEADER_SIZE) return;
+
+    const std::string &path = rare->flow_index_pathname;
+    std::vector<uint8_t> buf(rare->idx_size - flow_index::HEADER_SIZE);
+    demux.io().drain();                 // the batches written so far have to be there to be read
+    if(demux.io().read(path,flow_index::HEADER_SIZE,&buf[0],buf.size())!=(ssize_t)buf.size()){
+        DEBUG(1)("cannot read back index file %s to shift it",path.c_str());
+        return;
+    }
+    for(size_t i=0;i+flow_index::RECORD_SIZE<=buf.size();i+=flow_index::RECORD_SIZE){
+        flow_index::record r = flow_index::get_record(&buf[i]);
+        r.offset += by;
+        flow_index::put_record(&buf[i],r);
+    }
+    int ifd = demux.open_in_dir(path,O_WRONLY|O_BINARY,0666);
+    if(ifd<0){
+        perror(path.c_str());
+        return;
+    }
+    demux.io().write(ifd,flow_index::HEADER_SIZE,&buf[0],buf.size());
+    demux.io().close(ifd,0);
 }
 
 #pragma GCC diagnostic ignored "-Weffc++"
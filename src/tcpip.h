@@ -2,8 +2,12 @@
 #define TCPIP_H
 
 #include <fstream>
+#include <map>
+#include <string>
 
 #include "inet_ntop.h"
+#include "flow_table.h"
+#include "flow_index.h"
 
 /** On windows, there is no in_addr_t; this is from
  * /usr/include/netinet/in.h
@@ -93,24 +97,25 @@ public:
     flow_addr(const flow_addr &f):src(f.src),dst(f.dst),sport(f.sport),dport(f.dport),
 				  family(f.family){
     }
-    virtual ~flow_addr(){};
+    ~flow_addr(){};
     ipaddr	src;		// Source IP address; holds v4 or v6 
     ipaddr	dst;		// Destination IP address; holds v4 or v6 
     uint16_t    sport;		// Source port number 
     uint16_t    dport;		// Destination port number 
     sa_family_t family;		// AF_INET or AF_INET6 */
 
+    /* the packed key used by the flow table; computing it computes the hash */
+    flow_key key() const {
+        return flow_key(src.addr,dst.addr,sport,dport,family);
+    }
+
+    /* the same for the connection this flow belongs to; see flow_key */
+    flow_key conn_key() const {
+        return flow_key(src.addr,dst.addr,sport,dport,family,true);
+    }
+
     uint64_t hash() const {
-	if(family==AF_INET){
-	    return ((uint64_t)(src.quad(0))<<32 | dst.quad(0))
-                ^ ((uint64_t)(dst.quad(0))<<32 | src.quad(0))
-                ^ (sport<<16 | dport);
-	} else {
-	    return (src.dquad(0)<<32 ^ dst.dquad(0))
-                ^ (dst.dquad(0)<<32  ^ src.dquad(0))
-                ^ (src.dquad(1)      ^ dst.dquad(1))
-                ^ (sport<<16 | dport);
-	}
+        return key().hash;
     }
 
     inline bool operator ==(const flow_addr &b) const {
@@ -173,7 +178,7 @@ public:;
             memcpy(mac_saddr,pi.get_ether_shost(),sizeof(mac_saddr));
         }
     }
-    virtual ~flow(){};
+    ~flow(){};
     uint64_t  id;			// flow_counter when this flow was created
     int32_t   vlan;			// vlan interface we first observed; -1 means no vlan 
     uint8_t mac_daddr[6];               // dst mac address of first packet
@@ -189,9 +194,8 @@ public:;
     std::string filename(uint32_t connection_count, bool);
     // return a new filename for a flow based on the temlate,
     // optionally opening the file and returning a fd if &fd is provided
-    std::string new_filename(int *fd,int flags,int mode);	
+    std::string new_filename(class tcpdemux &demux,int *fd,int flags,int mode);
 
-    std::string new_pcap_filename();
 
     bool has_mac_daddr(){
         return mac_daddr[0] || mac_daddr[1] || mac_daddr[2] || mac_daddr[3] || mac_daddr[4] || mac_daddr[5];
@@ -257,20 +261,31 @@ public:
 #pragma GCC diagnostic ignored "-Wall"
 #pragma GCC diagnostic ignored "-Wmissing-noreturn"
 
-#if defined(HAVE_BOOST_ICL_INTERVAL_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_MAP_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_SET_HPP)
-#include <boost/icl/interval.hpp>
-#include <boost/icl/interval_map.hpp>
-#include <boost/icl/interval_set.hpp>
-typedef boost::icl::interval_set<uint64_t> recon_set; // Boost interval set of bytes that were reconstructed.
-#endif
-
+#include "interval_set.h"
 #include "intrusive_list.h"
+#include "timer_wheel.h"
 
 #pragma GCC diagnostic warning "-Weffc++"
 #pragma GCC diagnostic warning "-Wshadow"
 #pragma GCC diagnostic warning "-Wall"
 #pragma GCC diagnostic warning "-Wmissing-noreturn"
 
+/*
+ * Segments of a flow that are not written to its file yet, by offset in the file.
+ * Where segments overlap, the bytes that arrived last are kept, as they would be in the file.
+ */
+class reorder_queue {
+public:
+    typedef std::map<uint64_t,std::string> segments_t;
+    reorder_queue(time_t now):segments(),bytes(0),since(now){}
+    segments_t segments;                // no two overlap
+    size_t     bytes;
+    time_t     since;                   // packet time when the oldest of them arrived
+
+    void insert(uint64_t offset,const u_char *data,uint32_t length);
+    void rebase(uint64_t by);           // the file has gained by bytes at the front
+};
+
 class tcpip {
 public:
     /** track the direction of the flow; this is largely unused */
@@ -290,51 +305,103 @@ private:
 
 public:;
     tcpip(class tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_);    /* constructor in tcpip.cpp */
-    virtual ~tcpip();			// destructor
+    ~tcpip();				// destructor
 
+    /* State that is looked at for every packet of the flow, kept together
+     * at the front of the object; see cold_state for what is not.
+     */
     class tcpdemux &demux;		// our demultiplexer
-
-    /* State information for the flow being reconstructed */
-    flow	myflow;			/* Description of this flow */
-    dir_t	dir;			// direction of flow
     be13::tcp_seq isn;			// Flow's initial sequence number
     be13::tcp_seq nsn;			// fd - expected next sequence number 
+    uint64_t	pos;			// fd - current position+1 (next byte in stream to be written)
+    int		fd;			// file descriptor for file storing this flow's data 
     uint32_t	syn_count;		// number of SYNs seen
     uint32_t    fin_count;              // number of FINs received
     uint32_t    fin_size;               // length of stream as determined when fin is sent
-    uint64_t	pos;			// fd - current position+1 (next byte in stream to be written)
-
-    /* Archiving information */
-    std::string flow_pathname;		// path where flow is saved
-    int		fd;			// file descriptor for file storing this flow's data 
+    uint64_t    last_byte;              // last byte in flow processed
+    uint64_t	last_packet_number;	// for finding most recent packet written
+    dir_t	dir;			// direction of flow
     bool	file_created;		// true if file was created
+    bool        hold;                   // the start of the flow is not known yet: hold everything (see queue_data)
+    bool        used;                   // had a packet since close_oldest_fd() last passed it (-S fd-clock=1)
+
+    /* Write coalescing: bytes of the file that have not been written yet.
+     * They are [wbuf_off,wbuf_off+wbuf_len) of the file; wbuf is 0 when nothing is buffered.
+     */
+    uint8_t     *wbuf;
+    uint32_t    wbuf_len;
+    uint64_t    wbuf_off;
+    time_t      wbuf_time;              // packet time when the first of them was buffered
+    uint64_t    file_end;               // length of the file as written so far
+
+    /* Segments held back so that the file is written in order (see queue_data) */
+    reorder_queue *queue;               // 0 if none are
+    uint64_t    released;               // segments that start before here go straight to the file
+
+    interval_set seen;                  // the bytes of the flow that we have stored
+
+    /* The last bytes written to the file, [tail_off,tail_off+tail_len), kept
+     * so that stragglers can be checked in memory once the flow is saved.
+     */
+    uint8_t     *tail;                  // malloc()ed; 0 until the first write
+    uint32_t    tail_len;
+    uint32_t    tail_cap;               // bytes allocated; up to demux.opt.straggler_tail
+    uint64_t    tail_off;
 
-    /* Flow Index information - only used if flow packet/data indexing is requested --GDD */
-    std::string flow_index_pathname;	// Path for the flow index file
-    std::fstream		idx_file;				// File descriptor for storing the flow index data
+    /* State information for the flow being reconstructed */
+    flow	myflow;			/* Description of this flow */
 
-    /* Stats */
-    recon_set   *seen;                  // what we've seen; it must be * due to boost lossage
-    uint64_t    last_byte;              // last byte in flow processed
-    uint64_t	last_packet_number;	// for finding most recent packet written
-    uint64_t	out_of_order_count;	// all packets were contigious
-    uint64_t    violations;		// protocol violation count
+    /* Archiving information */
+    std::string flow_pathname;		// path where flow is saved
 
     /* File Acess Order */
-    intrusive_list<tcpip>::iterator it;
+    list_hook<tcpip> open_link;         // in tcpdemux::open_flows
+    list_hook<tcpip> wbuf_link;         // in tcpdemux::buffered_flows
+    list_hook<tcpip> queue_link;        // in tcpdemux::queued_flows
+
+    /* What few flows need: the -I index and the counts of things that
+     * went wrong. It is allocated by cold() the first time it is needed;
+     * until then there is only the pointer.
+     */
+    struct cold_state {
+        enum { INDEX_BATCH = 256 };     // records to gather before they are written
+        cold_state():flow_index_pathname(),idx(),idx_size(0),out_of_order_count(0),violations(0){}
+        std::string  flow_index_pathname; // Path for the flow index file
+        std::vector<flow_index::record> idx; // the packets stored since the index was last written
+        uint64_t     idx_size;          // bytes of the index file written; 0 until it is made
+        uint64_t     out_of_order_count; // all packets were contigious
+        uint64_t     violations;        // protocol violation count
+    };
+    cold_state  *rare;                  // 0 until cold() is called
+    cold_state  &cold() {
+        if(rare==0) rare = new cold_state();
+        return *rare;
+    }
+    uint64_t    out_of_order_count() const { return rare ? rare->out_of_order_count : 0; }
+    uint64_t    violations() const { return rare ? rare->violations : 0; }
 
     /* Methods */
     void close_file();			// close fd
+    void flush_buffer();                // write out the buffered bytes, if any
+    void flush();                       // write out the queued and buffered bytes
+    void queue_data(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts);
+    void release_queue(bool all,const struct timeval &ts);
+    void write_data(uint64_t offset,const u_char *data,uint32_t length,const struct timeval &ts);
+    void write_file(uint64_t offset,const uint8_t *data,uint32_t length);
+    void remember_tail(uint64_t offset,const uint8_t *data,uint32_t length); // bytes that are being written to the file
     int  open_file();                   // opens save file; return -1 if failure, 0 if success
-    void print_packet(const u_char *data, uint32_t length);
+    void print_packet(const u_char *data, uint32_t length, int32_t delta, const struct timeval &ts);
+    void print_open(const struct timeval &ts); // -J events
+    void print_close();
     void store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
     void process_packet(const struct timeval &ts,const int32_t delta,const u_char *data,const uint32_t length);
     uint32_t seen_bytes();
     void dump_seen();
     void dump_xml(class dfxml_writer *xmlreport,const std::string &xmladd);
-    static bool compare(std::string a, std::string b);
-    void sort_index(std::fstream *idx_file);
-    void sort_index();
+    void json_event(const char *event,const struct timeval &ts); // the fields every -J event has
+    void index_packet(uint64_t offset,const struct timeval &ts,uint32_t length); // -I
+    void flush_index();                 // write out the gathered index records
+    void shift_index(uint64_t by);      // the flow file has gained by bytes at the front
 };
 
 /* print a tcpip data structure. Largely for debugging */
@@ -343,12 +410,42 @@ inline std::ostream & operator <<(std::ostream &os,const tcpip &f) {
        << " dir:" << int(f.dir) << " isn:" << f.isn << " nsn: " << f.nsn
        << " sc:" << f.syn_count << " fc:" << f.fin_count << " fs:" << f.fin_size
        << " pos:" << f.pos << " fd: " << f.fd << " cr:" << f.file_created 
-       << " lb:" << f.last_byte << " lpn:" << f.last_packet_number << " ooc:" << f.out_of_order_count
+       << " lb:" << f.last_byte << " lpn:" << f.last_packet_number << " ooc:" << f.out_of_order_count()
        << "]";
     if(f.fd>0) os << " ftell(" << f.fd << ")=" << lseek(f.fd,0L,SEEK_CUR);
     return os;
 }
 
+/*
+ * A TCP connection: both half-streams of one canonical 5-tuple.
+ * half[0] holds the direction whose addresses are already in canonical
+ * order and half[1] holds the reverse (see flow_key::reversed). Either
+ * may be NULL. The two halves share a session ID and an idle timeout.
+ * The connection is deleted when its last half is removed.
+ */
+class tcpconn {
+private:
+    tcpconn(const tcpconn &);
+    tcpconn &operator=(const tcpconn &);
+public:
+    tcpconn(uint64_t session_id_):session_id(session_id_),timeout_hook(){
+        half[0] = 0;
+        half[1] = 0;
+    }
+    tcpip       *half[2];
+    uint64_t    session_id;             // shared by both halves
+    timer_wheel_hook<tcpconn> timeout_hook; // linked into tcpdemux::flow_timeouts
+
+    bool empty() const { return half[0]==0 && half[1]==0; }
+    time_t last_seen() const {          // seconds; the later of the two halves
+        time_t t = 0;
+        for(int i=0;i<2;i++){
+            if(half[i] && half[i]->myflow.tlast.tv_sec > t) t = half[i]->myflow.tlast.tv_sec;
+        }
+        return t;
+    }
+};
+
 /*
  * An saved_flow is a flow for which all of the packets have been received and tcpip state
  * has been discarded. The saved_flow allows matches against newly received packets
@@ -358,26 +455,58 @@ inline std::ostream & operator <<(std::ostream &os,const tcpip &f) {
 
 class saved_flow  {
 public:
-    saved_flow(tcpip *tcp):addr(tcp->myflow),
+    saved_flow(tcpip *tcp,uint64_t hash_):addr(tcp->myflow),
                            saved_filename(tcp->flow_pathname),
-                           isn(tcp->isn) {}
+                           isn(tcp->isn),
+                           hash(hash_),
+                           tail_off(tcp->tail_off),
+                           tail(tcp->tail ? std::string((const char *)tcp->tail,tcp->tail_len) : std::string()),
+                           lru_link() {}
                            
     flow_addr         addr;                  // flow address
     std::string       saved_filename;        // where the flow was saved
     be13::tcp_seq     isn;                    // the flow's ISN
+    uint64_t          hash;                  // in tcpdemux::saved_flow_filter
+    uint64_t          tail_off;              // tail is these bytes of the file,
+    std::string       tail;                  // the last that were written to it
+    list_hook<saved_flow> lru_link;          // in tcpdemux::saved_lru
+
+    /* memory this takes, including its entry in tcpdemux::saved_flow_map */
+    size_t bytes() const {
+        const size_t sso = sizeof(std::string);  // what a short string needs
+        return sizeof(*this) + 4*sizeof(void *) + sizeof(addr)
+            + (saved_filename.capacity()>=sso ? saved_filename.capacity()+1 : 0)
+            + (tail.capacity()>=sso ? tail.capacity()+1 : 0);
+    }
+
+    /* whether [offset,offset+length) of the file is in tail; if so, *match says whether data is the same */
+    bool in_tail(uint64_t offset,const u_char *data,size_t length,bool *match) const {
+        if(offset < tail_off || offset + length > tail_off + tail.size()) return false;
+        *match = memcmp(tail.data() + (offset - tail_off),data,length)==0;
+        return true;
+    }
     virtual ~saved_flow(){};
+private:
+    saved_flow(const saved_flow &);
+    saved_flow &operator=(const saved_flow &);
 };
 
+/* A flow being written to a pcap file of its own (-K); see tcpdemux::dissect_tcp() */
 class sparse_saved_flow  {
 public:
-    sparse_saved_flow (const flow_addr &idx, FILE *_fcap):addr(idx),fcap(_fcap) {}
-
-    flow_addr         addr;                  // flow address
-    FILE              *fcap;                // output pcap file
-    virtual ~sparse_saved_flow()
-    {
-        if(fcap) fclose(fcap);
-    }
+    sparse_saved_flow (const flow_addr &idx,const std::string &filename_):
+        addr(idx),filename(filename_),fd(-1),size(0),buf(0),buf_len(0),buf_time(0),open_link(),buf_link() {}
+
+    flow_addr         addr;                 // flow address; with pcap_both_directions, the lesser of the two directions
+    std::string       filename;             // output pcap file
+    int               fd;                   // -1 when it is not open
+    uint64_t          size;                 // bytes written to the file so far; 0 until it is made
+    uint8_t           *buf;                 // records not written yet, in a buffer of opt.write_buffer bytes, or 0
+    uint32_t          buf_len;
+    time_t            buf_time;             // packet time when the first of them was buffered
+    list_hook<sparse_saved_flow> open_link; // in tcpdemux::open_pcaps
+    list_hook<sparse_saved_flow> buf_link;  // in tcpdemux::buffered_pcaps
+    virtual ~sparse_saved_flow() {}         // closed by tcpdemux::close_pcap() first
     /* these are not implemented */
 private:
     sparse_saved_flow(const sparse_saved_flow &t);
@@ -0,0 +1,185 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/**
+ * timer_wheel.h
+ *
+ * A two-level hierarchical timer wheel for expiring idle flows.
+ *
+ * Time is measured in whole seconds of packet time, not wall-clock time.
+ * Nodes are linked into the wheel through an intrusive hook, so scheduling,
+ * cancelling and expiring a node are all O(1) and never allocate.
+ *
+ * - Level 0 has one slot per second for the next 256 seconds.
+ * - Level 1 has one slot per 256 seconds for the next 16384 seconds.
+ * - Anything further out is kept on an overflow list that is re-examined
+ *   every 16384 seconds.
+ *
+ * advance() moves the wheel forward to a new time and returns the nodes
+ * whose deadline has been reached. Time never moves backwards; packets with
+ * older timestamps simply do not advance the wheel.
+ */
+
+#include <vector>
+#include <cstddef>
+#include <inttypes.h>
+
+template <class T>
+class timer_wheel_hook {
+public:
+    timer_wheel_hook():next(0),pprev(0),when(0){}
+    T        *next;                     // next node in the slot
+    T       **pprev;                    // the pointer that points to us; 0 if not scheduled
+    uint64_t when;                      // deadline, in seconds
+private:
+    timer_wheel_hook(const timer_wheel_hook &);
+    timer_wheel_hook &operator=(const timer_wheel_hook &);
+};
+
+template <class T, timer_wheel_hook<T> T::*hook>
+class timer_wheel {
+    enum {
+        L0_BITS  = 8,
+        L1_BITS  = 6,
+        L0_SLOTS = 1<<L0_BITS,                      // 256 one-second slots
+        L1_SLOTS = 1<<L1_BITS,                      // 64 slots of 256 seconds
+        SPAN     = L0_SLOTS * L1_SLOTS              // 16384 seconds
+    };
+
+    T        *l0[L0_SLOTS];
+    T        *l1[L1_SLOTS];
+    T        *overflow;
+    uint64_t current;                   // the last second that was processed
+    bool     started;
+    size_t   count;
+
+    timer_wheel(const timer_wheel &);
+    timer_wheel &operator=(const timer_wheel &);
+
+    static void link(T **head,T *node) {
+        timer_wheel_hook<T> &h = node->*hook;
+        h.next  = *head;
+        h.pprev = head;
+        if(*head) ((*head)->*hook).pprev = &h.next;
+        *head = node;
+    }
+
+    static void unlink(T *node) {
+        timer_wheel_hook<T> &h = node->*hook;
+        *h.pprev = h.next;
+        if(h.next) (h.next->*hook).pprev = h.pprev;
+        h.next  = 0;
+        h.pprev = 0;
+    }
+
+    /* put a node into the slot that matches its deadline */
+    void bucket(T *node) {
+        uint64_t when = (node->*hook).when;
+        if(when <= current) when = current+1; // overdue; expire on the next tick
+        uint64_t delta = when - current;
+        if(delta <= L0_SLOTS){
+            link(&l0[when & (L0_SLOTS-1)],node);
+        } else if(delta < SPAN){
+            link(&l1[(when >> L0_BITS) & (L1_SLOTS-1)],node);
+        } else {
+            link(&overflow,node);
+        }
+    }
+
+    /* move every node on a list back through bucket() */
+    void rebucket(T **head) {
+        T *node = *head;
+        *head = 0;
+        while(node){
+            T *next = (node->*hook).next;
+            bucket(node);
+            node = next;
+        }
+    }
+
+    /* take every node off a list and hand it to the caller */
+    void drain(T **head,std::vector<T *> &out) {
+        T *node = *head;
+        *head = 0;
+        while(node){
+            T *next = (node->*hook).next;
+            (node->*hook).next  = 0;
+            (node->*hook).pprev = 0;
+            out.push_back(node);
+            node = next;
+        }
+    }
+
+public:
+    timer_wheel():l0(),l1(),overflow(0),current(0),started(false),count(0){}
+
+    bool   empty() const { return count==0; }
+    size_t size()  const { return count; }
+    uint64_t now() const { return current; }
+
+    bool is_scheduled(const T *node) const { return (node->*hook).pprev != 0; }
+    uint64_t when(const T *node)     const { return (node->*hook).when; }
+
+    /* schedule (or reschedule) a node to expire at the given second */
+    void schedule(T *node,uint64_t when) {
+        if(is_scheduled(node)){
+            unlink(node);
+        } else {
+            count++;
+        }
+        (node->*hook).when = when;
+        bucket(node);
+    }
+
+    void cancel(T *node) {
+        if(!is_scheduled(node)) return;
+        unlink(node);
+        count--;
+    }
+
+    /* advance the wheel to now; nodes whose deadline is <= now are appended to expired */
+    void advance(uint64_t now,std::vector<T *> &expired) {
+        if(started && now <= current) return;
+        if(!started || now - current >= SPAN){
+            /* First call or a big jump in time: rebuild the wheel from scratch */
+            std::vector<T *> all;
+            for(int i=0;i<L0_SLOTS;i++) drain(&l0[i],all);
+            for(int i=0;i<L1_SLOTS;i++) drain(&l1[i],all);
+            drain(&overflow,all);
+            started = true;
+            current = now;
+            for(typename std::vector<T *>::iterator it=all.begin();it!=all.end();it++){
+                if(((*it)->*hook).when <= now){
+                    expired.push_back(*it);
+                    count--;
+                } else {
+                    bucket(*it);
+                }
+            }
+            return;
+        }
+        while(current < now){
+            /* Cascade before the tick so that nodes due on the tick land in its slot */
+            uint64_t tick = current+1;
+            if((tick & (L0_SLOTS-1))==0){
+                if((tick & (SPAN-1))==0) rebucket(&overflow);
+                rebucket(&l1[(tick >> L0_BITS) & (L1_SLOTS-1)]);
+            }
+            current = tick;
+            size_t before = expired.size();
+            drain(&l0[current & (L0_SLOTS-1)],expired);
+            count -= expired.size() - before;
+        }
+    }
+
+    /* forget about everything that is scheduled */
+    void clear() {
+        std::vector<T *> all;
+        for(int i=0;i<L0_SLOTS;i++) drain(&l0[i],all);
+        for(int i=0;i<L1_SLOTS;i++) drain(&l1[i],all);
+        drain(&overflow,all);
+        count = 0;
+    }
+};
+
+#endif // TIMER_WHEEL_H
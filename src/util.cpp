@@ -112,6 +112,8 @@ static std::vector<std::string> split(const std::string &s, char delim)
 void mkdirs_for_path(std::string path)
 {
     static std::set<std::string> made_dirs; // track what we made
+    static cppmutex M;                  // -j shards make directories concurrently
+    cppmutex::lock lock(M);
 
     std::string mpath;                  // the path we are making
 
@@ -0,0 +1,42 @@
+#!/bin/sh
+# test that flows binned into directories (-Fk, or a -T template with a /)
+# are the flows that are written without binning, with the expected names,
+# whether or not there are descriptors to spare for holding directories open
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/outb$$
+OUT1=/tmp/outb1$$
+for t in test1 test2 test3 test4
+do
+  /bin/rm -rf $OUT
+  if ! $TCPFLOW -o $OUT -r $DMPDIR/$t.pcap ; then echo tcpflow failed; exit 1 ; fi
+  for opts in "-Fk" "-Fk -f 1" "-Fm"
+  do
+    /bin/rm -rf $OUT1
+    if ! $TCPFLOW $opts -o $OUT1 -r $DMPDIR/$t.pcap ; then echo tcpflow $opts failed; exit 1 ; fi
+    for f in `cd $OUT ; ls | grep -v report.xml`
+    do
+      case "$opts" in
+        -Fm) bf=$OUT1/000000-000999/000000/$f ;;
+        *)   bf=$OUT1/000/$f ;;
+      esac
+      if ! cmp $OUT/$f "$bf" ; then
+        echo "$t.pcap: $opts did not write $f in its bin"
+        exit 1
+      fi
+    done
+  done
+done
+
+/bin/rm -rf $OUT1
+if ! $TCPFLOW -T '%N/%%%#-%A.%a' -o $OUT1 -r $DMPDIR/test2.pcap ; then echo tcpflow -T failed; exit 1 ; fi
+for f in 000/%0-010.000.000.002.36559 001/%0-010.000.000.001.09999
+do
+  if [ ! -f $OUT1/$f ] ; then
+    echo "test2.pcap: -T did not write $f"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT $OUT1
+exit 0
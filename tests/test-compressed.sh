@@ -0,0 +1,32 @@
+#!/bin/sh
+# test that compressed captures and captures on stdin give the same flows as the plain file
+
+. $srcdir/test-subs.sh
+
+OUT1=/tmp/out1$$
+OUTC=/tmp/outc$$
+CAP=/tmp/cap$$
+for pcap in test1.pcap test2.pcap test3.pcap local.pcap
+do
+  /bin/rm -rf $OUT1
+  if ! $TCPFLOW -o $OUT1 -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+  for z in gzip bzip2 xz
+  do
+    if ! which $z >/dev/null 2>&1 ; then continue ; fi
+    $z -c $DMPDIR/$pcap > $CAP
+    /bin/rm -rf $OUTC
+    if ! $TCPFLOW -o $OUTC -r $CAP ; then echo tcpflow failed on $z $pcap; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT1 $OUTC ; then
+      echo "tcpflow -r $pcap compressed with $z does not match the plain file"
+      exit 1
+    fi
+  done
+  /bin/rm -rf $OUTC
+  if ! $TCPFLOW -o $OUTC -r - < $DMPDIR/$pcap ; then echo tcpflow failed on stdin; exit 1 ; fi
+  if ! diff -r -x report.xml $OUT1 $OUTC ; then
+    echo "tcpflow -r - < $pcap does not match the plain file"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT1 $OUTC $CAP
+exit 0
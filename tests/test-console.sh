@@ -0,0 +1,44 @@
+#!/bin/sh
+# test that -c and -C print the same whether their output is gathered into
+# big writes or written after every packet, and that -s leaves nothing
+# unprintable but newlines and carriage returns, and that -J closes every
+# flow that it opens
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/outc$$
+OUT1=/tmp/outc1$$
+OUT_DIR=/tmp/outcd$$
+for t in test1 test2 test3 test4
+do
+  for opts in "-c" "-C" "-c -D" "-c -J" "-c -B" "-C -0"
+  do
+    if ! $TCPFLOW $opts -S console-buffer=0 -o $OUT_DIR -r $DMPDIR/$t.pcap > $OUT ; then echo tcpflow $opts failed; exit 1 ; fi
+    for buf in "-S console-buffer=1" "-S console-flush-ms=100000" ""
+    do
+      if ! $TCPFLOW $opts $buf -o $OUT_DIR -r $DMPDIR/$t.pcap > $OUT1 ; then echo tcpflow $opts $buf failed; exit 1 ; fi
+      if ! cmp $OUT $OUT1 ; then
+        echo "$t.pcap: $opts $buf prints differently"
+        exit 1
+      fi
+    done
+  done
+  if ! $TCPFLOW -J -o $OUT_DIR -r $DMPDIR/$t.pcap > $OUT ; then echo tcpflow -J failed; exit 1 ; fi
+  opens=`grep -c '^{"event":"open",' $OUT`
+  closes=`grep -c '^{"event":"close",' $OUT`
+  if [ $opens = 0 -o $opens != $closes ] ; then
+    echo "$t.pcap: -J opened $opens flows and closed $closes"
+    exit 1
+  fi
+  if [ `grep -vc '^{"event":"[a-z]*",.*}$' $OUT` != 0 ] ; then
+    echo "$t.pcap: -J printed something that is not an event"
+    exit 1
+  fi
+  if ! $TCPFLOW -c -s -o $OUT_DIR -r $DMPDIR/$t.pcap > $OUT ; then echo tcpflow -c -s failed; exit 1 ; fi
+  if [ -n "`LC_ALL=C tr -d '\n\r -~' < $OUT`" ] ; then
+    echo "$t.pcap: -c -s printed unprintable bytes"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT $OUT1 $OUT_DIR
+exit 0
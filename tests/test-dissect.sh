@@ -0,0 +1,50 @@
+#!/bin/sh
+# test that -K writes the same pcap files when it has to close and reopen
+# them for lack of descriptors, and that with -S pcap-both-directions=1
+# each connection's pcap has the packets of both of its flows, which are
+# the same flows when the pcaps are written as pcapng
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/outk$$
+OUT1=/tmp/outk1$$
+OUT2=/tmp/outk2$$
+for t in test1 test2 test3 test4
+do
+  /bin/rm -rf $OUT
+  if ! $TCPFLOW -K -o $OUT -r $DMPDIR/$t.pcap ; then echo tcpflow -K failed; exit 1 ; fi
+  for opts in "-f 1" "-f 2 -S write-buffer=0"
+  do
+    /bin/rm -rf $OUT1
+    if ! $TCPFLOW -K $opts -o $OUT1 -r $DMPDIR/$t.pcap ; then echo tcpflow -K $opts failed; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT $OUT1 ; then
+      echo "$t.pcap: -K $opts writes different pcaps"
+      exit 1
+    fi
+  done
+
+  /bin/rm -rf $OUT $OUT1 $OUT2
+  if ! $TCPFLOW -o $OUT -r $DMPDIR/$t.pcap ; then echo tcpflow failed; exit 1 ; fi
+  if ! $TCPFLOW -K -S pcap-both-directions=1 -f 1 -o $OUT1 -r $DMPDIR/$t.pcap ; then echo tcpflow -K failed; exit 1 ; fi
+  for p in $OUT1/*.pcap
+  do
+    if ! $TCPFLOW -o $OUT2 -r $p ; then echo tcpflow -r $p failed; exit 1 ; fi
+  done
+  if ! diff -r -x report.xml $OUT $OUT2 ; then
+    echo "$t.pcap: the pcaps of -S pcap-both-directions=1 have different flows"
+    exit 1
+  fi
+
+  /bin/rm -rf $OUT1 $OUT2
+  if ! $TCPFLOW -K -S pcap-both-directions=1 -S pcap-format=pcapng -o $OUT1 -r $DMPDIR/$t.pcap ; then echo tcpflow -K pcapng failed; exit 1 ; fi
+  for p in $OUT1/*.pcap
+  do
+    if ! $TCPFLOW -o $OUT2 -r $p ; then echo tcpflow -r $p failed; exit 1 ; fi
+  done
+  if ! diff -r -x report.xml $OUT $OUT2 ; then
+    echo "$t.pcap: the pcapng files of -S pcap-format=pcapng have different flows"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT $OUT1 $OUT2
+exit 0
@@ -0,0 +1,21 @@
+#!/bin/sh
+# test that closing and reopening flow files when there are few descriptors
+# does not change them, whether the file to close is picked by LRU or clock
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/outf$$
+OUT1=/tmp/outf1$$
+/bin/rm -rf $OUT $OUT1
+if ! $TCPFLOW -o $OUT -r $DMPDIR/test4.pcap ; then echo tcpflow failed; exit 1 ; fi
+for opts in "-f 1" "-f 2" "-f 1 -S fd-clock=1" "-f 2 -S fd-clock=1"
+do
+  /bin/rm -rf $OUT1
+  if ! $TCPFLOW $opts -o $OUT1 -r $DMPDIR/test4.pcap ; then echo tcpflow $opts failed; exit 1 ; fi
+  if ! diff -r -x report.xml $OUT $OUT1 ; then
+    echo "test4.pcap: $opts writes different flows"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT $OUT1
+exit 0
@@ -0,0 +1,60 @@
+#!/bin/sh
+# test that -I writes a packet index next to each flow, in order of offset,
+# that tcpflow-findx prints and searches, and that it does not depend on
+# the write buffer, on how many files may be open or on -S segment-size
+
+. $srcdir/test-subs.sh
+
+FINDX=`dirname $TCPFLOW`/tcpflow-findx
+EXTRACT=`dirname $TCPFLOW`/tcpflow-extract
+OUT=/tmp/outx$$
+OUT1=/tmp/outx1$$
+OUT2=/tmp/outx2$$
+for p in test1.pcap test4.pcap reorder-nosyn.pcap
+do
+  /bin/rm -rf $OUT $OUT1 $OUT2
+  if ! $TCPFLOW -I -o $OUT -r $DMPDIR/$p ; then echo tcpflow -I failed; exit 1 ; fi
+  for f in $OUT/*.findx
+  do
+    flow=`echo $f | sed 's/\.findx$//'`
+    if [ ! -f $flow ]; then echo "$f: no flow file for the index"; exit 1 ; fi
+    if ! $FINDX $f > $OUT.txt ; then echo tcpflow-findx $f failed; exit 1 ; fi
+    if ! sort -n -c -t'|' -k1,1 $OUT.txt ; then echo "$f: not in order of offset"; exit 1 ; fi
+    size=`wc -c < $flow`
+    if ! awk -F'|' -v size=$size '$1+$3 > size { exit 1 }' $OUT.txt ; then
+      echo "$f: a packet is past the end of the flow file"
+      exit 1
+    fi
+    line=`sed -n 1p $OUT.txt`
+    if [ "`$FINDX -o ${line%%|*} $f`" != "$line" ]; then
+      echo "$f: tcpflow-findx -o does not find the first packet"
+      exit 1
+    fi
+  done
+  for opts in "-S write-buffer=0 -S reorder-queue=0" "-f 1"
+  do
+    /bin/rm -rf $OUT1
+    if ! $TCPFLOW -I $opts -o $OUT1 -r $DMPDIR/$p ; then echo tcpflow -I $opts failed; exit 1 ; fi
+    for f in $OUT/*.findx
+    do
+      g=$OUT1/`basename $f`
+      if [ "`$FINDX $f`" != "`$FINDX $g`" ]; then
+        echo "$p: -I $opts writes a different index for $f"
+        exit 1
+      fi
+    done
+  done
+  /bin/rm -rf $OUT1
+  if ! $TCPFLOW -I -S segment-size=1 -o $OUT1 -r $DMPDIR/$p ; then echo tcpflow -I -S segment-size failed; exit 1 ; fi
+  if ! $EXTRACT -o $OUT2 $OUT1/flows-0.idx ; then echo tcpflow-extract failed; exit 1 ; fi
+  for f in $OUT/*.findx
+  do
+    g=$OUT2/`basename $f`
+    if ! cmp -s $f $g ; then
+      echo "$p: -I -S segment-size writes a different index for $f"
+      exit 1
+    fi
+  done
+done
+/bin/rm -rf $OUT $OUT1 $OUT2 $OUT.txt
+exit 0
@@ -0,0 +1,29 @@
+#!/bin/sh
+# test that queueing writes and closes on an io_uring does not change the flows or their times
+# (where io_uring is not available, tcpflow says so and writes synchronously)
+
+. $srcdir/test-subs.sh
+
+OUT0=/tmp/out0$$
+OUTU=/tmp/outu$$
+LSTIME="ls -l --time-style=+%s"         # GNU ls; others show the times to the minute
+$LSTIME . >/dev/null 2>&1 || LSTIME="ls -l"
+for pcap in test1-out-of-order.pcap test5-lines-randomized.pcap local2.pcap bug3.pcap reorder-nosyn.pcap
+do
+  for opts in "" "-S io-depth=1 -S write-buffer=0" "-S io-depth=2 -S reorder-queue=0" "-f 4"
+  do
+    /bin/rm -rf $OUT0 $OUTU
+    if ! $TCPFLOW $opts -o $OUT0 -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW -S io-backend=uring $opts -o $OUTU -r $DMPDIR/$pcap ; then echo tcpflow -S io-backend=uring $opts failed; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT0 $OUTU ; then
+      echo "tcpflow -S io-backend=uring $opts -r $pcap does not match the sync backend"
+      exit 1
+    fi
+    if [ "`cd $OUT0 && $LSTIME | grep -v report.xml`" != "`cd $OUTU && $LSTIME | grep -v report.xml`" ] ; then
+      echo "tcpflow -S io-backend=uring $opts -r $pcap does not set the same times"
+      exit 1
+    fi
+  done
+done
+/bin/rm -rf $OUT0 $OUTU
+exit 0
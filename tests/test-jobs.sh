@@ -0,0 +1,32 @@
+#!/bin/sh
+# test that -j writes the same flows as a single demultiplexer, and that
+# the shards do not give two connections the same session id (%S)
+
+. $srcdir/test-subs.sh
+
+OUT1=/tmp/out1$$
+OUTJ=/tmp/outj$$
+for pcap in test1.pcap test2.pcap test3.pcap test4.pcap local.pcap local2.pcap bug2.pcap
+do
+  for opts in "" "-I" "-S tcp_timeout=1"
+  do
+    /bin/rm -rf $OUT1 $OUTJ
+    if ! $TCPFLOW -o $OUT1 $opts -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW -j 4 -o $OUTJ $opts -r $DMPDIR/$pcap ; then echo tcpflow -j 4 failed; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT1 $OUTJ ; then
+      echo "tcpflow -j 4 $opts -r $pcap does not match single-threaded output"
+      exit 1
+    fi
+  done
+  /bin/rm -rf $OUT1 $OUTJ
+  if ! $TCPFLOW -T '%S' -o $OUT1 -r $DMPDIR/$pcap ; then echo tcpflow -T failed; exit 1 ; fi
+  if ! $TCPFLOW -j 4 -T '%S' -o $OUTJ -r $DMPDIR/$pcap ; then echo tcpflow -j 4 -T failed; exit 1 ; fi
+  # which connection gets which id depends on the shards, but an id names
+  # only the two halves of one connection, so none is taken three times
+  if [ `ls $OUT1 | wc -l` != `ls $OUTJ | wc -l` ] || ls $OUTJ | grep -q 'c[2-9]$' ; then
+    echo "tcpflow -j 4 -T %S -r $pcap gives two connections the same session id"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT1 $OUTJ
+exit 0
@@ -0,0 +1,30 @@
+#!/bin/sh
+# test that merging the packets of several -r files by timestamp reassembles flows as one file would
+# local2-even.pcap and local2-odd.pcap hold alternate packets of local2.pcap
+
+. $srcdir/test-subs.sh
+
+OUT1=/tmp/out1$$
+OUTM=/tmp/outm$$
+for opts in "" "-I"
+do
+  for order in "even odd" "odd even"
+  do
+    set -- $order
+    /bin/rm -rf $OUT1 $OUTM
+    if ! $TCPFLOW -o $OUT1 $opts -r $DMPDIR/local2.pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW -S merge-inputs=1 -o $OUTM $opts -r $DMPDIR/local2-$1.pcap -r $DMPDIR/local2-$2.pcap ; then
+      echo tcpflow -S merge-inputs=1 failed; exit 1
+    fi
+    if ! grep -q "<pcap_merge inputs='2'>" $OUTM/report.xml ; then
+      echo "tcpflow -S merge-inputs=1 did not merge the files"
+      exit 1
+    fi
+    if ! diff -r -x report.xml $OUT1 $OUTM ; then
+      echo "tcpflow -S merge-inputs=1 $opts -r local2-$1.pcap -r local2-$2.pcap does not match local2.pcap"
+      exit 1
+    fi
+  done
+done
+/bin/rm -rf $OUT1 $OUTM
+exit 0
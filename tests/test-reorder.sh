@@ -0,0 +1,40 @@
+#!/bin/sh
+# test that holding out-of-order segments in memory writes the same flows as writing them as they come
+# reorder-nosyn.pcap is one flow without a SYN whose segments arrive out of order, overlap,
+# and twice start before the first one
+
+. $srcdir/test-subs.sh
+
+OUT0=/tmp/out0$$
+OUTQ=/tmp/outq$$
+for pcap in reorder-nosyn.pcap test1-out-of-order.pcap test5-lines-randomized.pcap test5-lines-randomized2.pcap
+do
+  for opts in "" "-S reorder-queue=120" "-S reorder-queue-age=2" "-S reorder-queue-mem=0"
+  do
+    /bin/rm -rf $OUT0 $OUTQ
+    if ! $TCPFLOW -S reorder-queue=0 -o $OUT0 -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW $opts -o $OUTQ -r $DMPDIR/$pcap ; then echo tcpflow $opts failed; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT0 $OUTQ ; then
+      echo "tcpflow $opts -r $pcap does not match -S reorder-queue=0"
+      exit 1
+    fi
+  done
+done
+
+# held in memory, the flow that starts early twice is written without moving the file
+/bin/rm -rf $OUTQ
+$TCPFLOW -o $OUTQ -r $DMPDIR/reorder-nosyn.pcap
+if ! grep -q "<file_shifts>0</file_shifts>" $OUTQ/report.xml ; then
+  echo "reorder-nosyn.pcap: the flow file was shifted"
+  exit 1
+fi
+
+# with no memory for queues between them, they are written out as soon as they are made
+/bin/rm -rf $OUTQ
+$TCPFLOW -S reorder-queue-mem=0 -o $OUTQ -r $DMPDIR/reorder-nosyn.pcap
+if grep -q "<queue_trims>0</queue_trims>" $OUTQ/report.xml ; then
+  echo "reorder-nosyn.pcap: -S reorder-queue-mem=0 kept its queue"
+  exit 1
+fi
+/bin/rm -rf $OUT0 $OUTQ
+exit 0
@@ -0,0 +1,28 @@
+#!/bin/sh
+# test that -S segment-size puts the flows in segment files that
+# tcpflow-extract turns back into the files tcpflow would have written
+
+. $srcdir/test-subs.sh
+
+EXTRACT=`dirname $TCPFLOW`/tcpflow-extract
+OUT=/tmp/outg$$
+OUT1=/tmp/outg1$$
+OUT2=/tmp/outg2$$
+for p in test1.pcap reorder-nosyn.pcap local2.pcap
+do
+  /bin/rm -rf $OUT $OUT1 $OUT2
+  if ! $TCPFLOW -o $OUT -r $DMPDIR/$p ; then echo tcpflow failed; exit 1 ; fi
+  if ! $TCPFLOW -S segment-size=1 -S write-buffer=0 -S reorder-queue=0 -o $OUT1 -r $DMPDIR/$p ; then echo tcpflow -S segment-size failed; exit 1 ; fi
+  if ls $OUT1 | grep -v -q -e '^flows-0\.' -e '^report.xml$' ; then
+    echo "$p: -S segment-size wrote files other than the segments and index"
+    ls $OUT1
+    exit 1
+  fi
+  if ! $EXTRACT -o $OUT2 $OUT1/flows-0.idx ; then echo tcpflow-extract failed; exit 1 ; fi
+  if ! diff -r -x report.xml $OUT $OUT2 ; then
+    echo "$p: the extracted flows are not the ones tcpflow writes"
+    exit 1
+  fi
+done
+/bin/rm -rf $OUT $OUT1 $OUT2
+exit 0
@@ -0,0 +1,26 @@
+#!/bin/sh
+# test that reading a pcap file as byte ranges writes the same flows as reading it in one piece
+
+. $srcdir/test-subs.sh
+
+OUT1=/tmp/out1$$
+OUTS=/tmp/outs$$
+for pcap in test4.pcap local.pcap local2.pcap bug2.pcap bug3.pcap bug8.pcap
+do
+  for opts in "" "-I"
+  do
+    /bin/rm -rf $OUT1 $OUTS
+    if ! $TCPFLOW -o $OUT1 $opts -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW -S pcap-split=7 -o $OUTS $opts -r $DMPDIR/$pcap ; then echo tcpflow -S pcap-split=7 failed; exit 1 ; fi
+    if ! grep -q "<pcap_split ranges='[2-7]'>" $OUTS/report.xml ; then
+      echo "tcpflow -S pcap-split=7 -r $pcap did not split the file"
+      exit 1
+    fi
+    if ! diff -r -x report.xml $OUT1 $OUTS ; then
+      echo "tcpflow -S pcap-split=7 $opts -r $pcap does not match the sequential output"
+      exit 1
+    fi
+  done
+done
+/bin/rm -rf $OUT1 $OUTS
+exit 0
@@ -0,0 +1,36 @@
+#!/bin/sh
+# test that late retransmissions for closed flows are recognized, and in memory
+# bug2.pcap has five retransmissions of one segment after its flow was closed
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/outs$$
+OUT0=/tmp/outs0$$
+/bin/rm -rf $OUT $OUT0
+if ! $TCPFLOW -o $OUT -r $DMPDIR/bug2.pcap ; then echo tcpflow failed; exit 1 ; fi
+if ! $TCPFLOW -S straggler-tail=0 -o $OUT0 -r $DMPDIR/bug2.pcap ; then echo tcpflow failed; exit 1 ; fi
+if ! diff -r -x report.xml $OUT $OUT0 ; then
+  echo "bug2.pcap: -S straggler-tail=0 writes different flows"
+  exit 1
+fi
+for x in "<saved_flow_hits>5</saved_flow_hits>" "<straggler_reads>0</straggler_reads>"
+do
+  if ! grep -q "$x" $OUT/report.xml ; then
+    echo "bug2.pcap: report.xml does not have $x"
+    exit 1
+  fi
+done
+if ! grep -q "<straggler_reads>5</straggler_reads>" $OUT0/report.xml ; then
+  echo "bug2.pcap: -S straggler-tail=0 did not read the file"
+  exit 1
+fi
+
+# without saved flows, the retransmissions start a new flow
+/bin/rm -rf $OUT0
+$TCPFLOW -S saved-flow-mem=0 -o $OUT0 -r $DMPDIR/bug2.pcap
+if [ ! -f $OUT0/069.026.190.048.00080-192.168.015.004.33088c1 ] ; then
+  echo "bug2.pcap: -S saved-flow-mem=0 did not start a new flow"
+  exit 1
+fi
+/bin/rm -rf $OUT $OUT0
+exit 0
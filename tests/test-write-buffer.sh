@@ -0,0 +1,33 @@
+#!/bin/sh
+# test that gathering each flow's segments into larger writes does not change the flows
+
+. $srcdir/test-subs.sh
+
+OUT0=/tmp/out0$$
+OUTW=/tmp/outw$$
+for pcap in test1-out-of-order.pcap test5-lines-randomized.pcap local2.pcap bug3.pcap
+do
+  for opts in "" "-S write-buffer=2000 -S write-buffer-mem=1" "-S write-buffer-age=0"
+  do
+    /bin/rm -rf $OUT0 $OUTW
+    if ! $TCPFLOW -S write-buffer=0 -o $OUT0 -r $DMPDIR/$pcap ; then echo tcpflow failed; exit 1 ; fi
+    if ! $TCPFLOW $opts -o $OUTW -r $DMPDIR/$pcap ; then echo tcpflow $opts failed; exit 1 ; fi
+    if ! diff -r -x report.xml $OUT0 $OUTW ; then
+      echo "tcpflow $opts -r $pcap does not match -S write-buffer=0"
+      exit 1
+    fi
+  done
+done
+
+# local2.pcap has flows of many segments, which should take fewer writes
+/bin/rm -rf $OUT0 $OUTW
+$TCPFLOW -o $OUTW -r $DMPDIR/local2.pcap
+segments=`sed -n 's/.*<flow_segments>\([0-9]*\)<.*/\1/p' $OUTW/report.xml`
+writes=`sed -n 's/.*<flow_writes>\([0-9]*\)<.*/\1/p' $OUTW/report.xml`
+echo "local2.pcap: $segments segments in $writes writes"
+if [ -z "$writes" ] || [ "$writes" -ge "$segments" ]; then
+  echo "segments were not gathered into fewer writes"
+  exit 1
+fi
+/bin/rm -rf $OUTW
+exit 0